@@ -0,0 +1,565 @@
+/*
+ * scatgatmodule.c
+ * Python bindings for the scatter gather library.
+ *
+ * Changelog:
+ * 	Added ReadPlan type with zero-copy block reads. Blocks are exposed
+ * 	through the buffer protocol and, when NumPy is importable, returned
+ * 	as NumPy arrays that keep the library buffer alive as their base.
+ */
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <pythread.h>
+
+#include "scatgat.h"
+
+//////////////////////////////////////////////////////////////////////// BLOCK TYPE
+/* Owner of a block buffer allocated by the library. Exposes the frames
+ * as a read-only (n_frames, frame_size) array of unsigned bytes. */
+typedef struct {
+	PyObject_HEAD
+	uint32_t *vdif_buf;													// allocated by read_next_block_vdif_frames
+	SGAllocator data_sga;												// allocator vdif_buf came from, outlives the plan
+	Py_ssize_t shape[2];												// n_frames, frame_size
+	Py_ssize_t strides[2];
+} BlockObject;
+
+static void Block_dealloc(BlockObject *self)
+{
+	if (self->vdif_buf != NULL)
+	{
+		self->data_sga.free(self->vdif_buf, self->data_sga.ctx);
+	}
+	Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static int Block_getbuffer(BlockObject *self, Py_buffer *view, int flags)
+{
+	if ((flags & PyBUF_WRITABLE) == PyBUF_WRITABLE)
+	{
+		PyErr_SetString(PyExc_BufferError, "Block is read-only.");
+		view->obj = NULL;
+		return -1;
+	}
+	view->obj = (PyObject *)self;
+	Py_INCREF(self);
+	view->buf = self->vdif_buf;
+	view->len = self->shape[0]*self->shape[1];
+	view->readonly = 1;
+	view->itemsize = 1;
+	view->format = (flags & PyBUF_FORMAT) ? "B" : NULL;
+	view->ndim = 2;
+	view->shape = (flags & PyBUF_ND) ? self->shape : NULL;
+	view->strides = (flags & PyBUF_STRIDES) == PyBUF_STRIDES ? self->strides : NULL;
+	view->suboffsets = NULL;
+	view->internal = NULL;
+	return 0;
+}
+
+static PyBufferProcs Block_as_buffer = {
+	(getbufferproc)Block_getbuffer,
+	NULL
+};
+
+static Py_ssize_t Block_length(BlockObject *self)
+{
+	return self->shape[0];
+}
+
+static PySequenceMethods Block_as_sequence = {
+	.sq_length = (lenfunc)Block_length,
+};
+
+static PyObject *Block_get_n_frames(BlockObject *self, void *closure)
+{
+	return PyLong_FromSsize_t(self->shape[0]);
+}
+
+static PyObject *Block_get_frame_size(BlockObject *self, void *closure)
+{
+	return PyLong_FromSsize_t(self->shape[1]);
+}
+
+static PyGetSetDef Block_getset[] = {
+	{"n_frames", (getter)Block_get_n_frames, NULL, "Number of VDIF frames.", NULL},
+	{"frame_size", (getter)Block_get_frame_size, NULL, "Frame size in bytes.", NULL},
+	{NULL}
+};
+
+static PyTypeObject BlockType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name = "scatgat.Block",
+	.tp_basicsize = sizeof(BlockObject),
+	.tp_dealloc = (destructor)Block_dealloc,
+	.tp_as_sequence = &Block_as_sequence,
+	.tp_as_buffer = &Block_as_buffer,
+	.tp_flags = Py_TPFLAGS_DEFAULT,
+	.tp_doc = "Block of VDIF frames owned by the scatter gather library.",
+	.tp_getset = Block_getset,
+};
+
+/* Hand a block to NumPy without copying, if NumPy is available. The
+ * import is attempted once per process. */
+static PyObject *block_as_array(PyObject *block)
+{
+	static PyObject *asarray = NULL;
+	static int numpy_missing = 0;
+	PyObject *numpy;
+	PyObject *array;
+	if (numpy_missing)
+	{
+		return block;
+	}
+	if (asarray == NULL)
+	{
+		numpy = PyImport_ImportModule("numpy");
+		if (numpy == NULL)
+		{
+			/* Without NumPy the Block itself is returned; it supports
+			 * memoryview() and the buffer protocol. */
+			PyErr_Clear();
+			numpy_missing = 1;
+			return block;
+		}
+		asarray = PyObject_GetAttrString(numpy, "asarray");
+		Py_DECREF(numpy);
+		if (asarray == NULL)
+		{
+			Py_DECREF(block);
+			return NULL;
+		}
+	}
+	array = PyObject_CallOneArg(asarray, block);
+	Py_DECREF(block);
+	return array;
+}
+
+//////////////////////////////////////////////////////////////////////// READPLAN TYPE
+/* sgpln is only replaced with both the GIL and lock held, so code 
+ * holding either one sees a live plan or NULL. Code that releases the 
+ * GIL takes lock and then reads sgpln again, since the plan may have 
+ * been closed in between. */
+typedef struct {
+	PyObject_HEAD
+	SGPlan *sgpln;
+	PyThread_type_lock lock;											// serialises use of sgpln while the GIL is released
+} ReadPlanObject;
+
+/* Convert a sequence of ints into a newly allocated C array. */
+static int *int_list_from_sequence(PyObject *seq, int *n)
+{
+	PyObject *fast;
+	int *list;
+	Py_ssize_t ii;
+	fast = PySequence_Fast(seq, "Expected a sequence of integers.");
+	if (fast == NULL)
+	{
+		return NULL;
+	}
+	*n = (int)PySequence_Fast_GET_SIZE(fast);
+	list = (int *)PyMem_Malloc(sizeof(int)*(*n > 0 ? *n : 1));
+	if (list == NULL)
+	{
+		Py_DECREF(fast);
+		PyErr_NoMemory();
+		return NULL;
+	}
+	for (ii=0; ii<*n; ii++)
+	{
+		list[ii] = (int)PyLong_AsLong(PySequence_Fast_GET_ITEM(fast, ii));
+		if (list[ii] == -1 && PyErr_Occurred())
+		{
+			PyMem_Free(list);
+			Py_DECREF(fast);
+			return NULL;
+		}
+	}
+	Py_DECREF(fast);
+	return list;
+}
+
+/* Install a new plan (or NULL) and close the old one. Called with the
+ * GIL held; the lock is taken without it. */
+static void ReadPlan_replace_plan(ReadPlanObject *self, SGPlan *sgpln)
+{
+	SGPlan *old_sgpln;
+	if (self->sgpln == NULL && sgpln == NULL)
+	{
+		return;
+	}
+	Py_BEGIN_ALLOW_THREADS
+	PyThread_acquire_lock(self->lock, WAIT_LOCK);
+	Py_END_ALLOW_THREADS
+	old_sgpln = self->sgpln;
+	self->sgpln = sgpln;
+	Py_BEGIN_ALLOW_THREADS
+	if (old_sgpln != NULL)
+	{
+		close_sg_read_plan(old_sgpln);
+		free_sg_plan(old_sgpln);
+	}
+	PyThread_release_lock(self->lock);
+	Py_END_ALLOW_THREADS
+}
+
+static void ReadPlan_close_plan(ReadPlanObject *self)
+{
+	ReadPlan_replace_plan(self, NULL);
+}
+
+static int ReadPlan_check_plan(SGPlan *sgpln)
+{
+	if (sgpln == NULL)
+	{
+		PyErr_SetString(PyExc_ValueError, "I/O operation on closed ReadPlan.");
+		return -1;
+	}
+	return 0;
+}
+
+static int ReadPlan_check(ReadPlanObject *self)
+{
+	return ReadPlan_check_plan(self->sgpln);
+}
+
+static int ReadPlan_init(ReadPlanObject *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {"pattern", "fmtstr", "mod_list", "disk_list", NULL};
+	const char *pattern;
+	const char *fmtstr;
+	PyObject *mods_obj;
+	PyObject *disks_obj;
+	int *mod_list = NULL;
+	int *disk_list = NULL;
+	int n_mod, n_disk;
+	int n_sgi;
+	SGPlan *sgpln = NULL;
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "ssOO", kwlist, &pattern, &fmtstr, &mods_obj, &disks_obj))
+	{
+		return -1;
+	}
+	if (self->lock == NULL)
+	{
+		self->lock = PyThread_allocate_lock();
+		if (self->lock == NULL)
+		{
+			PyErr_NoMemory();
+			return -1;
+		}
+	}
+	mod_list = int_list_from_sequence(mods_obj, &n_mod);
+	if (mod_list == NULL)
+	{
+		return -1;
+	}
+	disk_list = int_list_from_sequence(disks_obj, &n_disk);
+	if (disk_list == NULL)
+	{
+		PyMem_Free(mod_list);
+		return -1;
+	}
+	/* File discovery touches every disk, so let other threads run. */
+	Py_BEGIN_ALLOW_THREADS
+	n_sgi = make_sg_read_plan(&sgpln, pattern, fmtstr, mod_list, n_mod, disk_list, n_disk);
+	Py_END_ALLOW_THREADS
+	PyMem_Free(mod_list);
+	PyMem_Free(disk_list);
+	if (n_sgi <= 0)
+	{
+		PyErr_Format(PyExc_FileNotFoundError, "No SG files found matching '%s'.", pattern);
+		return -1;
+	}
+	ReadPlan_replace_plan(self, sgpln);
+	return 0;
+}
+
+static void ReadPlan_dealloc(ReadPlanObject *self)
+{
+	ReadPlan_close_plan(self);
+	if (self->lock != NULL)
+	{
+		PyThread_free_lock(self->lock);
+	}
+	Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+/* Read the next block into a library-allocated buffer owned by a new
+ * Block, returned as a NumPy array when possible. */
+static PyObject *ReadPlan_read_owned_block(ReadPlanObject *self)
+{
+	BlockObject *block;
+	SGPlan *sgpln;
+	SGAllocator data_sga;
+	uint32_t *vdif_buf = NULL;
+	int frame_size = 0;
+	int n_frames = -1;
+	Py_BEGIN_ALLOW_THREADS
+	PyThread_acquire_lock(self->lock, WAIT_LOCK);
+	sgpln = self->sgpln;
+	if (sgpln != NULL)
+	{
+		frame_size = sgpln->sgprt[0].sgi->pkt_size;
+		data_sga = sgpln->data_sga;
+		n_frames = read_next_block_vdif_frames(sgpln, &vdif_buf);
+	}
+	PyThread_release_lock(self->lock);
+	Py_END_ALLOW_THREADS
+	if (ReadPlan_check_plan(sgpln) == -1)
+	{
+		return NULL;
+	}
+	if (n_frames < 0)
+	{
+		if (vdif_buf != NULL)
+		{
+			data_sga.free(vdif_buf, data_sga.ctx);
+		}
+		PyErr_SetString(PyExc_OSError, "Unable to read next block.");
+		return NULL;
+	}
+	block = PyObject_New(BlockObject, &BlockType);
+	if (block == NULL)
+	{
+		if (vdif_buf != NULL)
+		{
+			data_sga.free(vdif_buf, data_sga.ctx);
+		}
+		return NULL;
+	}
+	block->vdif_buf = vdif_buf;
+	block->data_sga = data_sga;
+	block->shape[0] = n_frames;
+	block->shape[1] = frame_size;
+	block->strides[0] = frame_size;
+	block->strides[1] = 1;
+	return block_as_array((PyObject *)block);
+}
+
+static PyObject *ReadPlan_read_next_block(ReadPlanObject *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {"out", NULL};
+	PyObject *out = NULL;
+	Py_buffer view;
+	SGPlan *sgpln;
+	int n_frames = -1;
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O", kwlist, &out))
+	{
+		return NULL;
+	}
+	if (ReadPlan_check(self) == -1)
+	{
+		return NULL;
+	}
+	if (out != NULL && out != Py_None)
+	{
+		/* Borrow the caller's buffer: read straight into it. */
+		if (PyObject_GetBuffer(out, &view, PyBUF_WRITABLE | PyBUF_C_CONTIGUOUS) == -1)
+		{
+			return NULL;
+		}
+		Py_BEGIN_ALLOW_THREADS
+		PyThread_acquire_lock(self->lock, WAIT_LOCK);
+		sgpln = self->sgpln;
+		if (sgpln != NULL)
+		{
+			n_frames = read_next_block_vdif_frames_into(sgpln, (uint32_t *)view.buf, 
+				(int)(view.len/sgpln->sgprt[0].sgi->pkt_size));
+		}
+		PyThread_release_lock(self->lock);
+		Py_END_ALLOW_THREADS
+		PyBuffer_Release(&view);
+		if (ReadPlan_check_plan(sgpln) == -1)
+		{
+			return NULL;
+		}
+		if (n_frames < 0)
+		{
+			PyErr_SetString(PyExc_OSError, "Unable to read next block.");
+			return NULL;
+		}
+		return PyLong_FromLong(n_frames);
+	}
+	/* Otherwise the library allocates and the Block takes ownership. */
+	return ReadPlan_read_owned_block(self);
+}
+
+static PyObject *ReadPlan_seek(ReadPlanObject *self, PyObject *args)
+{
+	long long iblock;
+	SGPlan *sgpln;
+	int result = -1;
+	if (!PyArg_ParseTuple(args, "L", &iblock))
+	{
+		return NULL;
+	}
+	if (ReadPlan_check(self) == -1)
+	{
+		return NULL;
+	}
+	Py_BEGIN_ALLOW_THREADS
+	PyThread_acquire_lock(self->lock, WAIT_LOCK);
+	sgpln = self->sgpln;
+	if (sgpln != NULL)
+	{
+		result = seek_sg_read_plan(sgpln, (off_t)iblock);
+	}
+	PyThread_release_lock(self->lock);
+	Py_END_ALLOW_THREADS
+	if (ReadPlan_check_plan(sgpln) == -1)
+	{
+		return NULL;
+	}
+	if (result == -1)
+	{
+		PyErr_SetString(PyExc_ValueError, "Invalid block index.");
+		return NULL;
+	}
+	Py_RETURN_NONE;
+}
+
+static PyObject *ReadPlan_close(ReadPlanObject *self, PyObject *unused)
+{
+	ReadPlan_close_plan(self);
+	Py_RETURN_NONE;
+}
+
+static PyObject *ReadPlan_enter(ReadPlanObject *self, PyObject *unused)
+{
+	if (ReadPlan_check(self) == -1)
+	{
+		return NULL;
+	}
+	Py_INCREF(self);
+	return (PyObject *)self;
+}
+
+static PyObject *ReadPlan_exit(ReadPlanObject *self, PyObject *args)
+{
+	return ReadPlan_close(self, NULL);
+}
+
+static PyObject *ReadPlan_iternext(ReadPlanObject *self)
+{
+	PyObject *block;
+	if (ReadPlan_check(self) == -1)
+	{
+		return NULL;
+	}
+	block = ReadPlan_read_owned_block(self);
+	if (block != NULL && PyObject_Length(block) == 0)
+	{
+		/* End of data */
+		Py_DECREF(block);
+		return NULL;
+	}
+	return block;
+}
+
+static PyObject *ReadPlan_get_n_files(ReadPlanObject *self, void *closure)
+{
+	if (ReadPlan_check(self) == -1)
+	{
+		return NULL;
+	}
+	return PyLong_FromLong(self->sgpln->n_sgprt);
+}
+
+static PyObject *ReadPlan_get_frame_size(ReadPlanObject *self, void *closure)
+{
+	if (ReadPlan_check(self) == -1)
+	{
+		return NULL;
+	}
+	return PyLong_FromLong(self->sgpln->sgprt[0].sgi->pkt_size);
+}
+
+static PyObject *ReadPlan_get_max_block_frames(ReadPlanObject *self, void *closure)
+{
+	if (ReadPlan_check(self) == -1)
+	{
+		return NULL;
+	}
+	return PyLong_FromLong(get_sg_plan_max_block_frames(self->sgpln));
+}
+
+static PyObject *ReadPlan_get_closed(ReadPlanObject *self, void *closure)
+{
+	return PyBool_FromLong(self->sgpln == NULL);
+}
+
+static PyMethodDef ReadPlan_methods[] = {
+	{"read_next_block", (PyCFunction)(void (*)(void))ReadPlan_read_next_block, METH_VARARGS | METH_KEYWORDS,
+		"read_next_block(out=None)\n"
+		"Read the next contiguous block of VDIF frames.\n"
+		"Without out, returns an (n_frames, frame_size) uint8 array that\n"
+		"owns the library buffer (no copy); zero frames means end of data.\n"
+		"With a writable buffer out, reads into it and returns the frame count."},
+	{"seek", (PyCFunction)ReadPlan_seek, METH_VARARGS,
+		"seek(iblock)\nContinue reading from block index iblock in every SG file."},
+	{"close", (PyCFunction)ReadPlan_close, METH_NOARGS, "Close the plan and its files."},
+	{"__enter__", (PyCFunction)ReadPlan_enter, METH_NOARGS, NULL},
+	{"__exit__", (PyCFunction)ReadPlan_exit, METH_VARARGS, NULL},
+	{NULL}
+};
+
+static PyGetSetDef ReadPlan_getset[] = {
+	{"n_files", (getter)ReadPlan_get_n_files, NULL, "Number of SG files in the plan.", NULL},
+	{"frame_size", (getter)ReadPlan_get_frame_size, NULL, "VDIF frame size in bytes.", NULL},
+	{"max_block_frames", (getter)ReadPlan_get_max_block_frames, NULL, "Upper bound on frames per block read.", NULL},
+	{"closed", (getter)ReadPlan_get_closed, NULL, "True once the plan is closed.", NULL},
+	{NULL}
+};
+
+static PyTypeObject ReadPlanType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name = "scatgat.ReadPlan",
+	.tp_basicsize = sizeof(ReadPlanObject),
+	.tp_dealloc = (destructor)ReadPlan_dealloc,
+	.tp_flags = Py_TPFLAGS_DEFAULT,
+	.tp_doc = "ReadPlan(pattern, fmtstr, mod_list, disk_list)\n"
+		"Read-mode scatter gather plan. Iterating yields blocks until the end of data.",
+	.tp_iter = PyObject_SelfIter,
+	.tp_iternext = (iternextfunc)ReadPlan_iternext,
+	.tp_methods = ReadPlan_methods,
+	.tp_getset = ReadPlan_getset,
+	.tp_init = (initproc)ReadPlan_init,
+	.tp_new = PyType_GenericNew,
+};
+
+//////////////////////////////////////////////////////////////////////// MODULE
+static struct PyModuleDef scatgat_module = {
+	PyModuleDef_HEAD_INIT,
+	.m_name = "scatgat",
+	.m_doc = "High-level interface to read scatter gather files.",
+	.m_size = -1,
+};
+
+PyMODINIT_FUNC PyInit_scatgat(void)
+{
+	PyObject *m;
+	if (PyType_Ready(&BlockType) < 0 || PyType_Ready(&ReadPlanType) < 0)
+	{
+		return NULL;
+	}
+	m = PyModule_Create(&scatgat_module);
+	if (m == NULL)
+	{
+		return NULL;
+	}
+	Py_INCREF(&BlockType);
+	if (PyModule_AddObject(m, "Block", (PyObject *)&BlockType) < 0)
+	{
+		Py_DECREF(&BlockType);
+		Py_DECREF(m);
+		return NULL;
+	}
+	Py_INCREF(&ReadPlanType);
+	if (PyModule_AddObject(m, "ReadPlan", (PyObject *)&ReadPlanType) < 0)
+	{
+		Py_DECREF(&ReadPlanType);
+		Py_DECREF(m);
+		return NULL;
+	}
+	return m;
+}
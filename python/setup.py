@@ -0,0 +1,29 @@
+"""
+Build the scatgat Python extension against libscatgat.
+
+Build the library first (make -C ../src), then:
+    python setup.py build_ext --inplace
+sg_access.h and dplane_proxy.h must be on the include path, e.g. via
+CFLAGS=-I<path>.
+"""
+import os
+
+from setuptools import Extension, setup
+
+SRC_DIR = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "src")
+
+setup(
+    name="scatgat",
+    version="0.1",
+    description="High-level interface to read scatter gather files",
+    ext_modules=[
+        Extension(
+            "scatgat",
+            sources=["scatgatmodule.c"],
+            include_dirs=[SRC_DIR],
+            library_dirs=[SRC_DIR],
+            runtime_library_dirs=[SRC_DIR],
+            libraries=["scatgat"],
+        )
+    ],
+)
@@ -14,6 +14,10 @@
 
 #include "scatgat.h"
 
+#if defined(__x86_64__)
+	#include <immintrin.h>
+#endif
+
 /* Reliance on the frame rate is ignored to make the code more portable.
  * This means we cannot check data continuity across 1-second 
  * boundaries. */
@@ -31,10 +35,43 @@
  * resize is necessary */
 #define GROWTH_SIZE_IN_BLOCKS 1000
 
-#define LAST_VDIF_SECS_INRE(a) ((VDIFHeader *)(&(a->data_buf[(a->n_frames-1)*(a->sgi->pkt_size)/sizeof(uint32_t)])))->w1.secs_inre
-#define FIRST_VDIF_SECS_INRE(a) ((VDIFHeader *)(a->data_buf))->w1.secs_inre
-#define LAST_VDIF_DF_NUM_INSEC(a) ((VDIFHeader *)(&(a->data_buf[(a->n_frames-1)*(a->sgi->pkt_size)/sizeof(uint32_t)])))->w2.df_num_insec
-#define FIRST_VDIF_DF_NUM_INSEC(a) ((VDIFHeader *)(a->data_buf))->w2.df_num_insec
+/* ioprio_set(2) encoding, not exported by libc */
+#define SG_IOPRIO_WHO_PROCESS 1
+#define SG_IOPRIO_CLASS_SHIFT 13
+#define SG_IOPRIO_VALUE(cls,lvl) (((cls) << SG_IOPRIO_CLASS_SHIFT) | (lvl))
+
+/* Storage probe (see tune_sg_plan_storage). Probes read at most 
+ * SG_PROBE_BYTES per device, devices of read plans with no SG file of
+ * at least SG_PROBE_MIN_BYTES keep the defaults. */
+#define SG_PROBE_BYTES (64*1024*1024)
+#define SG_PROBE_MIN_BYTES (16*1024*1024)
+#define SG_PROBE_CHUNK_BYTES (4*1024*1024)
+#define SG_PROBE_LATENCY_READS 16
+#define SG_PROBE_TEMP_NAME ".sgprobe.XXXXXX"
+/* Scratch for the block headers between the frames of a coalesced 
+ * pread run; a larger gap ends the run */
+#define SG_STAGE_GAP_BYTES 4096
+/* Mean 4 KiB read latency from which a device is treated as rotational */
+#define SG_PROBE_ROTATIONAL_US 1000.0
+/* Largest write block size chosen from a profile */
+#define SG_PROBE_MAX_BLOCK_SIZE (64*1024*1024)
+/* Profiles kept in a profile file */
+#define SG_MAX_STORAGE_PROFILES 256
+
+/* Timestamps of the first / last frame in an SGPart buffer, loaded 
+ * with SG_VDIF_STAMP by sgthread_read_block when the block is read, or
+ * copied from the cache entry by lookup_sg_block_cache on a hit. */
+#define LAST_VDIF_SECS_INRE(a) SG_STAMP_SECS((a)->last_stamp)
+#define FIRST_VDIF_SECS_INRE(a) SG_STAMP_SECS((a)->first_stamp)
+#define LAST_VDIF_DF_NUM_INSEC(a) SG_STAMP_DF_NUM((a)->last_stamp)
+#define FIRST_VDIF_DF_NUM_INSEC(a) SG_STAMP_DF_NUM((a)->first_stamp)
+
+/* CRC32C (Castagnoli) polynomial, bit-reflected. */
+#define SG_CRC32C_POLY 0x82f63b78u
+/* Bytes per stream in the interleaved crc32 kernel. The instruction 
+ * has a latency of three cycles and issues every cycle, so three 
+ * independent streams keep it busy. */
+#define SG_CRC32C_STRIPE 8192
 
 /* File permissions with which scatter-gather files are created. */ 
 #define SG_FILE_PERMISSIONS (S_IWUSR | S_IRUSR | S_IWGRP | S_IRGRP | S_IROTH)
@@ -72,15 +109,158 @@ int compare_int_descend(const void *a, const void *b);
 int compare_sg_info(const void *a, const void *b);
 int compare_sg_part(const void *a, const void *b);
 
+/* Sample unpacking, see read_next_block_vdif_samples */
+typedef struct sg_unpack {
+	void *out;															// channel arrays
+	int format;															// enum sg_sample_format
+	int max_values;														// values per channel array
+	SGSampleInfo info;													// layout, from the first frame
+	uint32_t format_words[3];											// header words 0, 2, 3 masked to the format fields
+	int header_size;													// 32, or 16 for legacy headers
+	int8_t *scratch;													// one frame of values in stream order
+} SGUnpack;
+int decode_sg_sample_format(const uint32_t *frame, SGSampleInfo *info, uint32_t *format_words);
+int unpack_sg_frames(SGUnpack *unp, const uint32_t *frames, int n_frames, int pkt_size, int first_frame);
+
+/* Channel selection, see read_next_block_vdif_channels */
+#define SG_SELECT_MAX_PERIOD 64
+typedef struct sg_select {
+	uint32_t *out;														// narrowed frames
+	int out_size;														// narrowed frame size in bytes
+	int header_size;													// 32, or 16 for legacy headers
+	uint32_t format_words[3];											// header words 0, 2, 3 masked to the format fields
+	uint32_t word2;														// header word 2 of the narrowed frames
+	int n_words;														// 64-bit payload words per input frame
+	int period;															// payload words per sample time, at least 1
+	uint64_t mask[SG_SELECT_MAX_PERIOD];								// bits kept of each payload word in the period
+	int n_bits[SG_SELECT_MAX_PERIOD];									// bits set in each mask
+} SGSelect;
+int setup_sg_channel_select(SGSelect *sel, const uint32_t *frame, const int *chan_list, int n_sel);
+int select_sg_frames(SGSelect *sel, const uint32_t *frames, int n_frames, int pkt_size, int first_frame);
+int gather_next_sg_blocks(SGPlan *sgpln, uint32_t *vdif_buf, int max_frames, SGUnpack *unp, SGSelect *sel);
+void launch_sg_block_reads(SGPlan *sgpln, pthread_t *sg_threads, int *sg_threads_mask);
+void join_sg_block_reads(SGPlan *sgpln, pthread_t *sg_threads, const int *sg_threads_mask);
+
+/* Sampler statistics, see set_sg_plan_stats */
+#define SG_STATS_MAX_POSITIONS 64
+#define SG_STATS_MAX_BINS (1 << 20)
+#define SG_STATS_MAX_TERMS 4											// popcount terms per payload word
+typedef struct sg_stats_thread {
+	uint64_t *counts;													// [n_chan][n_states] state counts
+	int n_bins;															// bins allocated
+	double *power;														// [n_bins][n_chan] sums of squared levels
+	uint64_t *n_values;													// [n_bins][n_chan] values summed
+} SGStatsThread;
+typedef struct sg_stats_part {
+	int n_active;														// threads with an open bin in this block
+	uint16_t active[SG_MAX_VDIF_THREADS];								// their IDs
+	int bin[SG_MAX_VDIF_THREADS];										// open bin per thread ID, -1 if none
+	uint32_t *byte_counts[SG_MAX_VDIF_THREADS];							// [positions][256] per thread ID, or popcount sums, allocated on first use
+} SGStatsPart;
+typedef struct sg_stats_term {
+	int word;															// payload word within the period
+	int chan;															// channel counted
+	uint64_t mask;														// low bit of each sample of chan in the word
+} SGStatsTerm;
+typedef struct sg_stats {
+	SGSampleInfo info;													// layout, from the first frame
+	uint32_t format_words[3];											// header words 0, 2, 3 masked to the format fields
+	int header_size;													// 32, or 16 for legacy headers
+	size_t payload_bytes;												// bytes of samples per frame
+	int positions;														// byte positions counted apart, at least 4
+	int fields;															// samples per byte
+	uint16_t chan_of[SG_STATS_MAX_POSITIONS*8];							// channel of each field of each position
+	int period;															// payload words per sample time, at least 1
+	int n_terms;														// popcount terms per period, 0 to count bytes
+	SGStatsTerm terms[SG_STATS_MAX_TERMS*SG_STATS_MAX_POSITIONS/8];
+	double level2[256];													// squared level per state
+	int frames_per_second;
+	int bins_per_second;
+	uint32_t start_secs;												// VDIF seconds of bin 0
+	SGStatsPart *parts;													// per SGPart, used by its read worker only
+	pthread_mutex_t lock;												// protects the fields below
+	SGStatsThread *threads[SG_MAX_VDIF_THREADS];						// per thread ID, NULL if not seen
+	int n_threads;
+	int n_bins;
+	uint64_t n_frames;
+	uint64_t n_skipped;
+} SGStats;
+void tally_sg_part_stats(SGPart *sgprt);
+void flush_sg_stats(SGStats *sgs, SGStatsPart *ssp, int thread_id, const SGAllocator *sga);
+void free_sg_stats(SGPlan *sgpln);
+
+/* Quick-look spectra, see make_sg_quicklook */
+typedef struct sg_quicklook_work {
+	int8_t *scratch;													// one frame of values in stream order
+	float *samples;														// channel arrays of one frame
+	float *re;															// FFT points
+	float *im;
+	float *power;														// [n_chan][n_bins] of one frame
+} SGQuickLookWork;
+int setup_sg_quicklook_format(SGQuickLook *qlk, const uint32_t *frame, int frame_size);
+int alloc_sg_quicklook_work(SGQuickLook *qlk, SGQuickLookWork *work);
+void free_sg_quicklook_work(SGQuickLook *qlk, SGQuickLookWork *work);
+int64_t get_sg_quicklook_interval(const SGQuickLook *qlk, const uint32_t *frame);
+int transform_sg_quicklook_frame(SGQuickLook *qlk, SGQuickLookWork *work, const uint32_t *frame);
+void integrate_sg_quicklook(SGQuickLook *qlk, int64_t index, const float *power, int n_fft);
+void publish_sg_quicklook_before(SGQuickLook *qlk, int64_t limit);
+
+/* Frame and block hooks, see add_sg_plan_frame_hook */
+#define SG_HOOK_CHUNK_BYTES (256*1024)									// copied and hooked at a time, to stay in L2
+typedef struct sg_hook {
+	sg_frame_hook frame_fn;												// NULL for a block hook
+	sg_block_hook block_fn;
+	void *user_data;
+} SGHook;
+typedef struct sg_hooks {
+	int n_hooks;
+	int n_lead;															// frame hooks before the first block hook
+	SGHook hook[SG_MAX_HOOKS];
+} SGHooks;
+int add_sg_plan_hook(SGPlan *sgpln, sg_frame_hook frame_fn, sg_block_hook block_fn, void *user_data);
+int run_sg_frame_hooks(const SGHooks *sgh, int first, int last, uint32_t *frames, int n_frames, int pkt_size);
+int run_sg_hooks(const SGHooks *sgh, int first, uint32_t *frames, int n_frames, int pkt_size);
+int copy_sg_hooked_frames(SGPart *sgprt, const uint32_t *src);
+
+/* Read filter */
+int test_sg_thread_masks(const uint32_t *a, const uint32_t *b);
+int filter_sg_frames(const SGReadFilter *flt, uint32_t *dst, 
+					const uint32_t *src, int n_frames, int pkt_size);
+
 /* For sorting and continuity testing */
 int map_sg_parts_contiguous(SGPlan *sgpln, int *mapping);
 int test_sg_parts_contiguous(SGPart *a, SGPart *b);
 
+/* Work item for sgthread_scan_headers */
+typedef struct sg_header_scan_task {
+	SGPart *sgprt;														// SG file to scan
+	SGHeaderScan *scan;													// columns to fill
+	int ipart;															// index of sgprt in the plan
+	int offset;															// first row for this file
+	int n_frames;														// rows reserved for this file
+} SGHeaderScanTask;
+
 /* Threaded implementations compatible with pthread */
 static void * sgthread_read_block(void *arg);
+static void * sgthread_scan_headers(void *arg);
 static void * sgthread_fill_read_sgi(void *arg);
 static void * sgthread_fill_write_sgi(void *arg);
 static void * sgthread_write_block(void *arg);
+static void * sgthread_async_worker(void *arg);
+static void * sgthread_probe_storage(void *arg);
+static void * sgthread_recover_file(void *arg);
+static void * sgthread_open_scan(void *arg);
+static void * sgthread_quicklook(void *arg);
+
+/* Asynchronous operation queue */
+int submit_sg_async_op(SGPlan *sgpln, int op, uint32_t *vdif_buf, 
+					int n_frames, sg_async_callback cb, void *user_data);
+int pop_sg_completions(SGPlan *sgpln, SGCompletion *completions, 
+					int max_completions);
+int start_sg_async(SGPlan *sgpln);
+void stop_sg_async(SGPlan *sgpln);
+void free_sg_async_queue(SGAsyncQueue *asq, const SGAllocator *meta_sga);
+void schedule_sg_async_queue(SGAsyncQueue *asq);
 
 /* Handles writing and resizing of files through mmap */
 int first_write_sg_plan(SGPlan *sgpln);
@@ -88,14 +268,127 @@ int write_to_sg(SGInfo *sgi, const void *src, size_t n);
 int resize_to_sg(SGInfo *sgi, off_t new_size);
 
 /* Memory management */
+void *alloc_sg_meta(const SGAllocator *sga, size_t size);
+void *alloc_sg_data(const SGAllocator *sga, size_t size);
+void free_sg_mem(const SGAllocator *sga, void *ptr);
 void clear_sg_part_buffer(SGPart *sgprt);
-void free_sg_info(SGInfo *sgi);
-void init_sg_part(SGPart *sgprt, const SGInfo *sgi);
+void free_sg_info(SGInfo *sgi, const SGAllocator *meta_sga);
+void discard_sg_infos(SGInfo *sgi_buf, int n_sgi, int sgm);
+int init_sg_part(SGPart *sgprt, const SGInfo *sgi, SGPlan *sgpln);
 void init_sg_info(SGInfo *sgi, const char *filename);
+void init_sg_plan(SGPlan *sgpln, int sgm, const SGAllocator *meta_sga);
+
+/* Default allocators, see set_sg_default_allocators */
+static void *sg_libc_alloc(size_t size, size_t alignment, void *ctx);
+static void *sg_libc_aligned_alloc(size_t size, size_t alignment, void *ctx);
+static void sg_libc_free(void *ptr, void *ctx);
+static SGAllocator sg_default_meta_sga = { sg_libc_alloc, sg_libc_free, NULL };
+static SGAllocator sg_default_data_sga = { sg_libc_aligned_alloc, sg_libc_free, NULL };
 
 /* Misc checks */
 int first_write_sgplan(SGPlan *sgpln);
 
+/* Read cursors */
+#define SG_CURSOR_MAGIC 0x52434753										// "SGCR"
+/* Saved cursor, followed by n_parts SGCursorPart records */
+typedef struct sg_cursor_tag {
+	uint32_t magic;
+	uint32_t n_parts;													// SG files in the plan
+	uint64_t last_stamp;												// SGPlan.last_stamp
+	uint32_t checksum;													// CRC32C of the records
+	uint32_t reserved;													// zero
+} SGCursorTag;
+/* Position in one SG file, with the file identity it applies to */
+typedef struct sg_cursor_part {
+	uint64_t dev;
+	uint64_t ino;
+	int64_t size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	int64_t iblock;														// next block to read
+} SGCursorPart;
+uint32_t sg_cursor_checksum(const SGCursorTag *tag, const SGCursorPart *parts);
+
+/* Plan merging */
+void load_sg_merge_source(SGMerge *sgmrg, SGMergeSource *src);
+void advance_sg_merge_source(SGMerge *sgmrg, SGMergeSource *src, int n_frames);
+
+/* Scan chains */
+void start_sg_chain_open(SGScanChain *chain);
+int advance_sg_scan_chain(SGScanChain *chain);
+int trim_sg_chain_boundary(SGScanChain *chain, uint32_t *vdif_buf, int n_frames, int frame_size);
+void note_sg_chain_last_frames(SGScanChain *chain, const uint32_t *vdif_buf, int n_frames, int frame_size);
+
+/* Block checksums */
+uint32_t copy_sg_crc32c(uint32_t crc, void *dst, const void *src, size_t n);
+int write_crc32c_to_sg(SGInfo *sgi, const void *src, size_t n, uint32_t *crc);
+int test_sg_part_block_crc32c(SGPart *sgprt, const struct sg_wb_header_ext_tag *wbht, uint32_t crc);
+
+/* Block cache */
+int lookup_sg_block_cache(SGPart *sgprt);
+void insert_sg_block_cache(SGPart *sgprt);
+int test_sg_block_cache_enabled(void);
+
+/* Extended file format */
+int peek_sg_file_version(const char *filename);
+void open_sg_ext_file(const char *filename, SGInfo *sgi);
+int index_sg_ext_part(SGPart *sgprt, const SGAllocator *meta_sga);
+uint32_t *get_sg_part_block(SGPart *sgprt, off_t iblock, int *n_frames, uint32_t **end);
+const struct sg_wb_header_ext_tag *get_sg_part_block_header(SGPart *sgprt, off_t iblock);
+void fill_sg_wb_header_ext(struct sg_wb_header_ext_tag *wbht, const uint32_t *buf, int n_frames, int pkt_size);
+void close_sg_part_file(SGPart *sgprt);
+
+/* Checkpoint and recovery */
+#define SG_CHECKPOINT_MAGIC 0x4b434753									// "SGCK"
+/* Record appended to a checkpoint sidecar */
+typedef struct sg_checkpoint_tag {
+	uint32_t magic;
+	uint32_t n_blocks;													// blocks since the previous checkpoint
+	int64_t size;														// valid bytes in the SG file
+	int32_t last_blocknum;												// blocknum of the last block
+	uint32_t checksum;													// sg_checkpoint_checksum
+} SGCheckpointTag;
+/* Checkpoint state of one SG file in a write plan */
+typedef struct sg_checkpoint {
+	int fd;																// sidecar, opened for append
+	int interval;														// blocks per checkpoint
+	int n_pending;														// blocks since the last checkpoint
+} SGCheckpoint;
+int checkpoint_sg_part(SGPart *sgprt, int blocknum);
+void close_sg_checkpoint(SGPart *sgprt, const SGAllocator *meta_sga, int remove);
+static uint32_t sg_checkpoint_checksum(const SGCheckpointTag *tag);
+int test_sg_recovered_block(int fd, off_t offset, off_t file_size, const struct file_header_tag *fht, 
+							int last_blocknum, int *blocknum, int *wb_size);
+
+/* Device scheduler */
+struct sg_device;
+struct sg_device *acquire_sg_device(SGPart *sgprt);
+void release_sg_device(struct sg_device *sgd, size_t n_bytes);
+
+/* I/O quality of service */
+void apply_sg_io_qos(SGPlan *sgpln);
+void throttle_sg_io(SGPlan *sgpln, size_t n_bytes);
+
+/* Storage tuning */
+int probe_sg_storage_fd(int fd, off_t size, const SGAllocator *data_sga, SGStorageProfile *prof);
+int probe_sg_storage_dir(const char *filename, const SGAllocator *meta_sga, 
+					const SGAllocator *data_sga, SGStorageProfile *prof);
+void apply_sg_storage_profile(SGPart *sgprt, const SGStorageProfile *prof);
+size_t get_sg_storage_block_size(const SGStorageProfile *prof);
+void prefetch_sg_part_blocks(SGPart *sgprt);
+int read_sg_part_block_pread(SGPart *sgprt, const uint32_t *start);
+int get_sg_part_run_length(SGPart *sgprt);
+const uint32_t *coalesce_sg_part_blocks(SGPart *sgprt, const uint32_t *start);
+uint32_t *take_sg_part_staged_block(SGPart *sgprt);
+void discard_sg_part_stage(SGPart *sgprt);
+
+/* Work item for sgthread_probe_storage */
+typedef struct sg_storage_probe_task {
+	SGPart *sgprt;														// SG file on the device to probe
+	SGStorageProfile prof;												// filled by the probe
+	int result;															// 0 on success
+} SGStorageProbeTask;
+
 //////////////////////////////////////////////////////////////////////// SCATTER GATHER READING
 /*
  * Create an SGPlan instance in read-mode.
@@ -113,6 +406,7 @@ int first_write_sgplan(SGPlan *sgpln);
  *   int n_disk -- Number of disks to use.
  * Returns:
  *   int -- Number of SGInfo instances (SG files found mathcing pattern)
+ *     or -1 if memory could not be allocated.
  * Notes:
  *   The SGInfo entries stored in sgplan are sorted in ascending order
  *     according to the timestamp on the first VDIF frame in each SG 
@@ -140,9 +434,18 @@ int make_sg_read_plan(SGPlan **sgpln, const char *pattern,
 	/* Allocate temporary buffer to store maximum possible SGInfo 
 	 * instances.
 	 */
-	SGInfo *sgi_buf = (SGInfo *)calloc(sizeof(SGInfo),n_mod*n_disk);
+	SGAllocator meta_sga = sg_default_meta_sga; // allocator for the new plan
+	SGInfo *sgi_buf = (SGInfo *)alloc_sg_meta(&meta_sga, sizeof(SGInfo)*(n_mod*n_disk > 0 ? n_mod*n_disk : 1));
 	/* And allocate temporary single SGInfo. */
 	SGInfo *sgi_tmp;// = (SGInfo *)calloc(sizeof(SGInfo),1); 
+	if (sgi_buf == NULL)
+	{
+		perror("Unable to allocate SGInfo buffer.");
+		#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
+			DEBUGMSG_LEAVEFUNC;
+		#endif
+		return -1;
+	}
 	/* Step through all modules and disks, and access files that 
 	 * match the pattern.
 	 */
@@ -168,6 +471,8 @@ int make_sg_read_plan(SGPlan **sgpln, const char *pattern,
 				INFOMSG(_dbgmsg);
 			#endif
 			thread_result = pthread_create(&(sg_threads[ithread]), NULL, &sgthread_fill_read_sgi, filename[ithread]);
+			/* Note that the SGInfo returned by the thread comes from 
+			 * the default metadata allocator. */
 			if (thread_result != 0)
 			{
 				perror("Unable to launch thread.");
@@ -197,7 +502,7 @@ int make_sg_read_plan(SGPlan **sgpln, const char *pattern,
 				perror("Unable to join thread.");
 				exit(EXIT_FAILURE);
 			}
-			if (sgi_tmp->smi.mmfd > 0)
+			if (sgi_tmp != NULL && sgi_tmp->smi.mmfd > 0)
 			{
 				memcpy(sgi_buf+valid_sgi++, sgi_tmp, sizeof(SGInfo));
 				#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_INFO
@@ -209,13 +514,13 @@ int make_sg_read_plan(SGPlan **sgpln, const char *pattern,
 			/* Free the temporary SGInfo resources, but DO NOT free
 			 * the malloc'ed NAME to which we still keep a pointer.
 			 */
-			free(sgi_tmp);
+			free_sg_mem(&meta_sga, sgi_tmp);
 		}
 	}
 	if (valid_sgi == 0)
 	{
 		/* Done with this, free it. */
-		free(sgi_buf);
+		free_sg_mem(&meta_sga, sgi_buf);
 		#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
 			DEBUGMSG_LEAVEFUNC;
 		#endif
@@ -229,9 +534,25 @@ int make_sg_read_plan(SGPlan **sgpln, const char *pattern,
 	/* Sort SGInfo array according to second / frames */
 	qsort((void *)sgi_buf, valid_sgi, sizeof(SGInfo), compare_sg_info);
 	/* Allocate memory for SGPlan */
-	*sgpln = (SGPlan *)malloc(sizeof(SGPlan));
-	(*sgpln)->sgm = SCATGAT_MODE_READ;
-	(*sgpln)->sgprt = (SGPart *)malloc(sizeof(SGPart)*valid_sgi);
+	*sgpln = (SGPlan *)alloc_sg_meta(&meta_sga, sizeof(SGPlan));
+	if (*sgpln == NULL)
+	{
+		perror("Unable to allocate SGPlan.");
+		discard_sg_infos(sgi_buf, valid_sgi, SCATGAT_MODE_READ);
+		free_sg_mem(&meta_sga, sgi_buf);
+		return -1;
+	}
+	init_sg_plan(*sgpln, SCATGAT_MODE_READ, &meta_sga);
+	(*sgpln)->sgprt = (SGPart *)alloc_sg_meta(&meta_sga, sizeof(SGPart)*valid_sgi);
+	if ((*sgpln)->sgprt == NULL)
+	{
+		perror("Unable to allocate SGPart array.");
+		discard_sg_infos(sgi_buf, valid_sgi, SCATGAT_MODE_READ);
+		free_sg_mem(&meta_sga, sgi_buf);
+		free_sg_plan(*sgpln);
+		*sgpln = NULL;
+		return -1;
+	}
 	for (itmp=0; itmp<valid_sgi; itmp++)
 	{
 		// Replaced with initialization function
@@ -242,11 +563,22 @@ int make_sg_read_plan(SGPlan **sgpln, const char *pattern,
 		//~ (*sgpln)->sgprt[itmp].iblock = 0;
 		//~ (*sgpln)->sgprt[itmp].data_buf = NULL;
 		//~ (*sgpln)->sgprt[itmp].n_frames = 0;
-		init_sg_part(&((*sgpln)->sgprt[itmp]),&(sgi_buf[itmp]));
+		if (init_sg_part(&((*sgpln)->sgprt[itmp]),&(sgi_buf[itmp]),*sgpln) != 0)
+		{
+			/* Parts so far own their files, the rest are still in 
+			 * sgi_buf. */
+			(*sgpln)->n_sgprt = itmp;
+			close_sg_read_plan(*sgpln);
+			free_sg_plan(*sgpln);
+			*sgpln = NULL;
+			discard_sg_infos(sgi_buf+itmp, valid_sgi-itmp, SCATGAT_MODE_READ);
+			free_sg_mem(&meta_sga, sgi_buf);
+			return -1;
+		}
 	}
 	(*sgpln)->n_sgprt = valid_sgi;
 	/* Done with the temporary buffer, free it. */
-	free(sgi_buf);
+	free_sg_mem(&meta_sga, sgi_buf);
 	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
 		print_sg_plan(*sgpln,"\t");
 		DEBUGMSG_LEAVEFUNC;
@@ -280,6 +612,75 @@ int make_sg_read_plan(SGPlan **sgpln, const char *pattern,
  *     that file.
  */
 int read_next_block_vdif_frames(SGPlan *sgpln, uint32_t **vdif_buf)
+{
+	#ifdef DEBUG_LEVEL
+		char _dbgmsg[_DBGMSGLEN];
+	#endif
+	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
+		DEBUGMSG_ENTERFUNC;
+	#endif
+	int frames_estimate; // estimate the size of buffer to create
+	int frames_read; // count the number of frames received
+	
+	/* Check if read mode */
+	if (sgpln->sgm != SCATGAT_MODE_READ)
+	{
+		fprintf(stderr,"Trying to read from non-read-mode SGPlan.\n");
+		return -1;
+	}
+	/* Create storage buffer. The number of frames read is always 
+	 * smaller than or equal to one block per SG file.
+	 */
+	frames_estimate = get_sg_plan_max_block_frames(sgpln);
+	*vdif_buf = (uint32_t *)alloc_sg_data(&(sgpln->data_sga), (size_t)frames_estimate*sgpln->sgprt[0].sgi->pkt_size);
+	frames_read = read_next_block_vdif_frames_into(sgpln, *vdif_buf, frames_estimate);
+	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
+		DEBUGMSG_LEAVEFUNC;
+	#endif
+	return frames_read;
+}
+
+/*
+ * Read the next block of VDIF frames into a caller-supplied buffer.
+ * Arguments:
+ *   SGPlan *sgpln -- The SGPlan created for a given filename pattern.
+ *   uint32_t *vdif_buf -- Buffer to receive the stitched VDIF frames.
+ *   int max_frames -- Capacity of vdif_buf in frames.
+ * Returns:
+ *   int -- The number of VDIF frames copied to the buffer, zero if no
+ *     frames could be read, and -1 on error.
+ * Notes:
+ *   See read_next_block_vdif_frames for the stitching rules.
+ *   If the contiguous set does not fit in max_frames, stitching stops 
+ *     at the first block that would overflow the buffer. That block and
+ *     all blocks following it remain parked in their SGPart and are 
+ *     returned first by the next call.
+ */
+int read_next_block_vdif_frames_into(SGPlan *sgpln, uint32_t *vdif_buf, 
+							int max_frames)
+{
+	return gather_next_sg_blocks(sgpln, vdif_buf, max_frames, NULL, NULL);
+}
+
+/*
+ * Read and stitch the next blocks of a read plan.
+ * Arguments:
+ *   SGPlan *sgpln -- SGPlan instance created in read-mode.
+ *   uint32_t *vdif_buf -- Buffer to receive the stitched VDIF frames, 
+ *     unused if unp or sel is given.
+ *   int max_frames -- Capacity of the output in frames.
+ *   SGUnpack *unp -- Unpack the frames into samples instead of copying
+ *     them, or NULL.
+ *   SGSelect *sel -- Narrow the frames to some channels instead of 
+ *     copying them, or NULL.
+ * Returns:
+ *   int -- The number of VDIF frames copied, unpacked or narrowed, 
+ *     zero if no frames could be read, and -1 on error.
+ * Notes:
+ *   Implements read_next_block_vdif_frames_into, 
+ *     read_next_block_vdif_samples and read_next_block_vdif_channels.
+ */
+int gather_next_sg_blocks(SGPlan *sgpln, uint32_t *vdif_buf, int max_frames, SGUnpack *unp, SGSelect *sel)
 {
 	#ifdef DEBUG_LEVEL
 		char _dbgmsg[_DBGMSGLEN];
@@ -288,18 +689,17 @@ int read_next_block_vdif_frames(SGPlan *sgpln, uint32_t **vdif_buf)
 		DEBUGMSG_ENTERFUNC;
 		print_sg_plan(sgpln,"\t");
 	#endif
-	int ithread; // thread counter
-	int thread_result; // result of calls to pthread methods
 	pthread_t sg_threads[sgpln->n_sgprt]; // the pthreads used
 	int sg_threads_mask[sgpln->n_sgprt];
 	
-	int frames_estimate = 0; // estimate the size of buffer to create
 	int frames_read = 0; // count the number of frames received
 	int frame_size = sgpln->sgprt[0].sgi->pkt_size; // size of a frame
 	
 	int isgprt;
 	int n_contiguous_blocks = 0;
 	int mapping[sgpln->n_sgprt];
+	SGPart *sgprt;
+	uint64_t last_stamp = 0;
 	
 	/* Check if read mode */
 	if (sgpln->sgm != SCATGAT_MODE_READ)
@@ -308,7 +708,121 @@ int read_next_block_vdif_frames(SGPlan *sgpln, uint32_t **vdif_buf)
 		return -1;
 	}
 	
-	/* Launch threads to read data */
+	do
+	{
+		/* Read the next block of each SG file with an empty buffer */
+		launch_sg_block_reads(sgpln, sg_threads, sg_threads_mask);
+		join_sg_block_reads(sgpln, sg_threads, sg_threads_mask);
+	
+/***********************************************************************
+ * This part of the code checks continuity of data across block 
+ * boundaries.
+ */
+		n_contiguous_blocks = map_sg_parts_contiguous(sgpln, mapping);
+		//~ printf("n_contiguous_blocks = %d\n",n_contiguous_blocks);
+		if (n_contiguous_blocks == 0)
+		{
+			printf("No contiguous blocks found.\n");
+			return 0;
+		}
+		for (isgprt=0; isgprt<n_contiguous_blocks; isgprt++)
+		{
+			sgprt = &(sgpln->sgprt[mapping[isgprt]-1]);
+			/* Leave the remainder parked if the buffer is full. */
+			if (frames_read + (int)sgprt->n_frames > max_frames)
+			{
+				break;
+			}
+			if (sgprt->n_frames > 0)
+			{
+				last_stamp = SG_VDIF_STAMP(sgprt->data_buf + (size_t)(sgprt->n_frames-1)*(frame_size/sizeof(uint32_t)));
+			}
+			//~ printf("memcpy %d\n",isgprt);
+			if (unp != NULL)
+			{
+				if (unpack_sg_frames(unp, sgprt->data_buf, sgprt->n_frames, frame_size, frames_read) != 0)
+				{
+					return -1;
+				}
+			}
+			else if (sel != NULL)
+			{
+				if (select_sg_frames(sel, sgprt->data_buf, sgprt->n_frames, frame_size, frames_read) != 0)
+				{
+					return -1;
+				}
+			}
+			else
+			{
+				memcpy(vdif_buf + (size_t)frames_read*(frame_size/sizeof(uint32_t)),
+						sgprt->data_buf,(size_t)sgprt->n_frames*frame_size);
+			}
+			if (sgpln->qlk != NULL)
+			{
+				offer_sg_quicklook_frames(sgpln->qlk, sgprt->data_buf, sgprt->n_frames, frame_size);
+			}
+			frames_read += sgprt->n_frames;
+			clear_sg_part_buffer(sgprt);
+		}
+		if (frames_read == 0 && isgprt == 0)
+		{
+			fprintf(stderr,"Buffer too small to hold a single block.\n");
+			return -1;
+		}
+		/* Blocks left with no frames by the read filter were consumed,
+		 * go on to the next blocks rather than signal the end of data. */
+	} while (frames_read == 0);
+	sgpln->last_stamp = last_stamp;
+	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
+		snprintf(_dbgmsg,_DBGMSGLEN,"Found %d contiguous blocks\n",n_contiguous_blocks);
+		DEBUGMSG(_dbgmsg);
+	#endif
+/*
+ */
+//~ /***********************************************************************
+ //~ * This part of the code ignores discontinuities of data across block 
+ //~ * boundaries.
+ //~ */
+	//~ for (ithread=0; ithread<sgpln->n_sgprt; ithread++)
+	//~ {
+		//~ if (sg_threads_mask[ithread] == 1 && sgpln->sgprt[ithread].n_frames > 0)
+		//~ {
+			//~ memcpy((void *)(*vdif_buf + frames_read*frame_size/sizeof(uint32_t)),
+					//~ (void *)(sgpln->sgprt[ithread].data_buf),sgpln->sgprt[ithread].n_frames*frame_size);
+			//~ frames_read += sgpln->sgprt[ithread].n_frames;
+			//~ clear_sg_part_buffer(&(sgpln->sgprt[ithread]));
+		//~ }
+	//~ } 
+//~ /*
+//~  ***********************************************************************/
+	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
+		print_sg_plan(sgpln,"\t");
+		DEBUGMSG_LEAVEFUNC;
+	#endif
+	/* Return the frame count. */
+	return frames_read;
+}
+
+/*
+ * Start reading the next block of each SG file whose buffer is empty.
+ * Arguments:
+ *   SGPlan *sgpln -- SGPlan instance created in read-mode.
+ *   pthread_t *sg_threads -- One per SGPart, set for the reads started.
+ *   int *sg_threads_mask -- One per SGPart, set to 1 for the reads 
+ *     started and 0 otherwise.
+ * Return:
+ *   void
+ * Notes:
+ *   Each read runs in its own thread with sgthread_read_block; wait for
+ *     them with join_sg_block_reads.
+ */
+void launch_sg_block_reads(SGPlan *sgpln, pthread_t *sg_threads, int *sg_threads_mask)
+{
+	#ifdef DEBUG_LEVEL
+		char _dbgmsg[_DBGMSGLEN];
+	#endif
+	int ithread; // thread counter
+	int thread_result; // result of calls to pthread methods
 	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
 		DEBUGMSG("\tLaunching threads.");
 	#endif
@@ -318,7 +832,7 @@ int read_next_block_vdif_frames(SGPlan *sgpln, uint32_t **vdif_buf)
 		 * indicates that the next block of data should be read.
 		 */
 		sg_threads_mask[ithread] = 0;
-		if (sgpln->sgprt[ithread].n_frames == 0 && sgpln->sgprt[ithread].iblock < sgpln->sgprt[ithread].sgi->sg_total_blks)
+		if (sgpln->sgprt[ithread].n_block_frames == 0 && sgpln->sgprt[ithread].iblock < sgpln->sgprt[ithread].sgi->sg_total_blks)
 		{
 			sg_threads_mask[ithread] = 1;
 			thread_result = pthread_create(&(sg_threads[ithread]),NULL,&sgthread_read_block,&(sgpln->sgprt[ithread]));
@@ -327,32 +841,37 @@ int read_next_block_vdif_frames(SGPlan *sgpln, uint32_t **vdif_buf)
 				perror("Unable to create thread.");
 				exit(EXIT_FAILURE);
 			}
-			/* Remove the frames_estimate increment here ...
-			frames_estimate += sgpln->sgprt[ithread].sgi->sg_wr_pkts;
-			... and put it outside the thread launch loop. If 
-			newly read data maps continuously to already read
-			data, then we underestimate the number of frames
-			that we'll need to put in the output buffer. */
 		}
-		/* As per above, increment frames_estimate here. */
-		frames_estimate += sgpln->sgprt[ithread].sgi->sg_wr_pkts;
-
 	}
-	/* Create storage buffer. Assume that the number of frames read
-	 * is always smaller than or equal to the number of estimated frames
-	 */
-	*vdif_buf = (uint32_t *)malloc(frames_estimate*frame_size);
+}
+
+/*
+ * Wait for the block reads started by launch_sg_block_reads.
+ * Arguments:
+ *   SGPlan *sgpln -- SGPlan instance created in read-mode.
+ *   pthread_t *sg_threads -- As filled by launch_sg_block_reads.
+ *   const int *sg_threads_mask -- As filled by launch_sg_block_reads.
+ * Return:
+ *   void
+ * Notes:
+ *   The block counter of each SG file that returned frames is advanced.
+ */
+void join_sg_block_reads(SGPlan *sgpln, pthread_t *sg_threads, const int *sg_threads_mask)
+{
+	#ifdef DEBUG_LEVEL
+		char _dbgmsg[_DBGMSGLEN];
+	#endif
+	int ithread; // thread counter
+	int thread_result; // result of calls to pthread methods
 	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
 		DEBUGMSG("\tJoining threads.");
 	#endif
-	/* Join the threads */
 	for (ithread=0; ithread<sgpln->n_sgprt; ithread++)
 	{
 		/* Only join threads that have been started. */
 		if (sg_threads_mask[ithread] == 1)
 		{
 			thread_result = pthread_join(sg_threads[ithread],NULL);
-			//printf("Thread %d read %d frames.\n",ithread,msg_in->num_frames);
 			if (thread_result != 0)
 			{
 				perror("Unable to join thread.");
@@ -361,7 +880,7 @@ int read_next_block_vdif_frames(SGPlan *sgpln, uint32_t **vdif_buf)
 			/* If we read frames from this SG file, update the block 
 			 * counter.
 			 */
-			if (sgpln->sgprt[ithread].n_frames > 0)
+			if (sgpln->sgprt[ithread].n_block_frames > 0)
 			{
 				sgpln->sgprt[ithread].iblock++;
 			}
@@ -370,54 +889,6 @@ int read_next_block_vdif_frames(SGPlan *sgpln, uint32_t **vdif_buf)
 	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
 		print_sg_plan(sgpln,"\t");
 	#endif
-	
-/***********************************************************************
- * This part of the code checks continuity of data across block 
- * boundaries.
- */
-	n_contiguous_blocks = map_sg_parts_contiguous(sgpln, mapping);
-	//~ printf("n_contiguous_blocks = %d\n",n_contiguous_blocks);
-	if (n_contiguous_blocks == 0)
-	{
-		printf("No contiguous blocks found.\n");
-		return 0;
-	}
-	for (isgprt=0; isgprt<n_contiguous_blocks; isgprt++)
-	{
-		//~ printf("memcpy %d\n",isgprt);
-		memcpy((void *)(*vdif_buf + frames_read*frame_size/sizeof(uint32_t)),
-				(void *)(sgpln->sgprt[mapping[isgprt]-1].data_buf),sgpln->sgprt[mapping[isgprt]-1].n_frames*frame_size);
-		frames_read += sgpln->sgprt[mapping[isgprt]-1].n_frames;
-		clear_sg_part_buffer(&(sgpln->sgprt[mapping[isgprt]-1]));
-	}
-	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
-		snprintf(_dbgmsg,_DBGMSGLEN,"Found %d contiguous blocks\n",n_contiguous_blocks);
-		DEBUGMSG(_dbgmsg);
-	#endif
-/*
- */
-//~ /***********************************************************************
- //~ * This part of the code ignores discontinuities of data across block 
- //~ * boundaries.
- //~ */
-	//~ for (ithread=0; ithread<sgpln->n_sgprt; ithread++)
-	//~ {
-		//~ if (sg_threads_mask[ithread] == 1 && sgpln->sgprt[ithread].n_frames > 0)
-		//~ {
-			//~ memcpy((void *)(*vdif_buf + frames_read*frame_size/sizeof(uint32_t)),
-					//~ (void *)(sgpln->sgprt[ithread].data_buf),sgpln->sgprt[ithread].n_frames*frame_size);
-			//~ frames_read += sgpln->sgprt[ithread].n_frames;
-			//~ clear_sg_part_buffer(&(sgpln->sgprt[ithread]));
-		//~ }
-	//~ } 
-//~ /*
-//~  ***********************************************************************/
-	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
-		print_sg_plan(sgpln,"\t");
-		DEBUGMSG_LEAVEFUNC;
-	#endif
-	/* Return the frame count. */
-	return frames_read;
 }
 
 /*
@@ -477,7 +948,7 @@ int read_block_vdif_frames(SGPlan *sgpln, off_t iblock, uint32_t **vdif_buf)
 		frames_estimate += sgpln->sgprt[ithread].sgi->sg_wr_pkts;
 	}
 	/* Create storage buffer. */
-	*vdif_buf = (uint32_t *)malloc(frames_estimate*frame_size);
+	*vdif_buf = (uint32_t *)alloc_sg_data(&(sgpln->data_sga), (size_t)frames_estimate*frame_size);
 	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
 		DEBUGMSG("\tJoining threads.");
 	#endif
@@ -504,13 +975,17 @@ int read_block_vdif_frames(SGPlan *sgpln, off_t iblock, uint32_t **vdif_buf)
 }
 
 /*
- * Close scatter gather read plan.
+ * Reposition a read plan at a given block index.
  * Arguments:
- *   SGPlan *sgpln -- Pointer to SGPlan opened in read mode.
- * Return:
- *   void
+ *   SGPlan *sgpln -- SGPlan instance created in read-mode.
+ *   off_t iblock -- Block index to continue reading from in every SG 
+ *     file, clipped to the number of blocks in each file.
+ * Returns:
+ *   int -- 0 on success, -1 on error.
+ * Notes:
+ *   Blocks parked from previous reads are discarded.
  */
-void close_sg_read_plan(SGPlan *sgpln)
+int seek_sg_read_plan(SGPlan *sgpln, off_t iblock)
 {
 	#ifdef DEBUG_LEVEL
 		char _dbgmsg[_DBGMSGLEN];
@@ -518,45 +993,43 @@ void close_sg_read_plan(SGPlan *sgpln)
 	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
 		DEBUGMSG_ENTERFUNC;
 	#endif
+	int ii;
 	/* Check if read mode */
 	if (sgpln->sgm != SCATGAT_MODE_READ)
 	{
-		fprintf(stderr,"Cannot close non-read-mode SGPlan as read-mode.\n");
+		fprintf(stderr,"Trying to seek in non-read-mode SGPlan.\n");
+		return -1;
+	}
+	if (iblock < 0)
+	{
+		fprintf(stderr,"Invalid block index %ld.\n",(long int)iblock);
+		return -1;
 	}
-	int ii;
 	for (ii=0; ii<sgpln->n_sgprt; ii++)
 	{
-		sg_close(sgpln->sgprt[ii].sgi);
+		clear_sg_part_buffer(&(sgpln->sgprt[ii]));
+		sgpln->sgprt[ii].iblock = iblock < (off_t)sgpln->sgprt[ii].sgi->sg_total_blks ? iblock : (off_t)sgpln->sgprt[ii].sgi->sg_total_blks;
 	}
 	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
 		DEBUGMSG_LEAVEFUNC;
 	#endif
+	return 0;
 }
 
-
-//////////////////////////////////////////////////////////////////////// SCATTER GATHER WRITING
 /*
- * Create a write-mode SGPlan instance.
+ * Reposition a read plan at a given time.
  * Arguments:
- *   SGPlan **sgpln -- Address of SGPlan pointer to allocate memory.
- *   const char *pattern -- Filename pattern to search for.
- *   const char *fmtstr -- Format string used to compile the file full
- *     path. It should have the form <..>%d<..>%d<..>%s where the first
- *     %d is replaced with an element from mod_list, the second %d 
- *     replaced with an element from disk_list, and the %s replaced with
- *     pattern.
- *   int *mod_list -- Array of module numbers to use.
- *   int n_mod -- Number of modules to use.
- *   int *disk_list -- Array of disk numbers to use.
- *   int n_disk -- Number of disks to use.
+ *   SGPlan *sgpln -- SGPlan instance created in read-mode.
+ *   uint64_t stamp -- Time as SG_MAKE_STAMP(secs, df_num).
  * Returns:
- *   int -- Number of SGInfo instances (SG files created)
+ *   int -- 0 on success, -1 on error.
  * Notes:
- *   For each SG file created an SGPart element is stored in SGPlan.
+ *   Blocks within an SG file are in time order, so the first block 
+ *     ending at or after stamp is found by bisection on the block's 
+ *     first frame: the answer is the last block starting at or before 
+ *     stamp, or block 0.
  */
-int make_sg_write_plan(SGPlan **sgpln, const char *pattern, 
-					const char *fmtstr, int *mod_list, int n_mod, 
-					int *disk_list, int n_disk)
+int seek_sg_read_plan_time(SGPlan *sgpln, uint64_t stamp)
 {
 	#ifdef DEBUG_LEVEL
 		char _dbgmsg[_DBGMSGLEN];
@@ -564,17 +1037,419 @@ int make_sg_write_plan(SGPlan **sgpln, const char *pattern,
 	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
 		DEBUGMSG_ENTERFUNC;
 	#endif
-	int itmp; // just a counter
-	int idisk, imod; // disk, module counters
-	char filename[n_mod*n_disk][PATH_MAX]; // full filename searched for
-	int ithread; // thread counter
-	int thread_result; // return result for pthread methods
-	pthread_t sg_threads[n_mod*n_disk]; // pthreads to do filling
-	int valid_sgi = 0; // number of valid SG files created
-	/* Temporary store for allocated SGInfo instances. */
-	SGInfo *sgi_tmp;
-	/* Temporary store for SGPart instances. */
-	SGPart sgprt_tmp[n_mod*n_disk];
+	int ii;
+	off_t lo;
+	off_t hi;
+	off_t mid;
+	int n_frames;
+	uint32_t *start;
+	uint32_t *end;
+	uint64_t first_stamp;
+	const struct sg_wb_header_ext_tag *wbht;
+	SGPart *sgprt;
+	/* Check if read mode */
+	if (sgpln->sgm != SCATGAT_MODE_READ)
+	{
+		fprintf(stderr,"Trying to seek in non-read-mode SGPlan.\n");
+		return -1;
+	}
+	for (ii=0; ii<sgpln->n_sgprt; ii++)
+	{
+		sgprt = &(sgpln->sgprt[ii]);
+		clear_sg_part_buffer(sgprt);
+		/* Find the last block whose first frame is not after stamp */
+		lo = 0;
+		hi = sgprt->sgi->sg_total_blks;
+		while (hi - lo > 1)
+		{
+			mid = lo + (hi - lo)/2;
+			wbht = get_sg_part_block_header(sgprt,mid);
+			if (wbht != NULL)
+			{
+				first_stamp = wbht->first_stamp;
+			}
+			else
+			{
+				n_frames = 0;
+				start = get_sg_part_block(sgprt,mid,&n_frames,&end);
+				first_stamp = (start != NULL && n_frames > 0) ? SG_VDIF_STAMP(start) : UINT64_MAX;
+			}
+			if (first_stamp <= stamp)
+			{
+				lo = mid;
+			}
+			else
+			{
+				hi = mid;
+			}
+		}
+		sgprt->iblock = lo < (off_t)sgprt->sgi->sg_total_blks ? lo : (off_t)sgprt->sgi->sg_total_blks;
+	}
+	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
+		DEBUGMSG_LEAVEFUNC;
+	#endif
+	return 0;
+}
+
+/*
+ * Get the maximum number of frames a single block read may return.
+ * Arguments:
+ *   SGPlan *sgpln -- SGPlan instance created in read-mode.
+ * Returns:
+ *   int -- Sum over all SG files of the packets per block.
+ * Notes:
+ *   Each SGPart holds at most one block at a time, either freshly read
+ *     or parked from a previous call, so this bounds the output of 
+ *     read_next_block_vdif_frames_into.
+ */
+int get_sg_plan_max_block_frames(SGPlan *sgpln)
+{
+	int ii;
+	int frames_estimate = 0;
+	for (ii=0; ii<sgpln->n_sgprt; ii++)
+	{
+		frames_estimate += sgpln->sgprt[ii].sgi->sg_wr_pkts;
+	}
+	return frames_estimate;
+}
+
+/*
+ * Initialize a read filter that matches every frame.
+ * Arguments:
+ *   SGReadFilter *flt -- Filter to initialize.
+ * Return:
+ *   void
+ */
+void init_sg_read_filter(SGReadFilter *flt)
+{
+	memset(flt, 0, sizeof(SGReadFilter));
+	flt->start_stamp = 0;
+	flt->end_stamp = UINT64_MAX;
+	flt->station_id = -1;
+}
+
+/*
+ * Add a VDIF thread to the set selected by a read filter.
+ * Arguments:
+ *   SGReadFilter *flt -- Filter to update.
+ *   int thread_id -- VDIF thread ID, 0 to 1023.
+ * Returns:
+ *   int -- 0 on success, -1 if thread_id is out of range.
+ * Notes:
+ *   A filter without any thread added selects all threads.
+ */
+int add_sg_read_filter_thread(SGReadFilter *flt, int thread_id)
+{
+	if (thread_id < 0 || thread_id >= SG_MAX_VDIF_THREADS)
+	{
+		fprintf(stderr,"Invalid VDIF thread ID %d.\n",thread_id);
+		return -1;
+	}
+	flt->thread_mask[thread_id/32] |= 1u << (thread_id%32);
+	flt->use_thread_mask = 1;
+	return 0;
+}
+
+/*
+ * Set or clear the read filter of a read plan.
+ * Arguments:
+ *   SGPlan *sgpln -- SGPlan instance created in read-mode.
+ *   const SGReadFilter *flt -- Filter to copy into the plan, or NULL to
+ *     read all frames.
+ * Returns:
+ *   int -- 0 on success, -1 on error.
+ * Notes:
+ *   The filter applies to blocks read after the call. Blocks already 
+ *     parked in the plan keep the frames selected when they were read,
+ *     so set the filter before the first read or after a seek.
+ */
+int set_sg_read_filter(SGPlan *sgpln, const SGReadFilter *flt)
+{
+	/* Check if read mode */
+	if (sgpln->sgm != SCATGAT_MODE_READ)
+	{
+		fprintf(stderr,"Trying to filter non-read-mode SGPlan.\n");
+		return -1;
+	}
+	if (flt == NULL)
+	{
+		sgpln->has_filter = 0;
+		return 0;
+	}
+	if (flt->start_stamp >= flt->end_stamp)
+	{
+		fprintf(stderr,"Empty time range in read filter.\n");
+		return -1;
+	}
+	sgpln->filter = *flt;
+	sgpln->has_filter = 1;
+	return 0;
+}
+
+/*
+ * Test whether two thread bitmaps share a thread.
+ * Arguments:
+ *   const uint32_t *a, *b -- Bitmaps of SG_MAX_VDIF_THREADS bits.
+ * Returns:
+ *   int -- 1 if any thread is set in both, 0 otherwise.
+ */
+int test_sg_thread_masks(const uint32_t *a, const uint32_t *b)
+{
+	int ii;
+	for (ii=0; ii<SG_MAX_VDIF_THREADS/32; ii++)
+	{
+		if (a[ii] & b[ii])
+		{
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Copy the frames selected by a read filter.
+ * Arguments:
+ *   const SGReadFilter *flt -- Filter to apply.
+ *   uint32_t *dst -- Destination, may equal src for in-place use.
+ *   const uint32_t *src -- Frames to select from.
+ *   int n_frames -- Number of frames in src.
+ *   int pkt_size -- Frame size in bytes.
+ * Returns:
+ *   int -- Number of frames copied to dst.
+ * Notes:
+ *   Runs of consecutive matching frames are moved with a single 
+ *     memmove, and the payload of frames that do not match is never 
+ *     touched.
+ */
+int filter_sg_frames(const SGReadFilter *flt, uint32_t *dst, 
+					const uint32_t *src, int n_frames, int pkt_size)
+{
+	int stride = pkt_size/sizeof(uint32_t);
+	int n_out = 0;
+	int run_start = -1;
+	int iframe;
+	int match;
+	uint64_t stamp;
+	const uint32_t *h;
+	for (iframe=0; iframe<=n_frames; iframe++)
+	{
+		match = 0;
+		if (iframe < n_frames)
+		{
+			h = src + (size_t)iframe*stride;
+			stamp = SG_VDIF_STAMP(h);
+			match = stamp >= flt->start_stamp && stamp < flt->end_stamp &&
+				(flt->station_id < 0 || (int)VDIF_STATION_ID(h) == flt->station_id) &&
+				(!flt->use_thread_mask || (flt->thread_mask[VDIF_THREAD_ID(h)/32] >> (VDIF_THREAD_ID(h)%32)) & 1u);
+		}
+		if (match && run_start < 0)
+		{
+			run_start = iframe;
+		}
+		else if (!match && run_start >= 0)
+		{
+			memmove(dst + (size_t)n_out*stride, src + (size_t)run_start*stride, (size_t)(iframe-run_start)*pkt_size);
+			n_out += iframe-run_start;
+			run_start = -1;
+		}
+	}
+	return n_out;
+}
+
+/*
+ * Read only the VDIF headers of all frames in a read plan.
+ * Arguments:
+ *   SGPlan *sgpln -- SGPlan instance created in read-mode.
+ *   SGHeaderScan **scan -- Address of pointer to receive the columns.
+ * Returns:
+ *   int -- Number of frames scanned, or -1 on error.
+ * Notes:
+ *   Frames are counted from the block index first, so that the columns
+ *     are allocated once and each thread fills its own rows.
+ */
+int scan_sg_plan_headers(SGPlan *sgpln, SGHeaderScan **scan)
+{
+	#ifdef DEBUG_LEVEL
+		char _dbgmsg[_DBGMSGLEN];
+	#endif
+	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
+		DEBUGMSG_ENTERFUNC;
+	#endif
+	int ithread; // thread counter
+	int thread_result; // result of calls to pthread methods
+	pthread_t sg_threads[sgpln->n_sgprt]; // the pthreads used
+	SGHeaderScanTask tasks[sgpln->n_sgprt]; // work item per thread
+	off_t iblock;
+	int n_frames;
+	int n_total = 0;
+	uint32_t *end;
+	SGHeaderScan *shs;
+	char *col;
+	
+	*scan = NULL;
+	/* Check if read mode */
+	if (sgpln->sgm != SCATGAT_MODE_READ)
+	{
+		fprintf(stderr,"Trying to scan non-read-mode SGPlan.\n");
+		return -1;
+	}
+	/* Count frames per file from the block index. */
+	for (ithread=0; ithread<sgpln->n_sgprt; ithread++)
+	{
+		tasks[ithread].sgprt = &(sgpln->sgprt[ithread]);
+		tasks[ithread].ipart = ithread;
+		tasks[ithread].offset = n_total;
+		for (iblock=0; iblock<sgpln->sgprt[ithread].sgi->sg_total_blks; iblock++)
+		{
+			n_frames = 0;
+			get_sg_part_block(&(sgpln->sgprt[ithread]),iblock,&n_frames,&end);
+			n_total += n_frames;
+		}
+		tasks[ithread].n_frames = n_total - tasks[ithread].offset;
+	}
+	/* One allocation for the columns, widest first to keep alignment. */
+	shs = (SGHeaderScan *)alloc_sg_meta(&(sgpln->meta_sga), sizeof(SGHeaderScan));
+	if (shs == NULL)
+	{
+		return -1;
+	}
+	col = (char *)alloc_sg_data(&(sgpln->data_sga), (size_t)n_total*(3*sizeof(uint32_t) + 3*sizeof(uint16_t) + sizeof(uint8_t)));
+	if (col == NULL && n_total > 0)
+	{
+		free_sg_mem(&(sgpln->meta_sga), shs);
+		return -1;
+	}
+	shs->n_frames = n_total;
+	shs->secs = (uint32_t *)col;
+	shs->df_num = shs->secs + n_total;
+	shs->block = shs->df_num + n_total;
+	shs->thread = (uint16_t *)(shs->block + n_total);
+	shs->station = shs->thread + n_total;
+	shs->part = shs->station + n_total;
+	shs->flags = (uint8_t *)(shs->part + n_total);
+	/* Launch threads to scan headers */
+	for (ithread=0; ithread<sgpln->n_sgprt; ithread++)
+	{
+		tasks[ithread].scan = shs;
+		thread_result = pthread_create(&(sg_threads[ithread]),NULL,&sgthread_scan_headers,&(tasks[ithread]));
+		if (thread_result != 0)
+		{
+			perror("Unable to create thread.");
+			exit(EXIT_FAILURE);
+		}
+	}
+	for (ithread=0; ithread<sgpln->n_sgprt; ithread++)
+	{
+		thread_result = pthread_join(sg_threads[ithread],NULL);
+		if (thread_result != 0)
+		{
+			perror("Unable to join thread.");
+			exit(EXIT_FAILURE);
+		}
+	}
+	*scan = shs;
+	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
+		DEBUGMSG_LEAVEFUNC;
+	#endif
+	return n_total;
+}
+
+/*
+ * Release the result of scan_sg_plan_headers.
+ * Arguments:
+ *   SGPlan *sgpln -- Plan that produced the scan.
+ *   SGHeaderScan *scan -- Scan to release, may be NULL.
+ * Return:
+ *   void
+ */
+void free_sg_header_scan(SGPlan *sgpln, SGHeaderScan *scan)
+{
+	if (scan != NULL)
+	{
+		/* secs is the start of the single column allocation */
+		free_sg_mem(&(sgpln->data_sga), scan->secs);
+		free_sg_mem(&(sgpln->meta_sga), scan);
+	}
+}
+
+/*
+ * Close scatter gather read plan.
+ * Arguments:
+ *   SGPlan *sgpln -- Pointer to SGPlan opened in read mode.
+ * Return:
+ *   void
+ * Notes:
+ *   Pending asynchronous operations are completed before the files are
+ *     closed.
+ */
+void close_sg_read_plan(SGPlan *sgpln)
+{
+	#ifdef DEBUG_LEVEL
+		char _dbgmsg[_DBGMSGLEN];
+	#endif
+	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
+		DEBUGMSG_ENTERFUNC;
+	#endif
+	/* Check if read mode */
+	if (sgpln->sgm != SCATGAT_MODE_READ)
+	{
+		fprintf(stderr,"Cannot close non-read-mode SGPlan as read-mode.\n");
+	}
+	stop_sg_async(sgpln);
+	int ii;
+	for (ii=0; ii<sgpln->n_sgprt; ii++)
+	{
+		close_sg_part_file(&(sgpln->sgprt[ii]));
+	}
+	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
+		DEBUGMSG_LEAVEFUNC;
+	#endif
+}
+
+
+//////////////////////////////////////////////////////////////////////// SCATTER GATHER WRITING
+/*
+ * Create a write-mode SGPlan instance.
+ * Arguments:
+ *   SGPlan **sgpln -- Address of SGPlan pointer to allocate memory.
+ *   const char *pattern -- Filename pattern to search for.
+ *   const char *fmtstr -- Format string used to compile the file full
+ *     path. It should have the form <..>%d<..>%d<..>%s where the first
+ *     %d is replaced with an element from mod_list, the second %d 
+ *     replaced with an element from disk_list, and the %s replaced with
+ *     pattern.
+ *   int *mod_list -- Array of module numbers to use.
+ *   int n_mod -- Number of modules to use.
+ *   int *disk_list -- Array of disk numbers to use.
+ *   int n_disk -- Number of disks to use.
+ * Returns:
+ *   int -- Number of SGInfo instances (SG files created), or -1 if
+ *     memory could not be allocated.
+ * Notes:
+ *   For each SG file created an SGPart element is stored in SGPlan.
+ */
+int make_sg_write_plan(SGPlan **sgpln, const char *pattern, 
+					const char *fmtstr, int *mod_list, int n_mod, 
+					int *disk_list, int n_disk)
+{
+	#ifdef DEBUG_LEVEL
+		char _dbgmsg[_DBGMSGLEN];
+	#endif
+	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
+		DEBUGMSG_ENTERFUNC;
+	#endif
+	int itmp; // just a counter
+	int idisk, imod; // disk, module counters
+	char filename[n_mod*n_disk][PATH_MAX]; // full filename searched for
+	int ithread; // thread counter
+	int thread_result; // return result for pthread methods
+	pthread_t sg_threads[n_mod*n_disk]; // pthreads to do filling
+	int valid_sgi = 0; // number of valid SG files created
+	/* Temporary store for allocated SGInfo instances. */
+	SGInfo *sgi_tmp;
+	SGAllocator meta_sga = sg_default_meta_sga; // allocator for the new plan
+	/* Temporary store for SGPart instances. */
+	SGPart sgprt_tmp[n_mod*n_disk];
 	/* Step through all modules and disks, and access files that 
 	 * match the pattern.
 	 */
@@ -634,9 +1509,18 @@ int make_sg_write_plan(SGPlan **sgpln, const char *pattern,
 				perror("Unable to launch thread.");
 				exit(EXIT_FAILURE);
 			}
-			if (sgi_tmp != NULL)
+			if (sgi_tmp != NULL && init_sg_part(&(sgprt_tmp[valid_sgi]), sgi_tmp, NULL) != 0)
+			{
+				discard_sg_infos(sgi_tmp, 1, SCATGAT_MODE_WRITE);
+				free_sg_mem(&meta_sga, sgi_tmp);
+			}
+			else if (sgi_tmp != NULL)
 			{
-				init_sg_part(&(sgprt_tmp[valid_sgi++]), sgi_tmp);
+				valid_sgi++;
+				/* Free the temporary SGInfo resources, but DO NOT free
+				 * the malloc'ed NAME to which we still keep a pointer.
+				 */
+				free_sg_mem(&meta_sga, sgi_tmp);
 			}
 			else
 			{
@@ -647,20 +1531,37 @@ int make_sg_write_plan(SGPlan **sgpln, const char *pattern,
 			}
 		}
 	}
-	*sgpln = (SGPlan *)malloc(sizeof(SGPlan));
-	(*sgpln)->sgm = SCATGAT_MODE_WRITE;
-	(*sgpln)->block_count = 0;
-	(*sgpln)->n_sgprt = valid_sgi;
-	(*sgpln)->sgprt = (SGPart *)malloc(sizeof(SGPart)*valid_sgi);
-	memcpy((*sgpln)->sgprt, sgprt_tmp, sizeof(SGPart)*valid_sgi);
-	/* Free the temporary SGInfo resources, but DO NOT free
-	 * the malloc'ed NAME to which we still keep a pointer.
-	 */
-	free(sgi_tmp);
-	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
-		DEBUGMSG_LEAVEFUNC;
-	#endif
-	return valid_sgi;
+	*sgpln = (SGPlan *)alloc_sg_meta(&meta_sga, sizeof(SGPlan));
+	if (*sgpln != NULL)
+	{
+		init_sg_plan(*sgpln, SCATGAT_MODE_WRITE, &meta_sga);
+		(*sgpln)->sgprt = (SGPart *)alloc_sg_meta(&meta_sga, sizeof(SGPart)*(valid_sgi > 0 ? valid_sgi : 1));
+	}
+	if (*sgpln == NULL || (*sgpln)->sgprt == NULL)
+	{
+		perror("Unable to allocate SGPlan.");
+		for (itmp=0; itmp<valid_sgi; itmp++)
+		{
+			discard_sg_infos(sgprt_tmp[itmp].sgi, 1, SCATGAT_MODE_WRITE);
+			free_sg_mem(&meta_sga, sgprt_tmp[itmp].sgi);
+		}
+		if (*sgpln != NULL)
+		{
+			free_sg_plan(*sgpln);
+			*sgpln = NULL;
+		}
+		return -1;
+	}
+	(*sgpln)->n_sgprt = valid_sgi;
+	memcpy((*sgpln)->sgprt, sgprt_tmp, sizeof(SGPart)*valid_sgi);
+	for (itmp=0; itmp<valid_sgi; itmp++)
+	{
+		(*sgpln)->sgprt[itmp].sgpln = *sgpln;
+	}
+	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
+		DEBUGMSG_LEAVEFUNC;
+	#endif
+	return valid_sgi;
 }
 
 /*
@@ -716,8 +1617,20 @@ int write_vdif_frames(SGPlan *sgpln, uint32_t *vdif_buf, int n_frames)
 	{
 		// TODO: Check if incoming packets are valid?
 	}
-	printf("WBLOCK_SIZE = %ld, pkt_size = %ld\n",(long int)WBLOCK_SIZE,(long int)sgpln->sgprt[0].sgi->pkt_size);
-	frames_per_block = WBLOCK_SIZE/sgpln->sgprt[0].sgi->pkt_size;
+	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
+		snprintf(_dbgmsg,_DBGMSGLEN,"block_size = %ld, pkt_size = %ld",(long int)sgpln->block_size,(long int)sgpln->sgprt[0].sgi->pkt_size);
+		DEBUGMSG(_dbgmsg);
+	#endif
+	frames_per_block = sgpln->block_size/sgpln->sgprt[0].sgi->pkt_size;
+	if (frames_per_block == 0)
+	{
+		fprintf(stderr,"Block size %lu too small for %ld-byte frames.\n",(unsigned long)sgpln->block_size,(long)sgpln->sgprt[0].sgi->pkt_size);
+		return -1;
+	}
+	if (sgpln->qlk != NULL)
+	{
+		offer_sg_quicklook_frames(sgpln->qlk, vdif_buf, n_frames, sgpln->sgprt[0].sgi->pkt_size);
+	}
 	/* Find the first SG file that is short */
 	for (ithread=1; ithread<sgpln->n_sgprt; ithread++)
 	{
@@ -781,6 +1694,9 @@ int write_vdif_frames(SGPlan *sgpln, uint32_t *vdif_buf, int n_frames)
  *   SGPlan *sgpln -- Pointer to SGPlan opened in write-mode.
  * Return:
  *   void
+ * Notes:
+ *   Pending asynchronous operations are completed before the files are
+ *     trimmed and closed.
  */
 void close_sg_write_plan(SGPlan *sgpln)
 {
@@ -795,9 +1711,15 @@ void close_sg_write_plan(SGPlan *sgpln)
 	{
 		fprintf(stderr,"Cannot close non-write-mode SGPlan as write-mode\n");
 	}
+	stop_sg_async(sgpln);
 	int ii;
 	for (ii=0; ii<sgpln->n_sgprt; ii++)
 	{
+		/* Data must be durable before the checkpoint sidecar goes */
+		if (sgpln->sgprt[ii].ckpt != NULL)
+		{
+			fdatasync(sgpln->sgprt[ii].sgi->smi.mmfd);
+		}
 		if (sgpln->sgprt[ii].sgi->smi.size != (sgpln->sgprt[ii].sgi->smi.eomem - sgpln->sgprt[ii].sgi->smi.start))
 		{
 			if (sgpln->sgprt[ii].sgi->smi.size == 0)
@@ -821,329 +1743,7078 @@ void close_sg_write_plan(SGPlan *sgpln)
 		{
 			sg_close(sgpln->sgprt[ii].sgi);
 		}
+		close_sg_checkpoint(&(sgpln->sgprt[ii]), &(sgpln->meta_sga), 1);
 	}
 	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
 		DEBUGMSG_LEAVEFUNC;
 	#endif
 }
 
-//////////////////////////////////////////////////////////////////////// THREAD IMPLEMENTATIONS
-/* 
- * Create an SGInfo instance for reading for the given filename.
+/*
+ * Select the SG file format revision written by a write plan.
  * Arguments:
- *   void *arg -- Pointer to filename string.
+ *   SGPlan *sgpln -- SGPlan instance created in write-mode.
+ *   int version -- FILE_VERSION (default) or SG_FILE_VERSION_EXT.
  * Returns:
- *   void * -- Pointer to SGInfo instance if the filename produced a 
- *     valid sg_access result (test on SGInfo.smi) or NULL if not.
+ *   int -- 0 on success, -1 on error.
  * Notes:
- *   This method is suitable for a call via pthread_create.
+ *   Must be called before the first write. With SG_FILE_VERSION_EXT 
+ *     each block header also records the first / last frame stamps, the
+ *     frame count and the set of VDIF threads in the block. Read plans 
+ *     accept both revisions.
  */
-static void * sgthread_fill_read_sgi(void *arg)
+int set_sg_plan_file_version(SGPlan *sgpln, int version)
 {
-	#ifdef DEBUG_LEVEL
-		char _dbgmsg[_DBGMSGLEN];
-	#endif
-	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
-		DEBUGMSG_ENTERFUNC;
-	#endif
-	char *filename = (char *)arg; // filename to try to access
-	SGInfo *sgi = (SGInfo *)calloc(sizeof(SGInfo), 1); // SGInfo pointer to return
-	sgi->name = NULL;
-	sgi->verbose = 0;
-	sg_open(filename,sgi);
-	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
-		snprintf(_dbgmsg,_DBGMSGLEN,"\tsgi->smi.mmfd = %d",sgi->smi.mmfd);
-		DEBUGMSG(_dbgmsg);
-		sg_report(sgi,"\tSG Report:");
-		DEBUGMSG_LEAVEFUNC;
-	#endif
-	return (void *)sgi;
+	int ii;
+	if (sgpln->sgm != SCATGAT_MODE_WRITE)
+	{
+		fprintf(stderr,"Cannot set file version of non-write-mode SGPlan.\n");
+		return -1;
+	}
+	if (version != FILE_VERSION && version != SG_FILE_VERSION_EXT)
+	{
+		fprintf(stderr,"Unsupported SG file version %d.\n",version);
+		return -1;
+	}
+	if (!first_write_sg_plan(sgpln))
+	{
+		fprintf(stderr,"Cannot change file version after the first write.\n");
+		return -1;
+	}
+	sgpln->file_version = version;
+	for (ii=0; ii<sgpln->n_sgprt; ii++)
+	{
+		sgpln->sgprt[ii].sgi->sg_version = version;
+		sgpln->sgprt[ii].sgi->sg_wbht_size = version == SG_FILE_VERSION_EXT ? 
+			sizeof(struct sg_wb_header_ext_tag) : sizeof(struct wb_header_tag);
+	}
+	return 0;
 }
 
-/* Create an SGInfo instance for writing for the given filename.
+/*
+ * Set the block size used by a write plan.
  * Arguments:
- *   void *arg -- Pointer to filename string.
+ *   SGPlan *sgpln -- SGPlan instance created in write-mode.
+ *   size_t block_size -- Bytes of frames per block, between 
+ *     SG_MIN_BLOCK_SIZE and SG_MAX_BLOCK_SIZE.
  * Returns:
- *   void * -- Pointer to SGInfo instance if the the file could be 
- *     opened for writing and mapped to memory (i.e. valid SGInfo 
- *     instance could be created), or NULL otherwise.
+ *   int -- 0 on success, -1 on error.
  * Notes:
- *   This method is suitable for a call via pthread_create.
+ *   Must be called before the first write. Each block holds as many 
+ *     whole frames as fit in block_size, which is recorded in the file
+ *     header, and files grow in multiples of it.
  */
-static void * sgthread_fill_write_sgi(void *arg)
+int set_sg_plan_block_size(SGPlan *sgpln, size_t block_size)
 {
-	#ifdef DEBUG_LEVEL
-		char _dbgmsg[_DBGMSGLEN];
-	#endif
-	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
-		DEBUGMSG_ENTERFUNC;
-	#endif
-	char *filename = (char *)arg; // filename to try to access
-	SGInfo *sgi = (SGInfo *)malloc(sizeof(SGInfo));
-	// Fill in the fields for SGInfo
-	init_sg_info(sgi, filename);
-	// Fill in the fields for SGMMInfo
-	umask((mode_t)0);
-	sgi->smi.mmfd = open(filename, SG_FILE_WRITE_OPEN_MODE, SG_FILE_PERMISSIONS);
-	if (sgi->smi.mmfd == -1)
+	int ii;
+	if (sgpln->sgm != SCATGAT_MODE_WRITE)
 	{
-		perror("Unable to open / create file.");
-		free_sg_info(sgi);
-		return (void *)NULL;
+		fprintf(stderr,"Cannot set block size of non-write-mode SGPlan.\n");
+		return -1;
 	}
-	/* Guess initial file size equal to ideal single write block, 
-	 * defined in dplane_proxy.h. This size setting is just temporary,
-	 * and needs to be reset to zero to indicate the actual number of
-	 * bytes written to file.
-	 */
-	sgi->smi.size = (off_t)INITIAL_SIZE_IN_BLOCKS*WBLOCK_SIZE; //~ WBLOCK_SIZE + sizeof(struct file_header_tag);
-	/* Truncate file to initial size */
-	if (ftruncate(sgi->smi.mmfd, sgi->smi.size) == -1)
+	if (block_size < SG_MIN_BLOCK_SIZE || block_size > SG_MAX_BLOCK_SIZE)
 	{
-		perror("Unable to reset file size.");
-		free_sg_info(sgi);
-		return (void *)NULL;
+		fprintf(stderr,"Block size %lu outside [%d, %d].\n",(unsigned long)block_size,SG_MIN_BLOCK_SIZE,SG_MAX_BLOCK_SIZE);
+		return -1;
 	}
-	/* Create mmap */
-	sgi->smi.start = mmap(NULL, sgi->smi.size, SG_MMAP_WRITE_OPEN_PROTO, SG_MMAP_WRITE_OPEN_MODE, sgi->smi.mmfd, 0);
-	if (sgi->smi.start == MAP_FAILED)
+	if (!first_write_sg_plan(sgpln))
 	{
-		perror("Unable to map file.");
-		free_sg_info(sgi);
-		return (void *)NULL;
+		fprintf(stderr,"Cannot change block size after the first write.\n");
+		return -1;
 	}
-	sgi->smi.eomem = sgi->smi.start + sgi->smi.size;
-	sgi->smi.users = 1;
-	/* And reset file size to number of bytes written, zero */
-	sgi->smi.size = 0;
-	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
-		DEBUGMSG_LEAVEFUNC;
-	#endif
-	return (void *)sgi;
+	sgpln->block_size = block_size;
+	for (ii=0; ii<sgpln->n_sgprt; ii++)
+	{
+		sgpln->sgprt[ii].sgi->sg_wr_block = block_size;
+	}
+	return 0;
 }
 
+//////////////////////////////////////////////////////////////////////// ASYNCHRONOUS OPERATIONS
+/* Process-wide worker pool, protected by lock. The lock also guards 
+ * the creation of SGPlan.asq. Queue locks are taken before it. */
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;												// signalled when a queue is ready or the size shrinks
+	int max_workers;
+	int n_workers;														// threads running
+	int n_idle;															// threads waiting for a ready queue
+	SGAsyncQueue *ready_head;											// queues with operations and no thread
+	SGAsyncQueue *ready_tail;
+} sg_async_pool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, SG_ASYNC_DEFAULT_WORKERS, 0, 0, NULL, NULL };
+
 /*
- * Read one block's worth of VDIF packets from the given SG file.
+ * Submit an asynchronous read of the next block of VDIF frames.
  * Arguments:
- *   void *arg -- SGPart by reference that contains a pointer to 
- *     a valid SGInfo instance, and an index specifying which block to
- *     read.
+ *   SGPlan *sgpln -- SGPlan instance created in read-mode.
+ *   uint32_t *vdif_buf -- Buffer to receive the frames, which must
+ *     remain valid until the callback has been called.
+ *   int max_frames -- Capacity of vdif_buf in frames.
+ *   sg_async_callback cb -- Completion callback, may be NULL.
+ *   void *user_data -- Passed through to cb.
  * Returns:
- *   void *arg -- NULL
- * Notes:
- *   Upon successful read, the data_buf and n_frames fields of the 
- *     received SGPart instance are filled with VDIF data and a frame
- *     count, respectively.
- *   This method is compatible with pthread.
+ *   int -- 0 if the operation was queued, -1 on error.
  */
-static void * sgthread_read_block(void *arg)
+int submit_sg_read_next_block(SGPlan *sgpln, uint32_t *vdif_buf, 
+					int max_frames, sg_async_callback cb, void *user_data)
 {
-	#ifdef DEBUG_LEVEL
-		char _dbgmsg[_DBGMSGLEN];
-	#endif
-	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
-		DEBUGMSG_ENTERFUNC;
-	#endif
-	SGPart *sgprt = (SGPart *)arg;
-	uint32_t *start = NULL;
-	uint32_t *end = NULL;
-	
-	// check if this is a valid block number
-	if (sgprt->iblock < sgprt->sgi->sg_total_blks) 
+	/* Check if read mode */
+	if (sgpln->sgm != SCATGAT_MODE_READ)
 	{
-		//~ start = sg_pkt_by_blk(sgprt->sgi,0,&(sgprt->n_frames),&end);
-		start = sg_pkt_by_blk(sgprt->sgi,sgprt->iblock,(int *)&(sgprt->n_frames),&end);
-		// allocate data storage and copy data to memory
-		sgprt->data_buf = (uint32_t *)malloc(sgprt->n_frames*sgprt->sgi->pkt_size);
-		if (sgprt->data_buf != NULL)
-		{
-			memcpy(sgprt->data_buf,start,sgprt->n_frames*sgprt->sgi->pkt_size);
-		}
+		fprintf(stderr,"Trying to read from non-read-mode SGPlan.\n");
+		return -1;
 	}
-	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
-		DEBUGMSG_LEAVEFUNC;
-	#endif
-	return NULL;
+	return submit_sg_async_op(sgpln, SG_ASYNC_READ_NEXT_BLOCK, vdif_buf, max_frames, cb, user_data);
 }
 
-/* 
- * Write one block's worht of VDIF packets to the given SG file.
+/*
+ * Submit an asynchronous write of VDIF frames.
  * Arguments:
- *   void *arg -- SGPart by reference that contains the data to be 
- *     written as well as a reference to the SGInfo for the file to 
- *     write to.
- * Return:
- *   void *arg -- NULL
- * Notes:
- *   The data_buf and n_frames fields in the SGPart instance contain the
- *     VDIF data and frame count, respectively, that should be written 
- *     as the single next block in the SG file.
+ *   SGPlan *sgpln -- SGPlan instance created in write-mode.
+ *   uint32_t *vdif_buf -- Buffer containing the frames to write, which
+ *     must remain valid until the callback has been called.
+ *   int n_frames -- Number of frames to write.
+ *   sg_async_callback cb -- Completion callback, may be NULL.
+ *   void *user_data -- Passed through to cb.
+ * Returns:
+ *   int -- 0 if the operation was queued, -1 on error.
  */
-static void * sgthread_write_block(void *arg)
+int submit_sg_write_vdif_frames(SGPlan *sgpln, uint32_t *vdif_buf, 
+					int n_frames, sg_async_callback cb, void *user_data)
 {
-	#ifdef DEBUG_LEVEL
-		char _dbgmsg[_DBGMSGLEN];
-	#endif
-	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
-		DEBUGMSG_ENTERFUNC;
-	#endif
-	SGPart *sgprt = (SGPart *)arg;
-	struct file_header_tag fht = { 
-					.sync_word = SYNC_WORD, 
-					.version = FILE_VERSION, 
-					.packet_format = VDIF };
-	struct wb_header_tag wbht = { 
-					.blocknum = sgprt->inherited_block_count, //.blocknum = sgprt->iblock,
-					.wb_size = sgprt->sgi->pkt_size*sgprt->n_frames + sizeof(struct wb_header_tag)};
-	/* If first block, write file header */
-	if (sgprt->iblock == 0)
-	{
-		fht.packet_size = sgprt->sgi->pkt_size;
-		fht.block_size = fht.packet_size*(WBLOCK_SIZE/fht.packet_size) + sizeof(struct wb_header_tag);
-		if (write_to_sg(sgprt->sgi, (void *)&fht, sizeof(struct file_header_tag)) == -1)
-		{
-			fprintf(stderr,"Unable to write file header tag to SG in thread.\n");
-			return NULL;
-		}
-	}
-	/* Write block header */
-	if (write_to_sg(sgprt->sgi, (void *)&wbht, sizeof(struct wb_header_tag)) == -1)
-	{
-		fprintf(stderr,"Unable to write block header tag to SG in thread.\n");
-		return NULL;
-	}
-	/* Write data */
-	if (write_to_sg(sgprt->sgi, (void *)(sgprt->data_buf), sgprt->sgi->pkt_size*sgprt->n_frames) == -1)
+	/* Check if write mode */
+	if (sgpln->sgm != SCATGAT_MODE_WRITE)
 	{
-		fprintf(stderr,"Unable to write data block to SG in thread.\n");
-		return NULL;
+		fprintf(stderr,"Trying to write to non-write-mode SGPlan.\n");
+		return -1;
 	}
-	/* Update block counter for this SG file */
-	sgprt->iblock++;
-	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
-		DEBUGMSG_LEAVEFUNC;
-	#endif
-	return NULL;
+	return submit_sg_async_op(sgpln, SG_ASYNC_WRITE_FRAMES, vdif_buf, n_frames, cb, user_data);
 }
 
 /*
- * Write to SG file and resize if necessary
+ * Set the number of threads executing asynchronous operations.
  * Arguments:
- *   SGInfo *sgi -- Pointer to SGInfo instance for the file to be 
- *     written to.
- *   const void *src -- Pointer to buffer containing source data.
- *   size_t n -- Number of bytes to be written from the source data.
- * Return:
- *   int -- 0 on success, -1 on failure
+ *   int n_workers -- Size of the worker pool shared by all plans, 
+ *     SG_ASYNC_DEFAULT_WORKERS by default.
+ * Returns:
+ *   int -- 0 on success, -1 if n_workers is less than one.
  * Notes:
- *   The size of the file is increased as necessary, currently in steps
- *     of WBLOCK_SIZE (see dplane_proxy.h).
+ *   Threads are started as operations are queued, up to n_workers. 
+ *     When the size is reduced, idle threads beyond it exit.
+ *   Each thread executes one operation of one plan at a time, taking 
+ *     plans with queued operations in turn.
  */
-int write_to_sg(SGInfo *sgi, const void *src, size_t n)
+int set_sg_async_workers(int n_workers)
 {
-	#ifdef DEBUG_LEVEL
-		char _dbgmsg[_DBGMSGLEN];
-	#endif
-	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
-		DEBUGMSG_ENTERFUNC;
-	#endif
-	/* Check if resize is necessary */
-	if (sgi->smi.size+n > (off_t)(sgi->smi.eomem-sgi->smi.start))
+	if (n_workers < 1)
 	{
-		if (resize_to_sg(sgi, (off_t)(sgi->smi.eomem-sgi->smi.start)+(off_t)GROWTH_SIZE_IN_BLOCKS*WBLOCK_SIZE) == -1)
-		{
-			return -1;
-		}
+		fprintf(stderr,"Invalid number of asynchronous workers, %d.\n",n_workers);
+		return -1;
 	}
-	/* Memcopy */
-	memcpy(sgi->smi.start+sgi->smi.size, src, n);
-	sgi->smi.size += n;
-	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
-		DEBUGMSG_LEAVEFUNC;
-	#endif
+	pthread_mutex_lock(&(sg_async_pool.lock));
+	sg_async_pool.max_workers = n_workers;
+	pthread_cond_broadcast(&(sg_async_pool.cond));
+	pthread_mutex_unlock(&(sg_async_pool.lock));
 	return 0;
 }
 
 /*
- * Resize SG file.
+ * Get the completion eventfd of an SGPlan.
  * Arguments:
- *   SGInfo *sgi -- Pointer to SGInfo instance for the file to be 
- *     resized.
- *   off_t new_size -- The new file size, in bytes.
- * Return:
- *   int -- 0 on success, -1 on failure.
+ *   SGPlan *sgpln -- Pointer to SGPlan.
+ * Returns:
+ *   int -- Non-blocking eventfd that is readable while completions are
+ *     queued, or -1 on error.
  */
-int resize_to_sg(SGInfo *sgi, off_t new_size)
+int get_sg_plan_eventfd(SGPlan *sgpln)
 {
-	#ifdef DEBUG_LEVEL
-		char _dbgmsg[_DBGMSGLEN];
-	#endif
-	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
-		DEBUGMSG_ENTERFUNC;
-	#endif
-	/* Truncate file to new size */
-	if (ftruncate(sgi->smi.mmfd, new_size) == -1)
+	if (start_sg_async(sgpln) == -1)
 	{
-		perror("Unable to reset file size.");
+		return -1;
+	}
+	return sgpln->asq->efd;
+}
+
+/*
+ * Collect queued completions without blocking.
+ * Arguments:
+ *   SGPlan *sgpln -- Pointer to SGPlan.
+ *   SGCompletion *completions -- Array to receive completions.
+ *   int max_completions -- Size of the array.
+ * Returns:
+ *   int -- Number of completions stored, in completion order.
+ * Notes:
+ *   The eventfd counter is reset before the queue is inspected. A 
+ *     completion queued in between leaves the eventfd readable, which at
+ *     worst causes one spurious wake-up. Completions that do not fit in
+ *     the array leave it readable as well.
+ */
+int poll_sg_completions(SGPlan *sgpln, SGCompletion *completions, 
+					int max_completions)
+{
+	SGAsyncQueue *asq = sgpln->asq;
+	uint64_t efd_count;
+	int n_completions;
+	if (asq == NULL)
+	{
+		return 0;
+	}
+	if (read(asq->efd, &efd_count, sizeof(efd_count)) == -1)
+	{
+		/* EAGAIN: nothing signalled, but still check the queue. */
+	}
+	pthread_mutex_lock(&(asq->lock));
+	n_completions = pop_sg_completions(sgpln, completions, max_completions);
+	pthread_mutex_unlock(&(asq->lock));
+	return n_completions;
+}
+
+/*
+ * Collect queued completions, blocking until at least one is available.
+ * Arguments:
+ *   SGPlan *sgpln -- Pointer to SGPlan.
+ *   SGCompletion *completions -- Array to receive completions.
+ *   int max_completions -- Size of the array.
+ * Returns:
+ *   int -- Number of completions stored, zero if no operations are
+ *     pending.
+ */
+int wait_sg_completions(SGPlan *sgpln, SGCompletion *completions, 
+					int max_completions)
+{
+	SGAsyncQueue *asq = sgpln->asq;
+	uint64_t efd_count;
+	int n_completions;
+	if (asq == NULL)
+	{
+		return 0;
+	}
+	if (read(asq->efd, &efd_count, sizeof(efd_count)) == -1)
+	{
+		/* EAGAIN: nothing signalled, the condition decides. */
+	}
+	pthread_mutex_lock(&(asq->lock));
+	while (asq->done_head == NULL && asq->pending > 0)
+	{
+		pthread_cond_wait(&(asq->done_cond), &(asq->lock));
+	}
+	n_completions = pop_sg_completions(sgpln, completions, max_completions);
+	pthread_mutex_unlock(&(asq->lock));
+	return n_completions;
+}
+
+/*
+ * Move completions from the done list to the caller's array.
+ * Arguments:
+ *   SGPlan *sgpln -- Pointer to SGPlan, with sgpln->asq->lock held.
+ *   SGCompletion *completions -- Array to receive completions.
+ *   int max_completions -- Size of the array.
+ * Returns:
+ *   int -- Number of completions stored.
+ * Notes:
+ *   The callers reset the eventfd counter before popping. Completions 
+ *     left queued because the array is full signal it again, so that a
+ *     caller waiting on the eventfd is woken for them.
+ */
+int pop_sg_completions(SGPlan *sgpln, SGCompletion *completions, 
+					int max_completions)
+{
+	SGAsyncQueue *asq = sgpln->asq;
+	SGAsyncOp *asop;
+	uint64_t efd_increment = 1;
+	int n_completions = 0;
+	while (asq->done_head != NULL && n_completions < max_completions)
+	{
+		asop = asq->done_head;
+		asq->done_head = asop->next;
+		if (asq->done_head == NULL)
+		{
+			asq->done_tail = NULL;
+		}
+		completions[n_completions].op = asop->op;
+		completions[n_completions].vdif_buf = asop->vdif_buf;
+		completions[n_completions].result = asop->result;
+		completions[n_completions].user_data = asop->user_data;
+		n_completions++;
+		free_sg_mem(&(sgpln->meta_sga), asop);
+	}
+	if (asq->done_head != NULL && write(asq->efd, &efd_increment, sizeof(efd_increment)) == -1)
+	{
+		perror("Unable to signal eventfd.");
+	}
+	return n_completions;
+}
+
+/*
+ * Queue an operation for the plan's worker thread.
+ * Arguments:
+ *   SGPlan *sgpln -- Pointer to SGPlan.
+ *   int op -- Operation type, see sg_async_op_type.
+ *   uint32_t *vdif_buf -- Buffer to read into / write from.
+ *   int n_frames -- Buffer capacity (read) or frame count (write).
+ *   sg_async_callback cb -- Completion callback, may be NULL.
+ *   void *user_data -- Passed through to cb.
+ * Returns:
+ *   int -- 0 on success, -1 on failure.
+ * Notes:
+ *   The plan's queue is created on the first call. Submission after
+ *     the plan has started closing is refused.
+ */
+int submit_sg_async_op(SGPlan *sgpln, int op, uint32_t *vdif_buf, 
+					int n_frames, sg_async_callback cb, void *user_data)
+{
+	#ifdef DEBUG_LEVEL
+		char _dbgmsg[_DBGMSGLEN];
+	#endif
+	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
+		DEBUGMSG_ENTERFUNC;
+	#endif
+	SGAsyncQueue *asq;
+	SGAsyncOp *asop;
+	
+	if (start_sg_async(sgpln) == -1)
+	{
+		return -1;
+	}
+	asq = sgpln->asq;
+	asop = (SGAsyncOp *)alloc_sg_meta(&(sgpln->meta_sga), sizeof(SGAsyncOp));
+	if (asop == NULL)
+	{
+		return -1;
+	}
+	asop->op = op;
+	asop->vdif_buf = vdif_buf;
+	asop->n_frames = n_frames;
+	asop->cb = cb;
+	asop->user_data = user_data;
+	asop->result = 0;
+	asop->next = NULL;
+	pthread_mutex_lock(&(asq->lock));
+	if (asq->stop)
+	{
+		pthread_mutex_unlock(&(asq->lock));
+		free_sg_mem(&(sgpln->meta_sga), asop);
+		fprintf(stderr,"Cannot submit to SGPlan that is being closed.\n");
+		return -1;
+	}
+	if (asq->tail == NULL)
+	{
+		asq->head = asop;
+	}
+	else
+	{
+		asq->tail->next = asop;
+	}
+	asq->tail = asop;
+	asq->pending++;
+	if (!asq->scheduled)
+	{
+		schedule_sg_async_queue(asq);
+	}
+	pthread_mutex_unlock(&(asq->lock));
+	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
+		DEBUGMSG_LEAVEFUNC;
+	#endif
+	return 0;
+}
+
+/*
+ * Create the plan's operation queue and eventfd.
+ * Arguments:
+ *   SGPlan *sgpln -- Pointer to SGPlan.
+ * Returns:
+ *   int -- 0 on success (or if already started), -1 on failure.
+ * Notes:
+ *   Safe against concurrent first submissions, the queue is created 
+ *     under the pool lock.
+ */
+int start_sg_async(SGPlan *sgpln)
+{
+	SGAsyncQueue *asq;
+	int result = 0;
+	pthread_mutex_lock(&(sg_async_pool.lock));
+	if (sgpln->asq != NULL)
+	{
+		pthread_mutex_unlock(&(sg_async_pool.lock));
+		return 0;
+	}
+	asq = (SGAsyncQueue *)alloc_sg_meta(&(sgpln->meta_sga), sizeof(SGAsyncQueue));
+	if (asq == NULL)
+	{
+		result = -1;
+	}
+	else
+	{
+		memset(asq, 0, sizeof(SGAsyncQueue));
+		asq->sgpln = sgpln;
+		asq->meta_sga = sgpln->meta_sga;
+		asq->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (asq->efd == -1)
+		{
+			perror("Unable to create eventfd.");
+			free_sg_mem(&(sgpln->meta_sga), asq);
+			result = -1;
+		}
+		else
+		{
+			pthread_mutex_init(&(asq->lock), NULL);
+			pthread_cond_init(&(asq->done_cond), NULL);
+			sgpln->asq = asq;
+		}
+	}
+	pthread_mutex_unlock(&(sg_async_pool.lock));
+	return result;
+}
+
+/*
+ * Hand a queue with operations to the worker pool.
+ * Arguments:
+ *   SGAsyncQueue *asq -- Queue with operations and no thread serving 
+ *     it, with its lock held.
+ * Return:
+ *   void
+ * Notes:
+ *   Wakes an idle thread, or starts one if all are busy and the pool 
+ *     is not full. Pool threads are detached and live until the pool 
+ *     shrinks.
+ */
+void schedule_sg_async_queue(SGAsyncQueue *asq)
+{
+	pthread_t worker;
+	int thread_result; // result of calls to pthread methods
+	asq->scheduled = 1;
+	asq->ready_next = NULL;
+	pthread_mutex_lock(&(sg_async_pool.lock));
+	if (sg_async_pool.ready_tail == NULL)
+	{
+		sg_async_pool.ready_head = asq;
+	}
+	else
+	{
+		sg_async_pool.ready_tail->ready_next = asq;
+	}
+	sg_async_pool.ready_tail = asq;
+	if (sg_async_pool.n_idle > 0)
+	{
+		pthread_cond_signal(&(sg_async_pool.cond));
+	}
+	else if (sg_async_pool.n_workers < sg_async_pool.max_workers)
+	{
+		thread_result = pthread_create(&worker, NULL, &sgthread_async_worker, NULL);
+		if (thread_result != 0)
+		{
+			perror("Unable to create thread.");
+			exit(EXIT_FAILURE);
+		}
+		pthread_detach(worker);
+		sg_async_pool.n_workers++;
+	}
+	pthread_mutex_unlock(&(sg_async_pool.lock));
+}
+
+/*
+ * Stop the plan's worker thread after draining its queue.
+ * Arguments:
+ *   SGPlan *sgpln -- Pointer to SGPlan.
+ * Return:
+ *   void
+ * Notes:
+ *   All queued operations are executed and their callbacks called 
+ *     before this method returns. Does nothing if no operation was ever
+ *     submitted.
+ *   When called from a completion callback of the plan (i.e. on the 
+ *     pool thread executing its operation) the remaining queued 
+ *     operations complete with -1 instead.
+ *   Completions that were never polled are discarded, and the eventfd
+ *     is closed.
+ */
+void stop_sg_async(SGPlan *sgpln)
+{
+	#ifdef DEBUG_LEVEL
+		char _dbgmsg[_DBGMSGLEN];
+	#endif
+	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
+		DEBUGMSG_ENTERFUNC;
+	#endif
+	SGAsyncQueue *asq = sgpln->asq;
+	SGAsyncOp *asop;
+	SGAsyncOp *next;
+	if (asq == NULL)
+	{
+		return;
+	}
+	pthread_mutex_lock(&(asq->lock));
+	asq->stop = 1;
+	/* Closing from within a completion callback: the queue cannot be 
+	 * drained by waiting, so fail whatever is still queued and let the 
+	 * pool thread free the queue once the callback returns.
+	 */
+	if (asq->serving && pthread_equal(pthread_self(), asq->server))
+	{
+		asq->detached = 1;
+		asop = asq->head;
+		asq->head = NULL;
+		asq->tail = NULL;
+		pthread_mutex_unlock(&(asq->lock));
+		pthread_mutex_lock(&(sg_async_pool.lock));
+		sgpln->asq = NULL;
+		pthread_mutex_unlock(&(sg_async_pool.lock));
+		while (asop != NULL)
+		{
+			next = asop->next;
+			if (asop->cb != NULL)
+			{
+				asop->cb(sgpln, -1, asop->user_data);
+			}
+			free_sg_mem(&(sgpln->meta_sga), asop);
+			asop = next;
+		}
+		return;
+	}
+	/* The pool thread last touches the queue when it unlocks it after
+	 * clearing scheduled. */
+	while (asq->scheduled)
+	{
+		pthread_cond_wait(&(asq->done_cond), &(asq->lock));
+	}
+	pthread_mutex_unlock(&(asq->lock));
+	pthread_mutex_lock(&(sg_async_pool.lock));
+	sgpln->asq = NULL;
+	pthread_mutex_unlock(&(sg_async_pool.lock));
+	free_sg_async_queue(asq, &(sgpln->meta_sga));
+	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
+		DEBUGMSG_LEAVEFUNC;
+	#endif
+}
+
+/*
+ * Release a stopped operation queue.
+ * Arguments:
+ *   SGAsyncQueue *asq -- Queue no longer scheduled.
+ *   const SGAllocator *meta_sga -- Allocator the queue came from.
+ * Return:
+ *   void
+ */
+void free_sg_async_queue(SGAsyncQueue *asq, const SGAllocator *meta_sga)
+{
+	SGAsyncOp *asop;
+	SGAsyncOp *next;
+	for (asop = asq->done_head; asop != NULL; asop = next)
+	{
+		next = asop->next;
+		free_sg_mem(meta_sga, asop);
+	}
+	close(asq->efd);
+	pthread_cond_destroy(&(asq->done_cond));
+	pthread_mutex_destroy(&(asq->lock));
+	free_sg_mem(meta_sga, asq);
+}
+
+//////////////////////////////////////////////////////////////////////// READ CURSORS
+/*
+ * Get the size of the read cursor of a plan.
+ * Arguments:
+ *   SGPlan *sgpln -- SGPlan instance created in read-mode.
+ * Returns:
+ *   size_t -- Bytes needed by save_sg_read_cursor.
+ */
+size_t get_sg_read_cursor_size(SGPlan *sgpln)
+{
+	return sizeof(SGCursorTag) + sizeof(SGCursorPart)*sgpln->n_sgprt;
+}
+
+/*
+ * Save the read position of a plan.
+ * Arguments:
+ *   SGPlan *sgpln -- SGPlan instance created in read-mode.
+ *   void *buf -- Buffer to receive the cursor.
+ *   size_t size -- Capacity of buf, at least get_sg_read_cursor_size.
+ * Returns:
+ *   int -- Bytes written to buf, or -1 on error.
+ * Notes:
+ *   The cursor is a flat, checksummed record of the identity and next 
+ *     block of each SG file, plus the stamp of the last frame read, 
+ *     and can be written to disk as is. Blocks parked in the plan are 
+ *     recorded as not yet read, so that restoring reads them again and
+ *     the stream continues at the exact frame where it stopped.
+ *   Must not be called while asynchronous reads are pending.
+ */
+int save_sg_read_cursor(SGPlan *sgpln, void *buf, size_t size)
+{
+	SGCursorTag *tag = (SGCursorTag *)buf;
+	SGCursorPart *parts = (SGCursorPart *)(tag + 1);
+	SGPart *sgprt;
+	int ii;
+	if (sgpln->sgm != SCATGAT_MODE_READ)
+	{
+		fprintf(stderr,"Cannot save cursor of non-read-mode SGPlan.\n");
+		return -1;
+	}
+	if (size < get_sg_read_cursor_size(sgpln))
+	{
+		fprintf(stderr,"Cursor buffer too small.\n");
+		return -1;
+	}
+	tag->magic = SG_CURSOR_MAGIC;
+	tag->n_parts = sgpln->n_sgprt;
+	tag->last_stamp = sgpln->last_stamp;
+	tag->reserved = 0;
+	for (ii=0; ii<sgpln->n_sgprt; ii++)
+	{
+		sgprt = &(sgpln->sgprt[ii]);
+		parts[ii].dev = sgprt->file_id.dev;
+		parts[ii].ino = sgprt->file_id.ino;
+		parts[ii].size = sgprt->file_id.size;
+		parts[ii].mtime_sec = sgprt->file_id.mtime.tv_sec;
+		parts[ii].mtime_nsec = sgprt->file_id.mtime.tv_nsec;
+		// a parked block has been read but not returned
+		parts[ii].iblock = sgprt->n_block_frames > 0 ? sgprt->iblock-1 : sgprt->iblock;
+	}
+	tag->checksum = sg_cursor_checksum(tag, parts);
+	return (int)get_sg_read_cursor_size(sgpln);
+}
+
+/*
+ * Restore the read position of a plan saved with save_sg_read_cursor.
+ * Arguments:
+ *   SGPlan *sgpln -- SGPlan instance created in read-mode over the same
+ *     SG files.
+ *   const void *buf -- Saved cursor.
+ *   size_t size -- Bytes in buf.
+ * Returns:
+ *   int -- 0 on success, -1 if the cursor is damaged or the files 
+ *     differ (device, inode, size or modification time); the plan is 
+ *     then left unchanged.
+ * Notes:
+ *   Takes time proportional to the number of SG files; no data is read
+ *     until the next read.
+ */
+int restore_sg_read_cursor(SGPlan *sgpln, const void *buf, size_t size)
+{
+	const SGCursorTag *tag = (const SGCursorTag *)buf;
+	const SGCursorPart *parts = (const SGCursorPart *)(tag + 1);
+	SGPart *sgprt;
+	int ii;
+	if (sgpln->sgm != SCATGAT_MODE_READ)
+	{
+		fprintf(stderr,"Cannot restore cursor of non-read-mode SGPlan.\n");
+		return -1;
+	}
+	if (size < sizeof(SGCursorTag) || tag->magic != SG_CURSOR_MAGIC || 
+		tag->n_parts != (uint32_t)sgpln->n_sgprt || size < get_sg_read_cursor_size(sgpln) ||
+		tag->checksum != sg_cursor_checksum(tag, parts))
+	{
+		fprintf(stderr,"Invalid read cursor.\n");
+		return -1;
+	}
+	/* Plans over the same files list them in the same order */
+	for (ii=0; ii<sgpln->n_sgprt; ii++)
+	{
+		sgprt = &(sgpln->sgprt[ii]);
+		if (parts[ii].dev != (uint64_t)sgprt->file_id.dev || parts[ii].ino != (uint64_t)sgprt->file_id.ino ||
+			parts[ii].size != (int64_t)sgprt->file_id.size || parts[ii].mtime_sec != (int64_t)sgprt->file_id.mtime.tv_sec || 
+			parts[ii].mtime_nsec != (int64_t)sgprt->file_id.mtime.tv_nsec ||
+			parts[ii].iblock < 0 || parts[ii].iblock > (int64_t)sgprt->sgi->sg_total_blks)
+		{
+			fprintf(stderr,"Read cursor does not match %s.\n",sgprt->sgi->name);
+			return -1;
+		}
+	}
+	for (ii=0; ii<sgpln->n_sgprt; ii++)
+	{
+		clear_sg_part_buffer(&(sgpln->sgprt[ii]));
+		sgpln->sgprt[ii].iblock = parts[ii].iblock;
+	}
+	sgpln->last_stamp = tag->last_stamp;
+	return 0;
+}
+
+/*
+ * Checksum of a read cursor, covering the tag up to the checksum and 
+ * the part records.
+ */
+uint32_t sg_cursor_checksum(const SGCursorTag *tag, const SGCursorPart *parts)
+{
+	uint32_t crc = compute_sg_crc32c(0, tag, offsetof(SGCursorTag, checksum));
+	return compute_sg_crc32c(crc, parts, sizeof(SGCursorPart)*tag->n_parts);
+}
+
+//////////////////////////////////////////////////////////////////////// PLAN MERGING
+/*
+ * Create a time-aligned merge of several read plans.
+ * Arguments:
+ *   SGMerge **sgmrg -- Address of SGMerge pointer to allocate memory.
+ *   SGPlan **plans -- Read plans to merge, e.g. one per band recorded 
+ *     on its own module group.
+ *   int n_plans -- Number of plans.
+ * Returns:
+ *   int -- Number of sources on success, -1 on error.
+ * Notes:
+ *   The plans must be in read mode, hold at least one SG file and 
+ *     share a frame size. They remain owned by the caller and must 
+ *     outlive the merge; they should not be read directly meanwhile.
+ *   Frames are merged straight from the block buffers of the SG files
+ *     of each plan; the blocks of all sources are read at the same 
+ *     time.
+ */
+int make_sg_merge(SGMerge **sgmrg, SGPlan **plans, int n_plans)
+{
+	SGAllocator meta_sga = sg_default_meta_sga;
+	SGMergeSource *src;
+	int isrc;
+	int ithread;
+	if (n_plans <= 0)
+	{
+		fprintf(stderr,"No plans to merge.\n");
+		return -1;
+	}
+	for (isrc=0; isrc<n_plans; isrc++)
+	{
+		if (plans[isrc] == NULL || plans[isrc]->sgm != SCATGAT_MODE_READ || plans[isrc]->n_sgprt <= 0)
+		{
+			fprintf(stderr,"Merge source %d is not a read plan with SG files.\n",isrc);
+			return -1;
+		}
+		if (plans[isrc]->sgprt[0].sgi->pkt_size != plans[0]->sgprt[0].sgi->pkt_size)
+		{
+			fprintf(stderr,"Merge source %d has frame size %ld, expected %ld.\n",isrc,
+				(long)plans[isrc]->sgprt[0].sgi->pkt_size,(long)plans[0]->sgprt[0].sgi->pkt_size);
+			return -1;
+		}
+	}
+	*sgmrg = (SGMerge *)alloc_sg_meta(&meta_sga, sizeof(SGMerge));
+	if (*sgmrg == NULL)
+	{
+		perror("Unable to allocate memory for SGMerge.");
+		return -1;
+	}
+	(*sgmrg)->meta_sga = meta_sga;
+	(*sgmrg)->frame_size = plans[0]->sgprt[0].sgi->pkt_size;
+	(*sgmrg)->start_stamp = 0;
+	(*sgmrg)->n_src = 0;
+	(*sgmrg)->src = (SGMergeSource *)alloc_sg_meta(&meta_sga, sizeof(SGMergeSource)*n_plans);
+	if ((*sgmrg)->src == NULL)
+	{
+		perror("Unable to allocate memory for SGMergeSource.");
+		free_sg_merge(*sgmrg);
+		*sgmrg = NULL;
+		return -1;
+	}
+	for (isrc=0; isrc<n_plans; isrc++)
+	{
+		src = &((*sgmrg)->src[isrc]);
+		src->sgpln = plans[isrc];
+		src->remap = 0;
+		for (ithread=0; ithread<SG_MAX_VDIF_THREADS; ithread++)
+		{
+			src->thread_map[ithread] = ithread;
+		}
+		src->order = (int *)alloc_sg_meta(&meta_sga, sizeof(int)*plans[isrc]->n_sgprt);
+		src->sg_threads = (pthread_t *)alloc_sg_meta(&meta_sga, sizeof(pthread_t)*plans[isrc]->n_sgprt);
+		src->sg_threads_mask = (int *)alloc_sg_meta(&meta_sga, sizeof(int)*plans[isrc]->n_sgprt);
+		src->n_order = 0;
+		src->iorder = 0;
+		src->next = 0;
+		src->eof = 0;
+		(*sgmrg)->n_src++;
+		if (src->order == NULL || src->sg_threads == NULL || src->sg_threads_mask == NULL)
+		{
+			perror("Unable to allocate memory for SGMergeSource.");
+			free_sg_merge(*sgmrg);
+			*sgmrg = NULL;
+			return -1;
+		}
+	}
+	return (*sgmrg)->n_src;
+}
+
+/*
+ * Rename a VDIF thread of one merge source in the output.
+ * Arguments:
+ *   SGMerge *sgmrg -- Merge created with make_sg_merge.
+ *   int isrc -- Index of the source, in the order given.
+ *   int thread_in -- Thread ID as recorded.
+ *   int thread_out -- Thread ID to emit.
+ * Returns:
+ *   int -- 0 on success, -1 on error.
+ * Notes:
+ *   Used to keep thread IDs unique when bands were recorded with the 
+ *     same IDs. The header word is rewritten in the output buffer as 
+ *     frames are copied to it.
+ */
+int set_sg_merge_thread_map(SGMerge *sgmrg, int isrc, int thread_in, int thread_out)
+{
+	SGMergeSource *src;
+	int ithread;
+	if (isrc < 0 || isrc >= sgmrg->n_src)
+	{
+		fprintf(stderr,"Invalid merge source %d.\n",isrc);
+		return -1;
+	}
+	if (thread_in < 0 || thread_in >= SG_MAX_VDIF_THREADS || thread_out < 0 || thread_out >= SG_MAX_VDIF_THREADS)
+	{
+		fprintf(stderr,"Thread ID outside [0, %d).\n",SG_MAX_VDIF_THREADS);
+		return -1;
+	}
+	src = &(sgmrg->src[isrc]);
+	src->thread_map[thread_in] = thread_out;
+	src->remap = 0;
+	for (ithread=0; ithread<SG_MAX_VDIF_THREADS; ithread++)
+	{
+		if (src->thread_map[ithread] != ithread)
+		{
+			src->remap = 1;
+			break;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Position all sources of a merge at a time.
+ * Arguments:
+ *   SGMerge *sgmrg -- Merge created with make_sg_merge.
+ *   uint64_t stamp -- Time to start from, as from SG_MAKE_STAMP.
+ * Returns:
+ *   int -- 0 on success, -1 if no source has data from stamp.
+ * Notes:
+ *   Each plan is positioned with seek_sg_read_plan_time, and frames 
+ *     earlier than stamp are dropped, so that all sources start 
+ *     together.
+ */
+int seek_sg_merge_time(SGMerge *sgmrg, uint64_t stamp)
+{
+	int isrc;
+	int n_valid = 0;
+	sgmrg->start_stamp = stamp;
+	for (isrc=0; isrc<sgmrg->n_src; isrc++)
+	{
+		sgmrg->src[isrc].n_order = 0;
+		sgmrg->src[isrc].iorder = 0;
+		sgmrg->src[isrc].next = 0;
+		sgmrg->src[isrc].eof = seek_sg_read_plan_time(sgmrg->src[isrc].sgpln, stamp) != 0;
+		n_valid += !sgmrg->src[isrc].eof;
+	}
+	return n_valid > 0 ? 0 : -1;
+}
+
+/*
+ * Take up the blocks of a merge source read by join_sg_block_reads.
+ * Arguments:
+ *   SGMerge *sgmrg -- Merge the source belongs to.
+ *   SGMergeSource *src -- Source whose stitched blocks are used up.
+ * Return:
+ *   void
+ * Notes:
+ *   The blocks that follow on contiguously are stitched as 
+ *     gather_next_sg_blocks would, offered to the quick-look of the 
+ *     plan, and emitted from their own buffers. Frames before 
+ *     sgmrg->start_stamp are skipped. Sets src->eof once the plan has 
+ *     no more frames; if all frames were skipped, the source stays 
+ *     used up and is read again.
+ */
+void load_sg_merge_source(SGMerge *sgmrg, SGMergeSource *src)
+{
+	int stride = sgmrg->frame_size/sizeof(uint32_t);
+	int mapping[src->sgpln->n_sgprt];
+	int n_contiguous;
+	int ii;
+	SGPart *sgprt;
+	n_contiguous = map_sg_parts_contiguous(src->sgpln, mapping);
+	if (n_contiguous == 0)
+	{
+		src->eof = 1;
+		return;
+	}
+	src->n_order = n_contiguous;
+	src->iorder = 0;
+	src->next = 0;
+	for (ii=0; ii<n_contiguous; ii++)
+	{
+		src->order[ii] = mapping[ii]-1;
+		sgprt = &(src->sgpln->sgprt[src->order[ii]]);
+		if (sgprt->n_frames > 0)
+		{
+			src->sgpln->last_stamp = SG_VDIF_STAMP(sgprt->data_buf + (size_t)(sgprt->n_frames-1)*stride);
+			if (src->sgpln->qlk != NULL)
+			{
+				offer_sg_quicklook_frames(src->sgpln->qlk, sgprt->data_buf, sgprt->n_frames, sgmrg->frame_size);
+			}
+		}
+	}
+	/* Skip empty blocks and frames before the start */
+	advance_sg_merge_source(sgmrg, src, 0);
+	while (src->iorder < src->n_order)
+	{
+		sgprt = &(src->sgpln->sgprt[src->order[src->iorder]]);
+		if (SG_VDIF_STAMP(sgprt->data_buf + (size_t)src->next*stride) >= sgmrg->start_stamp)
+		{
+			break;
+		}
+		advance_sg_merge_source(sgmrg, src, 1);
+	}
+}
+
+/*
+ * Move a merge source past frames it has emitted.
+ * Arguments:
+ *   SGMerge *sgmrg -- Merge the source belongs to.
+ *   SGMergeSource *src -- Source with a block at hand.
+ *   int n_frames -- Frames emitted from the current block.
+ * Return:
+ *   void
+ * Notes:
+ *   Blocks used up, and empty blocks after them, are released to the 
+ *     plan for the next read.
+ */
+void advance_sg_merge_source(SGMerge *sgmrg, SGMergeSource *src, int n_frames)
+{
+	SGPart *sgprt;
+	(void)sgmrg;
+	src->next += n_frames;
+	while (src->iorder < src->n_order)
+	{
+		sgprt = &(src->sgpln->sgprt[src->order[src->iorder]]);
+		if (src->next < (int)sgprt->n_frames)
+		{
+			break;
+		}
+		clear_sg_part_buffer(sgprt);
+		src->iorder++;
+		src->next = 0;
+	}
+}
+
+/*
+ * Read the next frames of a merge in time order.
+ * Arguments:
+ *   SGMerge *sgmrg -- Merge created with make_sg_merge.
+ *   uint32_t *vdif_buf -- Buffer to receive the frames.
+ *   int max_frames -- Capacity of vdif_buf in frames.
+ * Returns:
+ *   int -- Number of frames copied, 0 at the end of all sources, and 
+ *     -1 on error.
+ * Notes:
+ *   Frames of all sources are interleaved by VDIF timestamp; frames 
+ *     with equal stamps follow source order, and the order within each 
+ *     source is kept. Sources that run out early simply drop out of 
+ *     the stream.
+ *   Runs of frames are copied once, from the blocks as read from the 
+ *     SG files into vdif_buf. Merging also reads the header of each 
+ *     frame to compare stamps, and rewrites it in vdif_buf for sources
+ *     with a thread map. When a source needs more data, the next blocks
+ *     of all such sources are read concurrently.
+ */
+int read_next_sg_merge_frames(SGMerge *sgmrg, uint32_t *vdif_buf, int max_frames)
+{
+	#ifdef DEBUG_LEVEL
+		char _dbgmsg[_DBGMSGLEN];
+	#endif
+	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
+		DEBUGMSG_ENTERFUNC;
+	#endif
+	int stride = sgmrg->frame_size/sizeof(uint32_t);
+	int frames_read = 0;
+	int isrc;
+	int imin;
+	int n_run;
+	int n_avail;
+	int n_refill;
+	int refill[sgmrg->n_src];
+	uint64_t stamp;
+	uint64_t min_stamp;
+	uint64_t bound_le; // run may take stamps up to this, from later sources
+	uint64_t bound_lt; // and below this, from earlier sources
+	uint64_t next_stamp[sgmrg->n_src];
+	SGMergeSource *src;
+	uint32_t *frames;
+	uint32_t *h;
+	if (max_frames <= 0)
+	{
+		fprintf(stderr,"Merge buffer holds no frames.\n");
+		return -1;
+	}
+	while (frames_read < max_frames)
+	{
+		/* Every live source needs a frame at hand to compare; read the 
+		 * next blocks of all sources that ran out at the same time */
+		do
+		{
+			n_refill = 0;
+			for (isrc=0; isrc<sgmrg->n_src; isrc++)
+			{
+				src = &(sgmrg->src[isrc]);
+				refill[isrc] = !src->eof && src->iorder >= src->n_order;
+				if (refill[isrc])
+				{
+					launch_sg_block_reads(src->sgpln, src->sg_threads, src->sg_threads_mask);
+					n_refill++;
+				}
+			}
+			for (isrc=0; isrc<sgmrg->n_src; isrc++)
+			{
+				if (refill[isrc])
+				{
+					src = &(sgmrg->src[isrc]);
+					join_sg_block_reads(src->sgpln, src->sg_threads, src->sg_threads_mask);
+					load_sg_merge_source(sgmrg, src);
+				}
+			}
+		} while (n_refill > 0);
+		imin = -1;
+		min_stamp = 0;
+		for (isrc=0; isrc<sgmrg->n_src; isrc++)
+		{
+			src = &(sgmrg->src[isrc]);
+			if (src->eof)
+			{
+				continue;
+			}
+			next_stamp[isrc] = SG_VDIF_STAMP(src->sgpln->sgprt[src->order[src->iorder]].data_buf + (size_t)src->next*stride);
+			if (imin < 0 || next_stamp[isrc] < min_stamp)
+			{
+				imin = isrc;
+				min_stamp = next_stamp[isrc];
+			}
+		}
+		if (imin < 0)
+		{
+			break;
+		}
+		/* The earliest source emits until another source's next frame
+		 * is due, ties going to the lower source index */
+		bound_le = UINT64_MAX;
+		bound_lt = UINT64_MAX;
+		for (isrc=0; isrc<sgmrg->n_src; isrc++)
+		{
+			if (isrc == imin || sgmrg->src[isrc].eof)
+			{
+				continue;
+			}
+			if (isrc > imin && next_stamp[isrc] < bound_le)
+			{
+				bound_le = next_stamp[isrc];
+			}
+			if (isrc < imin && next_stamp[isrc] < bound_lt)
+			{
+				bound_lt = next_stamp[isrc];
+			}
+		}
+		src = &(sgmrg->src[imin]);
+		frames = src->sgpln->sgprt[src->order[src->iorder]].data_buf + (size_t)src->next*stride;
+		n_avail = src->sgpln->sgprt[src->order[src->iorder]].n_frames - src->next;
+		n_run = 0;
+		do
+		{
+			n_run++;
+			if (n_run >= n_avail || frames_read + n_run >= max_frames)
+			{
+				break;
+			}
+			stamp = SG_VDIF_STAMP(frames + (size_t)n_run*stride);
+		} while (stamp <= bound_le && stamp < bound_lt);
+		h = vdif_buf + (size_t)frames_read*stride;
+		memcpy(h, frames, (size_t)n_run*sgmrg->frame_size);
+		if (src->remap)
+		{
+			for (isrc=0; isrc<n_run; isrc++, h+=stride)
+			{
+				h[3] = (h[3] & ~(0x3ffu << 16)) | ((uint32_t)src->thread_map[VDIF_THREAD_ID(h)] << 16);
+			}
+		}
+		advance_sg_merge_source(sgmrg, src, n_run);
+		frames_read += n_run;
+	}
+	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
+		snprintf(_dbgmsg,_DBGMSGLEN,"Merged %d frames\n",frames_read);
+		DEBUGMSG(_dbgmsg);
+		DEBUGMSG_LEAVEFUNC;
+	#endif
+	return frames_read;
+}
+
+/*
+ * Free an SGMerge and its buffers. The plans are not closed.
+ * Arguments:
+ *   SGMerge *sgmrg -- Merge created with make_sg_merge, may be NULL.
+ * Return:
+ *   void
+ */
+void free_sg_merge(SGMerge *sgmrg)
+{
+	SGAllocator meta_sga;
+	int isrc;
+	if (sgmrg == NULL)
+	{
+		return;
+	}
+	meta_sga = sgmrg->meta_sga;
+	for (isrc=0; isrc<sgmrg->n_src; isrc++)
+	{
+		free_sg_mem(&meta_sga, sgmrg->src[isrc].order);
+		free_sg_mem(&meta_sga, sgmrg->src[isrc].sg_threads);
+		free_sg_mem(&meta_sga, sgmrg->src[isrc].sg_threads_mask);
+	}
+	free_sg_mem(&meta_sga, sgmrg->src);
+	free_sg_mem(&meta_sga, sgmrg);
+}
+
+//////////////////////////////////////////////////////////////////////// SCAN CHAINS
+/*
+ * Create a reader for consecutive scans presented as one stream.
+ * Arguments:
+ *   SGScanChain **chain -- Address of SGScanChain pointer to allocate 
+ *     memory.
+ *   const char **patterns -- Filename pattern of each scan, in time 
+ *     order.
+ *   int n_scans -- Number of scans.
+ *   const char *fmtstr, int *mod_list, int n_mod, int *disk_list, 
+ *     int n_disk -- As for make_sg_read_plan, common to all scans.
+ * Returns:
+ *   int -- Number of scans on success, -1 on error.
+ * Notes:
+ *   The plan of the first scan is opened here; the plan of each 
+ *     following scan is opened by a background thread while the one 
+ *     before it is read, so crossing a boundary does not wait for file
+ *     discovery.
+ */
+int make_sg_scan_chain(SGScanChain **chain, const char **patterns, int n_scans, 
+					const char *fmtstr, int *mod_list, int n_mod, 
+					int *disk_list, int n_disk)
+{
+	SGAllocator meta_sga = sg_default_meta_sga;
+	SGScanChain *sgc;
+	int iscan;
+	if (n_scans <= 0)
+	{
+		fprintf(stderr,"No scans to chain.\n");
+		return -1;
+	}
+	sgc = (SGScanChain *)alloc_sg_meta(&meta_sga, sizeof(SGScanChain));
+	if (sgc == NULL)
+	{
+		perror("Unable to allocate memory for SGScanChain.");
+		return -1;
+	}
+	memset(sgc, 0, sizeof(SGScanChain));
+	sgc->meta_sga = meta_sga;
+	sgc->n_mod = n_mod;
+	sgc->n_disk = n_disk;
+	sgc->iscan = -1;
+	sgc->patterns = (char **)alloc_sg_meta(&meta_sga, sizeof(char *)*n_scans);
+	sgc->fmtstr = (char *)alloc_sg_meta(&meta_sga, strlen(fmtstr)+1);
+	sgc->mod_list = (int *)alloc_sg_meta(&meta_sga, sizeof(int)*n_mod);
+	sgc->disk_list = (int *)alloc_sg_meta(&meta_sga, sizeof(int)*n_disk);
+	if (sgc->patterns == NULL || sgc->fmtstr == NULL || sgc->mod_list == NULL || sgc->disk_list == NULL)
+	{
+		perror("Unable to allocate memory for SGScanChain.");
+		free_sg_scan_chain(sgc);
+		return -1;
+	}
+	for (iscan=0; iscan<n_scans; iscan++)
+	{
+		sgc->patterns[iscan] = (char *)alloc_sg_meta(&meta_sga, strlen(patterns[iscan])+1);
+		if (sgc->patterns[iscan] == NULL)
+		{
+			perror("Unable to allocate memory for SGScanChain.");
+			free_sg_scan_chain(sgc);
+			return -1;
+		}
+		strcpy(sgc->patterns[iscan], patterns[iscan]);
+		sgc->n_scans++;
+	}
+	strcpy(sgc->fmtstr, fmtstr);
+	memcpy(sgc->mod_list, mod_list, sizeof(int)*n_mod);
+	memcpy(sgc->disk_list, disk_list, sizeof(int)*n_disk);
+	/* Open the first scan in the foreground, then step onto it */
+	start_sg_chain_open(sgc);
+	if (advance_sg_scan_chain(sgc) != 0)
+	{
+		free_sg_scan_chain(sgc);
+		return -1;
+	}
+	*chain = sgc;
+	return sgc->n_scans;
+}
+
+/*
+ * Start opening the plan of the scan after the current one.
+ * Arguments:
+ *   SGScanChain *chain -- Scan chain.
+ * Return:
+ *   void
+ * Notes:
+ *   Nothing is started after the last scan. If the thread cannot be 
+ *     created the plan is opened in the calling thread instead.
+ */
+void start_sg_chain_open(SGScanChain *chain)
+{
+	if (chain->iscan+1 >= chain->n_scans)
+	{
+		return;
+	}
+	chain->next = NULL;
+	chain->next_result = -1;
+	if (pthread_create(&(chain->opener), NULL, &sgthread_open_scan, chain) == 0)
+	{
+		chain->opening = 1;
+	}
+	else
+	{
+		sgthread_open_scan(chain);
+	}
+}
+
+/*
+ * Step a scan chain onto the next scan that can be opened.
+ * Arguments:
+ *   SGScanChain *chain -- Scan chain.
+ * Returns:
+ *   int -- 0 if a scan is current, -1 past the last scan.
+ * Notes:
+ *   Closes the current plan, takes the plan opened in the background 
+ *     and starts opening the one after it.
+ */
+int advance_sg_scan_chain(SGScanChain *chain)
+{
+	if (chain->cur != NULL)
+	{
+		close_sg_read_plan(chain->cur);
+		free_sg_plan(chain->cur);
+		chain->cur = NULL;
+	}
+	while (chain->iscan+1 < chain->n_scans)
+	{
+		if (chain->opening)
+		{
+			pthread_join(chain->opener, NULL);
+			chain->opening = 0;
+		}
+		chain->iscan++;
+		chain->cur = chain->next_result > 0 ? chain->next : NULL;
+		chain->next = NULL;
+		start_sg_chain_open(chain);
+		if (chain->cur != NULL)
+		{
+			return 0;
+		}
+		fprintf(stderr,"Skipping scan %s, no SG files found.\n",chain->patterns[chain->iscan]);
+	}
+	chain->iscan = chain->n_scans;
+	return -1;
+}
+
+/*
+ * Check the first frames of a scan against the end of the previous one.
+ * Arguments:
+ *   SGScanChain *chain -- Scan chain, with last_stamp and last_threads
+ *     set.
+ *   uint32_t *vdif_buf -- First frames read from the new scan.
+ *   int n_frames -- Number of frames in vdif_buf.
+ *   int frame_size -- Bytes per frame.
+ * Returns:
+ *   int -- Number of frames left in vdif_buf, moved to its start.
+ * Notes:
+ *   Repeats are compared per VDIF thread: at last_stamp only threads in
+ *     last_threads are dropped, so frames of other threads sharing the 
+ *     boundary stamp are kept.
+ */
+int trim_sg_chain_boundary(SGScanChain *chain, uint32_t *vdif_buf, int n_frames, int frame_size)
+{
+	int stride = frame_size/sizeof(uint32_t);
+	int n_drop = 0;
+	int n_keep = 0;
+	int iframe;
+	uint64_t stamp;
+	uint64_t first_stamp;
+	uint32_t *h;
+	uint32_t last_secs = SG_STAMP_SECS(chain->last_stamp);
+	uint32_t last_df_num = SG_STAMP_DF_NUM(chain->last_stamp);
+	for (iframe=0; iframe<n_frames; iframe++)
+	{
+		h = vdif_buf + (size_t)iframe*stride;
+		stamp = SG_VDIF_STAMP(h);
+		if (stamp > chain->last_stamp)
+		{
+			break;
+		}
+		if (stamp < chain->last_stamp || (chain->last_threads[VDIF_THREAD_ID(h)/32] >> (VDIF_THREAD_ID(h)%32)) & 1u)
+		{
+			n_drop++;
+		}
+		else
+		{
+			if (n_keep < iframe)
+			{
+				memmove(vdif_buf + (size_t)n_keep*stride, h, frame_size);
+			}
+			n_keep++;
+		}
+	}
+	if (n_drop > 0)
+	{
+		memmove(vdif_buf + (size_t)n_keep*stride, vdif_buf + (size_t)iframe*stride, (size_t)(n_frames-iframe)*frame_size);
+		n_frames -= n_drop;
+		chain->n_overlap += n_drop;
+	}
+	if (n_frames == 0)
+	{
+		return 0;
+	}
+	first_stamp = SG_VDIF_STAMP(vdif_buf);
+	if (first_stamp != chain->last_stamp &&
+		!((SG_STAMP_SECS(first_stamp) == last_secs && SG_STAMP_DF_NUM(first_stamp) == last_df_num+1) ||
+		(SG_STAMP_SECS(first_stamp) == last_secs+1 && SG_STAMP_DF_NUM(first_stamp) == 0)))
+	{
+		fprintf(stderr,"Discontinuity entering scan %s: %u.%u -> %u.%u.\n",chain->patterns[chain->iscan],
+			last_secs,last_df_num,SG_STAMP_SECS(first_stamp),SG_STAMP_DF_NUM(first_stamp));
+		chain->n_gaps++;
+	}
+	return n_frames;
+}
+
+/*
+ * Remember the end of the frames returned by a scan chain.
+ * Arguments:
+ *   SGScanChain *chain -- Scan chain.
+ *   const uint32_t *vdif_buf -- Frames about to be returned, in time 
+ *     order.
+ *   int n_frames -- Number of frames in vdif_buf, at least 1.
+ *   int frame_size -- Bytes per frame.
+ * Return:
+ *   void
+ * Notes:
+ *   Sets last_stamp, and last_threads from the frames at that stamp, 
+ *     which are at the end of vdif_buf.
+ */
+void note_sg_chain_last_frames(SGScanChain *chain, const uint32_t *vdif_buf, int n_frames, int frame_size)
+{
+	int stride = frame_size/sizeof(uint32_t);
+	int iframe;
+	const uint32_t *h;
+	chain->have_last = 1;
+	chain->last_stamp = SG_VDIF_STAMP(vdif_buf + (size_t)(n_frames-1)*stride);
+	memset(chain->last_threads, 0, sizeof(chain->last_threads));
+	for (iframe=n_frames-1; iframe>=0; iframe--)
+	{
+		h = vdif_buf + (size_t)iframe*stride;
+		if (SG_VDIF_STAMP(h) != chain->last_stamp)
+		{
+			break;
+		}
+		chain->last_threads[VDIF_THREAD_ID(h)/32] |= 1u << (VDIF_THREAD_ID(h)%32);
+	}
+}
+
+/*
+ * Read the next frames of a scan chain.
+ * Arguments:
+ *   SGScanChain *chain -- Chain created with make_sg_scan_chain.
+ *   uint32_t *vdif_buf -- Buffer to receive the frames.
+ *   int max_frames -- Capacity of vdif_buf in frames, at least 
+ *     get_sg_plan_max_block_frames of each scan.
+ * Returns:
+ *   int -- Number of frames copied, 0 after the last scan, and -1 on 
+ *     error.
+ * Notes:
+ *   Reads as read_next_block_vdif_frames_into within a scan, and moves
+ *     on to the next scan when one is exhausted. Scans that cannot be 
+ *     opened are skipped with a warning.
+ *   At each boundary the first frame of the new scan is checked 
+ *     against the last frame returned. Frames before the stamp of that
+ *     frame, and frames at its stamp of VDIF threads already returned 
+ *     at it, are dropped as repeats (n_overlap); other threads at that
+ *     stamp are kept. A jump other than to the next frame number, or 
+ *     to frame 0 of the next second, is reported and counted in 
+ *     n_gaps; the frame rate is not assumed, so gaps ending exactly on
+ *     a second boundary pass.
+ */
+int read_next_sg_chain_frames(SGScanChain *chain, uint32_t *vdif_buf, int max_frames)
+{
+	#ifdef DEBUG_LEVEL
+		char _dbgmsg[_DBGMSGLEN];
+	#endif
+	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
+		DEBUGMSG_ENTERFUNC;
+	#endif
+	int frames_read = 0;
+	int n_frames;
+	int frame_size;
+	int boundary = 0;
+	while (chain->cur != NULL)
+	{
+		frame_size = chain->cur->sgprt[0].sgi->pkt_size;
+		n_frames = read_next_block_vdif_frames_into(chain->cur, vdif_buf, max_frames);
+		if (n_frames < 0)
+		{
+			return -1;
+		}
+		if (n_frames == 0)
+		{
+			/* Scan exhausted, go on to the next */
+			if (advance_sg_scan_chain(chain) != 0)
+			{
+				break;
+			}
+			if (chain->cur->sgprt[0].sgi->pkt_size != frame_size)
+			{
+				fprintf(stderr,"Scan %s has frame size %ld, expected %d.\n",chain->patterns[chain->iscan],
+					(long)chain->cur->sgprt[0].sgi->pkt_size,frame_size);
+				return -1;
+			}
+			chain->n_boundaries++;
+			boundary = 1;
+			continue;
+		}
+		if (boundary && chain->have_last)
+		{
+			n_frames = trim_sg_chain_boundary(chain, vdif_buf, n_frames, frame_size);
+		}
+		if (n_frames > 0)
+		{
+			note_sg_chain_last_frames(chain, vdif_buf, n_frames, frame_size);
+			frames_read = n_frames;
+			break;
+		}
+	}
+	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
+		snprintf(_dbgmsg,_DBGMSGLEN,"Read %d frames from scan %d\n",frames_read,chain->iscan);
+		DEBUGMSG(_dbgmsg);
+		DEBUGMSG_LEAVEFUNC;
+	#endif
+	return frames_read;
+}
+
+/*
+ * Free a scan chain, closing its plans.
+ * Arguments:
+ *   SGScanChain *chain -- Chain created with make_sg_scan_chain, may be
+ *     NULL.
+ * Return:
+ *   void
+ */
+void free_sg_scan_chain(SGScanChain *chain)
+{
+	SGAllocator meta_sga;
+	int iscan;
+	if (chain == NULL)
+	{
+		return;
+	}
+	meta_sga = chain->meta_sga;
+	if (chain->opening)
+	{
+		pthread_join(chain->opener, NULL);
+	}
+	if (chain->next != NULL)
+	{
+		close_sg_read_plan(chain->next);
+		free_sg_plan(chain->next);
+	}
+	if (chain->cur != NULL)
+	{
+		close_sg_read_plan(chain->cur);
+		free_sg_plan(chain->cur);
+	}
+	for (iscan=0; iscan<chain->n_scans; iscan++)
+	{
+		free_sg_mem(&meta_sga, chain->patterns[iscan]);
+	}
+	free_sg_mem(&meta_sga, chain->patterns);
+	free_sg_mem(&meta_sga, chain->fmtstr);
+	free_sg_mem(&meta_sga, chain->mod_list);
+	free_sg_mem(&meta_sga, chain->disk_list);
+	free_sg_mem(&meta_sga, chain);
+}
+
+//////////////////////////////////////////////////////////////////////// THREAD IMPLEMENTATIONS
+/* 
+ * Create an SGInfo instance for reading for the given filename.
+ * Arguments:
+ *   void *arg -- Pointer to filename string.
+ * Returns:
+ *   void * -- Pointer to SGInfo instance if the filename produced a 
+ *     valid sg_access result (test on SGInfo.smi) or NULL if not.
+ * Notes:
+ *   This method is suitable for a call via pthread_create.
+ */
+static void * sgthread_fill_read_sgi(void *arg)
+{
+	#ifdef DEBUG_LEVEL
+		char _dbgmsg[_DBGMSGLEN];
+	#endif
+	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
+		DEBUGMSG_ENTERFUNC;
+	#endif
+	char *filename = (char *)arg; // filename to try to access
+	SGInfo *sgi = (SGInfo *)alloc_sg_meta(&sg_default_meta_sga, sizeof(SGInfo)); // SGInfo pointer to return
+	if (sgi == NULL)
+	{
+		perror("Unable to allocate SGInfo.");
+		#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
+			DEBUGMSG_LEAVEFUNC;
+		#endif
+		return NULL;
+	}
+	memset(sgi, 0, sizeof(SGInfo));
+	sgi->name = NULL;
+	sgi->verbose = 0;
+	/* sg_access only knows the legacy block header */
+	if (peek_sg_file_version(filename) == SG_FILE_VERSION_EXT)
+	{
+		open_sg_ext_file(filename,sgi);
+	}
+	else
+	{
+		sg_open(filename,sgi);
+	}
+	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
+		snprintf(_dbgmsg,_DBGMSGLEN,"\tsgi->smi.mmfd = %d",sgi->smi.mmfd);
+		DEBUGMSG(_dbgmsg);
+		sg_report(sgi,"\tSG Report:");
+		DEBUGMSG_LEAVEFUNC;
+	#endif
+	return (void *)sgi;
+}
+
+/* Create an SGInfo instance for writing for the given filename.
+ * Arguments:
+ *   void *arg -- Pointer to filename string.
+ * Returns:
+ *   void * -- Pointer to SGInfo instance if the the file could be 
+ *     opened for writing and mapped to memory (i.e. valid SGInfo 
+ *     instance could be created), or NULL otherwise.
+ * Notes:
+ *   This method is suitable for a call via pthread_create.
+ */
+static void * sgthread_fill_write_sgi(void *arg)
+{
+	#ifdef DEBUG_LEVEL
+		char _dbgmsg[_DBGMSGLEN];
+	#endif
+	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
+		DEBUGMSG_ENTERFUNC;
+	#endif
+	char *filename = (char *)arg; // filename to try to access
+	SGInfo *sgi = (SGInfo *)alloc_sg_meta(&sg_default_meta_sga, sizeof(SGInfo));
+	if (sgi == NULL)
+	{
+		perror("Unable to allocate SGInfo.");
+		return (void *)NULL;
+	}
+	// Fill in the fields for SGInfo
+	init_sg_info(sgi, filename);
+	// Fill in the fields for SGMMInfo
+	umask((mode_t)0);
+	sgi->smi.mmfd = open(filename, SG_FILE_WRITE_OPEN_MODE, SG_FILE_PERMISSIONS);
+	if (sgi->smi.mmfd == -1)
+	{
+		perror("Unable to open / create file.");
+		free_sg_info(sgi, &sg_default_meta_sga);
+		return (void *)NULL;
+	}
+	/* Guess initial file size equal to ideal single write block, 
+	 * defined in dplane_proxy.h. This size setting is just temporary,
+	 * and needs to be reset to zero to indicate the actual number of
+	 * bytes written to file.
+	 */
+	sgi->smi.size = (off_t)INITIAL_SIZE_IN_BLOCKS*WBLOCK_SIZE; //~ WBLOCK_SIZE + sizeof(struct file_header_tag);
+	/* Truncate file to initial size */
+	if (ftruncate(sgi->smi.mmfd, sgi->smi.size) == -1)
+	{
+		perror("Unable to reset file size.");
+		free_sg_info(sgi, &sg_default_meta_sga);
+		return (void *)NULL;
+	}
+	/* Create mmap */
+	sgi->smi.start = mmap(NULL, sgi->smi.size, SG_MMAP_WRITE_OPEN_PROTO, SG_MMAP_WRITE_OPEN_MODE, sgi->smi.mmfd, 0);
+	if (sgi->smi.start == MAP_FAILED)
+	{
+		perror("Unable to map file.");
+		free_sg_info(sgi, &sg_default_meta_sga);
+		return (void *)NULL;
+	}
+	sgi->smi.eomem = sgi->smi.start + sgi->smi.size;
+	sgi->smi.users = 1;
+	/* And reset file size to number of bytes written, zero */
+	sgi->smi.size = 0;
+	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
+		DEBUGMSG_LEAVEFUNC;
+	#endif
+	return (void *)sgi;
+}
+
+/*
+ * Read one block's worth of VDIF packets from the given SG file.
+ * Arguments:
+ *   void *arg -- SGPart by reference that contains a pointer to 
+ *     a valid SGInfo instance, and an index specifying which block to
+ *     read.
+ * Returns:
+ *   void *arg -- NULL
+ * Notes:
+ *   Upon successful read, the data_buf and n_frames fields of the 
+ *     received SGPart instance are filled with VDIF data and a frame
+ *     count, respectively.
+ *   If the plan has a read filter, blocks outside its time range are
+ *     skipped (advancing iblock) and only matching frames are copied.
+ *     n_block_frames and the stamps then still describe the whole 
+ *     block, which may leave n_frames at zero.
+ *   With the device scheduler enabled, the transfer from the file 
+ *     waits until the device is granted to this plan.
+ *   With sampler statistics enabled, the frames are counted once 
+ *     copied, while still in cache.
+ *   Hooks of the plan run on the frames before they are counted. 
+ *     Leading frame hooks are fused with a plain copy, unless the 
+ *     block cache, which keeps blocks as stored, is enabled. Like the
+ *     read filter, hooks may leave fewer frames than n_block_frames.
+ *   This method is compatible with pthread.
+ */
+static void * sgthread_read_block(void *arg)
+{
+	#ifdef DEBUG_LEVEL
+		char _dbgmsg[_DBGMSGLEN];
+	#endif
+	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
+		DEBUGMSG_ENTERFUNC;
+	#endif
+	SGPart *sgprt = (SGPart *)arg;
+	const SGReadFilter *flt = sgprt->sgpln->has_filter ? &(sgprt->sgpln->filter) : NULL;
+	const SGHooks *sgh = sgprt->sgpln->hooks;
+	uint32_t *start = NULL;
+	uint32_t *end = NULL;
+	int stride = sgprt->sgi->pkt_size/sizeof(uint32_t);
+	int n_frames;
+	uint64_t first_stamp;
+	uint64_t last_stamp;
+	const struct sg_wb_header_ext_tag *wbht;
+	struct sg_device *sgd = NULL;
+	const uint32_t *src;
+	uint32_t crc = 0;
+	int n_hooked = -1;
+	
+	apply_sg_io_qos(sgprt->sgpln);
+	/* With a time range, skip blocks that end before it from their 
+	 * first and last headers only, and stop at a block starting after 
+	 * it. Blocks within a file are in time order. Extended block headers
+	 * give the stamps and threads without touching the frames. */
+	while (flt != NULL && sgprt->iblock < sgprt->sgi->sg_total_blks)
+	{
+		wbht = get_sg_part_block_header(sgprt,sgprt->iblock);
+		if (wbht != NULL)
+		{
+			n_frames = wbht->n_frames;
+			first_stamp = wbht->first_stamp;
+			last_stamp = wbht->last_stamp;
+		}
+		else
+		{
+			n_frames = 0;
+			start = get_sg_part_block(sgprt,sgprt->iblock,&n_frames,&end);
+			if (start == NULL || n_frames == 0)
+			{
+				break;
+			}
+			first_stamp = SG_VDIF_STAMP(start);
+			last_stamp = SG_VDIF_STAMP(start + (size_t)(n_frames-1)*stride);
+		}
+		if (n_frames == 0)
+		{
+			break;
+		}
+		if (first_stamp >= flt->end_stamp)
+		{
+			sgprt->iblock = sgprt->sgi->sg_total_blks;
+		}
+		else if (last_stamp < flt->start_stamp || 
+			(wbht != NULL && flt->use_thread_mask && !test_sg_thread_masks(flt->thread_mask, wbht->thread_mask)))
+		{
+			sgprt->iblock++;
+		}
+		else
+		{
+			break;
+		}
+	}
+	// check if this is a valid block number
+	if (sgprt->iblock < sgprt->sgi->sg_total_blks) 
+	{
+		// serve the block from memory if another read cached it
+		if (lookup_sg_block_cache(sgprt) == 0)
+		{
+			if (flt != NULL)
+			{
+				sgprt->n_frames = filter_sg_frames(flt, sgprt->data_buf, sgprt->data_buf, sgprt->n_frames, sgprt->sgi->pkt_size);
+			}
+			if (sgh != NULL)
+			{
+				sgprt->n_frames = run_sg_hooks(sgh, 0, sgprt->data_buf, sgprt->n_frames, sgprt->sgi->pkt_size);
+			}
+			if (sgprt->sgpln->stats != NULL)
+			{
+				tally_sg_part_stats(sgprt);
+			}
+			#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
+				DEBUGMSG_LEAVEFUNC;
+			#endif
+			return NULL;
+		}
+		//~ start = sg_pkt_by_blk(sgprt->sgi,0,&(sgprt->n_frames),&end);
+		start = get_sg_part_block(sgprt,sgprt->iblock,(int *)&(sgprt->n_frames),&end);
+		sgprt->n_block_frames = sgprt->n_frames;
+		/* Blocks written with a checksum are verified as they are copied */
+		wbht = sgprt->sgpln->checksums ? get_sg_part_block_header(sgprt,sgprt->iblock) : NULL;
+		if (wbht != NULL && !(wbht->flags & SG_WB_EXT_CRC32C))
+		{
+			wbht = NULL;
+		}
+		throttle_sg_io(sgprt->sgpln, (size_t)sgprt->n_frames*sgprt->sgi->pkt_size);
+		sgd = acquire_sg_device(sgprt);
+		src = coalesce_sg_part_blocks(sgprt, start);
+		if (flt != NULL && sgprt->n_frames > 0)
+		{
+			/* Copy only the selected frames, but keep the stamps of the
+			 * whole block for stitching. */
+			sgprt->first_stamp = SG_VDIF_STAMP(src);
+			sgprt->last_stamp = SG_VDIF_STAMP(src + (size_t)(sgprt->n_frames-1)*stride);
+			if (wbht != NULL)
+			{
+				test_sg_part_block_crc32c(sgprt, wbht, compute_sg_crc32c(0, src, (size_t)sgprt->n_frames*sgprt->sgi->pkt_size));
+			}
+			/* A staged block is filtered in place */
+			if (src != start)
+			{
+				sgprt->data_buf = take_sg_part_staged_block(sgprt);
+			}
+			else
+			{
+				sgprt->data_buf = (uint32_t *)alloc_sg_data(&(sgprt->sgpln->data_sga), (size_t)sgprt->n_frames*sgprt->sgi->pkt_size);
+			}
+			if (sgprt->data_buf != NULL)
+			{
+				sgprt->n_frames = filter_sg_frames(flt, sgprt->data_buf, src, sgprt->n_frames, sgprt->sgi->pkt_size);
+				if (sgh != NULL)
+				{
+					sgprt->n_frames = run_sg_hooks(sgh, 0, sgprt->data_buf, sgprt->n_frames, sgprt->sgi->pkt_size);
+				}
+			}
+			prefetch_sg_part_blocks(sgprt);
+			if (sgprt->sgpln->stats != NULL)
+			{
+				tally_sg_part_stats(sgprt);
+			}
+			release_sg_device(sgd, (size_t)sgprt->n_block_frames*sgprt->sgi->pkt_size);
+			#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
+				DEBUGMSG_LEAVEFUNC;
+			#endif
+			return NULL;
+		}
+		// allocate data storage and copy data to memory; a block staged
+		// by a coalesced read is already in its own buffer
+		if (src != start)
+		{
+			sgprt->data_buf = take_sg_part_staged_block(sgprt);
+		}
+		else
+		{
+			sgprt->data_buf = (uint32_t *)alloc_sg_data(&(sgprt->sgpln->data_sga), (size_t)sgprt->n_frames*sgprt->sgi->pkt_size);
+		}
+		if (sgprt->data_buf != NULL)
+		{
+			/* Blocks not staged by a coalesced read are read directly 
+			 * with the pread engine */
+			if (src == start && (sgprt->read_engine != SG_READ_ENGINE_PREAD || read_sg_part_block_pread(sgprt,start) != 0))
+			{
+				if (wbht != NULL)
+				{
+					crc = copy_sg_crc32c(0, sgprt->data_buf, src, (size_t)sgprt->n_frames*sgprt->sgi->pkt_size);
+				}
+				else if (sgh != NULL && sgh->n_lead > 0 && sgprt->n_frames > 0 && !test_sg_block_cache_enabled())
+				{
+					/* Stamps of the frames as stored, before hooks */
+					sgprt->first_stamp = SG_VDIF_STAMP(src);
+					sgprt->last_stamp = SG_VDIF_STAMP(src + (size_t)(sgprt->n_frames-1)*stride);
+					n_hooked = copy_sg_hooked_frames(sgprt, src);
+				}
+				else
+				{
+					memcpy(sgprt->data_buf,src,(size_t)sgprt->n_frames*sgprt->sgi->pkt_size);
+				}
+			}
+			else if (wbht != NULL)
+			{
+				crc = compute_sg_crc32c(0, sgprt->data_buf, (size_t)sgprt->n_frames*sgprt->sgi->pkt_size);
+			}
+			if (wbht != NULL)
+			{
+				test_sg_part_block_crc32c(sgprt, wbht, crc);
+			}
+			prefetch_sg_part_blocks(sgprt);
+			release_sg_device(sgd, (size_t)sgprt->n_frames*sgprt->sgi->pkt_size);
+			sgd = NULL;
+			if (n_hooked >= 0)
+			{
+				sgprt->n_frames = n_hooked;
+			}
+			else
+			{
+				if (sgprt->n_frames > 0)
+				{
+					sgprt->first_stamp = SG_VDIF_STAMP(sgprt->data_buf);
+					sgprt->last_stamp = SG_VDIF_STAMP(sgprt->data_buf + (size_t)(sgprt->n_frames-1)*stride);
+				}
+				insert_sg_block_cache(sgprt);
+				if (sgh != NULL)
+				{
+					sgprt->n_frames = run_sg_hooks(sgh, 0, sgprt->data_buf, sgprt->n_frames, sgprt->sgi->pkt_size);
+				}
+			}
+			if (sgprt->sgpln->stats != NULL)
+			{
+				tally_sg_part_stats(sgprt);
+			}
+		}
+		release_sg_device(sgd, 0);
+	}
+	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
+		DEBUGMSG_LEAVEFUNC;
+	#endif
+	return NULL;
+}
+
+/*
+ * Decode the VDIF headers of all frames in one SG file.
+ * Arguments:
+ *   void *arg -- SGHeaderScanTask by reference, giving the file and the
+ *     rows reserved for it.
+ * Return:
+ *   void *arg -- NULL
+ * Notes:
+ *   Frames are visited in place in the memory map, reading only the 
+ *     four header words needed. The mapping is advised MADV_RANDOM for 
+ *     the duration, so each header costs at most one page rather than 
+ *     a read-ahead window of payload, and restored to MADV_NORMAL.
+ *   Rows beyond the count reserved by the caller are not written.
+ */
+static void * sgthread_scan_headers(void *arg)
+{
+	#ifdef DEBUG_LEVEL
+		char _dbgmsg[_DBGMSGLEN];
+	#endif
+	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
+		DEBUGMSG_ENTERFUNC;
+	#endif
+	SGHeaderScanTask *task = (SGHeaderScanTask *)arg;
+	SGInfo *sgi = task->sgprt->sgi;
+	SGHeaderScan *shs = task->scan;
+	size_t map_len = (char *)sgi->smi.eomem - (char *)sgi->smi.start;
+	int stride = sgi->pkt_size/sizeof(uint32_t);
+	int irow = task->offset;
+	int row_end = task->offset + task->n_frames;
+	off_t iblock;
+	int n_frames;
+	int iframe;
+	uint32_t *start;
+	uint32_t *end;
+	const uint32_t *h;
+	
+	apply_sg_io_qos(task->sgprt->sgpln);
+	madvise(sgi->smi.start, map_len, MADV_RANDOM);
+	for (iblock=0; iblock<sgi->sg_total_blks && irow<row_end; iblock++)
+	{
+		n_frames = 0;
+		start = get_sg_part_block(task->sgprt,iblock,&n_frames,&end);
+		if (start == NULL)
+		{
+			continue;
+		}
+		for (iframe=0, h=start; iframe<n_frames && irow<row_end; iframe++, h+=stride, irow++)
+		{
+			shs->secs[irow] = VDIF_SECS_INRE(h);
+			shs->df_num[irow] = VDIF_DF_NUM_INSEC(h);
+			shs->thread[irow] = (uint16_t)VDIF_THREAD_ID(h);
+			shs->station[irow] = (uint16_t)VDIF_STATION_ID(h);
+			shs->flags[irow] = (VDIF_INVALID(h) ? SG_HEADER_INVALID : 0) | 
+				(VDIF_LEGACY(h) ? SG_HEADER_LEGACY : 0) | 
+				(VDIF_IS_COMPLEX(h) ? SG_HEADER_COMPLEX : 0);
+			shs->part[irow] = (uint16_t)task->ipart;
+			shs->block[irow] = (uint32_t)iblock;
+		}
+	}
+	madvise(sgi->smi.start, map_len, MADV_NORMAL);
+	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
+		DEBUGMSG_LEAVEFUNC;
+	#endif
+	return NULL;
+}
+
+/* 
+ * Write one block's worht of VDIF packets to the given SG file.
+ * Arguments:
+ *   void *arg -- SGPart by reference that contains the data to be 
+ *     written as well as a reference to the SGInfo for the file to 
+ *     write to.
+ * Return:
+ *   void *arg -- NULL
+ * Notes:
+ *   The data_buf and n_frames fields in the SGPart instance contain the
+ *     VDIF data and frame count, respectively, that should be written 
+ *     as the single next block in the SG file.
+ */
+static void * sgthread_write_block(void *arg)
+{
+	#ifdef DEBUG_LEVEL
+		char _dbgmsg[_DBGMSGLEN];
+	#endif
+	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
+		DEBUGMSG_ENTERFUNC;
+	#endif
+	SGPart *sgprt = (SGPart *)arg;
+	int ext = sgprt->sgpln->file_version == SG_FILE_VERSION_EXT;
+	size_t wbht_size = ext ? sizeof(struct sg_wb_header_ext_tag) : sizeof(struct wb_header_tag);
+	struct file_header_tag fht = { 
+					.sync_word = SYNC_WORD, 
+					.version = ext ? SG_FILE_VERSION_EXT : FILE_VERSION, 
+					.packet_format = VDIF };
+	struct sg_wb_header_ext_tag wbht = { 
+					.blocknum = sgprt->inherited_block_count, //.blocknum = sgprt->iblock,
+					.wb_size = sgprt->sgi->pkt_size*sgprt->n_frames + wbht_size};
+	off_t block_start = sgprt->sgi->smi.size;
+	off_t wb_offset;
+	struct sg_device *sgd;
+	uint32_t crc = 0;
+	apply_sg_io_qos(sgprt->sgpln);
+	throttle_sg_io(sgprt->sgpln, wbht.wb_size);
+	/* If first block, write file header */
+	if (sgprt->iblock == 0)
+	{
+		fht.packet_size = sgprt->sgi->pkt_size;
+		fht.block_size = fht.packet_size*(sgprt->sgpln->block_size/fht.packet_size) + wbht_size;
+		if (write_to_sg(sgprt->sgi, (void *)&fht, sizeof(struct file_header_tag)) == -1)
+		{
+			fprintf(stderr,"Unable to write file header tag to SG in thread.\n");
+			return NULL;
+		}
+	}
+	/* Describe the block in the extended header; wb_header_tag is its
+	 * leading part, so legacy files just write less of it. */
+	if (ext)
+	{
+		fill_sg_wb_header_ext(&wbht, sgprt->data_buf, sgprt->n_frames, sgprt->sgi->pkt_size);
+		if (sgprt->sgpln->checksums)
+		{
+			wbht.flags |= SG_WB_EXT_CRC32C;
+		}
+	}
+	/* The grant covers both the copy into the map and the writeback */
+	sgd = acquire_sg_device(sgprt);
+	/* Write block header */
+	wb_offset = sgprt->sgi->smi.size;
+	if (write_to_sg(sgprt->sgi, (void *)&wbht, wbht_size) == -1)
+	{
+		fprintf(stderr,"Unable to write block header tag to SG in thread.\n");
+		release_sg_device(sgd, 0);
+		return NULL;
+	}
+	/* Write data, checksummed on the way into the map, and fill in the
+	 * CRC of the header already written */
+	if (wbht.flags & SG_WB_EXT_CRC32C)
+	{
+		if (write_crc32c_to_sg(sgprt->sgi, (void *)(sgprt->data_buf), sgprt->sgi->pkt_size*sgprt->n_frames, &crc) == -1)
+		{
+			fprintf(stderr,"Unable to write data block to SG in thread.\n");
+			release_sg_device(sgd, 0);
+			return NULL;
+		}
+		((struct sg_wb_header_ext_tag *)(sgprt->sgi->smi.start + wb_offset))->crc32c = crc;
+	}
+	else if (write_to_sg(sgprt->sgi, (void *)(sgprt->data_buf), sgprt->sgi->pkt_size*sgprt->n_frames) == -1)
+	{
+		fprintf(stderr,"Unable to write data block to SG in thread.\n");
+		release_sg_device(sgd, 0);
+		return NULL;
+	}
+	/* Start writeback here so that it runs at this thread's priority, 
+	 * and wait for it while the device is granted */
+	if (sgd != NULL)
+	{
+		sync_file_range(sgprt->sgi->smi.mmfd, block_start, sgprt->sgi->smi.size - block_start, 
+				SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+	}
+	else if (sgprt->sgpln->qos.io_class != SG_IO_CLASS_NONE)
+	{
+		sync_file_range(sgprt->sgi->smi.mmfd, block_start, sgprt->sgi->smi.size - block_start, SYNC_FILE_RANGE_WRITE);
+	}
+	release_sg_device(sgd, sgprt->sgi->smi.size - block_start);
+	if (sgprt->ckpt != NULL && checkpoint_sg_part(sgprt, wbht.blocknum) == -1)
+	{
+		fprintf(stderr,"Unable to checkpoint SG file in thread.\n");
+	}
+	/* Update block counter for this SG file */
+	sgprt->iblock++;
+	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
+		DEBUGMSG_LEAVEFUNC;
+	#endif
+	return NULL;
+}
+
+/*
+ * Execute queued asynchronous operations of all plans.
+ * Arguments:
+ *   void *arg -- NULL
+ * Returns:
+ *   void * -- NULL
+ * Notes:
+ *   Thread of the worker pool. Takes the first queue of the ready 
+ *     list, executes its oldest operation with the lock released, so 
+ *     callbacks may submit further operations, and puts the queue back 
+ *     at the end of the list if more are queued. One queue is thus 
+ *     served by one thread at a time, in submission order, and plans 
+ *     take turns. Operations without a callback are moved to the done
+ *     list and signalled on the eventfd. The thread exits when idle 
+ *     and the pool has shrunk below it.
+ *   This method is compatible with pthread.
+ */
+static void * sgthread_async_worker(void *arg)
+{
+	#ifdef DEBUG_LEVEL
+		char _dbgmsg[_DBGMSGLEN];
+	#endif
+	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
+		DEBUGMSG_ENTERFUNC;
+	#endif
+	SGAsyncQueue *asq;
+	SGAsyncOp *asop;
+	SGPlan *sgpln;
+	SGAllocator meta_sga;
+	int result;
+	uint64_t efd_increment = 1;
+	
+	pthread_mutex_lock(&(sg_async_pool.lock));
+	while (1)
+	{
+		while (sg_async_pool.ready_head == NULL && sg_async_pool.n_workers <= sg_async_pool.max_workers)
+		{
+			sg_async_pool.n_idle++;
+			pthread_cond_wait(&(sg_async_pool.cond), &(sg_async_pool.lock));
+			sg_async_pool.n_idle--;
+		}
+		if (sg_async_pool.ready_head == NULL)
+		{
+			/* Pool shrunk */
+			break;
+		}
+		asq = sg_async_pool.ready_head;
+		sg_async_pool.ready_head = asq->ready_next;
+		if (sg_async_pool.ready_head == NULL)
+		{
+			sg_async_pool.ready_tail = NULL;
+		}
+		pthread_mutex_unlock(&(sg_async_pool.lock));
+		pthread_mutex_lock(&(asq->lock));
+		asop = asq->head;
+		if (asop == NULL)
+		{
+			asq->scheduled = 0;
+			pthread_cond_broadcast(&(asq->done_cond));
+			pthread_mutex_unlock(&(asq->lock));
+			pthread_mutex_lock(&(sg_async_pool.lock));
+			continue;
+		}
+		asq->head = asop->next;
+		if (asq->head == NULL)
+		{
+			asq->tail = NULL;
+		}
+		asq->serving = 1;
+		asq->server = pthread_self();
+		/* Local copies, the plan may be freed by a callback. */
+		sgpln = asq->sgpln;
+		meta_sga = asq->meta_sga;
+		pthread_mutex_unlock(&(asq->lock));
+		if (asop->op == SG_ASYNC_READ_NEXT_BLOCK)
+		{
+			result = read_next_block_vdif_frames_into(sgpln, asop->vdif_buf, asop->n_frames);
+		}
+		else
+		{
+			result = write_vdif_frames(sgpln, asop->vdif_buf, asop->n_frames);
+		}
+		if (asop->cb != NULL)
+		{
+			asop->cb(sgpln, result, asop->user_data);
+			free_sg_mem(&meta_sga, asop);
+			pthread_mutex_lock(&(asq->lock));
+		}
+		else
+		{
+			/* Queue the completion and wake up the eventfd. */
+			asop->result = result;
+			asop->next = NULL;
+			pthread_mutex_lock(&(asq->lock));
+			if (asq->done_tail == NULL)
+			{
+				asq->done_head = asop;
+			}
+			else
+			{
+				asq->done_tail->next = asop;
+			}
+			asq->done_tail = asop;
+			if (write(asq->efd, &efd_increment, sizeof(efd_increment)) == -1)
+			{
+				perror("Unable to signal eventfd.");
+			}
+		}
+		asq->serving = 0;
+		asq->pending--;
+		if (asq->detached)
+		{
+			/* The plan was closed by the callback and may be gone. */
+			pthread_mutex_unlock(&(asq->lock));
+			free_sg_async_queue(asq, &meta_sga);
+		}
+		else
+		{
+			if (asq->head != NULL)
+			{
+				/* Back to the end of the ready list, other plans first */
+				schedule_sg_async_queue(asq);
+			}
+			else
+			{
+				asq->scheduled = 0;
+			}
+			pthread_cond_broadcast(&(asq->done_cond));
+			pthread_mutex_unlock(&(asq->lock));
+		}
+		pthread_mutex_lock(&(sg_async_pool.lock));
+	}
+	sg_async_pool.n_workers--;
+	pthread_mutex_unlock(&(sg_async_pool.lock));
+	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
+		DEBUGMSG_LEAVEFUNC;
+	#endif
+	return NULL;
+}
+
+/*
+ * Write to SG file and resize if necessary
+ * Arguments:
+ *   SGInfo *sgi -- Pointer to SGInfo instance for the file to be 
+ *     written to.
+ *   const void *src -- Pointer to buffer containing source data.
+ *   size_t n -- Number of bytes to be written from the source data.
+ * Return:
+ *   int -- 0 on success, -1 on failure
+ * Notes:
+ *   The size of the file is increased as necessary, in steps of
+ *     GROWTH_SIZE_IN_BLOCKS write blocks (sgi->sg_wr_block).
+ */
+int write_to_sg(SGInfo *sgi, const void *src, size_t n)
+{
+	#ifdef DEBUG_LEVEL
+		char _dbgmsg[_DBGMSGLEN];
+	#endif
+	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
+		DEBUGMSG_ENTERFUNC;
+	#endif
+	/* Check if resize is necessary */
+	if (sgi->smi.size+n > (off_t)(sgi->smi.eomem-sgi->smi.start))
+	{
+		if (resize_to_sg(sgi, (off_t)(sgi->smi.eomem-sgi->smi.start)+(off_t)GROWTH_SIZE_IN_BLOCKS*sgi->sg_wr_block) == -1)
+		{
+			return -1;
+		}
+	}
+	/* Memcopy */
+	memcpy(sgi->smi.start+sgi->smi.size, src, n);
+	sgi->smi.size += n;
+	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
+		DEBUGMSG_LEAVEFUNC;
+	#endif
+	return 0;
+}
+
+/*
+ * Resize SG file.
+ * Arguments:
+ *   SGInfo *sgi -- Pointer to SGInfo instance for the file to be 
+ *     resized.
+ *   off_t new_size -- The new file size, in bytes.
+ * Return:
+ *   int -- 0 on success, -1 on failure.
+ */
+int resize_to_sg(SGInfo *sgi, off_t new_size)
+{
+	#ifdef DEBUG_LEVEL
+		char _dbgmsg[_DBGMSGLEN];
+	#endif
+	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
+		DEBUGMSG_ENTERFUNC;
+	#endif
+	/* Truncate file to new size */
+	if (ftruncate(sgi->smi.mmfd, new_size) == -1)
+	{
+		perror("Unable to reset file size.");
 		return -1;
 	}
 	/* Re-mmap for non-zero new_size, and unmap if size is zero. */
 	if (new_size != (off_t)0)
 	{
-		sgi->smi.start = mremap(sgi->smi.start, (sgi->smi.eomem - sgi->smi.start), new_size, MREMAP_MAYMOVE);
-		if (sgi->smi.start == MAP_FAILED)
+		sgi->smi.start = mremap(sgi->smi.start, (sgi->smi.eomem - sgi->smi.start), new_size, MREMAP_MAYMOVE);
+		if (sgi->smi.start == MAP_FAILED)
+		{
+			perror("Unable to map file.");
+			return -1;
+		}
+		sgi->smi.eomem = sgi->smi.start + new_size;
+	}
+	else
+	{
+		if (munmap(sgi->smi.start, (sgi->smi.eomem - sgi->smi.start)) == -1)
+		{
+			perror("Unable to unmap file for resize to zero.");
+			return -1;
+		}
+		sgi->smi.start = NULL;
+		sgi->smi.eomem = NULL;
+	}
+	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
+		DEBUGMSG_LEAVEFUNC;
+	#endif
+	return 0;
+}
+
+
+/*
+ * Probe the storage device holding one SG file.
+ * Arguments:
+ *   void *arg -- SGStorageProbeTask by reference.
+ * Return:
+ *   void *arg -- NULL
+ * Notes:
+ *   Read plans probe the SG file itself if it holds at least 
+ *     SG_PROBE_MIN_BYTES, anything else goes through a temporary file 
+ *     next to it (see probe_sg_storage_dir).
+ */
+static void * sgthread_probe_storage(void *arg)
+{
+	#ifdef DEBUG_LEVEL
+		char _dbgmsg[_DBGMSGLEN];
+	#endif
+	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
+		DEBUGMSG_ENTERFUNC;
+	#endif
+	SGStorageProbeTask *task = (SGStorageProbeTask *)arg;
+	SGInfo *sgi = task->sgprt->sgi;
+	SGPlan *sgpln = task->sgprt->sgpln;
+	off_t size = (char *)sgi->smi.eomem - (char *)sgi->smi.start;
+	
+	task->prof.dev = task->sgprt->file_id.dev;
+	task->prof.write_mbps = 0;
+	/* Read plans never write, see tune_sg_plan_storage */
+	if (sgpln->sgm == SCATGAT_MODE_READ)
+	{
+		task->result = probe_sg_storage_fd(sgi->smi.mmfd, size, &(sgpln->data_sga), &(task->prof));
+	}
+	else
+	{
+		task->result = probe_sg_storage_dir(sgi->name, &(sgpln->meta_sga), &(sgpln->data_sga), &(task->prof));
+	}
+	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
+		DEBUGMSG_LEAVEFUNC;
+	#endif
+	return NULL;
+}
+
+/*
+ * Recover one SG file.
+ * Arguments:
+ *   void *arg -- Filename by reference.
+ * Return:
+ *   void *arg -- NULL on success, arg on failure.
+ */
+static void * sgthread_recover_file(void *arg)
+{
+	return recover_sg_file((const char *)arg, NULL) == 0 ? NULL : arg;
+}
+
+/*
+ * Open the read plan of the scan after the current one in a chain.
+ * Arguments:
+ *   void *arg -- SGScanChain by reference.
+ * Return:
+ *   void * -- NULL
+ * Notes:
+ *   Only sets chain->next and chain->next_result, which the chain 
+ *     reads after joining the thread.
+ */
+static void * sgthread_open_scan(void *arg)
+{
+	SGScanChain *chain = (SGScanChain *)arg;
+	chain->next_result = make_sg_read_plan(&(chain->next), chain->patterns[chain->iscan+1], chain->fmtstr, 
+						chain->mod_list, chain->n_mod, chain->disk_list, chain->n_disk);
+	return NULL;
+}
+
+/*
+ * Transform the frames queued for a quick-look spectrometer.
+ * Arguments:
+ *   void *arg -- SGQuickLook by reference.
+ * Return:
+ *   void * -- NULL
+ * Notes:
+ *   Runs until the spectrometer is stopped. Frames are transformed 
+ *     outside the lock from their queue slot, which is only returned 
+ *     to the free stack afterwards; the spectrum of each frame is 
+ *     integrated under the lock.
+ */
+static void * sgthread_quicklook(void *arg)
+{
+	SGQuickLook *qlk = (SGQuickLook *)arg;
+	SGQuickLookWork work;
+	const uint32_t *frame;
+	int64_t index = 0;
+	int islot, n_fft;
+	memset(&work, 0, sizeof(SGQuickLookWork));
+	pthread_mutex_lock(&(qlk->lock));
+	while (1)
+	{
+		while (!qlk->stop && qlk->n_ready == 0)
+		{
+			pthread_cond_wait(&(qlk->work_cond), &(qlk->lock));
+		}
+		if (qlk->stop)
+		{
+			break;
+		}
+		islot = qlk->ready[qlk->ready_head];
+		qlk->ready_head = (qlk->ready_head + 1) % qlk->cfg.queue_frames;
+		qlk->n_ready--;
+		qlk->n_busy++;
+		pthread_mutex_unlock(&(qlk->lock));
+		frame = qlk->slots + (size_t)islot*(qlk->frame_size/sizeof(uint32_t));
+		n_fft = 0;
+		if (work.power != NULL || alloc_sg_quicklook_work(qlk, &work) == 0)
+		{
+			index = get_sg_quicklook_interval(qlk, frame);
+			n_fft = transform_sg_quicklook_frame(qlk, &work, frame);
+		}
+		pthread_mutex_lock(&(qlk->lock));
+		if (n_fft > 0)
+		{
+			integrate_sg_quicklook(qlk, index, work.power, n_fft);
+		}
+		qlk->free_slots[qlk->n_free++] = islot;
+		qlk->n_busy--;
+		pthread_cond_broadcast(&(qlk->idle_cond));
+	}
+	pthread_mutex_unlock(&(qlk->lock));
+	free_sg_quicklook_work(qlk, &work);
+	return NULL;
+}
+
+//////////////////////////////////////////////////////////////////////// TIME ORDERING UTILITIES
+/*
+ * Comparison method to sort an array of integers in reverse order, i.e.
+ *   from largest to smallest.
+ * Arguments:
+ *   const void *a -- Integer by reference
+ *   const void *b -- Integer by reference
+ * Return:
+ *   int -- Returns -1 if a > b, 0 if a == b, and 1 if a < b.
+ */
+int compare_int_descend(const void *a, const void *b)
+{
+	int *int_a = (int *)a;
+	int *int_b = (int *)b;
+	return *int_b < *int_a ? -1 : *int_b > *int_a;
+}
+
+/*
+ * Comparison method to sort an array of SGInfo elements.
+ * Arguments:
+ *   const void *a -- SGInfo by reference.
+ *   const void *b -- SGInfo by reference.
+ * Return:
+ *   int - Returns -1 if a < b, 0 if a == b, and 1 if a > b.
+ * Notes:
+ *   The comparison is done by comparing the timestamp on the first VDIF
+ *     frame in the file associated with *a and *b.
+ */
+int compare_sg_info(const void *a, const void *b)
+{
+	#ifdef DEBUG_LEVEL
+		char _dbgmsg[_DBGMSGLEN];
+	#endif
+	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
+		DEBUGMSG_ENTERFUNC;
+	#endif
+	SGInfo *sgi_a = (SGInfo *)a;
+	SGInfo *sgi_b = (SGInfo *)b;
+	int result = sgi_a->first_secs < sgi_b->first_secs ? -1 : sgi_a->first_secs > sgi_b->first_secs;
+	if (result == 0)
+	{
+		result = sgi_a->first_frame < sgi_b->first_frame ? -1 : sgi_a->first_frame > sgi_b->first_frame;
+	}
+	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
+		DEBUGMSG_LEAVEFUNC;
+	#endif
+	return result;
+}
+
+/*
+ * Comparison method to sort an array of SGPart elements.
+ * Arguments
+ *   const void *a -- SGPart by reference.
+ *   const void *b -- SGPart by reference.
+ * Return:
+ *   int -- Returns -1 if a < b, 0 if a == b, and 1 if a > b.
+ * Notes:
+ *   The comparison is based on the timestamp on the first VDIF frame in
+ *     the a->data_buf and b->data_buf, as cached in first_stamp.
+ */
+int compare_sg_part(const void *a, const void *b)
+{
+	#ifdef DEBUG_LEVEL
+		char _dbgmsg[_DBGMSGLEN];
+	#endif
+	//~ #if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
+		//~ DEBUGMSG_ENTERFUNC;
+	//~ #endif
+	SGPart *sgprt_a = (SGPart *)a;
+	SGPart *sgprt_b = (SGPart *)b;
+	/* The packed stamp orders by seconds since reference epoch, then by
+	 * data frame number within second. */
+	int result = sgprt_a->first_stamp < sgprt_b->first_stamp ? -1 : sgprt_a->first_stamp > sgprt_b->first_stamp;
+	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
+		snprintf(_dbgmsg,_DBGMSGLEN,"Result = %d (%u.%u ? %u.%u)",result,
+					FIRST_VDIF_SECS_INRE(sgprt_a),FIRST_VDIF_DF_NUM_INSEC(sgprt_a),
+					FIRST_VDIF_SECS_INRE(sgprt_b),FIRST_VDIF_DF_NUM_INSEC(sgprt_b));
+		DEBUGMSG(_dbgmsg);
+		//~ DEBUGMSG_LEAVEFUNC;
+	#endif
+	return result;
+}
+
+/*
+ * Find a contiguous mapping of SGParts in the given SGPlan.
+ * Arguments:
+ *   SGPlan *sgpln -- SGPlan that contains the SGParts array to order.
+ *   int *mapping -- Allocated integer array that will contain the 
+ *     ordered mapping so that the first M entries will list the 
+ *     contiguous blocks from start to end. This is followed by 
+ *     sgpln->n_sgprt-M negative indecies that list blocks that are not
+ *     contiguous with this block set.
+ * Returns:
+ *   int -- The number of contiguous blocks found.
+ */
+int map_sg_parts_contiguous(SGPlan *sgpln, int *mapping)
+{
+	//~ printf(" -->> map_sg_parts_contiguous\n");
+	#ifdef DEBUG_LEVEL
+		char _dbgmsg[_DBGMSGLEN];
+	#endif
+	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
+		DEBUGMSG_ENTERFUNC;
+	#endif
+	int ii, jj;
+	int idx_min_new = 0;
+	int tmp_map = 0;
+	int return_value = 0;
+	int dead_nodes = sgpln->n_sgprt;
+	/* Initialize mapping array. Just put indecies in increasing 
+	 * magnitude, and make entries for dead nodes negative.
+	 */
+	for (ii=0; ii<sgpln->n_sgprt; ii++)
+	{
+		if (sgpln->sgprt[ii].n_block_frames > 0)
+		{
+			dead_nodes--;
+			mapping[ii] = ii+1;
+		}
+		else
+		{
+			mapping[ii] = -(ii+1);
+		}
+	}
+	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
+		
+		printf("Mapping(init) = [");
+		for (ii=0; ii<sgpln->n_sgprt; ii++)
+		{
+			printf("%5d",mapping[ii]);
+		}
+		printf("]\n");
+		DEBUGMSG_LEAVEFUNC;
+	#endif
+	/* If all nodes dead, just return zero. */
+	if (dead_nodes == sgpln->n_sgprt)
+	{
+		return 0;
+	}
+	/* Put all dead nodes at the end */
+	qsort((void *)mapping, sgpln->n_sgprt, sizeof(int), compare_int_descend);
+	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
+		
+		printf("Mapping(qsort) = [");
+		for (ii=0; ii<sgpln->n_sgprt; ii++)
+		{
+			printf("%5d",mapping[ii]);
+		}
+		printf("]\n");
+		DEBUGMSG_LEAVEFUNC;
+	#endif
+	/* Sort according to timestamps */
+	for (ii=0; ii<sgpln->n_sgprt-dead_nodes; ii++)
+	{
+		idx_min_new = ii;
+		for (jj=ii; jj<sgpln->n_sgprt-dead_nodes; jj++)
+		{
+			if (compare_sg_part((void *)&(sgpln->sgprt[mapping[jj]-1]),(void *)&(sgpln->sgprt[mapping[idx_min_new]-1])) < 0)
+			{
+				idx_min_new = jj;
+			}
+		}
+		tmp_map = mapping[ii];
+		mapping[ii] = mapping[idx_min_new];
+		mapping[idx_min_new] = tmp_map;
+	}
+	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
+		
+		printf("Mapping(bsort) = [");
+		for (ii=0; ii<sgpln->n_sgprt; ii++)
+		{
+			printf("%5d",mapping[ii]);
+		}
+		printf("]\n");
+		DEBUGMSG_LEAVEFUNC;
+	#endif
+	
+	/* Check data continuity, and set index negative if not. */
+	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
+		snprintf(_dbgmsg,_DBGMSGLEN,"%d / %d dead nodes",dead_nodes,sgpln->n_sgprt);
+		DEBUGMSG(_dbgmsg);
+	#endif
+	for (ii = 0;ii<sgpln->n_sgprt-dead_nodes-1; ii++)
+	{
+		#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
+			snprintf(_dbgmsg,_DBGMSGLEN,"ii = %d",ii);
+			DEBUGMSG(_dbgmsg);
+		#endif
+		if (!test_sg_parts_contiguous(&(sgpln->sgprt[mapping[ii]-1]),&(sgpln->sgprt[mapping[ii+1]-1])))
+		{
+			break;
+		}
+	}
+	return_value = ii+1;
+	for (jj=return_value; jj<sgpln->n_sgprt-dead_nodes; jj++)
+	{
+		mapping[jj] = -mapping[jj];
+	}
+	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
+		
+		printf("Mapping(final) = [");
+		for (ii=0; ii<sgpln->n_sgprt; ii++)
+		{
+			printf("%5d",mapping[ii]);
+		}
+		printf("]\n");
+		DEBUGMSG_LEAVEFUNC;
+	#endif
+	//~ printf(" <<-- map_sg_parts_contiguous\n");
+	return return_value;
+}
+
+/*
+ * Test whether two SG parts are contiguous.
+ * Arguments:
+ *   SGPart *a -- Pointer to SGPart assumed to contain first data.
+ *   SGPart *b -- Pointer to SGPart assumed to contain last data.
+ * Returns:
+ *   int -- 1 if contiguous, 0 if not.
+ * Notes:
+ *   Continuinity means that the last VDIF frame in the a->data_buf
+ *     and the first VDIF frame in b->data_buf are adjacent or aligned
+ *     in time, according to seconds-since-reference-epoch and 
+ *     data-frame-within-second counters. The aligned case is needed if
+ *     two or more parallel streams are processed simultaneously, in 
+ *     which case packets may have duplicate timestamps.
+ *   In order to make the code portable for different frame rates, the
+ *     reliance on VDIF_FRAMES_PER_SECOND is removed. This means that 
+ *     continuity across a 1-second boundary is ignored.
+ */
+int test_sg_parts_contiguous(SGPart *a, SGPart *b)
+{
+	#ifdef DEBUG_LEVEL
+		char _dbgmsg[_DBGMSGLEN];
+	#endif
+	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
+		DEBUGMSG_ENTERFUNC;
+	#endif
+	
+	// Test if either pointer is NULL
+	if (a == NULL || b == NULL) {
+		#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
+			DEBUGMSG_LEAVEFUNC;
+		#endif
+		return 0;
+	}
+	
+	/* Seconds since reference epoch. */
+	uint32_t secs_inre_a_last = LAST_VDIF_SECS_INRE(a);
+	uint32_t secs_inre_a_first = FIRST_VDIF_SECS_INRE(a);
+	uint32_t secs_inre_b_first = FIRST_VDIF_SECS_INRE(b);
+	uint32_t secs_inre_b_last = LAST_VDIF_SECS_INRE(b);
+	/* Data frame number within second */
+	uint32_t df_num_insec_a_last = LAST_VDIF_DF_NUM_INSEC(a);
+	uint32_t df_num_insec_a_first = FIRST_VDIF_DF_NUM_INSEC(a);
+	uint32_t df_num_insec_b_first = FIRST_VDIF_DF_NUM_INSEC(b);
+	uint32_t df_num_insec_b_last = LAST_VDIF_DF_NUM_INSEC(b);
+	
+	/* Set valid range for b start */
+	uint32_t min_secs_inre_b_first = secs_inre_a_first;
+	uint32_t max_secs_inre_b_first = secs_inre_a_last;
+	uint32_t min_df_num_insec_b_first;
+	uint32_t max_df_num_insec_b_first;
+	
+	
+	if (secs_inre_a_first == secs_inre_a_last) // If a is contained in single second
+	{
+		if (secs_inre_b_first == secs_inre_a_last) // If b starts in the same second as that containing a
+		{
+			if (df_num_insec_b_first >= df_num_insec_a_first && // b cannot start before a
+				df_num_insec_b_first <= df_num_insec_a_last+1) // and b should start at least directly after a ends
+			{
+				#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
+					snprintf(_dbgmsg,_DBGMSGLEN,"Contiguous (%u.%u -> %u.%u ? %u.%u -> %u.%u)",
+								secs_inre_a_first,df_num_insec_a_first,secs_inre_a_last,df_num_insec_a_last,
+								secs_inre_b_first,df_num_insec_b_first,secs_inre_b_last,df_num_insec_b_last);
+					DEBUGMSG(_dbgmsg);
+					DEBUGMSG_LEAVEFUNC;
+				#endif
+				return 1;
+			}
+		} // b cannot start outside the second in which a is contained
+	}
+	else // a is split across multiple seconds
+	{
+		if (secs_inre_b_first == secs_inre_a_first) // if b starts in same second as a starts
+		{
+			if (df_num_insec_b_first >= df_num_insec_a_first) // since a ends in future second, only need to check that b did not start before a
+			{
+				#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
+					snprintf(_dbgmsg,_DBGMSGLEN,"Contiguous (%u.%u -> %u.%u ? %u.%u -> %u.%u)",
+								secs_inre_a_first,df_num_insec_a_first,secs_inre_a_last,df_num_insec_a_last,
+								secs_inre_b_first,df_num_insec_b_first,secs_inre_b_last,df_num_insec_b_last);
+					DEBUGMSG(_dbgmsg);
+					DEBUGMSG_LEAVEFUNC;
+				#endif
+				return 1;
+			}
+		}
+		else if (secs_inre_b_first == secs_inre_a_last) // if b starts in the same second as a ends
+		{
+			if (df_num_insec_b_first <= df_num_insec_a_last+1) // since a started in past second, only need to check that b starts directly after a ends or earlier
+			{
+				#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
+					snprintf(_dbgmsg,_DBGMSGLEN,"Contiguous (%u.%u -> %u.%u ? %u.%u -> %u.%u)",
+								secs_inre_a_first,df_num_insec_a_first,secs_inre_a_last,df_num_insec_a_last,
+								secs_inre_b_first,df_num_insec_b_first,secs_inre_b_last,df_num_insec_b_last);
+					DEBUGMSG(_dbgmsg);
+					DEBUGMSG_LEAVEFUNC;
+				#endif
+				return 1;
+			}
+		}
+		else if (secs_inre_b_first > secs_inre_a_first && // if b starts in some second between where a starts and ends, that's okay too
+					secs_inre_b_first < secs_inre_a_last)
+		{
+			#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
+				snprintf(_dbgmsg,_DBGMSGLEN,"Contiguous (%u.%u -> %u.%u ? %u.%u -> %u.%u)",
+							secs_inre_a_first,df_num_insec_a_first,secs_inre_a_last,df_num_insec_a_last,
+							secs_inre_b_first,df_num_insec_b_first,secs_inre_b_last,df_num_insec_b_last);
+				DEBUGMSG(_dbgmsg);
+				DEBUGMSG_LEAVEFUNC;
+			#endif
+			return 1;
+		}
+	}
+	/* All other cases fail */
+	//~ if (secs_inre_b_first == secs_inre_a_last)
+	//~ {
+		//~ if ((df_num_insec_b_first == df_num_insec_a_last+1) || (df_num_insec_b_first == df_num_insec_a_first))
+		//~ {
+			//~ #if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
+				//~ snprintf(_dbgmsg,_DBGMSGLEN,"Contiguous (%u.%u -> %u.%u ? %u.%u -> %u.%u)",secs_inre_a_first,df_num_insec_a_first,secs_inre_a_last,df_num_insec_a_last,secs_inre_b_first,df_num_insec_b_first,secs_inre_b_last,df_num_insec_b_last);
+				//~ DEBUGMSG(_dbgmsg);
+				//~ DEBUGMSG_LEAVEFUNC;
+			//~ #endif
+			//~ #if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
+				//~ DEBUGMSG_LEAVEFUNC;
+			//~ #endif
+			//~ return 1;
+		//~ }
+	//~ }
+	//~ else if (secs_inre_b_first == secs_inre_a_last+1)
+	//~ {
+		//~ if (df_num_insec_a_last == VDIF_FRAMES_PER_SECOND-1 && df_num_insec_b_first == 0)
+		//~ {
+		//~ #if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
+			//~ DEBUGMSG_LEAVEFUNC;
+		//~ #endif
+			//~ return 1;
+		//~ }
+	//~ }
+	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
+		snprintf(_dbgmsg,_DBGMSGLEN,"Non-Contiguous (%u.%u -> %u.%u ? %u.%u -> %u.%u)",
+						secs_inre_a_first,df_num_insec_a_first,secs_inre_a_last,df_num_insec_a_last,
+						secs_inre_b_first,df_num_insec_b_first,secs_inre_b_last,df_num_insec_b_last);
+			DEBUGMSG(_dbgmsg);
+		DEBUGMSG_LEAVEFUNC;
+	#endif
+	return 0;
+}
+
+//////////////////////////////////////////////////////////////////////// CHECKPOINT AND RECOVERY
+/*
+ * Checkpoint a write plan every few blocks for crash recovery.
+ * Arguments:
+ *   SGPlan *sgpln -- SGPlan instance created in write-mode.
+ *   int n_blocks -- Blocks per SG file between checkpoints.
+ * Returns:
+ *   int -- 0 on success, -1 on error.
+ */
+int set_sg_plan_checkpoint(SGPlan *sgpln, int n_blocks)
+{
+	#ifdef DEBUG_LEVEL
+		char _dbgmsg[_DBGMSGLEN];
+	#endif
+	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
+		DEBUGMSG_ENTERFUNC;
+	#endif
+	int ii;
+	char filename[PATH_MAX];
+	SGCheckpoint *ckpt;
+	if (sgpln->sgm != SCATGAT_MODE_WRITE)
+	{
+		fprintf(stderr,"Cannot checkpoint non-write-mode SGPlan.\n");
+		return -1;
+	}
+	if (n_blocks <= 0)
+	{
+		fprintf(stderr,"Invalid checkpoint interval %d.\n",n_blocks);
+		return -1;
+	}
+	if (!first_write_sg_plan(sgpln))
+	{
+		fprintf(stderr,"Cannot enable checkpoints after the first write.\n");
+		return -1;
+	}
+	for (ii=0; ii<sgpln->n_sgprt; ii++)
+	{
+		if (sgpln->sgprt[ii].ckpt != NULL)
+		{
+			sgpln->sgprt[ii].ckpt->interval = n_blocks;
+			continue;
+		}
+		ckpt = (SGCheckpoint *)alloc_sg_meta(&(sgpln->meta_sga), sizeof(SGCheckpoint));
+		if (ckpt == NULL)
+		{
+			return -1;
+		}
+		snprintf(filename,PATH_MAX,"%s%s",sgpln->sgprt[ii].sgi->name,SG_CHECKPOINT_SUFFIX);
+		ckpt->fd = open(filename, O_WRONLY|O_CREAT|O_TRUNC|O_APPEND, SG_FILE_PERMISSIONS);
+		if (ckpt->fd == -1)
+		{
+			perror("Unable to create checkpoint file.");
+			free_sg_mem(&(sgpln->meta_sga), ckpt);
+			return -1;
+		}
+		ckpt->interval = n_blocks;
+		ckpt->n_pending = 0;
+		sgpln->sgprt[ii].ckpt = ckpt;
+	}
+	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
+		DEBUGMSG_LEAVEFUNC;
+	#endif
+	return 0;
+}
+
+/*
+ * Record a block written to an SG file, and checkpoint if due.
+ * Arguments:
+ *   SGPart *sgprt -- Part in a write plan with checkpoints enabled.
+ *   int blocknum -- Block number in the block header.
+ * Returns:
+ *   int -- 0 on success, -1 on error.
+ * Notes:
+ *   Must be called after the whole block is in the file.
+ */
+int checkpoint_sg_part(SGPart *sgprt, int blocknum)
+{
+	SGCheckpoint *ckpt = sgprt->ckpt;
+	SGCheckpointTag tag;
+	if (++ckpt->n_pending < ckpt->interval)
+	{
+		return 0;
+	}
+	/* Blocks must be durable before the checkpoint that vouches for 
+	 * them */
+	if (fdatasync(sgprt->sgi->smi.mmfd) == -1)
+	{
+		perror("Unable to sync SG file for checkpoint.");
+		return -1;
+	}
+	tag.magic = SG_CHECKPOINT_MAGIC;
+	tag.n_blocks = ckpt->n_pending;
+	tag.size = sgprt->sgi->smi.size;
+	tag.last_blocknum = blocknum;
+	tag.checksum = 0;
+	tag.checksum = sg_checkpoint_checksum(&tag);
+	ckpt->n_pending = 0;
+	if (write(ckpt->fd, &tag, sizeof(SGCheckpointTag)) != sizeof(SGCheckpointTag) || fdatasync(ckpt->fd) == -1)
+	{
+		perror("Unable to write checkpoint.");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Stop checkpointing an SG file.
+ * Arguments:
+ *   SGPart *sgprt -- Part in a write plan.
+ *   const SGAllocator *meta_sga -- Allocator of the plan.
+ *   int remove -- Non-zero to delete the sidecar, after the SG file 
+ *     has been closed cleanly.
+ * Return:
+ *   void
+ */
+void close_sg_checkpoint(SGPart *sgprt, const SGAllocator *meta_sga, int remove)
+{
+	char filename[PATH_MAX];
+	if (sgprt->ckpt == NULL)
+	{
+		return;
+	}
+	close(sgprt->ckpt->fd);
+	if (remove)
+	{
+		snprintf(filename,PATH_MAX,"%s%s",sgprt->sgi->name,SG_CHECKPOINT_SUFFIX);
+		unlink(filename);
+	}
+	free_sg_mem(meta_sga, sgprt->ckpt);
+	sgprt->ckpt = NULL;
+}
+
+/* FNV-1a over a checkpoint tag with checksum zero */
+static uint32_t sg_checkpoint_checksum(const SGCheckpointTag *tag)
+{
+	uint32_t h = 2166136261u;
+	const unsigned char *p;
+	size_t ii;
+	SGCheckpointTag tmp = *tag;
+	tmp.checksum = 0;
+	for (p=(const unsigned char *)&tmp, ii=0; ii<sizeof(SGCheckpointTag); ii++)
+	{
+		h = (h ^ p[ii])*16777619u;
+	}
+	return h;
+}
+
+/*
+ * Test whether a block header in a file being recovered is plausible.
+ * Arguments:
+ *   int fd -- SG file.
+ *   off_t offset -- Offset of the block header.
+ *   off_t file_size -- Size of the file.
+ *   const struct file_header_tag *fht -- File header.
+ *   int last_blocknum -- Block number of the previous valid block.
+ *   int *blocknum -- Set to the block number, if valid.
+ *   int *wb_size -- Set to the block size including header, if valid.
+ * Returns:
+ *   int -- 1 if valid, 0 otherwise.
+ */
+int test_sg_recovered_block(int fd, off_t offset, off_t file_size, const struct file_header_tag *fht, 
+							int last_blocknum, int *blocknum, int *wb_size)
+{
+	struct sg_wb_header_ext_tag wbht;
+	size_t wbht_size = fht->version == SG_FILE_VERSION_EXT ? sizeof(struct sg_wb_header_ext_tag) : sizeof(struct wb_header_tag);
+	uint32_t h[4];
+	int n_frames;
+	if (offset + (off_t)wbht_size > file_size || pread(fd, &wbht, wbht_size, offset) != (ssize_t)wbht_size)
+	{
+		return 0;
+	}
+	n_frames = (wbht.wb_size - (int)wbht_size)/fht->packet_size;
+	if (wbht.wb_size <= (int)wbht_size || wbht.wb_size > fht->block_size || 
+		(wbht.wb_size - (int)wbht_size) % fht->packet_size != 0 ||
+		offset + wbht.wb_size > file_size || wbht.blocknum <= last_blocknum)
+	{
+		return 0;
+	}
+	if (fht->version == SG_FILE_VERSION_EXT && wbht.n_frames != (uint32_t)n_frames)
+	{
+		return 0;
+	}
+	/* First and last frame must look like VDIF of the recorded size */
+	if (pread(fd, h, sizeof(h), offset + wbht_size) != sizeof(h) || VDIF_DF_LEN_BYTES(h) != (uint32_t)fht->packet_size)
+	{
+		return 0;
+	}
+	if (pread(fd, h, sizeof(h), offset + wbht_size + (off_t)(n_frames-1)*fht->packet_size) != sizeof(h) || 
+		VDIF_DF_LEN_BYTES(h) != (uint32_t)fht->packet_size)
+	{
+		return 0;
+	}
+	*blocknum = wbht.blocknum;
+	*wb_size = wbht.wb_size;
+	return 1;
+}
+
+/*
+ * Restore an SG file left behind by a write plan that did not close.
+ * Arguments:
+ *   const char *filename -- SG file to recover.
+ *   SGRecoveryInfo *info -- Filled with the outcome, may be NULL.
+ * Returns:
+ *   int -- 0 on success, -1 on error.
+ */
+int recover_sg_file(const char *filename, SGRecoveryInfo *info)
+{
+	#ifdef DEBUG_LEVEL
+		char _dbgmsg[_DBGMSGLEN];
+	#endif
+	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
+		DEBUGMSG_ENTERFUNC;
+	#endif
+	char ckname[PATH_MAX];
+	struct file_header_tag fht;
+	struct stat st;
+	SGCheckpointTag tag;
+	SGRecoveryInfo rinfo = { 0, 0, 0, 0 };
+	off_t offset = sizeof(struct file_header_tag);
+	int last_blocknum = INT_MIN;
+	int blocknum;
+	int wb_size;
+	int fd;
+	int ckfd;
+	fd = open(filename, O_RDWR);
+	if (fd == -1)
+	{
+		perror("Unable to open SG file for recovery.");
+		return -1;
+	}
+	if (fstat(fd, &st) == -1 || pread(fd, &fht, sizeof(fht), 0) != sizeof(fht) || 
+		fht.sync_word != SYNC_WORD || fht.packet_size <= 0)
+	{
+		fprintf(stderr,"No valid SG file header in %s.\n",filename);
+		close(fd);
+		return -1;
+	}
+	/* Take blocks up to the last complete checkpoint */
+	snprintf(ckname,PATH_MAX,"%s%s",filename,SG_CHECKPOINT_SUFFIX);
+	ckfd = open(ckname, O_RDONLY);
+	while (ckfd != -1 && read(ckfd, &tag, sizeof(tag)) == sizeof(tag) && tag.magic == SG_CHECKPOINT_MAGIC)
+	{
+		if (sg_checkpoint_checksum(&tag) != tag.checksum || tag.size < offset || tag.size > st.st_size)
+		{
+			break;
+		}
+		offset = tag.size;
+		last_blocknum = tag.last_blocknum;
+		rinfo.n_blocks += tag.n_blocks;
+	}
+	/* Then walk block headers after it */
+	while (test_sg_recovered_block(fd, offset, st.st_size, &fht, last_blocknum, &blocknum, &wb_size))
+	{
+		offset += wb_size;
+		last_blocknum = blocknum;
+		rinfo.n_blocks++;
+		rinfo.n_scanned++;
+	}
+	rinfo.size = offset;
+	rinfo.truncated = st.st_size - offset;
+	if (rinfo.truncated > 0 && ftruncate(fd, offset) == -1)
+	{
+		perror("Unable to truncate SG file.");
+		close(fd);
+		if (ckfd != -1)
+		{
+			close(ckfd);
+		}
+		return -1;
+	}
+	fsync(fd);
+	close(fd);
+	if (ckfd != -1)
+	{
+		close(ckfd);
+		unlink(ckname);
+	}
+	if (info != NULL)
+	{
+		*info = rinfo;
+	}
+	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_INFO
+		snprintf(_dbgmsg,_DBGMSGLEN,"%s: %d blocks (%d scanned), %ld bytes truncated.",filename,rinfo.n_blocks,rinfo.n_scanned,(long)rinfo.truncated);
+		INFOMSG(_dbgmsg);
+	#endif
+	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
+		DEBUGMSG_LEAVEFUNC;
+	#endif
+	return 0;
+}
+
+/*
+ * Recover all SG files of a scan in parallel, see recover_sg_file.
+ * Arguments:
+ *   const char *pattern, *fmtstr, int *mod_list, int n_mod, 
+ *     int *disk_list, int n_disk -- As for make_sg_read_plan.
+ * Returns:
+ *   int -- Number of SG files recovered, or -1 if any file that exists
+ *     could not be recovered.
+ */
+int recover_sg_files(const char *pattern, const char *fmtstr, 
+					int *mod_list, int n_mod, int *disk_list, int n_disk)
+{
+	char filename[n_mod*n_disk][PATH_MAX];
+	pthread_t sg_threads[n_mod*n_disk];
+	int exists[n_mod*n_disk];
+	int idisk, imod;
+	int ithread;
+	int thread_result;
+	int n_recovered = 0;
+	int failed = 0;
+	void *result;
+	for (imod=0; imod<n_mod; imod++)
+	{
+		for (idisk=0; idisk<n_disk; idisk++)
+		{
+			ithread = imod*n_disk + idisk;
+			snprintf(filename[ithread],PATH_MAX,fmtstr,mod_list[imod],disk_list[idisk],pattern);
+			exists[ithread] = access(filename[ithread], F_OK) == 0;
+			if (!exists[ithread])
+			{
+				continue;
+			}
+			thread_result = pthread_create(&(sg_threads[ithread]), NULL, &sgthread_recover_file, filename[ithread]);
+			if (thread_result != 0)
+			{
+				perror("Unable to launch thread.");
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+	for (ithread=0; ithread<n_mod*n_disk; ithread++)
+	{
+		if (!exists[ithread])
+		{
+			continue;
+		}
+		thread_result = pthread_join(sg_threads[ithread],&result);
+		if (thread_result != 0)
+		{
+			perror("Unable to join thread.");
+			exit(EXIT_FAILURE);
+		}
+		if (result == NULL)
+		{
+			n_recovered++;
+		}
+		else
+		{
+			failed = 1;
+		}
+	}
+	return failed ? -1 : n_recovered;
+}
+
+//////////////////////////////////////////////////////////////////////// EXTENDED FILE FORMAT
+/*
+ * Read the format revision from the header of an SG file.
+ * Arguments:
+ *   const char *filename -- SG file to inspect.
+ * Returns:
+ *   int -- Version in the file header tag, or -1 if the file cannot be
+ *     read or does not start with SYNC_WORD.
+ */
+int peek_sg_file_version(const char *filename)
+{
+	struct file_header_tag fht;
+	int fd;
+	ssize_t n;
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+	{
+		return -1;
+	}
+	n = pread(fd, &fht, sizeof(struct file_header_tag), 0);
+	close(fd);
+	if (n != (ssize_t)sizeof(struct file_header_tag) || fht.sync_word != SYNC_WORD)
+	{
+		return -1;
+	}
+	return fht.version;
+}
+
+/*
+ * Open an extended-format SG file for reading, the counterpart of 
+ * sg_open for SG_FILE_VERSION_EXT.
+ * Arguments:
+ *   const char *filename -- SG file to open.
+ *   SGInfo *sgi -- Filled as sg_open would; sgi->smi.mmfd is left at 
+ *     zero on failure.
+ * Return:
+ *   void
+ * Notes:
+ *   The file is mapped read-only and the block headers are walked once
+ *     to count blocks and frames.
+ */
+void open_sg_ext_file(const char *filename, SGInfo *sgi)
+{
+	#ifdef DEBUG_LEVEL
+		char _dbgmsg[_DBGMSGLEN];
+	#endif
+	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
+		DEBUGMSG_ENTERFUNC;
+	#endif
+	struct stat st;
+	const struct file_header_tag *fht;
+	const struct sg_wb_header_ext_tag *wbht;
+	const struct sg_wb_header_ext_tag *last_wbht = NULL;
+	char *ptr;
+	int fd;
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+	{
+		return;
+	}
+	if (fstat(fd, &st) == -1 || st.st_size < (off_t)(sizeof(struct file_header_tag) + sizeof(struct sg_wb_header_ext_tag)))
+	{
+		close(fd);
+		return;
+	}
+	sgi->smi.start = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (sgi->smi.start == MAP_FAILED)
+	{
+		perror("Unable to map file.");
+		sgi->smi.start = NULL;
+		close(fd);
+		return;
+	}
+	sgi->smi.mmfd = fd;
+	sgi->smi.size = st.st_size;
+	sgi->smi.eomem = (char *)sgi->smi.start + st.st_size;
+	sgi->smi.users = 1;
+	sgi->name = (char *)malloc((strlen(filename)+1)*sizeof(char));
+	strcpy(sgi->name,filename);
+	fht = (const struct file_header_tag *)sgi->smi.start;
+	sgi->sg_version = fht->version;
+	sgi->pkt_size = fht->packet_size;
+	sgi->pkt_offset = sizeof(VDIFHeader);
+	sgi->sg_fht_size = sizeof(struct file_header_tag);
+	sgi->sg_wbht_size = sizeof(struct sg_wb_header_ext_tag);
+	sgi->sg_wr_block = fht->block_size;
+	sgi->sg_wr_pkts = (fht->block_size - sizeof(struct sg_wb_header_ext_tag))/fht->packet_size;
+	sgi->sg_total_blks = 0;
+	sgi->total_pkts = 0;
+	for (ptr = (char *)sgi->smi.start + sizeof(struct file_header_tag); 
+		ptr + sizeof(struct sg_wb_header_ext_tag) <= (char *)sgi->smi.eomem; 
+		ptr += wbht->wb_size)
+	{
+		wbht = (const struct sg_wb_header_ext_tag *)ptr;
+		if (wbht->wb_size < (int)sizeof(struct sg_wb_header_ext_tag) || ptr + wbht->wb_size > (char *)sgi->smi.eomem)
+		{
+			break;
+		}
+		if (last_wbht == NULL)
+		{
+			sgi->first_secs = SG_STAMP_SECS(wbht->first_stamp);
+			sgi->first_frame = SG_STAMP_DF_NUM(wbht->first_stamp);
+			sgi->ref_epoch = VDIF_REF_EPOCH((const uint32_t *)(wbht + 1));
+		}
+		last_wbht = wbht;
+		sgi->sg_total_blks++;
+		sgi->total_pkts += wbht->n_frames;
+	}
+	if (last_wbht != NULL)
+	{
+		sgi->final_secs = SG_STAMP_SECS(last_wbht->last_stamp);
+		sgi->final_frame = SG_STAMP_DF_NUM(last_wbht->last_stamp);
+	}
+	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
+		DEBUGMSG_LEAVEFUNC;
+	#endif
+}
+
+/*
+ * Build the block offset index of an extended-format SGPart.
+ * Arguments:
+ *   SGPart *sgprt -- Part opened with open_sg_ext_file.
+ *   const SGAllocator *meta_sga -- Allocator for the index.
+ * Returns:
+ *   int -- 0 on success, -1 on error.
+ */
+int index_sg_ext_part(SGPart *sgprt, const SGAllocator *meta_sga)
+{
+	const struct sg_wb_header_ext_tag *wbht;
+	off_t offset = sizeof(struct file_header_tag);
+	off_t iblock;
+	sgprt->blk_offset = (off_t *)alloc_sg_meta(meta_sga, sizeof(off_t)*(sgprt->sgi->sg_total_blks > 0 ? sgprt->sgi->sg_total_blks : 1));
+	if (sgprt->blk_offset == NULL)
+	{
+		sgprt->sgi->sg_total_blks = 0;
+		return -1;
+	}
+	for (iblock=0; iblock<sgprt->sgi->sg_total_blks; iblock++)
+	{
+		sgprt->blk_offset[iblock] = offset;
+		wbht = (const struct sg_wb_header_ext_tag *)((char *)sgprt->sgi->smi.start + offset);
+		offset += wbht->wb_size;
+	}
+	return 0;
+}
+
+/*
+ * Locate the frames of a block, for either file format revision.
+ * Arguments:
+ *   SGPart *sgprt -- Part in a read plan.
+ *   off_t iblock -- Block index, less than sgi->sg_total_blks.
+ *   int *n_frames -- Set to the number of frames in the block.
+ *   uint32_t **end -- Set to the end of the block.
+ * Returns:
+ *   uint32_t * -- First frame of the block in the memory map.
+ * Notes:
+ *   Same contract as sg_pkt_by_blk, which handles legacy files.
+ */
+uint32_t *get_sg_part_block(SGPart *sgprt, off_t iblock, int *n_frames, uint32_t **end)
+{
+	const struct sg_wb_header_ext_tag *wbht;
+	if (sgprt->blk_offset == NULL)
+	{
+		return sg_pkt_by_blk(sgprt->sgi,iblock,n_frames,end);
+	}
+	wbht = get_sg_part_block_header(sgprt,iblock);
+	*n_frames = wbht->n_frames;
+	*end = (uint32_t *)((char *)wbht + wbht->wb_size);
+	return (uint32_t *)(wbht + 1);
+}
+
+/*
+ * Get the extended header of a block.
+ * Arguments:
+ *   SGPart *sgprt -- Part in a read plan.
+ *   off_t iblock -- Block index, less than sgi->sg_total_blks.
+ * Returns:
+ *   const struct sg_wb_header_ext_tag * -- Header in the memory map, or
+ *     NULL for legacy files.
+ */
+const struct sg_wb_header_ext_tag *get_sg_part_block_header(SGPart *sgprt, off_t iblock)
+{
+	if (sgprt->blk_offset == NULL)
+	{
+		return NULL;
+	}
+	return (const struct sg_wb_header_ext_tag *)((char *)sgprt->sgi->smi.start + sgprt->blk_offset[iblock]);
+}
+
+/*
+ * Describe a block of frames in an extended block header.
+ * Arguments:
+ *   struct sg_wb_header_ext_tag *wbht -- Header with blocknum and 
+ *     wb_size set; the remaining fields are filled.
+ *   const uint32_t *buf -- Frames to be written.
+ *   int n_frames -- Number of frames.
+ *   int pkt_size -- Frame size in bytes.
+ * Return:
+ *   void
+ * Notes:
+ *   Only the header words of each frame are read, which is cheap next 
+ *     to writing the frames.
+ */
+void fill_sg_wb_header_ext(struct sg_wb_header_ext_tag *wbht, const uint32_t *buf, int n_frames, int pkt_size)
+{
+	int stride = pkt_size/sizeof(uint32_t);
+	int iframe;
+	uint32_t thread_id;
+	const uint32_t *h;
+	wbht->first_stamp = 0;
+	wbht->last_stamp = 0;
+	wbht->n_frames = n_frames;
+	wbht->flags = 0;
+	wbht->crc32c = 0;
+	wbht->reserved = 0;
+	memset(wbht->thread_mask, 0, sizeof(wbht->thread_mask));
+	if (n_frames <= 0)
+	{
+		return;
+	}
+	wbht->first_stamp = SG_VDIF_STAMP(buf);
+	wbht->last_stamp = SG_VDIF_STAMP(buf + (size_t)(n_frames-1)*stride);
+	for (iframe=0, h=buf; iframe<n_frames; iframe++, h+=stride)
+	{
+		thread_id = VDIF_THREAD_ID(h);
+		wbht->thread_mask[thread_id/32] |= 1u << (thread_id%32);
+	}
+}
+
+/*
+ * Close the SG file of a read plan part, for either format revision.
+ * Arguments:
+ *   SGPart *sgprt -- Part in a read plan.
+ * Return:
+ *   void
+ */
+void close_sg_part_file(SGPart *sgprt)
+{
+	if (sgprt->sgi->sg_version != SG_FILE_VERSION_EXT)
+	{
+		sg_close(sgprt->sgi);
+		return;
+	}
+	if (sgprt->sgi->smi.start != NULL)
+	{
+		munmap(sgprt->sgi->smi.start, (char *)sgprt->sgi->smi.eomem - (char *)sgprt->sgi->smi.start);
+		sgprt->sgi->smi.start = NULL;
+	}
+	if (sgprt->sgi->smi.mmfd > 0)
+	{
+		close(sgprt->sgi->smi.mmfd);
+		sgprt->sgi->smi.mmfd = 0;
+	}
+}
+
+//////////////////////////////////////////////////////////////////////// I/O QUALITY OF SERVICE
+/*
+ * Set the I/O priority and bandwidth cap of a plan.
+ * Arguments:
+ *   SGPlan *sgpln -- SGPlan instance, read or write mode.
+ *   int io_class -- enum sg_io_class.
+ *   int io_level -- Level within the class, 0 (highest) to 
+ *     SG_IO_LEVELS-1; ignored for SG_IO_CLASS_NONE and _IDLE.
+ *   double max_mbps -- Cap on the plan's file I/O in MB/s, 0 for none.
+ * Returns:
+ *   int -- 0 on success, -1 on error.
+ * Notes:
+ *   Should not be called while the plan has reads or writes in flight.
+ */
+int set_sg_plan_io_qos(SGPlan *sgpln, int io_class, int io_level, double max_mbps)
+{
+	if (io_class < SG_IO_CLASS_NONE || io_class > SG_IO_CLASS_IDLE)
+	{
+		fprintf(stderr,"Invalid I/O class %d.\n",io_class);
+		return -1;
+	}
+	if (io_level < 0 || io_level >= SG_IO_LEVELS)
+	{
+		fprintf(stderr,"Invalid I/O priority level %d.\n",io_level);
+		return -1;
+	}
+	if (max_mbps < 0)
+	{
+		fprintf(stderr,"Invalid bandwidth cap %g MB/s.\n",max_mbps);
+		return -1;
+	}
+	pthread_mutex_lock(&(sgpln->qos.lock));
+	sgpln->qos.io_class = io_class;
+	sgpln->qos.io_level = io_class == SG_IO_CLASS_IDLE ? 0 : io_level;
+	sgpln->qos.max_bytes_per_sec = max_mbps*1e6;
+	sgpln->qos.tokens = sgpln->qos.max_bytes_per_sec*SG_IO_QOS_BURST_SEC;
+	clock_gettime(CLOCK_MONOTONIC, &(sgpln->qos.refill));
+	pthread_mutex_unlock(&(sgpln->qos.lock));
+	return 0;
+}
+
+/*
+ * Apply the I/O priority of a plan to the calling thread.
+ * Arguments:
+ *   SGPlan *sgpln -- Plan the thread works for.
+ * Return:
+ *   void
+ * Notes:
+ *   If the realtime class is refused the plan is downgraded to 
+ *     best-effort level 0, with a single warning.
+ */
+void apply_sg_io_qos(SGPlan *sgpln)
+{
+	int io_class, io_level;
+	pthread_mutex_lock(&(sgpln->qos.lock));
+	io_class = sgpln->qos.io_class;
+	io_level = sgpln->qos.io_level;
+	pthread_mutex_unlock(&(sgpln->qos.lock));
+	if (io_class == SG_IO_CLASS_NONE)
+	{
+		return;
+	}
+	if (syscall(SYS_ioprio_set, SG_IOPRIO_WHO_PROCESS, 0, SG_IOPRIO_VALUE(io_class, io_level)) == 0)
+	{
+		return;
+	}
+	if (io_class == SG_IO_CLASS_REALTIME && errno == EPERM)
+	{
+		pthread_mutex_lock(&(sgpln->qos.lock));
+		if (sgpln->qos.io_class == SG_IO_CLASS_REALTIME)
+		{
+			fprintf(stderr,"Realtime I/O class not permitted, using best-effort.\n");
+			sgpln->qos.io_class = SG_IO_CLASS_BEST_EFFORT;
+			sgpln->qos.io_level = 0;
+		}
+		pthread_mutex_unlock(&(sgpln->qos.lock));
+		syscall(SYS_ioprio_set, SG_IOPRIO_WHO_PROCESS, 0, SG_IOPRIO_VALUE(SG_IO_CLASS_BEST_EFFORT, 0));
+	}
+}
+
+/*
+ * Charge a transfer to the bandwidth cap of a plan.
+ * Arguments:
+ *   SGPlan *sgpln -- Plan the transfer belongs to.
+ *   size_t n_bytes -- Bytes about to be read or written.
+ * Return:
+ *   void
+ * Notes:
+ *   Tokens accrue at the capped rate up to SG_IO_QOS_BURST_SEC worth.
+ *     A transfer is always admitted, and whatever it overdraws is 
+ *     slept off first, so concurrent threads queue behind each other's
+ *     debt and the plan as a whole stays at the cap.
+ */
+void throttle_sg_io(SGPlan *sgpln, size_t n_bytes)
+{
+	struct timespec now;
+	struct timespec pause;
+	double wait = 0;
+	double rate;
+	pthread_mutex_lock(&(sgpln->qos.lock));
+	rate = sgpln->qos.max_bytes_per_sec;
+	if (rate > 0)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		sgpln->qos.tokens += rate*((now.tv_sec - sgpln->qos.refill.tv_sec) + 1e-9*(now.tv_nsec - sgpln->qos.refill.tv_nsec));
+		if (sgpln->qos.tokens > rate*SG_IO_QOS_BURST_SEC)
+		{
+			sgpln->qos.tokens = rate*SG_IO_QOS_BURST_SEC;
+		}
+		sgpln->qos.refill = now;
+		sgpln->qos.tokens -= n_bytes;
+		if (sgpln->qos.tokens < 0)
+		{
+			wait = -sgpln->qos.tokens/rate;
+		}
+	}
+	pthread_mutex_unlock(&(sgpln->qos.lock));
+	if (wait > 0)
+	{
+		pause.tv_sec = (time_t)wait;
+		pause.tv_nsec = (long)((wait - pause.tv_sec)*1e9);
+		while (nanosleep(&pause, &pause) == -1 && errno == EINTR);
+	}
+}
+
+//////////////////////////////////////////////////////////////////////// STORAGE TUNING
+/*
+ * Tune a plan to the storage holding its SG files.
+ * Arguments:
+ *   SGPlan *sgpln -- SGPlan instance, read or write mode.
+ *   const char *profile_path -- File to load and save device profiles,
+ *     or NULL to always probe and not save.
+ * Returns:
+ *   int -- Number of devices probed, or -1 on error.
+ * Notes:
+ *   The profile file holds one line per device, "dev read_mbps 
+ *     write_mbps latency_us", and is rewritten whenever a device is 
+ *     probed. Only measurements are stored; the settings derived from 
+ *     them are recomputed on every call.
+ *   Read plans never write to the data directories; devices that 
+ *     cannot be probed keep the defaults.
+ */
+int tune_sg_plan_storage(SGPlan *sgpln, const char *profile_path)
+{
+	#ifdef DEBUG_LEVEL
+		char _dbgmsg[_DBGMSGLEN];
+	#endif
+	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
+		DEBUGMSG_ENTERFUNC;
+	#endif
+	SGStorageProfile *profs; // known devices, loaded then probed
+	int n_prof = 0;
+	int n_loaded;
+	SGStorageProbeTask *tasks; // one per device to probe
+	int n_task = 0;
+	int n_probed = 0;
+	SGPart *sgprt;
+	off_t size;
+	off_t best_size;
+	pthread_t *sg_threads;
+	int thread_result;
+	int ii, jj, kk;
+	unsigned long dev;
+	double read_mbps, write_mbps, latency_us;
+	char line[256];
+	FILE *fh;
+	size_t block_size = 0;
+	int result = 0;
+	
+	profs = (SGStorageProfile *)alloc_sg_meta(&(sgpln->meta_sga), sizeof(SGStorageProfile)*(2*sgpln->n_sgprt+SG_MAX_STORAGE_PROFILES));
+	tasks = (SGStorageProbeTask *)alloc_sg_meta(&(sgpln->meta_sga), sizeof(SGStorageProbeTask)*sgpln->n_sgprt);
+	sg_threads = (pthread_t *)alloc_sg_meta(&(sgpln->meta_sga), sizeof(pthread_t)*sgpln->n_sgprt);
+	if (profs == NULL || tasks == NULL || sg_threads == NULL)
+	{
+		free_sg_mem(&(sgpln->meta_sga), profs);
+		free_sg_mem(&(sgpln->meta_sga), tasks);
+		free_sg_mem(&(sgpln->meta_sga), sg_threads);
+		return -1;
+	}
+	/* Load saved profiles, keeping entries for other devices so that 
+	 * they are written back */
+	if (profile_path != NULL && (fh = fopen(profile_path, "r")) != NULL)
+	{
+		while (fgets(line, sizeof(line), fh) != NULL && n_prof < SG_MAX_STORAGE_PROFILES)
+		{
+			if (line[0] == '#' || sscanf(line, "%lu %lf %lf %lf", &dev, &read_mbps, &write_mbps, &latency_us) != 4)
+			{
+				continue;
+			}
+			profs[n_prof].dev = (dev_t)dev;
+			profs[n_prof].read_mbps = read_mbps;
+			profs[n_prof].write_mbps = write_mbps;
+			profs[n_prof].latency_us = latency_us;
+			n_prof++;
+		}
+		fclose(fh);
+	}
+	n_loaded = n_prof;
+	/* Probe each device without a profile once: read plans through 
+	 * their largest SG file on it, write plans only if allowed to 
+	 * write. Other devices keep the defaults. */
+	for (ii=0; ii<sgpln->n_sgprt && (sgpln->sgm == SCATGAT_MODE_READ || sgpln->write_probe); ii++)
+	{
+		for (jj=0; jj<n_loaded; jj++)
+		{
+			if (profs[jj].dev == sgpln->sgprt[ii].file_id.dev)
+			{
+				break;
+			}
+		}
+		for (kk=0; jj == n_loaded && kk<n_task; kk++)
+		{
+			if (tasks[kk].sgprt->file_id.dev == sgpln->sgprt[ii].file_id.dev)
+			{
+				break;
+			}
+		}
+		if (jj < n_loaded || kk < n_task)
+		{
+			continue;
+		}
+		sgprt = &(sgpln->sgprt[ii]);
+		if (sgpln->sgm == SCATGAT_MODE_READ)
+		{
+			best_size = -1;
+			for (jj=ii; jj<sgpln->n_sgprt; jj++)
+			{
+				size = (char *)sgpln->sgprt[jj].sgi->smi.eomem - (char *)sgpln->sgprt[jj].sgi->smi.start;
+				if (sgpln->sgprt[jj].file_id.dev == sgprt->file_id.dev && 
+					sgpln->sgprt[jj].sgi->smi.mmfd > 0 && size > best_size)
+				{
+					sgprt = &(sgpln->sgprt[jj]);
+					best_size = size;
+				}
+			}
+			if (best_size < SG_PROBE_MIN_BYTES)
+			{
+				/* Mark the device as seen, without a task */
+				tasks[n_task].sgprt = sgprt;
+				tasks[n_task].result = 1;
+				n_task++;
+				continue;
+			}
+		}
+		tasks[n_task].sgprt = sgprt;
+		tasks[n_task].result = -1;
+		n_task++;
+	}
+	for (ii=0; ii<n_task; ii++)
+	{
+		if (tasks[ii].result > 0)
+		{
+			continue;
+		}
+		thread_result = pthread_create(&(sg_threads[ii]),NULL,&sgthread_probe_storage,&(tasks[ii]));
+		if (thread_result != 0)
+		{
+			perror("Unable to create thread.");
+			exit(EXIT_FAILURE);
+		}
+	}
+	for (ii=0; ii<n_task; ii++)
+	{
+		if (tasks[ii].result > 0)
+		{
+			continue;
+		}
+		thread_result = pthread_join(sg_threads[ii],NULL);
+		if (thread_result != 0)
+		{
+			perror("Unable to join thread.");
+			exit(EXIT_FAILURE);
+		}
+		if (tasks[ii].result != 0)
+		{
+			fprintf(stderr,"Unable to probe storage for %s, using defaults.\n",tasks[ii].sgprt->sgi->name);
+			continue;
+		}
+		profs[n_prof++] = tasks[ii].prof;
+		n_probed++;
+	}
+	if (result == 0)
+	{
+		/* Configure the parts, and find the block size for the slowest 
+		 * device */
+		for (ii=0; ii<sgpln->n_sgprt; ii++)
+		{
+			for (jj=0; jj<n_prof; jj++)
+			{
+				if (profs[jj].dev == sgpln->sgprt[ii].file_id.dev)
+				{
+					apply_sg_storage_profile(&(sgpln->sgprt[ii]), &(profs[jj]));
+					if (get_sg_storage_block_size(&(profs[jj])) > block_size)
+					{
+						block_size = get_sg_storage_block_size(&(profs[jj]));
+					}
+					break;
+				}
+			}
+		}
+		if (sgpln->sgm == SCATGAT_MODE_WRITE && block_size > 0 && first_write_sg_plan(sgpln))
+		{
+			set_sg_plan_block_size(sgpln, block_size);
+		}
+		/* Save measurements */
+		if (profile_path != NULL && n_probed > 0)
+		{
+			fh = fopen(profile_path, "w");
+			if (fh == NULL)
+			{
+				perror("Unable to save storage profile.");
+			}
+			else
+			{
+				fprintf(fh, "# dev read_mbps write_mbps latency_us\n");
+				for (ii=0; ii<n_prof; ii++)
+				{
+					fprintf(fh, "%lu %.1f %.1f %.1f\n", (unsigned long)profs[ii].dev, 
+						profs[ii].read_mbps, profs[ii].write_mbps, profs[ii].latency_us);
+				}
+				fclose(fh);
+			}
+		}
+	}
+	free_sg_mem(&(sgpln->meta_sga), profs);
+	free_sg_mem(&(sgpln->meta_sga), tasks);
+	free_sg_mem(&(sgpln->meta_sga), sg_threads);
+	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
+		DEBUGMSG_LEAVEFUNC;
+	#endif
+	return result == 0 ? n_probed : -1;
+}
+
+/*
+ * Allow tune_sg_plan_storage to write a probe file.
+ * Arguments:
+ *   SGPlan *sgpln -- SGPlan instance created in write-mode.
+ *   int enable -- Non-zero to enable, 0 to disable (default).
+ * Returns:
+ *   int -- 0 on success, -1 on error.
+ */
+int set_sg_plan_write_probe(SGPlan *sgpln, int enable)
+{
+	if (sgpln->sgm != SCATGAT_MODE_WRITE)
+	{
+		fprintf(stderr,"Only write-mode SGPlan can probe by writing.\n");
+		return -1;
+	}
+	sgpln->write_probe = enable != 0;
+	return 0;
+}
+
+/*
+ * Measure read bandwidth and latency on an open file.
+ * Arguments:
+ *   int fd -- File descriptor open for reading.
+ *   off_t size -- Size of the file in bytes.
+ *   const SGAllocator *data_sga -- Allocator for the read buffer.
+ *   SGStorageProfile *prof -- read_mbps and latency_us are set.
+ * Returns:
+ *   int -- 0 on success, -1 on error.
+ * Notes:
+ *   Reads up to SG_PROBE_BYTES from the start of the file in 
+ *     SG_PROBE_CHUNK_BYTES requests, then SG_PROBE_LATENCY_READS 4 KiB
+ *     reads spread over the file. Cached pages in each range are 
+ *     dropped first, which is only advice to the kernel: figures for 
+ *     dirty or locked pages may be optimistic.
+ */
+int probe_sg_storage_fd(int fd, off_t size, const SGAllocator *data_sga, SGStorageProfile *prof)
+{
+	char *buf;
+	off_t n_bytes = size < SG_PROBE_BYTES ? size : SG_PROBE_BYTES;
+	off_t offset;
+	off_t stride;
+	ssize_t n;
+	struct timespec t0, t1;
+	double elapsed = 0;
+	int ii;
+	
+	if (fd <= 0)
+	{
+		return -1;
+	}
+	buf = (char *)alloc_sg_data(data_sga, SG_PROBE_CHUNK_BYTES);
+	if (buf == NULL)
+	{
+		return -1;
+	}
+	/* Sequential bandwidth */
+	posix_fadvise(fd, 0, n_bytes, POSIX_FADV_DONTNEED);
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (offset=0; offset<n_bytes; offset+=n)
+	{
+		n = pread(fd, buf, n_bytes-offset < SG_PROBE_CHUNK_BYTES ? n_bytes-offset : SG_PROBE_CHUNK_BYTES, offset);
+		if (n <= 0)
+		{
+			break;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	elapsed = (t1.tv_sec - t0.tv_sec) + 1e-9*(t1.tv_nsec - t0.tv_nsec);
+	if (offset == 0 || elapsed <= 0)
+	{
+		free_sg_mem(data_sga, buf);
+		return -1;
+	}
+	prof->read_mbps = offset/elapsed/1e6;
+	/* Latency, from small reads at page-aligned offsets across the file */
+	stride = (size/SG_PROBE_LATENCY_READS) & ~(off_t)4095;
+	elapsed = 0;
+	for (ii=0; ii<SG_PROBE_LATENCY_READS; ii++)
+	{
+		offset = ii*stride + (stride/2 & ~(off_t)4095);
+		posix_fadvise(fd, offset, 4096, POSIX_FADV_DONTNEED);
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		n = pread(fd, buf, 4096, offset);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		elapsed += (t1.tv_sec - t0.tv_sec) + 1e-9*(t1.tv_nsec - t0.tv_nsec);
+	}
+	prof->latency_us = elapsed/SG_PROBE_LATENCY_READS*1e6;
+	free_sg_mem(data_sga, buf);
+	return 0;
+}
+
+/*
+ * Measure the storage under the directory of a file with a temporary
+ *   file.
+ * Arguments:
+ *   const char *filename -- File whose directory to probe.
+ *   const SGAllocator *meta_sga -- Allocator for the file name.
+ *   const SGAllocator *data_sga -- Allocator for the write buffer.
+ *   SGStorageProfile *prof -- write_mbps, read_mbps and latency_us are
+ *     set.
+ * Returns:
+ *   int -- 0 on success, -1 on error.
+ * Notes:
+ *   SG_PROBE_BYTES are written and synced, then read back with 
+ *     probe_sg_storage_fd. The file is removed before returning.
+ */
+int probe_sg_storage_dir(const char *filename, const SGAllocator *meta_sga, 
+					const SGAllocator *data_sga, SGStorageProfile *prof)
+{
+	char *tmpname;
+	char *slash;
+	char *buf;
+	off_t offset;
+	ssize_t n = 0;
+	struct timespec t0, t1;
+	double elapsed;
+	int fd;
+	int result = -1;
+	
+	tmpname = (char *)alloc_sg_meta(meta_sga, strlen(filename)+sizeof(SG_PROBE_TEMP_NAME)+1);
+	buf = (char *)alloc_sg_data(data_sga, SG_PROBE_CHUNK_BYTES);
+	if (tmpname == NULL || buf == NULL)
+	{
+		free_sg_mem(meta_sga, tmpname);
+		free_sg_mem(data_sga, buf);
+		return -1;
+	}
+	strcpy(tmpname, filename);
+	slash = strrchr(tmpname, '/');
+	strcpy(slash == NULL ? tmpname : slash+1, SG_PROBE_TEMP_NAME);
+	fd = mkstemp(tmpname);
+	if (fd == -1)
+	{
+		perror("Unable to create storage probe file.");
+		free_sg_mem(meta_sga, tmpname);
+		free_sg_mem(data_sga, buf);
+		return -1;
+	}
+	memset(buf, 0xa5, SG_PROBE_CHUNK_BYTES);
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (offset=0; offset<SG_PROBE_BYTES; offset+=n)
+	{
+		n = pwrite(fd, buf, SG_PROBE_CHUNK_BYTES, offset);
+		if (n <= 0)
+		{
+			break;
+		}
+	}
+	if (n > 0 && fdatasync(fd) == 0)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		elapsed = (t1.tv_sec - t0.tv_sec) + 1e-9*(t1.tv_nsec - t0.tv_nsec);
+		prof->write_mbps = elapsed > 0 ? offset/elapsed/1e6 : 0;
+		result = probe_sg_storage_fd(fd, offset, data_sga, prof);
+	}
+	close(fd);
+	unlink(tmpname);
+	free_sg_mem(meta_sga, tmpname);
+	free_sg_mem(data_sga, buf);
+	return result;
+}
+
+/*
+ * Get the write block size suited to a device.
+ * Arguments:
+ *   const SGStorageProfile *prof -- Device profile.
+ * Returns:
+ *   size_t -- Block size, a multiple of SG_MIN_BLOCK_SIZE within 
+ *     [SG_MIN_BLOCK_SIZE, SG_PROBE_MAX_BLOCK_SIZE].
+ * Notes:
+ *   Latency is at most 5% of the time to transfer a block, i.e. the 
+ *     block is at least 20 times the bandwidth-latency product.
+ */
+size_t get_sg_storage_block_size(const SGStorageProfile *prof)
+{
+	double mbps = prof->write_mbps > 0 ? prof->write_mbps : prof->read_mbps;
+	double block_size = 20*mbps*prof->latency_us;
+	if (block_size < SG_MIN_BLOCK_SIZE)
+	{
+		return SG_MIN_BLOCK_SIZE;
+	}
+	if (block_size > SG_PROBE_MAX_BLOCK_SIZE)
+	{
+		return SG_PROBE_MAX_BLOCK_SIZE;
+	}
+	return (size_t)block_size/SG_MIN_BLOCK_SIZE*SG_MIN_BLOCK_SIZE;
+}
+
+/*
+ * Set read engine and prefetch depth of a part from a device profile.
+ * Arguments:
+ *   SGPart *sgprt -- Part with SG file on the device.
+ *   const SGStorageProfile *prof -- Device profile.
+ * Return:
+ *   void
+ * Notes:
+ *   Devices slower to respond than SG_PROBE_ROTATIONAL_US are read 
+ *     with one large pread per block, so a block costs one request 
+ *     rather than a series of page faults each waiting on read-ahead.
+ *   Blocks are requested ahead of use to cover the bandwidth-latency 
+ *     product plus the block being consumed.
+ */
+void apply_sg_storage_profile(SGPart *sgprt, const SGStorageProfile *prof)
+{
+	double in_flight;
+	if (sgprt->sgpln->sgm != SCATGAT_MODE_READ)
+	{
+		return;
+	}
+	sgprt->read_engine = prof->latency_us >= SG_PROBE_ROTATIONAL_US ? SG_READ_ENGINE_PREAD : SG_READ_ENGINE_MMAP;
+	in_flight = prof->read_mbps*prof->latency_us;
+	sgprt->prefetch_blocks = 1 + (sgprt->sgi->sg_wr_block > 0 ? (int)(in_flight/sgprt->sgi->sg_wr_block) + 1 : 1);
+	if (sgprt->prefetch_blocks > SG_MAX_PREFETCH_BLOCKS)
+	{
+		sgprt->prefetch_blocks = SG_MAX_PREFETCH_BLOCKS;
+	}
+	discard_sg_part_stage(sgprt);
+}
+
+/*
+ * Ask the kernel to read the blocks following the current one.
+ * Arguments:
+ *   SGPart *sgprt -- Part in a read plan.
+ * Return:
+ *   void
+ * Notes:
+ *   Blocks of the current coalesced run are already in memory and are
+ *     skipped.
+ */
+void prefetch_sg_part_blocks(SGPart *sgprt)
+{
+	off_t first = sgprt->iblock + 1;
+	off_t last = sgprt->iblock + sgprt->prefetch_blocks;
+	uint32_t *start;
+	uint32_t *end;
+	off_t offset;
+	int n_frames;
+	if (sgprt->iblock >= sgprt->run_start && sgprt->iblock < sgprt->run_end && first < sgprt->run_end)
+	{
+		first = sgprt->run_end;
+	}
+	if (last >= (off_t)sgprt->sgi->sg_total_blks)
+	{
+		last = sgprt->sgi->sg_total_blks - 1;
+	}
+	if (sgprt->prefetch_blocks <= 0 || sgprt->sgi->smi.mmfd <= 0 || first > last)
+	{
+		return;
+	}
+	start = get_sg_part_block(sgprt,first,&n_frames,&end);
+	offset = (char *)start - (char *)sgprt->sgi->smi.start;
+	get_sg_part_block(sgprt,last,&n_frames,&end);
+	posix_fadvise(sgprt->sgi->smi.mmfd, offset, (char *)end - (char *)start, POSIX_FADV_WILLNEED);
+}
+
+/*
+ * Read the frames of the current block with pread.
+ * Arguments:
+ *   SGPart *sgprt -- Part with data_buf allocated for n_frames frames.
+ *   const uint32_t *start -- First frame of the block in the memory 
+ *     map, giving the file offset.
+ * Returns:
+ *   int -- 0 on success, -1 if the caller should copy from the map.
+ */
+int read_sg_part_block_pread(SGPart *sgprt, const uint32_t *start)
+{
+	size_t n_bytes = (size_t)sgprt->n_frames*sgprt->sgi->pkt_size;
+	off_t offset = (const char *)start - (const char *)sgprt->sgi->smi.start;
+	size_t done = 0;
+	ssize_t n;
+	if (sgprt->sgi->smi.mmfd <= 0)
+	{
+		return -1;
+	}
+	while (done < n_bytes)
+	{
+		n = pread(sgprt->sgi->smi.mmfd, (char *)sgprt->data_buf + done, n_bytes - done, offset + done);
+		if (n <= 0)
+		{
+			return -1;
+		}
+		done += n;
+	}
+	return 0;
+}
+
+/*
+ * Set how a read plan reads its SG files.
+ * Arguments:
+ *   SGPlan *sgpln -- SGPlan instance created in read-mode.
+ *   int read_engine -- enum sg_read_engine.
+ *   int prefetch_blocks -- Blocks to read ahead, 0 to 
+ *     SG_MAX_PREFETCH_BLOCKS.
+ * Returns:
+ *   int -- 0 on success, -1 on error.
+ */
+int set_sg_plan_read_engine(SGPlan *sgpln, int read_engine, int prefetch_blocks)
+{
+	int ii;
+	if (sgpln->sgm != SCATGAT_MODE_READ)
+	{
+		fprintf(stderr,"Cannot set read engine of non-read-mode SGPlan.\n");
+		return -1;
+	}
+	if (read_engine != SG_READ_ENGINE_MMAP && read_engine != SG_READ_ENGINE_PREAD)
+	{
+		fprintf(stderr,"Invalid read engine %d.\n",read_engine);
+		return -1;
+	}
+	if (prefetch_blocks < 0 || prefetch_blocks > SG_MAX_PREFETCH_BLOCKS)
+	{
+		fprintf(stderr,"Prefetch depth %d outside [0, %d].\n",prefetch_blocks,SG_MAX_PREFETCH_BLOCKS);
+		return -1;
+	}
+	for (ii=0; ii<sgpln->n_sgprt; ii++)
+	{
+		sgpln->sgprt[ii].read_engine = read_engine;
+		sgpln->sgprt[ii].prefetch_blocks = prefetch_blocks;
+		/* Staged data was read for the old engine */
+		discard_sg_part_stage(&(sgpln->sgprt[ii]));
+	}
+	return 0;
+}
+
+/*
+ * Get the number of blocks to fetch in the next coalesced read.
+ * Arguments:
+ *   SGPart *sgprt -- Part in a read plan, with prefetch_blocks > 0.
+ * Returns:
+ *   int -- Run length in blocks, at least 1.
+ * Notes:
+ *   Without a measurement yet, two blocks are fetched to get one.
+ */
+int get_sg_part_run_length(SGPart *sgprt)
+{
+	double block_bytes = sgprt->sgi->sg_wr_block > 0 ? sgprt->sgi->sg_wr_block : WBLOCK_SIZE;
+	int max_blocks = sgprt->prefetch_blocks + 1;
+	int n_blocks;
+	if (max_blocks > SG_MAX_COALESCE_BYTES/block_bytes)
+	{
+		max_blocks = SG_MAX_COALESCE_BYTES/block_bytes;
+	}
+	if (max_blocks < 1)
+	{
+		return 1;
+	}
+	if (sgprt->io_mbps <= 0)
+	{
+		return max_blocks < 2 ? max_blocks : 2;
+	}
+	n_blocks = (int)(sgprt->io_mbps*SG_COALESCE_TARGET_USEC/block_bytes);
+	if (n_blocks < 1)
+	{
+		return 1;
+	}
+	return n_blocks < max_blocks ? n_blocks : max_blocks;
+}
+
+/*
+ * Fetch the run of blocks starting at the current block, if it is not
+ *   already in memory.
+ * Arguments:
+ *   SGPart *sgprt -- Part in a read plan.
+ *   const uint32_t *start -- First frame of block iblock in the map.
+ * Returns:
+ *   const uint32_t * -- Where to copy the frames of block iblock from:
+ *     its staged buffer for the pread engine (see 
+ *     take_sg_part_staged_block), else start.
+ * Notes:
+ *   Does nothing with prefetch_blocks == 0. The pread engine reads the
+ *     frames of all blocks in the run with one preadv into a buffer per
+ *     block, and the block headers in between into a scratch buffer. 
+ *     The mmap engine faults the run in. The time of each fetch 
+ *     updates io_mbps, an exponential average, from which the length 
+ *     of the next run is chosen (get_sg_part_run_length). A failed 
+ *     fetch leaves the block to be read from the map.
+ */
+const uint32_t *coalesce_sg_part_blocks(SGPart *sgprt, const uint32_t *start)
+{
+	off_t last;
+	off_t offset = (const char *)start - (const char *)sgprt->sgi->smi.start;
+	off_t iblock;
+	size_t n_bytes;
+	size_t done = 0;
+	ssize_t n;
+	int n_frames;
+	int n_iov = 0;
+	int n_run;
+	uint32_t *block;
+	uint32_t *end;
+	const char *pos = (const char *)start;
+	char *page;
+	long page_size;
+	char gap[SG_STAGE_GAP_BYTES];
+	struct iovec iov[2*(SG_MAX_PREFETCH_BLOCKS+1)];
+	struct iovec *piov = iov;
+	struct timespec t0, t1;
+	double elapsed;
+	if (sgprt->prefetch_blocks <= 0 || sgprt->sgi->smi.mmfd <= 0)
+	{
+		return start;
+	}
+	if (sgprt->iblock < sgprt->run_start || sgprt->iblock >= sgprt->run_end ||
+		(sgprt->read_engine == SG_READ_ENGINE_PREAD && sgprt->stage_bufs[sgprt->iblock - sgprt->run_start] == NULL))
+	{
+		discard_sg_part_stage(sgprt);
+		n_run = get_sg_part_run_length(sgprt);
+		if (n_run > SG_MAX_PREFETCH_BLOCKS+1)
+		{
+			n_run = SG_MAX_PREFETCH_BLOCKS+1;
+		}
+		last = sgprt->iblock + n_run - 1;
+		if (last >= (off_t)sgprt->sgi->sg_total_blks)
+		{
+			last = sgprt->sgi->sg_total_blks - 1;
+		}
+		sgprt->run_start = sgprt->iblock;
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		if (sgprt->read_engine == SG_READ_ENGINE_PREAD)
+		{
+			/* One buffer per block, each to be handed out as data_buf; 
+			 * the run ends early at a gap too large for the scratch 
+			 * buffer or when out of memory */
+			for (iblock=sgprt->iblock; iblock<=last; iblock++)
+			{
+				block = get_sg_part_block(sgprt,iblock,&n_frames,&end);
+				if ((const char *)block < pos || (size_t)((const char *)block - pos) > sizeof(gap))
+				{
+					break;
+				}
+				sgprt->stage_bufs[iblock - sgprt->run_start] = (uint32_t *)alloc_sg_data(&(sgprt->sgpln->data_sga), (char *)end - (char *)block);
+				if (sgprt->stage_bufs[iblock - sgprt->run_start] == NULL)
+				{
+					break;
+				}
+				if ((const char *)block > pos)
+				{
+					iov[n_iov].iov_base = gap;
+					iov[n_iov++].iov_len = (const char *)block - pos;
+				}
+				iov[n_iov].iov_base = sgprt->stage_bufs[iblock - sgprt->run_start];
+				iov[n_iov++].iov_len = (char *)end - (char *)block;
+				pos = (const char *)end;
+			}
+			last = iblock - 1;
+			n_bytes = pos - (const char *)start;
+			while (done < n_bytes)
+			{
+				n = preadv(sgprt->sgi->smi.mmfd, piov, n_iov, offset + done);
+				if (n <= 0)
+				{
+					discard_sg_part_stage(sgprt);
+					return start;
+				}
+				done += n;
+				/* Continue a short read after the part already filled */
+				while (n_iov > 0 && (size_t)n >= piov->iov_len)
+				{
+					n -= piov->iov_len;
+					piov++;
+					n_iov--;
+				}
+				if (n > 0)
+				{
+					piov->iov_base = (char *)piov->iov_base + n;
+					piov->iov_len -= n;
+				}
+			}
+		}
+		else
+		{
+			get_sg_part_block(sgprt,last,&n_frames,&end);
+			n_bytes = (char *)end - (const char *)start;
+			page_size = sysconf(_SC_PAGESIZE);
+			page = (char *)((uintptr_t)start & ~(uintptr_t)(page_size-1));
+			#ifdef MADV_POPULATE_READ
+			if (madvise(page, (char *)end - page, MADV_POPULATE_READ) != 0)
+			#endif
+			{
+				/* Wait for the pages, so that the time measured is that
+				 * of the read rather than of the request */
+				madvise(page, (char *)end - page, MADV_WILLNEED);
+				for (; page < (char *)end; page += page_size)
+				{
+					(void)*(volatile const char *)page;
+				}
+			}
+		}
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		elapsed = (t1.tv_sec - t0.tv_sec) + 1e-9*(t1.tv_nsec - t0.tv_nsec);
+		if (elapsed > 0 && n_bytes > 0)
+		{
+			sgprt->io_mbps = sgprt->io_mbps > 0 ? 0.75*sgprt->io_mbps + 0.25*n_bytes/elapsed/1e6 : n_bytes/elapsed/1e6;
+		}
+		sgprt->run_end = last + 1;
+	}
+	if (sgprt->read_engine == SG_READ_ENGINE_PREAD && sgprt->iblock < sgprt->run_end)
+	{
+		return sgprt->stage_bufs[sgprt->iblock - sgprt->run_start];
+	}
+	return start;
+}
+
+/*
+ * Hand out the staged buffer of the current block.
+ * Arguments:
+ *   SGPart *sgprt -- Part for which coalesce_sg_part_blocks returned a 
+ *     staged buffer.
+ * Returns:
+ *   uint32_t * -- The buffer, allocated with the plan's data_sga, now 
+ *     owned by the caller.
+ */
+uint32_t *take_sg_part_staged_block(SGPart *sgprt)
+{
+	uint32_t *buf = sgprt->stage_bufs[sgprt->iblock - sgprt->run_start];
+	sgprt->stage_bufs[sgprt->iblock - sgprt->run_start] = NULL;
+	return buf;
+}
+
+/*
+ * Drop the current coalesced run, freeing the blocks not handed out.
+ * Arguments:
+ *   SGPart *sgprt -- Part in a read plan.
+ * Return:
+ *   void
+ */
+void discard_sg_part_stage(SGPart *sgprt)
+{
+	int ii;
+	for (ii=0; ii<SG_MAX_PREFETCH_BLOCKS+1; ii++)
+	{
+		free_sg_mem(&(sgprt->sgpln->data_sga), sgprt->stage_bufs[ii]);
+		sgprt->stage_bufs[ii] = NULL;
+	}
+	sgprt->run_end = sgprt->run_start;
+}
+
+//////////////////////////////////////////////////////////////////////// SAMPLE UNPACKING
+/* Format fields of the VDIF header words kept in SGUnpack.format_words:
+ * legacy flag; data frame length and log2(channels); bits per sample 
+ * and complex flag. */
+#define SG_FORMAT_MASK_W0 0x40000000u
+#define SG_FORMAT_MASK_W2 0x1fffffffu
+#define SG_FORMAT_MASK_W3 0xfc000000u
+
+/* Kernel expanding n_bytes of packed samples of 1 << log2_bits bits 
+ * into one int8_t value each, lowest bits first. */
+typedef void (*SGExpandKernel)(int8_t *dst, const uint8_t *src, size_t n_bytes, int log2_bits);
+
+/* Tables and kernel, set up once by sg_unpack_init. */
+static struct {
+	pthread_once_t once;
+	SGExpandKernel expand;												// selected for this CPU
+	int8_t lut[4][256][8];												// values of each byte, per log2(bits per sample)
+} sg_unpack = { .once = PTHREAD_ONCE_INIT };
+
+/*
+ * Value of an offset-binary sample code: odd levels symmetric about 
+ * zero, except 8-bit samples which are re-centred.
+ */
+static int8_t sg_sample_level(int code, int bits)
+{
+	return bits < 8 ? (int8_t)(2*code - ((1 << bits) - 1)) : (int8_t)(code - 128);
+}
+
+/*
+ * Table-driven expand kernel, one lookup per byte.
+ */
+static void sg_expand_sw(int8_t *dst, const uint8_t *src, size_t n_bytes, int log2_bits)
+{
+	int n_values = 8 >> log2_bits;
+	size_t ii;
+	for (ii=0; ii<n_bytes; ii++, dst+=n_values)
+	{
+		memcpy(dst, sg_unpack.lut[log2_bits][src[ii]], n_values);
+	}
+}
+
+#if defined(__x86_64__)
+/*
+ * AVX2 expand kernel. Bit fields are isolated into one plane per 
+ * position within the byte, mapped to levels with a byte shuffle and 
+ * interleaved back into stream order. The remainder goes through the 
+ * tables.
+ */
+__attribute__((target("avx2")))
+static void sg_expand_avx2(int8_t *dst, const uint8_t *src, size_t n_bytes, int log2_bits)
+{
+	size_t ii = 0;
+	__m256i x, lut, mask, p0, p1, p2, p3, a, b, c, d;
+	__m128i y, one, q0, q1, q2, q3, q4, q5, q6, q7, e0, e1, e2, e3, f0, f1, f2, f3;
+	switch (log2_bits)
+	{
+		case 0:
+			/* 1-bit: eight planes, interleaved through 8, 16 and 32 bits */
+			one = _mm_set1_epi8(1);
+			for (; ii+16<=n_bytes; ii+=16, dst+=128)
+			{
+				y = _mm_loadu_si128((const __m128i *)(src + ii));
+				#define SG_BIT_PLANE(k) _mm_sub_epi8(_mm_add_epi8(_mm_and_si128(_mm_srli_epi16(y, k), one), \
+											_mm_and_si128(_mm_srli_epi16(y, k), one)), one)
+				q0 = SG_BIT_PLANE(0); q1 = SG_BIT_PLANE(1); q2 = SG_BIT_PLANE(2); q3 = SG_BIT_PLANE(3);
+				q4 = SG_BIT_PLANE(4); q5 = SG_BIT_PLANE(5); q6 = SG_BIT_PLANE(6); q7 = SG_BIT_PLANE(7);
+				#undef SG_BIT_PLANE
+				e0 = _mm_unpacklo_epi16(_mm_unpacklo_epi8(q0, q1), _mm_unpacklo_epi8(q2, q3));
+				e1 = _mm_unpackhi_epi16(_mm_unpacklo_epi8(q0, q1), _mm_unpacklo_epi8(q2, q3));
+				e2 = _mm_unpacklo_epi16(_mm_unpackhi_epi8(q0, q1), _mm_unpackhi_epi8(q2, q3));
+				e3 = _mm_unpackhi_epi16(_mm_unpackhi_epi8(q0, q1), _mm_unpackhi_epi8(q2, q3));
+				f0 = _mm_unpacklo_epi16(_mm_unpacklo_epi8(q4, q5), _mm_unpacklo_epi8(q6, q7));
+				f1 = _mm_unpackhi_epi16(_mm_unpacklo_epi8(q4, q5), _mm_unpacklo_epi8(q6, q7));
+				f2 = _mm_unpacklo_epi16(_mm_unpackhi_epi8(q4, q5), _mm_unpackhi_epi8(q6, q7));
+				f3 = _mm_unpackhi_epi16(_mm_unpackhi_epi8(q4, q5), _mm_unpackhi_epi8(q6, q7));
+				_mm_storeu_si128((__m128i *)(dst + 0), _mm_unpacklo_epi32(e0, f0));
+				_mm_storeu_si128((__m128i *)(dst + 16), _mm_unpackhi_epi32(e0, f0));
+				_mm_storeu_si128((__m128i *)(dst + 32), _mm_unpacklo_epi32(e1, f1));
+				_mm_storeu_si128((__m128i *)(dst + 48), _mm_unpackhi_epi32(e1, f1));
+				_mm_storeu_si128((__m128i *)(dst + 64), _mm_unpacklo_epi32(e2, f2));
+				_mm_storeu_si128((__m128i *)(dst + 80), _mm_unpackhi_epi32(e2, f2));
+				_mm_storeu_si128((__m128i *)(dst + 96), _mm_unpacklo_epi32(e3, f3));
+				_mm_storeu_si128((__m128i *)(dst + 112), _mm_unpackhi_epi32(e3, f3));
+			}
+			break;
+		case 1:
+			/* 2-bit: four planes; 256-bit unpacks work per 128-bit lane,
+			 * so the lanes are put back in order when storing */
+			lut = _mm256_setr_epi8(-3,-1,1,3,0,0,0,0,0,0,0,0,0,0,0,0,-3,-1,1,3,0,0,0,0,0,0,0,0,0,0,0,0);
+			mask = _mm256_set1_epi8(3);
+			for (; ii+32<=n_bytes; ii+=32, dst+=128)
+			{
+				x = _mm256_loadu_si256((const __m256i *)(src + ii));
+				p0 = _mm256_shuffle_epi8(lut, _mm256_and_si256(x, mask));
+				p1 = _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(x, 2), mask));
+				p2 = _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(x, 4), mask));
+				p3 = _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(x, 6), mask));
+				a = _mm256_unpacklo_epi8(p0, p1);
+				b = _mm256_unpackhi_epi8(p0, p1);
+				c = _mm256_unpacklo_epi8(p2, p3);
+				d = _mm256_unpackhi_epi8(p2, p3);
+				p0 = _mm256_unpacklo_epi16(a, c);
+				p1 = _mm256_unpackhi_epi16(a, c);
+				p2 = _mm256_unpacklo_epi16(b, d);
+				p3 = _mm256_unpackhi_epi16(b, d);
+				_mm256_storeu_si256((__m256i *)(dst + 0), _mm256_permute2x128_si256(p0, p1, 0x20));
+				_mm256_storeu_si256((__m256i *)(dst + 32), _mm256_permute2x128_si256(p2, p3, 0x20));
+				_mm256_storeu_si256((__m256i *)(dst + 64), _mm256_permute2x128_si256(p0, p1, 0x31));
+				_mm256_storeu_si256((__m256i *)(dst + 96), _mm256_permute2x128_si256(p2, p3, 0x31));
+			}
+			break;
+		case 2:
+			/* 4-bit: two planes */
+			lut = _mm256_setr_epi8(-15,-13,-11,-9,-7,-5,-3,-1,1,3,5,7,9,11,13,15,
+									-15,-13,-11,-9,-7,-5,-3,-1,1,3,5,7,9,11,13,15);
+			mask = _mm256_set1_epi8(15);
+			for (; ii+32<=n_bytes; ii+=32, dst+=64)
+			{
+				x = _mm256_loadu_si256((const __m256i *)(src + ii));
+				p0 = _mm256_shuffle_epi8(lut, _mm256_and_si256(x, mask));
+				p1 = _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(x, 4), mask));
+				a = _mm256_unpacklo_epi8(p0, p1);
+				b = _mm256_unpackhi_epi8(p0, p1);
+				_mm256_storeu_si256((__m256i *)(dst + 0), _mm256_permute2x128_si256(a, b, 0x20));
+				_mm256_storeu_si256((__m256i *)(dst + 32), _mm256_permute2x128_si256(a, b, 0x31));
+			}
+			break;
+		default:
+			/* 8-bit: re-centre */
+			mask = _mm256_set1_epi8((char)0x80);
+			for (; ii+32<=n_bytes; ii+=32, dst+=32)
+			{
+				x = _mm256_loadu_si256((const __m256i *)(src + ii));
+				_mm256_storeu_si256((__m256i *)dst, _mm256_xor_si256(x, mask));
+			}
+			break;
+	}
+	sg_expand_sw(dst, src + ii, n_bytes - ii, log2_bits);
+}
+#endif
+
+/*
+ * Deal the values of one frame, in stream order, out to the channel 
+ * arrays: channel c of sample t goes to out[c*chan_stride + t*n_comp].
+ * Real samples are copied one value at a time, complex samples as one
+ * (I, Q) pair.
+ */
+static void sg_deal_int8(int8_t *out, size_t chan_stride, const int8_t *vals, int n_chan, int n_comp, int spf)
+{
+	int16_t pair;
+	int ichan, isample;
+	for (ichan=0; ichan<n_chan; ichan++, out+=chan_stride)
+	{
+		if (n_comp == 1)
+		{
+			for (isample=0; isample<spf; isample++)
+			{
+				out[isample] = vals[(size_t)isample*n_chan + ichan];
+			}
+		}
+		else
+		{
+			for (isample=0; isample<spf; isample++)
+			{
+				memcpy(&pair, vals + ((size_t)isample*n_chan + ichan)*2, 2);
+				memcpy(out + (size_t)isample*2, &pair, 2);
+			}
+		}
+	}
+}
+
+static void sg_deal_float(float *out, size_t chan_stride, const int8_t *vals, int n_chan, int n_comp, int spf)
+{
+	int n_step = n_chan*n_comp;
+	int ichan, isample;
+	for (ichan=0; ichan<n_chan; ichan++, out+=chan_stride)
+	{
+		if (n_step == 1)
+		{
+			for (isample=0; isample<spf; isample++)
+			{
+				out[isample] = vals[isample];
+			}
+		}
+		else if (n_comp == 1)
+		{
+			for (isample=0; isample<spf; isample++)
+			{
+				out[isample] = vals[(size_t)isample*n_step + ichan];
+			}
+		}
+		else
+		{
+			for (isample=0; isample<spf; isample++)
+			{
+				out[(size_t)isample*2] = vals[(size_t)isample*n_step + ichan*2];
+				out[(size_t)isample*2 + 1] = vals[(size_t)isample*n_step + ichan*2 + 1];
+			}
+		}
+	}
+}
+
+/*
+ * Build the tables and select the kernel for this CPU.
+ */
+static void sg_unpack_init(void)
+{
+	int log2_bits, bits, code, k;
+	for (log2_bits=0; log2_bits<4; log2_bits++)
+	{
+		bits = 1 << log2_bits;
+		for (code=0; code<256; code++)
+		{
+			for (k=0; k<8/bits; k++)
+			{
+				sg_unpack.lut[log2_bits][code][k] = sg_sample_level((code >> (k*bits)) & ((1 << bits) - 1), bits);
+			}
+		}
+	}
+	sg_unpack.expand = sg_expand_sw;
+	#if defined(__x86_64__)
+		if (__builtin_cpu_supports("avx2"))
+		{
+			sg_unpack.expand = sg_expand_avx2;
+		}
+	#endif
+}
+
+/*
+ * Decode the sample layout from a VDIF header.
+ * Arguments:
+ *   const uint32_t *frame -- VDIF frame.
+ *   SGSampleInfo *info -- Receives the layout; counts are zeroed.
+ *   uint32_t *format_words -- Receives header words 0, 2 and 3 masked 
+ *     to the format fields, may be NULL.
+ * Returns:
+ *   int -- 0 on success, -1 if the samples cannot be unpacked.
+ */
+int decode_sg_sample_format(const uint32_t *frame, SGSampleInfo *info, uint32_t *format_words)
+{
+	int header_size = VDIF_LEGACY(frame) ? 16 : 32;
+	int payload_bits = ((int)VDIF_DF_LEN_BYTES(frame) - header_size)*8;
+	int step_bits;
+	memset(info, 0, sizeof(SGSampleInfo));
+	info->n_chan = 1 << VDIF_LOG2_NCHAN(frame);
+	info->bits_per_sample = VDIF_BITS_PER_SAMPLE(frame);
+	info->is_complex = VDIF_IS_COMPLEX(frame);
+	step_bits = info->n_chan*info->bits_per_sample*(1 + info->is_complex);
+	if (info->bits_per_sample != 1 && info->bits_per_sample != 2 && 
+		info->bits_per_sample != 4 && info->bits_per_sample != 8)
+	{
+		fprintf(stderr,"Cannot unpack %d-bit samples.\n",info->bits_per_sample);
+		return -1;
+	}
+	if (payload_bits <= 0 || payload_bits % step_bits != 0)
+	{
+		fprintf(stderr,"Frame payload of %d bits does not hold whole samples.\n",payload_bits);
+		return -1;
+	}
+	info->samples_per_frame = payload_bits/step_bits;
+	if (format_words != NULL)
+	{
+		format_words[0] = frame[0] & SG_FORMAT_MASK_W0;
+		format_words[1] = frame[2] & SG_FORMAT_MASK_W2;
+		format_words[2] = frame[3] & SG_FORMAT_MASK_W3;
+	}
+	return 0;
+}
+
+/*
+ * Get the sample layout of the frames in a read plan.
+ * Arguments:
+ *   SGPlan *sgpln -- SGPlan instance created in read-mode.
+ *   SGSampleInfo *info -- Filled from the first frame of the first SG 
+ *     file; n_frames, n_samples and first_stamp are set to zero.
+ * Returns:
+ *   int -- 0 on success, -1 if there are no frames or their format 
+ *     cannot be unpacked.
+ */
+int get_sg_plan_sample_info(SGPlan *sgpln, SGSampleInfo *info)
+{
+	uint32_t *start = NULL;
+	uint32_t *end = NULL;
+	int n_frames = 0;
+	if (sgpln->sgm != SCATGAT_MODE_READ || sgpln->n_sgprt <= 0)
+	{
+		fprintf(stderr,"No frames to describe in SGPlan.\n");
+		return -1;
+	}
+	start = get_sg_part_block(&(sgpln->sgprt[0]),0,&n_frames,&end);
+	if (start == NULL || n_frames <= 0)
+	{
+		fprintf(stderr,"No frames to describe in SGPlan.\n");
+		return -1;
+	}
+	return decode_sg_sample_format(start, info, NULL);
+}
+
+/*
+ * Unpack frames into the channel arrays of a sample read.
+ * Arguments:
+ *   SGUnpack *unp -- Output and layout.
+ *   const uint32_t *frames -- Frames to unpack.
+ *   int n_frames -- Number of frames.
+ *   int pkt_size -- Frame size in bytes.
+ *   int first_frame -- Index of frames[0] in the output.
+ * Returns:
+ *   int -- 0 on success, -1 if a frame differs in format.
+ * Notes:
+ *   A single real channel is expanded straight into the int8 output; 
+ *     otherwise each frame is expanded into the scratch buffer, small 
+ *     enough to stay in cache, and dealt out to the channel arrays.
+ */
+int unpack_sg_frames(SGUnpack *unp, const uint32_t *frames, int n_frames, int pkt_size, int first_frame)
+{
+	int stride = pkt_size/sizeof(uint32_t);
+	int n_comp = 1 + unp->info.is_complex;
+	int n_step = unp->info.n_chan*n_comp;								// values per sample time
+	int spf = unp->info.samples_per_frame;
+	int log2_bits = __builtin_ctz(unp->info.bits_per_sample);
+	size_t payload_bytes = (size_t)spf*n_step*unp->info.bits_per_sample/8;
+	size_t offset;
+	const uint32_t *h;
+	int iframe;
+	for (iframe=0, h=frames; iframe<n_frames; iframe++, h+=stride)
+	{
+		if ((h[0] & SG_FORMAT_MASK_W0) != unp->format_words[0] || (h[2] & SG_FORMAT_MASK_W2) != unp->format_words[1] ||
+			(h[3] & SG_FORMAT_MASK_W3) != unp->format_words[2])
+		{
+			fprintf(stderr,"Frame format changed, cannot unpack.\n");
+			return -1;
+		}
+		if (first_frame + iframe == 0)
+		{
+			unp->info.first_stamp = SG_VDIF_STAMP(h);
+		}
+		offset = (size_t)(first_frame + iframe)*spf*n_comp;
+		if (n_step == 1 && unp->format == SG_SAMPLES_INT8)
+		{
+			sg_unpack.expand((int8_t *)unp->out + offset, (const uint8_t *)h + unp->header_size, payload_bytes, log2_bits);
+			continue;
+		}
+		sg_unpack.expand(unp->scratch, (const uint8_t *)h + unp->header_size, payload_bytes, log2_bits);
+		if (unp->format == SG_SAMPLES_INT8)
+		{
+			sg_deal_int8((int8_t *)unp->out + offset, unp->max_values, unp->scratch, unp->info.n_chan, n_comp, spf);
+		}
+		else
+		{
+			sg_deal_float((float *)unp->out + offset, unp->max_values, unp->scratch, unp->info.n_chan, n_comp, spf);
+		}
+	}
+	return 0;
+}
+
+/*
+ * Read the next block of VDIF frames unpacked into per-channel samples.
+ * Arguments:
+ *   SGPlan *sgpln -- The SGPlan created for a given filename pattern.
+ *   void *out -- Buffer of n_chan channel arrays of int8_t or float, 
+ *     channel c starting at element c*max_values.
+ *   int format -- enum sg_sample_format.
+ *   int max_values -- Capacity of each channel array in values; 
+ *     complex samples take two (I then Q).
+ *   SGSampleInfo *info -- Receives the layout and the number of frames
+ *     and samples unpacked, may be NULL.
+ * Returns:
+ *   int -- The number of VDIF frames unpacked, zero if no frames could
+ *     be read, and -1 on error.
+ * Notes:
+ *   Frames are stitched as by read_next_block_vdif_frames_into, with 
+ *     room for max_values/(samples_per_frame*(1+is_complex)) frames, 
+ *     and unpacked straight from the block buffers instead of being 
+ *     copied, so the samples cost no extra pass over the frames. 
+ *   All frames must share the format of the first; frames of several 
+ *     VDIF threads are unpacked in stream order, so select one thread 
+ *     with a read filter where that matters. Headers are not kept.
+ *   Samples are expanded with AVX2 table lookups where the CPU allows,
+ *     and per-byte tables otherwise.
+ */
+int read_next_block_vdif_samples(SGPlan *sgpln, void *out, int format, 
+							int max_values, SGSampleInfo *info)
+{
+	SGUnpack unp;
+	uint32_t *start = NULL;
+	uint32_t *end = NULL;
+	int n_frames = 0;
+	int result;
+	if (sgpln->sgm != SCATGAT_MODE_READ || sgpln->n_sgprt <= 0)
+	{
+		fprintf(stderr,"Trying to read from non-read-mode SGPlan.\n");
+		return -1;
+	}
+	if (format != SG_SAMPLES_INT8 && format != SG_SAMPLES_FLOAT)
+	{
+		fprintf(stderr,"Unknown sample format %d.\n",format);
+		return -1;
+	}
+	pthread_once(&(sg_unpack.once), sg_unpack_init);
+	start = get_sg_part_block(&(sgpln->sgprt[0]),0,&n_frames,&end);
+	if (start == NULL || n_frames <= 0)
+	{
+		return 0;
+	}
+	if (decode_sg_sample_format(start, &(unp.info), unp.format_words) != 0)
+	{
+		return -1;
+	}
+	unp.out = out;
+	unp.format = format;
+	unp.max_values = max_values;
+	unp.header_size = VDIF_LEGACY(start) ? 16 : 32;
+	unp.scratch = (int8_t *)alloc_sg_data(&(sgpln->data_sga), 
+		(size_t)unp.info.samples_per_frame*unp.info.n_chan*(1 + unp.info.is_complex) + 32);
+	if (unp.scratch == NULL)
+	{
+		perror("Unable to allocate unpack buffer.");
+		return -1;
+	}
+	result = gather_next_sg_blocks(sgpln, NULL, 
+		max_values/(unp.info.samples_per_frame*(1 + unp.info.is_complex)), &unp, NULL);
+	free_sg_mem(&(sgpln->data_sga), unp.scratch);
+	if (info != NULL)
+	{
+		*info = unp.info;
+		if (result > 0)
+		{
+			info->n_frames = result;
+			info->n_samples = result*unp.info.samples_per_frame;
+		}
+	}
+	return result;
+}
+
+//////////////////////////////////////////////////////////////////////// CHANNEL SELECTION
+/* Kernel writing the kept bit fields of one frame payload. */
+typedef void (*SGSelectKernel)(unsigned char *dst, const unsigned char *src, const SGSelect *sel);
+
+/* Kernel, set up once by sg_select_init. */
+static struct {
+	pthread_once_t once;
+	SGSelectKernel kernel;												// selected for this CPU
+} sg_select = { .once = PTHREAD_ONCE_INIT };
+
+/*
+ * Append the low n bits of v to a bit stream, lowest bits first, 
+ * storing each 64-bit word once it is full.
+ */
+static inline void sg_put_bits(unsigned char **dst, uint64_t *acc, int *n_acc, uint64_t v, int n)
+{
+	*acc |= v << *n_acc;
+	*n_acc += n;
+	if (*n_acc >= 64)
+	{
+		memcpy(*dst, acc, sizeof(uint64_t));
+		*dst += sizeof(uint64_t);
+		*n_acc -= 64;
+		*acc = *n_acc > 0 ? v >> (n - *n_acc) : 0;
+	}
+}
+
+/*
+ * Portable select kernel, copies each run of adjacent kept bits.
+ */
+static void sg_select_sw(unsigned char *dst, const unsigned char *src, const SGSelect *sel)
+{
+	uint64_t acc = 0;
+	uint64_t w, m, run;
+	int n_acc = 0;
+	int ii, k, start, len;
+	for (ii=0, k=0; ii<sel->n_words; ii++)
+	{
+		memcpy(&w, src + (size_t)ii*sizeof(uint64_t), sizeof(uint64_t));
+		for (m=sel->mask[k]; m != 0; )
+		{
+			start = __builtin_ctzll(m);
+			run = m >> start;
+			len = ~run == 0 ? 64 - start : __builtin_ctzll(~run);
+			sg_put_bits(&dst, &acc, &n_acc, len == 64 ? w : (w >> start) & ((1ull << len) - 1), len);
+			m = start + len == 64 ? 0 : m & (~0ull << (start + len));
+		}
+		if (++k == sel->period)
+		{
+			k = 0;
+		}
+	}
+}
+
+#if defined(__x86_64__)
+/*
+ * BMI2 select kernel, one bit extraction per payload word.
+ */
+__attribute__((target("bmi2")))
+static void sg_select_bmi2(unsigned char *dst, const unsigned char *src, const SGSelect *sel)
+{
+	uint64_t acc = 0;
+	uint64_t w;
+	int n_acc = 0;
+	int ii, k;
+	for (ii=0, k=0; ii<sel->n_words; ii++)
+	{
+		memcpy(&w, src + (size_t)ii*sizeof(uint64_t), sizeof(uint64_t));
+		sg_put_bits(&dst, &acc, &n_acc, _pext_u64(w, sel->mask[k]), sel->n_bits[k]);
+		if (++k == sel->period)
+		{
+			k = 0;
+		}
+	}
+}
+#endif
+
+/*
+ * Select the kernel for this CPU.
+ */
+static void sg_select_init(void)
+{
+	sg_select.kernel = sg_select_sw;
+	#if defined(__x86_64__)
+		if (__builtin_cpu_supports("bmi2"))
+		{
+			sg_select.kernel = sg_select_bmi2;
+		}
+	#endif
+}
+
+/*
+ * Prepare the masks and header of a channel selection.
+ * Arguments:
+ *   SGSelect *sel -- Receives the selection; out is left unset.
+ *   const uint32_t *frame -- VDIF frame giving the format.
+ *   const int *chan_list -- Channels to keep, in ascending order.
+ *   int n_sel -- Number of channels in chan_list, a power of two.
+ * Returns:
+ *   int -- 0 on success, -1 if the selection cannot be applied.
+ * Notes:
+ *   Sample times are powers of two bits wide, so below 64 bits each 
+ *     payload word holds whole sample times and above it each sample
+ *     time spans whole words; either way the masks repeat every 
+ *     period words and no channel field straddles two words.
+ */
+int setup_sg_channel_select(SGSelect *sel, const uint32_t *frame, const int *chan_list, int n_sel)
+{
+	SGSampleInfo info;
+	int slot_bits, step_bits, payload_bytes, out_payload;
+	long out_bits;
+	int ii, ibit, bit;
+	uint64_t slot_mask;
+	if (decode_sg_sample_format(frame, &info, sel->format_words) != 0)
+	{
+		return -1;
+	}
+	if (n_sel <= 0 || n_sel > info.n_chan || (n_sel & (n_sel - 1)) != 0)
+	{
+		fprintf(stderr,"Cannot keep %d of %d channels, need a power of two.\n",n_sel,info.n_chan);
+		return -1;
+	}
+	for (ii=0; ii<n_sel; ii++)
+	{
+		if (chan_list[ii] < 0 || chan_list[ii] >= info.n_chan || (ii > 0 && chan_list[ii] <= chan_list[ii-1]))
+		{
+			fprintf(stderr,"Channel list must ascend within 0..%d.\n",info.n_chan-1);
+			return -1;
+		}
+	}
+	slot_bits = info.bits_per_sample*(1 + info.is_complex);
+	step_bits = slot_bits*info.n_chan;
+	sel->period = step_bits > 64 ? step_bits/64 : 1;
+	if (sel->period > SG_SELECT_MAX_PERIOD)
+	{
+		fprintf(stderr,"Too many channels to select from.\n");
+		return -1;
+	}
+	sel->header_size = VDIF_LEGACY(frame) ? 16 : 32;
+	payload_bytes = VDIF_DF_LEN_BYTES(frame) - sel->header_size;
+	out_bits = (long)info.samples_per_frame*slot_bits*n_sel;
+	if (out_bits % 64 != 0)
+	{
+		fprintf(stderr,"Narrowed payload of %ld bits is not a whole number of words.\n",out_bits);
+		return -1;
+	}
+	out_payload = out_bits/8;
+	sel->n_words = payload_bytes/8;
+	sel->out_size = sel->header_size + out_payload;
+	sel->word2 = (frame[2] & ~SG_FORMAT_MASK_W2) | ((uint32_t)__builtin_ctz(n_sel) << 24) | (uint32_t)(sel->out_size/8);
+	slot_mask = (1ull << slot_bits) - 1;
+	memset(sel->mask, 0, sizeof(sel->mask));
+	for (ii=0; ii<n_sel; ii++)
+	{
+		for (ibit=0; ibit<64*sel->period; ibit+=step_bits)
+		{
+			bit = ibit + chan_list[ii]*slot_bits;
+			sel->mask[bit/64] |= slot_mask << (bit%64);
+		}
+	}
+	for (ii=0; ii<sel->period; ii++)
+	{
+		sel->n_bits[ii] = __builtin_popcountll(sel->mask[ii]);
+	}
+	return 0;
+}
+
+/*
+ * Narrow frames into the output of a channel read.
+ * Arguments:
+ *   SGSelect *sel -- Output and selection.
+ *   const uint32_t *frames -- Frames to narrow.
+ *   int n_frames -- Number of frames.
+ *   int pkt_size -- Frame size in bytes.
+ *   int first_frame -- Index of frames[0] in the output.
+ * Returns:
+ *   int -- 0 on success, -1 if a frame differs in format.
+ */
+int select_sg_frames(SGSelect *sel, const uint32_t *frames, int n_frames, int pkt_size, int first_frame)
+{
+	int stride = pkt_size/sizeof(uint32_t);
+	int out_stride = sel->out_size/sizeof(uint32_t);
+	uint32_t *dst = sel->out + (size_t)first_frame*out_stride;
+	const uint32_t *h;
+	int iframe;
+	for (iframe=0, h=frames; iframe<n_frames; iframe++, h+=stride, dst+=out_stride)
+	{
+		if ((h[0] & SG_FORMAT_MASK_W0) != sel->format_words[0] || (h[2] & SG_FORMAT_MASK_W2) != sel->format_words[1] ||
+			(h[3] & SG_FORMAT_MASK_W3) != sel->format_words[2])
+		{
+			fprintf(stderr,"Frame format changed, cannot select channels.\n");
+			return -1;
+		}
+		memcpy(dst, h, sel->header_size);
+		dst[2] = sel->word2;
+		sg_select.kernel((unsigned char *)dst + sel->header_size, (const unsigned char *)h + sel->header_size, sel);
+	}
+	return 0;
+}
+
+/*
+ * Get the size of the frames produced by a channel read.
+ * Arguments:
+ *   SGPlan *sgpln -- SGPlan instance created in read-mode.
+ *   const int *chan_list -- Channels to keep, in ascending order.
+ *   int n_sel -- Number of channels in chan_list.
+ * Returns:
+ *   int -- Size in bytes of each frame returned by 
+ *     read_next_block_vdif_channels, or -1 if the selection cannot be
+ *     applied to the frames of the plan.
+ */
+int get_sg_plan_channel_frame_size(SGPlan *sgpln, const int *chan_list, int n_sel)
+{
+	SGSelect sel;
+	uint32_t *start = NULL;
+	uint32_t *end = NULL;
+	int n_frames = 0;
+	if (sgpln->sgm != SCATGAT_MODE_READ || sgpln->n_sgprt <= 0)
+	{
+		fprintf(stderr,"No frames to select from in SGPlan.\n");
+		return -1;
+	}
+	start = get_sg_part_block(&(sgpln->sgprt[0]),0,&n_frames,&end);
+	if (start == NULL || n_frames <= 0)
+	{
+		fprintf(stderr,"No frames to select from in SGPlan.\n");
+		return -1;
+	}
+	if (setup_sg_channel_select(&sel, start, chan_list, n_sel) != 0)
+	{
+		return -1;
+	}
+	return sel.out_size;
+}
+
+/*
+ * Read the next block of VDIF frames, keeping only some channels.
+ * Arguments:
+ *   SGPlan *sgpln -- The SGPlan created for a given filename pattern.
+ *   uint32_t *vdif_buf -- Buffer to receive the narrowed VDIF frames,
+ *     packed at get_sg_plan_channel_frame_size bytes each.
+ *   int max_frames -- Capacity of vdif_buf in frames.
+ *   const int *chan_list -- Channels to keep, in ascending order.
+ *   int n_sel -- Number of channels in chan_list, a power of two.
+ * Returns:
+ *   int -- The number of VDIF frames written to the buffer, zero if no 
+ *     frames could be read, and -1 on error.
+ * Notes:
+ *   Frames are stitched as by read_next_block_vdif_frames_into and the
+ *     kept channels are extracted straight from the block buffers. 
+ *     Each output frame is a valid VDIF frame: the header is copied 
+ *     with the frame length and log2(channels) rewritten, and the 
+ *     payload holds the selected bit fields of every sample in stream
+ *     order, n_sel/n_chan of the input.
+ *   All frames must share the format of the first, and the narrowed 
+ *     payload must be a whole number of 8-byte words.
+ *   Bit fields are gathered with BMI2 bit extraction where the CPU 
+ *     allows, and copied run by run otherwise.
+ */
+int read_next_block_vdif_channels(SGPlan *sgpln, uint32_t *vdif_buf, int max_frames,
+							const int *chan_list, int n_sel)
+{
+	SGSelect sel;
+	uint32_t *start = NULL;
+	uint32_t *end = NULL;
+	int n_frames = 0;
+	if (sgpln->sgm != SCATGAT_MODE_READ || sgpln->n_sgprt <= 0)
+	{
+		fprintf(stderr,"Trying to read from non-read-mode SGPlan.\n");
+		return -1;
+	}
+	pthread_once(&(sg_select.once), sg_select_init);
+	start = get_sg_part_block(&(sgpln->sgprt[0]),0,&n_frames,&end);
+	if (start == NULL || n_frames <= 0)
+	{
+		return 0;
+	}
+	if (setup_sg_channel_select(&sel, start, chan_list, n_sel) != 0)
+	{
+		return -1;
+	}
+	sel.out = vdif_buf;
+	return gather_next_sg_blocks(sgpln, NULL, max_frames, NULL, &sel);
+}
+
+//////////////////////////////////////////////////////////////////////// SAMPLER STATISTICS
+/* Kernel adding the popcounts of the terms of n_words payload words to
+ * sums: per term, the low bits, the high bits and both set. */
+typedef void (*SGPopcountKernel)(uint64_t *sums, const unsigned char *src, size_t n_words, const SGStats *sgs);
+
+/* Kernel, set up once by sg_stats_init. */
+static struct {
+	pthread_once_t once;
+	SGPopcountKernel popcount;											// selected for this CPU
+} sg_stats = { .once = PTHREAD_ONCE_INIT };
+
+/*
+ * Popcount kernel body, compiled once per target.
+ */
+static inline __attribute__((always_inline)) void sg_popcount_terms(uint64_t *sums, const unsigned char *src, size_t n_words, const SGStats *sgs)
+{
+	SGStatsTerm terms[SG_STATS_MAX_TERMS*SG_STATS_MAX_POSITIONS/8];
+	uint64_t acc[3*SG_STATS_MAX_TERMS*SG_STATS_MAX_POSITIONS/8];
+	int n_terms = sgs->n_terms;
+	int period = sgs->period;
+	uint64_t w, lo, hi, mask;
+	size_t ii;
+	int k;
+	/* Sums are kept apart from the terms so they stay in registers */
+	memcpy(terms, sgs->terms, n_terms*sizeof(SGStatsTerm));
+	memset(acc, 0, 3*n_terms*sizeof(uint64_t));
+	if (n_terms == 1 && period == 1)
+	{
+		mask = terms[0].mask;
+		for (ii=0; ii<n_words; ii++)
+		{
+			memcpy(&w, src + ii*sizeof(uint64_t), sizeof(uint64_t));
+			acc[0] += __builtin_popcountll(w & mask);
+			acc[1] += __builtin_popcountll((w >> 1) & mask);
+			acc[2] += __builtin_popcountll(w & (w >> 1) & mask);
+		}
+	}
+	else
+	{
+		for (ii=0; ii<n_words; ii+=period)
+		{
+			for (k=0; k<n_terms; k++)
+			{
+				memcpy(&w, src + (ii + terms[k].word)*sizeof(uint64_t), sizeof(uint64_t));
+				lo = w & terms[k].mask;
+				hi = (w >> 1) & terms[k].mask;
+				acc[3*k] += __builtin_popcountll(lo);
+				acc[3*k + 1] += __builtin_popcountll(hi);
+				acc[3*k + 2] += __builtin_popcountll(lo & hi);
+			}
+		}
+	}
+	for (k=0; k<3*n_terms; k++)
+	{
+		sums[k] += acc[k];
+	}
+}
+
+static void sg_popcount_sw(uint64_t *sums, const unsigned char *src, size_t n_words, const SGStats *sgs)
+{
+	sg_popcount_terms(sums, src, n_words, sgs);
+}
+
+#if defined(__x86_64__)
+__attribute__((target("popcnt")))
+static void sg_popcount_hw(uint64_t *sums, const unsigned char *src, size_t n_words, const SGStats *sgs)
+{
+	sg_popcount_terms(sums, src, n_words, sgs);
+}
+#endif
+
+/*
+ * Select the kernel for this CPU.
+ */
+static void sg_stats_init(void)
+{
+	sg_stats.popcount = sg_popcount_sw;
+	#if defined(__x86_64__)
+		if (__builtin_cpu_supports("popcnt"))
+		{
+			sg_stats.popcount = sg_popcount_hw;
+		}
+	#endif
+}
+
+/*
+ * Count the frames of a block read into an SGPart.
+ * Arguments:
+ *   SGPart *sgprt -- SGPart with data_buf holding n_frames frames.
+ * Returns:
+ *   void
+ * Notes:
+ *   Called by the read worker of the part. Counts are kept per VDIF 
+ *     thread for the bin being counted and only decoded into states and
+ *     levels by flush_sg_stats, when the bin of a thread changes and at
+ *     the end of the block.
+ *   1- and 2-bit samples of a few channels per payload word are counted
+ *     with popcounts of the low bits, the high bits and both, masked 
+ *     per channel. Otherwise each byte of payload bumps one entry of a 
+ *     histogram per byte position within a sample time; positions 
+ *     repeat every sample time, so at least four are kept to give 
+ *     independent counters for short sample times.
+ */
+void tally_sg_part_stats(SGPart *sgprt)
+{
+	SGStats *sgs = sgprt->sgpln->stats;
+	SGStatsPart *ssp = &(sgs->parts[sgprt - sgprt->sgpln->sgprt]);
+	int stride = sgprt->sgi->pkt_size/sizeof(uint32_t);
+	int positions = sgs->positions;
+	size_t payload_bytes = sgs->payload_bytes;
+	uint64_t n_frames = 0;
+	uint64_t n_skipped = 0;
+	const uint32_t *h;
+	const uint8_t *src;
+	uint32_t *bc;
+	uint32_t secs;
+	int iframe, thread_id, bin, k;
+	size_t ii;
+	if (sgprt->data_buf == NULL)
+	{
+		return;
+	}
+	for (iframe=0, h=sgprt->data_buf; iframe<(int)sgprt->n_frames; iframe++, h+=stride)
+	{
+		secs = VDIF_SECS_INRE(h);
+		if (VDIF_INVALID(h) || (h[0] & SG_FORMAT_MASK_W0) != sgs->format_words[0] || 
+			(h[2] & SG_FORMAT_MASK_W2) != sgs->format_words[1] || (h[3] & SG_FORMAT_MASK_W3) != sgs->format_words[2] ||
+			secs < sgs->start_secs || secs - sgs->start_secs >= (uint32_t)(SG_STATS_MAX_BINS/sgs->bins_per_second))
+		{
+			n_skipped++;
+			continue;
+		}
+		thread_id = VDIF_THREAD_ID(h);
+		bin = (secs - sgs->start_secs)*sgs->bins_per_second + 
+			(int)((uint64_t)VDIF_DF_NUM_INSEC(h)*sgs->bins_per_second/sgs->frames_per_second);
+		if (ssp->bin[thread_id] != bin)
+		{
+			if (ssp->bin[thread_id] >= 0)
+			{
+				flush_sg_stats(sgs, ssp, thread_id, &(sgprt->sgpln->meta_sga));
+			}
+			else
+			{
+				if (ssp->byte_counts[thread_id] == NULL)
+				{
+					ssp->byte_counts[thread_id] = (uint32_t *)alloc_sg_meta(&(sgprt->sgpln->meta_sga), (size_t)positions*256*sizeof(uint32_t));
+					if (ssp->byte_counts[thread_id] == NULL)
+					{
+						n_skipped++;
+						continue;
+					}
+					memset(ssp->byte_counts[thread_id], 0, (size_t)positions*256*sizeof(uint32_t));
+				}
+				ssp->active[ssp->n_active++] = thread_id;
+			}
+			ssp->bin[thread_id] = bin;
+		}
+		bc = ssp->byte_counts[thread_id];
+		src = (const uint8_t *)h + sgs->header_size;
+		if (sgs->n_terms > 0)
+		{
+			sg_stats.popcount((uint64_t *)bc, src, payload_bytes/sizeof(uint64_t), sgs);
+			((uint64_t *)bc)[3*sgs->n_terms] += payload_bytes/sizeof(uint64_t)/sgs->period;
+			n_frames++;
+			continue;
+		}
+		for (ii=0; ii<payload_bytes; ii+=positions)
+		{
+			for (k=0; k<positions; k++)
+			{
+				bc[k*256 + src[ii + k]]++;
+			}
+		}
+		n_frames++;
+	}
+	/* Close the open bins, a block holds far fewer bytes than the 
+	 * 32-bit counters allow. */
+	for (k=0; k<ssp->n_active; k++)
+	{
+		flush_sg_stats(sgs, ssp, ssp->active[k], &(sgprt->sgpln->meta_sga));
+		ssp->bin[ssp->active[k]] = -1;
+	}
+	ssp->n_active = 0;
+	pthread_mutex_lock(&(sgs->lock));
+	sgs->n_frames += n_frames;
+	sgs->n_skipped += n_skipped;
+	pthread_mutex_unlock(&(sgs->lock));
+}
+
+/*
+ * Decode the byte histograms of one thread into its statistics.
+ * Arguments:
+ *   SGStats *sgs -- Statistics of the plan.
+ *   SGStatsPart *ssp -- Histograms of the calling read worker.
+ *   int thread_id -- VDIF thread ID with an open bin in ssp.
+ *   const SGAllocator *sga -- Allocator for the thread results.
+ * Returns:
+ *   void
+ * Notes:
+ *   The histograms are cleared. If memory for the results runs out, 
+ *     the counts are dropped and reported on stderr.
+ */
+void flush_sg_stats(SGStats *sgs, SGStatsPart *ssp, int thread_id, const SGAllocator *sga)
+{
+	uint32_t *bc = ssp->byte_counts[thread_id];
+	const uint64_t *sums = (const uint64_t *)bc;
+	uint64_t state_n[4];
+	int bin = ssp->bin[thread_id];
+	int n_chan = sgs->info.n_chan;
+	int bits = sgs->info.bits_per_sample;
+	int code_mask = (1 << bits) - 1;
+	SGStatsThread *st;
+	int n_bins;
+	double *power;
+	uint64_t *n_values;
+	int ipos, v, f, chan, code, k;
+	uint64_t n;
+	pthread_mutex_lock(&(sgs->lock));
+	st = sgs->threads[thread_id];
+	if (st == NULL)
+	{
+		st = (SGStatsThread *)alloc_sg_meta(sga, sizeof(SGStatsThread));
+		if (st == NULL || (st->counts = (uint64_t *)alloc_sg_meta(sga, ((size_t)n_chan << bits)*sizeof(uint64_t))) == NULL)
+		{
+			free_sg_mem(sga, st);
+			goto dropped;
+		}
+		memset(st->counts, 0, ((size_t)n_chan << bits)*sizeof(uint64_t));
+		st->n_bins = 0;
+		st->power = NULL;
+		st->n_values = NULL;
+		sgs->threads[thread_id] = st;
+		sgs->n_threads++;
+	}
+	if (bin >= st->n_bins)
+	{
+		n_bins = bin + 1 > 2*st->n_bins ? bin + 1 : 2*st->n_bins;
+		power = (double *)alloc_sg_meta(sga, (size_t)n_bins*n_chan*sizeof(double));
+		n_values = (uint64_t *)alloc_sg_meta(sga, (size_t)n_bins*n_chan*sizeof(uint64_t));
+		if (power == NULL || n_values == NULL)
+		{
+			free_sg_mem(sga, power);
+			free_sg_mem(sga, n_values);
+			goto dropped;
+		}
+		memset(power, 0, (size_t)n_bins*n_chan*sizeof(double));
+		memset(n_values, 0, (size_t)n_bins*n_chan*sizeof(uint64_t));
+		if (st->n_bins > 0)
+		{
+			memcpy(power, st->power, (size_t)st->n_bins*n_chan*sizeof(double));
+			memcpy(n_values, st->n_values, (size_t)st->n_bins*n_chan*sizeof(uint64_t));
+		}
+		free_sg_mem(sga, st->power);
+		free_sg_mem(sga, st->n_values);
+		st->power = power;
+		st->n_values = n_values;
+		st->n_bins = n_bins;
+	}
+	if (bin >= sgs->n_bins)
+	{
+		sgs->n_bins = bin + 1;
+	}
+	/* States from popcounts: both bits set, high only, low only, and the
+	 * rest of the samples in the masks. */
+	for (k=0; k<sgs->n_terms; k++)
+	{
+		chan = sgs->terms[k].chan;
+		n = sums[3*sgs->n_terms]*__builtin_popcountll(sgs->terms[k].mask);
+		if (bits == 1)
+		{
+			state_n[1] = sums[3*k];
+			state_n[0] = n - sums[3*k];
+		}
+		else
+		{
+			state_n[3] = sums[3*k + 2];
+			state_n[2] = sums[3*k + 1] - sums[3*k + 2];
+			state_n[1] = sums[3*k] - sums[3*k + 2];
+			state_n[0] = n - sums[3*k] - sums[3*k + 1] + sums[3*k + 2];
+		}
+		for (code=0; code<=code_mask; code++)
+		{
+			st->counts[((size_t)chan << bits) + code] += state_n[code];
+			st->power[(size_t)bin*n_chan + chan] += state_n[code]*sgs->level2[code];
+			st->n_values[(size_t)bin*n_chan + chan] += state_n[code];
+		}
+	}
+	for (ipos=0; sgs->n_terms == 0 && ipos<sgs->positions; ipos++)
+	{
+		for (v=0; v<256; v++)
+		{
+			n = bc[ipos*256 + v];
+			if (n == 0)
+			{
+				continue;
+			}
+			for (f=0; f<sgs->fields; f++)
+			{
+				chan = sgs->chan_of[ipos*8 + f];
+				code = (v >> (f*bits)) & code_mask;
+				st->counts[((size_t)chan << bits) + code] += n;
+				st->power[(size_t)bin*n_chan + chan] += n*sgs->level2[code];
+				st->n_values[(size_t)bin*n_chan + chan] += n;
+			}
+		}
+	}
+	pthread_mutex_unlock(&(sgs->lock));
+	memset(bc, 0, (size_t)sgs->positions*256*sizeof(uint32_t));
+	return;
+dropped:
+	pthread_mutex_unlock(&(sgs->lock));
+	fprintf(stderr,"Unable to allocate statistics, counts of thread %d dropped.\n",thread_id);
+	memset(bc, 0, (size_t)sgs->positions*256*sizeof(uint32_t));
+}
+
+/*
+ * Release the sampler statistics of a plan.
+ * Arguments:
+ *   SGPlan *sgpln -- SGPlan instance, stats is reset to NULL.
+ * Returns:
+ *   void
+ */
+void free_sg_stats(SGPlan *sgpln)
+{
+	SGStats *sgs = sgpln->stats;
+	int ii, jj;
+	if (sgs == NULL)
+	{
+		return;
+	}
+	for (ii=0; ii<SG_MAX_VDIF_THREADS; ii++)
+	{
+		for (jj=0; jj<sgpln->n_sgprt; jj++)
+		{
+			free_sg_mem(&(sgpln->meta_sga), sgs->parts[jj].byte_counts[ii]);
+		}
+		if (sgs->threads[ii] != NULL)
+		{
+			free_sg_mem(&(sgpln->meta_sga), sgs->threads[ii]->counts);
+			free_sg_mem(&(sgpln->meta_sga), sgs->threads[ii]->power);
+			free_sg_mem(&(sgpln->meta_sga), sgs->threads[ii]->n_values);
+			free_sg_mem(&(sgpln->meta_sga), sgs->threads[ii]);
+		}
+	}
+	pthread_mutex_destroy(&(sgs->lock));
+	free_sg_mem(&(sgpln->meta_sga), sgs->parts);
+	free_sg_mem(&(sgpln->meta_sga), sgs);
+	sgpln->stats = NULL;
+}
+
+/*
+ * Collect sampler statistics of the blocks read by a plan.
+ * Arguments:
+ *   SGPlan *sgpln -- SGPlan instance created in read-mode.
+ *   int frames_per_second -- VDIF frames per second of each thread, or
+ *     0 to disable the statistics.
+ *   int bins_per_second -- Time bins per second for the power series.
+ * Returns:
+ *   int -- 0 on success, -1 on error.
+ * Notes:
+ *   The read workers count the sample states of every frame they copy,
+ *     per VDIF thread and channel, and sum the squared sample levels 
+ *     (as returned by read_next_block_vdif_samples) per time bin, while
+ *     the block is still in cache. Any read call collects them, also 
+ *     blocks read again after a seek. Calling again resets them.
+ *   The format is taken from the first frame of the plan and bin 0 
+ *     starts at the earliest second of its files. Invalid frames, 
+ *     frames of another format and frames outside the bins are 
+ *     skipped and counted. Payloads that do not hold a whole number of
+ *     sample times (or of 64-bit word periods) are rejected.
+ *   Set before reading, not while asynchronous reads are queued.
+ */
+int set_sg_plan_stats(SGPlan *sgpln, int frames_per_second, int bins_per_second)
+{
+	SGStats *sgs;
+	uint32_t *start = NULL;
+	uint32_t *end = NULL;
+	int n_frames = 0;
+	int slot_bits, step_bits, step_bytes;
+	int ii, jj, bit;
+	if (sgpln->sgm != SCATGAT_MODE_READ || sgpln->n_sgprt <= 0)
+	{
+		fprintf(stderr,"Statistics need a read-mode SGPlan.\n");
+		return -1;
+	}
+	free_sg_stats(sgpln);
+	if (frames_per_second <= 0)
+	{
+		return 0;
+	}
+	if (bins_per_second <= 0 || bins_per_second > frames_per_second)
+	{
+		fprintf(stderr,"Invalid statistics bins, %d per second.\n",bins_per_second);
+		return -1;
+	}
+	start = get_sg_part_block(&(sgpln->sgprt[0]),0,&n_frames,&end);
+	if (start == NULL || n_frames <= 0)
+	{
+		fprintf(stderr,"No frames to collect statistics of in SGPlan.\n");
+		return -1;
+	}
+	sgs = (SGStats *)alloc_sg_meta(&(sgpln->meta_sga), sizeof(SGStats));
+	if (sgs == NULL)
+	{
+		perror("Unable to allocate statistics.");
+		return -1;
+	}
+	memset(sgs, 0, sizeof(SGStats));
+	if (decode_sg_sample_format(start, &(sgs->info), sgs->format_words) != 0)
+	{
+		free_sg_mem(&(sgpln->meta_sga), sgs);
+		return -1;
+	}
+	slot_bits = sgs->info.bits_per_sample*(1 + sgs->info.is_complex);
+	step_bits = slot_bits*sgs->info.n_chan;
+	step_bytes = step_bits/8;
+	sgs->positions = step_bytes > 4 ? step_bytes : 4;
+	if (sgs->positions > SG_STATS_MAX_POSITIONS)
+	{
+		fprintf(stderr,"Too many channels to collect statistics of.\n");
+		free_sg_mem(&(sgpln->meta_sga), sgs);
+		return -1;
+	}
+	sgs->fields = 8/sgs->info.bits_per_sample;
+	for (ii=0; ii<sgs->positions; ii++)
+	{
+		for (jj=0; jj<sgs->fields; jj++)
+		{
+			bit = (ii*8 + jj*sgs->info.bits_per_sample) % step_bits;
+			sgs->chan_of[ii*8 + jj] = bit/slot_bits;
+		}
+	}
+	/* Popcount terms, one per channel present in each payload word */
+	sgs->period = step_bits > 64 ? step_bits/64 : 1;
+	sgs->n_terms = 0;
+	for (ii=0; sgs->info.bits_per_sample <= 2 && ii<64*sgs->period; ii+=sgs->info.bits_per_sample)
+	{
+		jj = sgs->n_terms - 1;
+		if (jj < 0 || sgs->terms[jj].word != ii/64 || sgs->terms[jj].chan != (ii % step_bits)/slot_bits)
+		{
+			/* Channels repeat within a word shorter than a sample time */
+			for (jj=0; jj<sgs->n_terms; jj++)
+			{
+				if (sgs->terms[jj].word == ii/64 && sgs->terms[jj].chan == (ii % step_bits)/slot_bits)
+				{
+					break;
+				}
+			}
+			if (jj == sgs->n_terms)
+			{
+				if (sgs->n_terms == SG_STATS_MAX_TERMS*sgs->period)
+				{
+					sgs->n_terms = 0;
+					break;
+				}
+				sgs->terms[jj].word = ii/64;
+				sgs->terms[jj].chan = (ii % step_bits)/slot_bits;
+				sgs->terms[jj].mask = 0;
+				sgs->n_terms++;
+			}
+		}
+		sgs->terms[jj].mask |= 1ull << (ii % 64);
+	}
+	for (ii=0; ii<(1 << sgs->info.bits_per_sample); ii++)
+	{
+		sgs->level2[ii] = (double)sg_sample_level(ii, sgs->info.bits_per_sample)*sg_sample_level(ii, sgs->info.bits_per_sample);
+	}
+	sgs->header_size = VDIF_LEGACY(start) ? 16 : 32;
+	sgs->payload_bytes = (size_t)VDIF_DF_LEN_BYTES(start) - sgs->header_size;
+	/* The counting loops step over whole sample times or word periods */
+	if ((sgs->n_terms > 0 && sgs->payload_bytes % ((size_t)sgs->period*sizeof(uint64_t)) != 0) || 
+		(sgs->n_terms == 0 && sgs->payload_bytes % (size_t)sgs->positions != 0))
+	{
+		fprintf(stderr,"Payload of %ld bytes does not hold whole sample times.\n",(long)sgs->payload_bytes);
+		free_sg_mem(&(sgpln->meta_sga), sgs);
+		return -1;
+	}
+	sgs->frames_per_second = frames_per_second;
+	sgs->bins_per_second = bins_per_second;
+	sgs->start_secs = sgpln->sgprt[0].sgi->first_secs;
+	for (ii=1; ii<sgpln->n_sgprt; ii++)
+	{
+		if (sgpln->sgprt[ii].sgi->first_secs < sgs->start_secs)
+		{
+			sgs->start_secs = sgpln->sgprt[ii].sgi->first_secs;
+		}
+	}
+	sgs->parts = (SGStatsPart *)alloc_sg_meta(&(sgpln->meta_sga), (size_t)sgpln->n_sgprt*sizeof(SGStatsPart));
+	if (sgs->parts == NULL)
+	{
+		perror("Unable to allocate statistics.");
+		free_sg_mem(&(sgpln->meta_sga), sgs);
+		return -1;
+	}
+	memset(sgs->parts, 0, (size_t)sgpln->n_sgprt*sizeof(SGStatsPart));
+	for (ii=0; ii<sgpln->n_sgprt; ii++)
+	{
+		for (jj=0; jj<SG_MAX_VDIF_THREADS; jj++)
+		{
+			sgs->parts[ii].bin[jj] = -1;
+		}
+	}
+	pthread_once(&(sg_stats.once), sg_stats_init);
+	pthread_mutex_init(&(sgs->lock), NULL);
+	sgpln->stats = sgs;
+	return 0;
+}
+
+/*
+ * Get the summary of the sampler statistics of a plan.
+ * Arguments:
+ *   SGPlan *sgpln -- SGPlan instance with statistics enabled.
+ *   SGStatsInfo *info -- Receives the summary.
+ *   int *thread_ids -- Receives the IDs of the VDIF threads seen in 
+ *     ascending order, may be NULL.
+ *   int max_threads -- Capacity of thread_ids.
+ * Returns:
+ *   int -- 0 on success, -1 if statistics are not enabled.
+ */
+int get_sg_plan_stats_info(SGPlan *sgpln, SGStatsInfo *info, int *thread_ids, int max_threads)
+{
+	SGStats *sgs = sgpln->stats;
+	int ii, n = 0;
+	if (sgs == NULL)
+	{
+		fprintf(stderr,"Statistics are not enabled for SGPlan.\n");
+		return -1;
+	}
+	pthread_mutex_lock(&(sgs->lock));
+	info->n_chan = sgs->info.n_chan;
+	info->bits_per_sample = sgs->info.bits_per_sample;
+	info->is_complex = sgs->info.is_complex;
+	info->n_threads = sgs->n_threads;
+	info->n_bins = sgs->n_bins;
+	info->start_secs = sgs->start_secs;
+	info->bins_per_second = sgs->bins_per_second;
+	info->n_frames = sgs->n_frames;
+	info->n_skipped = sgs->n_skipped;
+	for (ii=0; thread_ids != NULL && ii<SG_MAX_VDIF_THREADS && n<max_threads; ii++)
+	{
+		if (sgs->threads[ii] != NULL)
+		{
+			thread_ids[n++] = ii;
+		}
+	}
+	pthread_mutex_unlock(&(sgs->lock));
+	return 0;
+}
+
+/*
+ * Get the sampler statistics of one VDIF thread.
+ * Arguments:
+ *   SGPlan *sgpln -- SGPlan instance with statistics enabled.
+ *   int thread_id -- VDIF thread ID.
+ *   uint64_t *counts -- Receives n_chan histograms of 
+ *     1 << bits_per_sample state counts, channel c starting at 
+ *     c << bits_per_sample, may be NULL.
+ *   double *power -- Receives the mean squared sample level per bin and
+ *     channel at power[bin*n_chan + c], 0 for empty bins, may be NULL.
+ *   int max_bins -- Capacity of power in bins.
+ * Returns:
+ *   int -- The number of bins written to power, or -1 if the thread 
+ *     was not seen.
+ */
+int get_sg_plan_thread_stats(SGPlan *sgpln, int thread_id, uint64_t *counts, double *power, int max_bins)
+{
+	SGStats *sgs = sgpln->stats;
+	SGStatsThread *st;
+	int n_chan, n_bins, ii;
+	if (sgs == NULL || thread_id < 0 || thread_id >= SG_MAX_VDIF_THREADS)
+	{
+		return -1;
+	}
+	pthread_mutex_lock(&(sgs->lock));
+	st = sgs->threads[thread_id];
+	if (st == NULL)
+	{
+		pthread_mutex_unlock(&(sgs->lock));
+		return -1;
+	}
+	n_chan = sgs->info.n_chan;
+	n_bins = sgs->n_bins < max_bins ? sgs->n_bins : max_bins;
+	if (counts != NULL)
+	{
+		memcpy(counts, st->counts, ((size_t)n_chan << sgs->info.bits_per_sample)*sizeof(uint64_t));
+	}
+	for (ii=0; power != NULL && ii<n_bins*n_chan; ii++)
+	{
+		power[ii] = ii < st->n_bins*n_chan && st->n_values[ii] > 0 ? st->power[ii]/st->n_values[ii] : 0;
+	}
+	pthread_mutex_unlock(&(sgs->lock));
+	return power != NULL ? n_bins : 0;
+}
+
+//////////////////////////////////////////////////////////////////////// QUICK-LOOK SPECTRA
+/* Kernel running the butterfly stages of an n-point FFT in place on 
+ * points already in bit-reversed order. */
+typedef void (*SGFftKernel)(float *re, float *im, const float *tw_re, const float *tw_im, int n);
+
+/* Kernel, set up once by sg_fft_init. */
+static struct {
+	pthread_once_t once;
+	SGFftKernel stages;													// selected for this CPU
+} sg_fft = { .once = PTHREAD_ONCE_INIT };
+
+/*
+ * One radix-2 stage, butterflies of span 2*half.
+ */
+static inline __attribute__((always_inline)) void sg_fft_stage(float *re, float *im, 
+	const float *tw_re, const float *tw_im, int n, int half)
+{
+	float wr, wi, tr, ti;
+	int ii, jj;
+	for (ii=0; ii<n; ii+=2*half)
+	{
+		for (jj=0; jj<half; jj++)
+		{
+			wr = tw_re[half + jj];
+			wi = tw_im[half + jj];
+			tr = re[ii + jj + half]*wr - im[ii + jj + half]*wi;
+			ti = re[ii + jj + half]*wi + im[ii + jj + half]*wr;
+			re[ii + jj + half] = re[ii + jj] - tr;
+			im[ii + jj + half] = im[ii + jj] - ti;
+			re[ii + jj] += tr;
+			im[ii + jj] += ti;
+		}
+	}
+}
+
+/*
+ * Portable FFT kernel.
+ */
+static void sg_fft_sw(float *re, float *im, const float *tw_re, const float *tw_im, int n)
+{
+	int half;
+	for (half=1; half<n; half*=2)
+	{
+		sg_fft_stage(re, im, tw_re, tw_im, n, half);
+	}
+}
+
+#if defined(__x86_64__)
+/*
+ * AVX2 FFT kernel. Real and imaginary parts are kept apart, so stages 
+ * of half 8 and more run eight butterflies per instruction on 
+ * contiguous points and twiddles; the first three stages are scalar.
+ */
+__attribute__((target("avx2")))
+static void sg_fft_avx2(float *re, float *im, const float *tw_re, const float *tw_im, int n)
+{
+	__m256 ar, ai, br, bi, wr, wi, tr, ti;
+	int half, ii, jj;
+	for (half=1; half<n && half<8; half*=2)
+	{
+		sg_fft_stage(re, im, tw_re, tw_im, n, half);
+	}
+	for (; half<n; half*=2)
+	{
+		for (ii=0; ii<n; ii+=2*half)
+		{
+			for (jj=0; jj<half; jj+=8)
+			{
+				wr = _mm256_loadu_ps(tw_re + half + jj);
+				wi = _mm256_loadu_ps(tw_im + half + jj);
+				ar = _mm256_loadu_ps(re + ii + jj);
+				ai = _mm256_loadu_ps(im + ii + jj);
+				br = _mm256_loadu_ps(re + ii + jj + half);
+				bi = _mm256_loadu_ps(im + ii + jj + half);
+				tr = _mm256_sub_ps(_mm256_mul_ps(br, wr), _mm256_mul_ps(bi, wi));
+				ti = _mm256_add_ps(_mm256_mul_ps(br, wi), _mm256_mul_ps(bi, wr));
+				_mm256_storeu_ps(re + ii + jj + half, _mm256_sub_ps(ar, tr));
+				_mm256_storeu_ps(im + ii + jj + half, _mm256_sub_ps(ai, ti));
+				_mm256_storeu_ps(re + ii + jj, _mm256_add_ps(ar, tr));
+				_mm256_storeu_ps(im + ii + jj, _mm256_add_ps(ai, ti));
+			}
+		}
+	}
+}
+#endif
+
+/*
+ * Select the kernel for this CPU.
+ */
+static void sg_fft_init(void)
+{
+	sg_fft.stages = sg_fft_sw;
+	#if defined(__x86_64__)
+		if (__builtin_cpu_supports("avx2"))
+		{
+			sg_fft.stages = sg_fft_avx2;
+		}
+	#endif
+}
+
+/*
+ * Set up a quick-look spectrometer for the format of its first frame.
+ * Arguments:
+ *   SGQuickLook *qlk -- Spectrometer, with its lock held.
+ *   const uint32_t *frame -- First frame kept.
+ *   int frame_size -- Frame size in bytes.
+ * Returns:
+ *   int -- 0 on success, -1 if the frames cannot be transformed or 
+ *     memory runs out; what was allocated is released by 
+ *     free_sg_quicklook.
+ */
+int setup_sg_quicklook_format(SGQuickLook *qlk, const uint32_t *frame, int frame_size)
+{
+	int n = qlk->cfg.fft_size;
+	int log2_n = __builtin_ctz(n);
+	size_t n_values;
+	int ii, bit, half;
+	if (decode_sg_sample_format(frame, &(qlk->info), qlk->format_words) != 0)
+	{
+		return -1;
+	}
+	if (qlk->info.samples_per_frame < n)
+	{
+		fprintf(stderr,"FFT of %d points is longer than the %d samples of a frame.\n",n,qlk->info.samples_per_frame);
+		return -1;
+	}
+	qlk->header_size = VDIF_LEGACY(frame) ? 16 : 32;
+	qlk->frame_size = frame_size;
+	qlk->n_bins = qlk->info.is_complex ? n : n/2;
+	qlk->first_secs = VDIF_SECS_INRE(frame);
+	n_values = (size_t)qlk->info.n_chan*qlk->n_bins;
+	qlk->slots = (uint32_t *)alloc_sg_data(&(qlk->data_sga), (size_t)qlk->cfg.queue_frames*frame_size);
+	qlk->free_slots = (int *)alloc_sg_meta(&(qlk->meta_sga), qlk->cfg.queue_frames*sizeof(int));
+	qlk->ready = (int *)alloc_sg_meta(&(qlk->meta_sga), qlk->cfg.queue_frames*sizeof(int));
+	qlk->tw_re = (float *)alloc_sg_meta(&(qlk->meta_sga), n*sizeof(float));
+	qlk->tw_im = (float *)alloc_sg_meta(&(qlk->meta_sga), n*sizeof(float));
+	qlk->bitrev = (int *)alloc_sg_meta(&(qlk->meta_sga), n*sizeof(int));
+	qlk->results = (SGQuickLookAcc *)alloc_sg_meta(&(qlk->meta_sga), qlk->cfg.max_results*sizeof(SGQuickLookAcc));
+	if (qlk->slots == NULL || qlk->free_slots == NULL || qlk->ready == NULL || qlk->tw_re == NULL || 
+		qlk->tw_im == NULL || qlk->bitrev == NULL || qlk->results == NULL)
+	{
+		perror("Unable to allocate quick-look buffers.");
+		return -1;
+	}
+	memset(qlk->results, 0, qlk->cfg.max_results*sizeof(SGQuickLookAcc));
+	for (ii=0; ii<qlk->cfg.max_results + SG_QL_OPEN; ii++)
+	{
+		SGQuickLookAcc *acc = ii < SG_QL_OPEN ? &(qlk->open[ii]) : &(qlk->results[ii - SG_QL_OPEN]);
+		acc->index = -1;
+		acc->power = (double *)alloc_sg_meta(&(qlk->meta_sga), n_values*sizeof(double));
+		if (acc->power == NULL)
+		{
+			perror("Unable to allocate quick-look buffers.");
+			return -1;
+		}
+		memset(acc->power, 0, n_values*sizeof(double));
+	}
+	for (ii=0; ii<qlk->cfg.queue_frames; ii++)
+	{
+		qlk->free_slots[ii] = ii;
+	}
+	qlk->n_free = qlk->cfg.queue_frames;
+	for (ii=0; ii<n; ii++)
+	{
+		qlk->bitrev[ii] = 0;
+		for (bit=0; bit<log2_n; bit++)
+		{
+			qlk->bitrev[ii] |= ((ii >> bit) & 1) << (log2_n - 1 - bit);
+		}
+	}
+	/* Twiddles of each stage, exp(-i*pi*j/half) at [half + j] */
+	qlk->tw_re[0] = 1;
+	qlk->tw_im[0] = 0;
+	for (half=1; half<n; half*=2)
+	{
+		for (ii=0; ii<half; ii++)
+		{
+			qlk->tw_re[half + ii] = (float)cos(M_PI*ii/half);
+			qlk->tw_im[half + ii] = (float)-sin(M_PI*ii/half);
+		}
+	}
+	return 0;
+}
+
+/*
+ * Allocate the buffers of a quick-look worker.
+ * Arguments:
+ *   SGQuickLook *qlk -- Spectrometer, format set.
+ *   SGQuickLookWork *work -- Receives the buffers.
+ * Returns:
+ *   int -- 0 on success, -1 if memory runs out.
+ */
+int alloc_sg_quicklook_work(SGQuickLook *qlk, SGQuickLookWork *work)
+{
+	size_t n_values = (size_t)qlk->info.samples_per_frame*qlk->info.n_chan*(1 + qlk->info.is_complex);
+	work->scratch = (int8_t *)alloc_sg_data(&(qlk->data_sga), n_values + 32);
+	work->samples = (float *)alloc_sg_data(&(qlk->data_sga), n_values*sizeof(float));
+	work->re = (float *)alloc_sg_data(&(qlk->data_sga), qlk->cfg.fft_size*sizeof(float));
+	work->im = (float *)alloc_sg_data(&(qlk->data_sga), qlk->cfg.fft_size*sizeof(float));
+	work->power = (float *)alloc_sg_data(&(qlk->data_sga), (size_t)qlk->info.n_chan*qlk->n_bins*sizeof(float));
+	if (work->scratch == NULL || work->samples == NULL || work->re == NULL || work->im == NULL || work->power == NULL)
+	{
+		perror("Unable to allocate quick-look buffers.");
+		free_sg_quicklook_work(qlk, work);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Free the buffers of a quick-look worker.
+ * Arguments:
+ *   SGQuickLook *qlk -- Spectrometer.
+ *   SGQuickLookWork *work -- Buffers, reset to NULL.
+ * Returns:
+ *   void
+ */
+void free_sg_quicklook_work(SGQuickLook *qlk, SGQuickLookWork *work)
+{
+	free_sg_mem(&(qlk->data_sga), work->scratch);
+	free_sg_mem(&(qlk->data_sga), work->samples);
+	free_sg_mem(&(qlk->data_sga), work->re);
+	free_sg_mem(&(qlk->data_sga), work->im);
+	free_sg_mem(&(qlk->data_sga), work->power);
+	memset(work, 0, sizeof(SGQuickLookWork));
+}
+
+/*
+ * Get the integration interval of a frame.
+ * Arguments:
+ *   const SGQuickLook *qlk -- Spectrometer, format set.
+ *   const uint32_t *frame -- VDIF frame.
+ * Returns:
+ *   int64_t -- Interval number, negative before the first frame kept.
+ */
+int64_t get_sg_quicklook_interval(const SGQuickLook *qlk, const uint32_t *frame)
+{
+	double t = ((double)VDIF_SECS_INRE(frame) - qlk->first_secs) + 
+		(double)VDIF_DF_NUM_INSEC(frame)/qlk->cfg.frames_per_second;
+	return (int64_t)floor(t/qlk->cfg.interval);
+}
+
+/*
+ * Transform one frame into power spectra.
+ * Arguments:
+ *   SGQuickLook *qlk -- Spectrometer, format set.
+ *   SGQuickLookWork *work -- Buffers of the calling worker; power 
+ *     receives the summed |X|^2 of the frame per channel and bin.
+ *   const uint32_t *frame -- VDIF frame of the spectrometer format.
+ * Returns:
+ *   int -- The number of FFTs summed per channel.
+ * Notes:
+ *   Each channel is cut into samples_per_frame/fft_size segments. Real
+ *     segments are transformed two at a time as the real and imaginary 
+ *     parts of one complex FFT X, and separated with 
+ *     A[k] = (X[k] + X*[n-k])/2 and B[k] = (X[k] - X*[n-k])/2i.
+ */
+int transform_sg_quicklook_frame(SGQuickLook *qlk, SGQuickLookWork *work, const uint32_t *frame)
+{
+	int n = qlk->cfg.fft_size;
+	int n_chan = qlk->info.n_chan;
+	int n_comp = 1 + qlk->info.is_complex;
+	int spf = qlk->info.samples_per_frame;
+	int n_seg = spf/n;
+	int n_bins = qlk->n_bins;
+	size_t payload_bytes = (size_t)spf*n_chan*n_comp*qlk->info.bits_per_sample/8;
+	const int *bitrev = qlk->bitrev;
+	float *re = work->re;
+	float *im = work->im;
+	const float *a, *b;
+	float *pw;
+	float xr, xi;
+	int iseg, n_total, ichan, ii, k, k2;
+	sg_unpack.expand(work->scratch, (const uint8_t *)frame + qlk->header_size, payload_bytes, 
+		__builtin_ctz(qlk->info.bits_per_sample));
+	sg_deal_float(work->samples, (size_t)spf*n_comp, work->scratch, n_chan, n_comp, spf);
+	memset(work->power, 0, (size_t)n_chan*n_bins*sizeof(float));
+	if (qlk->info.is_complex)
+	{
+		for (ichan=0; ichan<n_chan; ichan++)
+		{
+			pw = work->power + (size_t)ichan*n_bins;
+			for (iseg=0; iseg<n_seg; iseg++)
+			{
+				a = work->samples + (size_t)ichan*spf*2 + (size_t)iseg*n*2;
+				for (ii=0; ii<n; ii++)
+				{
+					re[bitrev[ii]] = a[2*ii];
+					im[bitrev[ii]] = a[2*ii + 1];
+				}
+				sg_fft.stages(re, im, qlk->tw_re, qlk->tw_im, n);
+				/* Bins from -fs/2 */
+				for (k=0; k<n; k++)
+				{
+					pw[(k + n/2) & (n - 1)] += re[k]*re[k] + im[k]*im[k];
+				}
+			}
+		}
+		return n_seg;
+	}
+	n_total = n_chan*n_seg;
+	for (iseg=0; iseg<n_total; iseg+=2)
+	{
+		a = work->samples + (size_t)(iseg/n_seg)*spf + (size_t)(iseg%n_seg)*n;
+		b = iseg + 1 < n_total ? work->samples + (size_t)((iseg + 1)/n_seg)*spf + (size_t)((iseg + 1)%n_seg)*n : NULL;
+		for (ii=0; ii<n; ii++)
+		{
+			re[bitrev[ii]] = a[ii];
+			im[bitrev[ii]] = b != NULL ? b[ii] : 0;
+		}
+		sg_fft.stages(re, im, qlk->tw_re, qlk->tw_im, n);
+		pw = work->power + (size_t)(iseg/n_seg)*n_bins;
+		for (k=0; k<n/2; k++)
+		{
+			k2 = (n - k) & (n - 1);
+			xr = re[k] + re[k2];
+			xi = im[k] - im[k2];
+			pw[k] += 0.25f*(xr*xr + xi*xi);
+		}
+		if (b != NULL)
+		{
+			pw = work->power + (size_t)((iseg + 1)/n_seg)*n_bins;
+			for (k=0; k<n/2; k++)
+			{
+				k2 = (n - k) & (n - 1);
+				xr = re[k] - re[k2];
+				xi = im[k] + im[k2];
+				pw[k] += 0.25f*(xr*xr + xi*xi);
+			}
+		}
+	}
+	return n_seg;
+}
+
+/*
+ * Add the spectrum of one frame to its integration.
+ * Arguments:
+ *   SGQuickLook *qlk -- Spectrometer, with its lock held.
+ *   int64_t index -- Interval of the frame.
+ *   const float *power -- Summed |X|^2 of the frame.
+ *   int n_fft -- FFTs summed per channel.
+ * Returns:
+ *   void
+ * Notes:
+ *   A frame of a later interval than any before publishes the 
+ *     integrations that fall out of the SG_QL_OPEN open ones; frames of
+ *     those are late from then on.
+ */
+void integrate_sg_quicklook(SGQuickLook *qlk, int64_t index, const float *power, int n_fft)
+{
+	SGQuickLookAcc *acc;
+	size_t n_values = (size_t)qlk->info.n_chan*qlk->n_bins;
+	size_t ii;
+	if (index < 0 || index < qlk->max_index - (SG_QL_OPEN - 1))
+	{
+		qlk->stats.n_late++;
+		return;
+	}
+	if (index > qlk->max_index)
+	{
+		qlk->max_index = index;
+		publish_sg_quicklook_before(qlk, index - (SG_QL_OPEN - 1));
+	}
+	acc = &(qlk->open[index % SG_QL_OPEN]);
+	acc->index = index;
+	for (ii=0; ii<n_values; ii++)
+	{
+		acc->power[ii] += power[ii];
+	}
+	acc->n_frames++;
+	acc->n_fft += n_fft;
+}
+
+/*
+ * Publish the open integrations of earlier intervals.
+ * Arguments:
+ *   SGQuickLook *qlk -- Spectrometer, with its lock held.
+ *   int64_t limit -- Intervals before this are published, oldest 
+ *     first.
+ * Returns:
+ *   void
+ * Notes:
+ *   Published integrations trade buffers with the result they fill, so
+ *     nothing is copied. A full result queue drops its oldest spectrum.
+ */
+void publish_sg_quicklook_before(SGQuickLook *qlk, int64_t limit)
+{
+	SGQuickLookAcc *acc;
+	SGQuickLookAcc *res;
+	double *power;
+	int ii, first;
+	while (1)
+	{
+		first = -1;
+		for (ii=0; ii<SG_QL_OPEN; ii++)
+		{
+			if (qlk->open[ii].index >= 0 && qlk->open[ii].index < limit && 
+				(first < 0 || qlk->open[ii].index < qlk->open[first].index))
+			{
+				first = ii;
+			}
+		}
+		if (first < 0)
+		{
+			return;
+		}
+		acc = &(qlk->open[first]);
+		if (qlk->n_results == qlk->cfg.max_results)
+		{
+			qlk->results_head = (qlk->results_head + 1) % qlk->cfg.max_results;
+			qlk->n_results--;
+			qlk->stats.n_results_dropped++;
+		}
+		res = &(qlk->results[(qlk->results_head + qlk->n_results) % qlk->cfg.max_results]);
+		power = res->power;
+		*res = *acc;
+		acc->power = power;
+		memset(acc->power, 0, (size_t)qlk->info.n_chan*qlk->n_bins*sizeof(double));
+		acc->index = -1;
+		acc->n_frames = 0;
+		acc->n_fft = 0;
+		qlk->n_results++;
+	}
+}
+
+/*
+ * Create a quick-look spectrometer.
+ * Arguments:
+ *   SGQuickLook **qlk -- Address of SGQuickLook pointer to allocate 
+ *     memory.
+ *   const SGQuickLookConfig *cfg -- Settings.
+ * Returns:
+ *   int -- 0 on success, -1 on error.
+ * Notes:
+ *   Frames are offered with offer_sg_quicklook_frames, or by the read 
+ *     and write calls of plans it is attached to (attach_sg_quicklook).
+ *     Offering never waits: one frame in cfg.decimate of the analysed 
+ *     thread is copied to a free slot of the queue, and dropped if 
+ *     none is free, so the quick-look samples a full-rate stream 
+ *     instead of slowing it down.
+ *   cfg.n_workers threads unpack the queued frames, transform every 
+ *     channel in segments of cfg.fft_size samples, and integrate |X|^2 
+ *     over intervals of cfg.interval seconds of VDIF time. An interval
+ *     is published to the result queue once frames two intervals later
+ *     arrive, or by flush_sg_quicklook.
+ *   Real samples give fft_size/2 bins from 0, two segments sharing one
+ *     complex FFT; complex samples give fft_size bins from -fs/2.
+ *   The format is taken from the first frame kept; fft_size must not 
+ *     exceed the samples per channel of a frame.
+ */
+int make_sg_quicklook(SGQuickLook **qlk, const SGQuickLookConfig *cfg)
+{
+	SGAllocator meta_sga = sg_default_meta_sga;
+	int ii;
+	if (cfg->fft_size < 2 || cfg->fft_size > SG_QL_MAX_FFT || (cfg->fft_size & (cfg->fft_size - 1)) != 0 ||
+		cfg->interval <= 0 || cfg->frames_per_second <= 0 || cfg->decimate <= 0 || cfg->n_workers <= 0 || 
+		cfg->queue_frames <= 0 || cfg->max_results <= 0 || cfg->thread_id >= SG_MAX_VDIF_THREADS)
+	{
+		fprintf(stderr,"Invalid quick-look settings.\n");
+		return -1;
+	}
+	*qlk = (SGQuickLook *)alloc_sg_meta(&meta_sga, sizeof(SGQuickLook));
+	if (*qlk == NULL)
+	{
+		perror("Unable to allocate memory for SGQuickLook.");
+		return -1;
+	}
+	memset(*qlk, 0, sizeof(SGQuickLook));
+	(*qlk)->cfg = *cfg;
+	(*qlk)->meta_sga = meta_sga;
+	(*qlk)->data_sga = sg_default_data_sga;
+	(*qlk)->thread_id = cfg->thread_id;
+	(*qlk)->max_index = -1;
+	for (ii=0; ii<SG_QL_OPEN; ii++)
+	{
+		(*qlk)->open[ii].index = -1;
+	}
+	pthread_mutex_init(&((*qlk)->lock), NULL);
+	pthread_cond_init(&((*qlk)->work_cond), NULL);
+	pthread_cond_init(&((*qlk)->idle_cond), NULL);
+	pthread_once(&(sg_unpack.once), sg_unpack_init);
+	pthread_once(&(sg_fft.once), sg_fft_init);
+	(*qlk)->workers = (pthread_t *)alloc_sg_meta(&meta_sga, cfg->n_workers*sizeof(pthread_t));
+	if ((*qlk)->workers == NULL)
+	{
+		perror("Unable to allocate memory for SGQuickLook.");
+		free_sg_quicklook(*qlk);
+		*qlk = NULL;
+		return -1;
+	}
+	for (ii=0; ii<cfg->n_workers; ii++)
+	{
+		if (pthread_create(&((*qlk)->workers[ii]), NULL, &sgthread_quicklook, *qlk) != 0)
+		{
+			perror("Unable to create thread.");
+			exit(EXIT_FAILURE);
+		}
+	}
+	return 0;
+}
+
+/*
+ * Feed a quick-look spectrometer from a plan.
+ * Arguments:
+ *   SGPlan *sgpln -- SGPlan instance, read or write mode.
+ *   SGQuickLook *qlk -- Spectrometer, or NULL to detach.
+ * Returns:
+ *   int -- 0 on success.
+ * Notes:
+ *   Read plans offer the frames of every block returned, write plans 
+ *     the frames of every write_vdif_frames call, so a scan can be 
+ *     watched while it is recorded. Several plans may feed one 
+ *     spectrometer. Detach before freeing the spectrometer.
+ */
+int attach_sg_quicklook(SGPlan *sgpln, SGQuickLook *qlk)
+{
+	sgpln->qlk = qlk;
+	return 0;
+}
+
+/*
+ * Offer frames to a quick-look spectrometer.
+ * Arguments:
+ *   SGQuickLook *qlk -- Spectrometer created with make_sg_quicklook.
+ *   const uint32_t *frames -- VDIF frames.
+ *   int n_frames -- Number of frames.
+ *   int frame_size -- Frame size in bytes.
+ * Returns:
+ *   int -- The number of frames queued for the workers.
+ */
+int offer_sg_quicklook_frames(SGQuickLook *qlk, const uint32_t *frames, int n_frames, int frame_size)
+{
+	int stride = frame_size/sizeof(uint32_t);
+	const uint32_t *h;
+	int iframe, islot;
+	int n_queued = 0;
+	pthread_mutex_lock(&(qlk->lock));
+	for (iframe=0, h=frames; iframe<n_frames; iframe++, h+=stride)
+	{
+		if (qlk->thread_id < 0)
+		{
+			qlk->thread_id = VDIF_THREAD_ID(h);
+		}
+		if ((int)VDIF_THREAD_ID(h) != qlk->thread_id)
+		{
+			continue;
+		}
+		qlk->stats.n_offered++;
+		if (qlk->n_skip++ % qlk->cfg.decimate != 0)
+		{
+			continue;
+		}
+		if (qlk->format_state == 0)
+		{
+			qlk->format_state = setup_sg_quicklook_format(qlk, h, frame_size) == 0 ? 1 : -1;
+		}
+		if (qlk->format_state < 0 || frame_size != qlk->frame_size || VDIF_INVALID(h) || 
+			(h[0] & SG_FORMAT_MASK_W0) != qlk->format_words[0] || (h[2] & SG_FORMAT_MASK_W2) != qlk->format_words[1] ||
+			(h[3] & SG_FORMAT_MASK_W3) != qlk->format_words[2])
+		{
+			qlk->stats.n_skipped++;
+			continue;
+		}
+		if (qlk->n_free == 0)
+		{
+			qlk->stats.n_dropped++;
+			continue;
+		}
+		islot = qlk->free_slots[--qlk->n_free];
+		memcpy(qlk->slots + (size_t)islot*stride, h, frame_size);
+		qlk->ready[(qlk->ready_head + qlk->n_ready) % qlk->cfg.queue_frames] = islot;
+		qlk->n_ready++;
+		qlk->stats.n_queued++;
+		n_queued++;
+	}
+	if (n_queued > 0)
+	{
+		pthread_cond_broadcast(&(qlk->work_cond));
+	}
+	pthread_mutex_unlock(&(qlk->lock));
+	return n_queued;
+}
+
+/*
+ * Finish the frames queued and publish every open integration.
+ * Arguments:
+ *   SGQuickLook *qlk -- Spectrometer created with make_sg_quicklook.
+ * Returns:
+ *   void
+ * Notes:
+ *   Use at the end of a scan, later frames of the same intervals are 
+ *     counted as late.
+ */
+void flush_sg_quicklook(SGQuickLook *qlk)
+{
+	pthread_mutex_lock(&(qlk->lock));
+	while (qlk->n_ready > 0 || qlk->n_busy > 0)
+	{
+		pthread_cond_wait(&(qlk->idle_cond), &(qlk->lock));
+	}
+	if (qlk->format_state > 0)
+	{
+		publish_sg_quicklook_before(qlk, INT64_MAX);
+	}
+	pthread_mutex_unlock(&(qlk->lock));
+}
+
+/*
+ * Take the oldest integrated spectrum.
+ * Arguments:
+ *   SGQuickLook *qlk -- Spectrometer created with make_sg_quicklook.
+ *   float *spec -- Receives the mean |X[k]|^2/fft_size per FFT, channel 
+ *     c at spec[c*n_bins].
+ *   int max_values -- Capacity of spec.
+ *   SGSpectrumInfo *info -- Receives the layout and time of the 
+ *     spectrum, may be NULL.
+ * Returns:
+ *   int -- 1 if a spectrum was taken, 0 if none is ready, and -1 if 
+ *     spec cannot hold n_chan*n_bins values; the spectrum then stays 
+ *     queued and info gives its layout.
+ */
+int read_sg_quicklook_spectrum(SGQuickLook *qlk, float *spec, int max_values, SGSpectrumInfo *info)
+{
+	SGQuickLookAcc *res;
+	size_t n_values, ii;
+	double scale;
+	pthread_mutex_lock(&(qlk->lock));
+	if (qlk->n_results == 0)
+	{
+		pthread_mutex_unlock(&(qlk->lock));
+		return 0;
+	}
+	res = &(qlk->results[qlk->results_head]);
+	n_values = (size_t)qlk->info.n_chan*qlk->n_bins;
+	if (info != NULL)
+	{
+		info->n_chan = qlk->info.n_chan;
+		info->n_bins = qlk->n_bins;
+		info->is_complex = qlk->info.is_complex;
+		info->index = res->index;
+		info->start_time = qlk->first_secs + res->index*qlk->cfg.interval;
+		info->n_frames = res->n_frames;
+		info->n_fft = res->n_fft;
+	}
+	if ((size_t)max_values < n_values)
+	{
+		pthread_mutex_unlock(&(qlk->lock));
+		return -1;
+	}
+	scale = 1.0/((double)res->n_fft*qlk->cfg.fft_size);
+	for (ii=0; ii<n_values; ii++)
+	{
+		spec[ii] = res->power[ii]*scale;
+	}
+	qlk->results_head = (qlk->results_head + 1) % qlk->cfg.max_results;
+	qlk->n_results--;
+	pthread_mutex_unlock(&(qlk->lock));
+	return 1;
+}
+
+/*
+ * Get the frame counts of a quick-look spectrometer.
+ * Arguments:
+ *   SGQuickLook *qlk -- Spectrometer created with make_sg_quicklook.
+ *   SGQuickLookStats *stats -- Receives the counts.
+ * Returns:
+ *   void
+ */
+void get_sg_quicklook_stats(SGQuickLook *qlk, SGQuickLookStats *stats)
+{
+	pthread_mutex_lock(&(qlk->lock));
+	*stats = qlk->stats;
+	pthread_mutex_unlock(&(qlk->lock));
+}
+
+/*
+ * Stop a quick-look spectrometer and free it.
+ * Arguments:
+ *   SGQuickLook *qlk -- Spectrometer created with make_sg_quicklook, 
+ *     detached from all plans.
+ * Returns:
+ *   void
+ * Notes:
+ *   Frames still queued are discarded, flush first to keep them.
+ */
+void free_sg_quicklook(SGQuickLook *qlk)
+{
+	SGAllocator meta_sga;
+	int ii;
+	if (qlk == NULL)
+	{
+		return;
+	}
+	meta_sga = qlk->meta_sga;
+	pthread_mutex_lock(&(qlk->lock));
+	qlk->stop = 1;
+	pthread_cond_broadcast(&(qlk->work_cond));
+	pthread_mutex_unlock(&(qlk->lock));
+	for (ii=0; qlk->workers != NULL && ii<qlk->cfg.n_workers; ii++)
+	{
+		pthread_join(qlk->workers[ii], NULL);
+	}
+	for (ii=0; ii<SG_QL_OPEN; ii++)
+	{
+		free_sg_mem(&meta_sga, qlk->open[ii].power);
+	}
+	for (ii=0; qlk->results != NULL && ii<qlk->cfg.max_results; ii++)
+	{
+		free_sg_mem(&meta_sga, qlk->results[ii].power);
+	}
+	free_sg_mem(&(qlk->data_sga), qlk->slots);
+	free_sg_mem(&meta_sga, qlk->free_slots);
+	free_sg_mem(&meta_sga, qlk->ready);
+	free_sg_mem(&meta_sga, qlk->tw_re);
+	free_sg_mem(&meta_sga, qlk->tw_im);
+	free_sg_mem(&meta_sga, qlk->bitrev);
+	free_sg_mem(&meta_sga, qlk->results);
+	free_sg_mem(&meta_sga, qlk->workers);
+	pthread_cond_destroy(&(qlk->idle_cond));
+	pthread_cond_destroy(&(qlk->work_cond));
+	pthread_mutex_destroy(&(qlk->lock));
+	free_sg_mem(&meta_sga, qlk);
+}
+
+//////////////////////////////////////////////////////////////////////// FRAME HOOKS
+/*
+ * Append a hook to the chain of a plan.
+ * Arguments:
+ *   SGPlan *sgpln -- SGPlan instance created in read-mode.
+ *   sg_frame_hook frame_fn -- Frame hook, or NULL if block_fn is given.
+ *   sg_block_hook block_fn -- Block hook, or NULL if frame_fn is given.
+ *   void *user_data -- Passed through to the hook.
+ * Returns:
+ *   int -- 0 on success, -1 on error.
+ */
+int add_sg_plan_hook(SGPlan *sgpln, sg_frame_hook frame_fn, sg_block_hook block_fn, void *user_data)
+{
+	SGHooks *sgh = sgpln->hooks;
+	if (sgpln->sgm != SCATGAT_MODE_READ || (frame_fn == NULL && block_fn == NULL))
+	{
+		fprintf(stderr,"Hooks need a read-mode SGPlan and a function.\n");
+		return -1;
+	}
+	if (sgh == NULL)
+	{
+		sgh = (SGHooks *)alloc_sg_meta(&(sgpln->meta_sga), sizeof(SGHooks));
+		if (sgh == NULL)
+		{
+			perror("Unable to allocate hooks.");
+			return -1;
+		}
+		memset(sgh, 0, sizeof(SGHooks));
+		sgpln->hooks = sgh;
+	}
+	if (sgh->n_hooks == SG_MAX_HOOKS)
+	{
+		fprintf(stderr,"Too many hooks, at most %d.\n",SG_MAX_HOOKS);
+		return -1;
+	}
+	sgh->hook[sgh->n_hooks].frame_fn = frame_fn;
+	sgh->hook[sgh->n_hooks].block_fn = block_fn;
+	sgh->hook[sgh->n_hooks].user_data = user_data;
+	if (frame_fn != NULL && sgh->n_lead == sgh->n_hooks)
+	{
+		sgh->n_lead++;
+	}
+	sgh->n_hooks++;
+	return 0;
+}
+
+/*
+ * Run a run of frame hooks over frames.
+ * Arguments:
+ *   const SGHooks *sgh -- Hook chain.
+ *   int first -- Index of the first hook to run.
+ *   int last -- Index after the last hook to run, all frame hooks.
+ *   uint32_t *frames -- VDIF frames, kept frames are compacted in 
+ *     place.
+ *   int n_frames -- Number of frames.
+ *   int pkt_size -- Frame size in bytes.
+ * Returns:
+ *   int -- The number of frames kept.
+ * Notes:
+ *   Each frame goes through all hooks of the run before the next, and 
+ *     the first hook dropping it ends its run.
+ */
+int run_sg_frame_hooks(const SGHooks *sgh, int first, int last, uint32_t *frames, int n_frames, int pkt_size)
+{
+	int stride = pkt_size/sizeof(uint32_t);
+	uint32_t *frame = frames;
+	int n_kept = 0;
+	int iframe, ihook;
+	for (iframe=0; iframe<n_frames; iframe++, frame+=stride)
+	{
+		for (ihook=first; ihook<last; ihook++)
+		{
+			if (sgh->hook[ihook].frame_fn(frame, pkt_size, sgh->hook[ihook].user_data) != 0)
+			{
+				break;
+			}
+		}
+		if (ihook < last)
+		{
+			continue;
+		}
+		if (n_kept != iframe)
+		{
+			memcpy(frames + (size_t)n_kept*stride, frame, pkt_size);
+		}
+		n_kept++;
+	}
+	return n_kept;
+}
+
+/*
+ * Run the hooks of a chain over frames.
+ * Arguments:
+ *   const SGHooks *sgh -- Hook chain.
+ *   int first -- Index of the first hook to run, later ones follow.
+ *   uint32_t *frames -- VDIF frames, kept frames are compacted in 
+ *     place.
+ *   int n_frames -- Number of frames.
+ *   int pkt_size -- Frame size in bytes.
+ * Returns:
+ *   int -- The number of frames kept.
+ * Notes:
+ *   Consecutive frame hooks share one pass over the frames.
+ */
+int run_sg_hooks(const SGHooks *sgh, int first, uint32_t *frames, int n_frames, int pkt_size)
+{
+	int ihook = first;
+	int last, n_kept;
+	while (ihook < sgh->n_hooks && n_frames > 0)
+	{
+		if (sgh->hook[ihook].block_fn != NULL)
+		{
+			n_kept = sgh->hook[ihook].block_fn(frames, n_frames, pkt_size, sgh->hook[ihook].user_data);
+			n_frames = n_kept < 0 ? 0 : (n_kept < n_frames ? n_kept : n_frames);
+			ihook++;
+			continue;
+		}
+		for (last=ihook; last<sgh->n_hooks && sgh->hook[last].frame_fn != NULL; last++);
+		n_frames = run_sg_frame_hooks(sgh, ihook, last, frames, n_frames, pkt_size);
+		ihook = last;
+	}
+	return n_frames;
+}
+
+/*
+ * Copy a block into the buffer of a part, running the hooks of its 
+ * plan on the way.
+ * Arguments:
+ *   SGPart *sgprt -- Part with data_buf allocated for n_frames frames.
+ *   const uint32_t *src -- The frames as stored.
+ * Returns:
+ *   int -- The number of frames kept, compacted at the start of 
+ *     data_buf.
+ * Notes:
+ *   The leading frame hooks run on each chunk of SG_HOOK_CHUNK_BYTES 
+ *     as soon as it is copied, the remaining hooks once over the 
+ *     frames kept, so that no pass reads the block from memory again.
+ */
+int copy_sg_hooked_frames(SGPart *sgprt, const uint32_t *src)
+{
+	const SGHooks *sgh = sgprt->sgpln->hooks;
+	int pkt_size = sgprt->sgi->pkt_size;
+	int stride = pkt_size/sizeof(uint32_t);
+	int chunk = SG_HOOK_CHUNK_BYTES/pkt_size > 0 ? SG_HOOK_CHUNK_BYTES/pkt_size : 1;
+	uint32_t *dst;
+	int iframe, n_copy;
+	int n_kept = 0;
+	for (iframe=0; iframe<(int)sgprt->n_frames; iframe+=n_copy)
+	{
+		n_copy = (int)sgprt->n_frames - iframe < chunk ? (int)sgprt->n_frames - iframe : chunk;
+		dst = sgprt->data_buf + (size_t)n_kept*stride;
+		memcpy(dst, src + (size_t)iframe*stride, (size_t)n_copy*pkt_size);
+		n_kept += run_sg_frame_hooks(sgh, 0, sgh->n_lead, dst, n_copy, pkt_size);
+	}
+	return run_sg_hooks(sgh, sgh->n_lead, sgprt->data_buf, n_kept, pkt_size);
+}
+
+/*
+ * Add a per-frame hook to the chain run by the read workers.
+ * Arguments:
+ *   SGPlan *sgpln -- SGPlan instance created in read-mode.
+ *   sg_frame_hook fn -- Called with each frame of each block read, 
+ *     which it may modify in place. Returns nonzero to drop the frame.
+ *   void *user_data -- Passed through to fn.
+ * Returns:
+ *   int -- 0 on success, -1 on error.
+ * Notes:
+ *   Hooks run in the order added, in the worker thread of each SG file
+ *     while the block is still in cache, so that header rewrites and 
+ *     flagging cost no extra pass over the output. Frame hooks added 
+ *     before any block hook run during the copy from file, a chunk of
+ *     frames at a time; the others in one pass over the block after it.
+ *   The workers of a plan run concurrently, so hooks must be thread 
+ *     safe. Any read call runs them, also on blocks read again after a
+ *     seek or served from the block cache, which keeps the frames as 
+ *     stored.
+ *   Stitching uses the time stamps of the frames as stored. Hooks may 
+ *     rewrite any header field, but frames whose time is moved are 
+ *     returned where the original time would have placed them.
+ *   Add before reading, not while asynchronous reads are queued.
+ */
+int add_sg_plan_frame_hook(SGPlan *sgpln, sg_frame_hook fn, void *user_data)
+{
+	return add_sg_plan_hook(sgpln, fn, NULL, user_data);
+}
+
+/*
+ * Add a per-block hook to the chain run by the read workers.
+ * Arguments:
+ *   SGPlan *sgpln -- SGPlan instance created in read-mode.
+ *   sg_block_hook fn -- Called with the frames of each block read, 
+ *     after the hooks added before it. Returns the number of frames 
+ *     kept, moved to the start of the frames.
+ *   void *user_data -- Passed through to fn.
+ * Returns:
+ *   int -- 0 on success, -1 on error.
+ * Notes:
+ *   See add_sg_plan_frame_hook. A block hook is not called for blocks 
+ *     left without frames.
+ */
+int add_sg_plan_block_hook(SGPlan *sgpln, sg_block_hook fn, void *user_data)
+{
+	return add_sg_plan_hook(sgpln, NULL, fn, user_data);
+}
+
+/*
+ * Remove all hooks of a plan.
+ * Arguments:
+ *   SGPlan *sgpln -- SGPlan instance.
+ * Returns:
+ *   void
+ * Notes:
+ *   Not while asynchronous reads are queued.
+ */
+void clear_sg_plan_hooks(SGPlan *sgpln)
+{
+	free_sg_mem(&(sgpln->meta_sga), sgpln->hooks);
+	sgpln->hooks = NULL;
+}
+
+//////////////////////////////////////////////////////////////////////// BLOCK CHECKSUMS
+/* Kernel updating a raw (not inverted) CRC32C over n bytes of src, and 
+ * copying them to dst unless it is NULL. */
+typedef uint32_t (*SGCrc32cKernel)(uint32_t crc, unsigned char *dst, const unsigned char *src, size_t n);
+
+/* Tables and kernel, set up once by sg_crc32c_init. */
+static struct {
+	pthread_once_t once;
+	SGCrc32cKernel kernel;												// selected for this CPU
+	uint32_t table[8][256];												// slicing-by-8 tables
+	uint32_t stripe_shift[4][256];										// multiply by x^(8*SG_CRC32C_STRIPE)
+} sg_crc32c = { .once = PTHREAD_ONCE_INIT };
+
+/*
+ * Multiply two polynomials modulo the CRC32C polynomial, both 
+ * bit-reflected.
+ */
+static uint32_t sg_crc32c_multmodp(uint32_t a, uint32_t b)
+{
+	uint32_t m = 1u << 31;
+	uint32_t p = 0;
+	while (m != 0)
+	{
+		if (a & m)
 		{
-			perror("Unable to map file.");
+			p ^= b;
+		}
+		m >>= 1;
+		b = b & 1 ? (b >> 1) ^ SG_CRC32C_POLY : b >> 1;
+	}
+	return p;
+}
+
+/*
+ * Shift a raw CRC over SG_CRC32C_STRIPE zero bytes, i.e. multiply it by
+ * x^(8*SG_CRC32C_STRIPE). The operation is linear, so it is tabulated 
+ * per byte of the CRC.
+ */
+static inline uint32_t sg_crc32c_shift_stripe(uint32_t crc)
+{
+	return sg_crc32c.stripe_shift[0][crc & 0xff] ^ sg_crc32c.stripe_shift[1][(crc >> 8) & 0xff] ^
+			sg_crc32c.stripe_shift[2][(crc >> 16) & 0xff] ^ sg_crc32c.stripe_shift[3][crc >> 24];
+}
+
+/*
+ * Table-driven CRC32C kernel, eight bytes per step.
+ */
+static uint32_t sg_crc32c_sw(uint32_t crc, unsigned char *dst, const unsigned char *src, size_t n)
+{
+	uint64_t w;
+	for (; n >= 8; n -= 8, src += 8)
+	{
+		memcpy(&w, src, 8);
+		if (dst != NULL)
+		{
+			memcpy(dst, &w, 8);
+			dst += 8;
+		}
+		w ^= crc;
+		crc = sg_crc32c.table[7][w & 0xff] ^ sg_crc32c.table[6][(w >> 8) & 0xff] ^
+				sg_crc32c.table[5][(w >> 16) & 0xff] ^ sg_crc32c.table[4][(w >> 24) & 0xff] ^
+				sg_crc32c.table[3][(w >> 32) & 0xff] ^ sg_crc32c.table[2][(w >> 40) & 0xff] ^
+				sg_crc32c.table[1][(w >> 48) & 0xff] ^ sg_crc32c.table[0][w >> 56];
+	}
+	for (; n > 0; n--, src++)
+	{
+		if (dst != NULL)
+		{
+			*dst++ = *src;
+		}
+		crc = (crc >> 8) ^ sg_crc32c.table[0][(crc ^ *src) & 0xff];
+	}
+	return crc;
+}
+
+#if defined(__x86_64__)
+/*
+ * SSE4.2 CRC32C kernel. Runs of three stripes are checksummed as three 
+ * independent streams, the second and third starting from zero, and 
+ * combined by shifting: crc(A|B) = shift(crc(A), |B|) ^ crc0(B).
+ */
+__attribute__((target("sse4.2")))
+static uint32_t sg_crc32c_hw(uint32_t crc, unsigned char *dst, const unsigned char *src, size_t n)
+{
+	uint64_t crc0 = crc;
+	uint64_t crc1;
+	uint64_t crc2;
+	uint64_t w0, w1, w2;
+	size_t ii;
+	while (n >= 3*SG_CRC32C_STRIPE)
+	{
+		crc1 = 0;
+		crc2 = 0;
+		for (ii=0; ii<SG_CRC32C_STRIPE; ii+=8)
+		{
+			memcpy(&w0, src + ii, 8);
+			memcpy(&w1, src + SG_CRC32C_STRIPE + ii, 8);
+			memcpy(&w2, src + 2*SG_CRC32C_STRIPE + ii, 8);
+			crc0 = _mm_crc32_u64(crc0, w0);
+			crc1 = _mm_crc32_u64(crc1, w1);
+			crc2 = _mm_crc32_u64(crc2, w2);
+			if (dst != NULL)
+			{
+				memcpy(dst + ii, &w0, 8);
+				memcpy(dst + SG_CRC32C_STRIPE + ii, &w1, 8);
+				memcpy(dst + 2*SG_CRC32C_STRIPE + ii, &w2, 8);
+			}
+		}
+		crc0 = sg_crc32c_shift_stripe(crc0) ^ crc1;
+		crc0 = sg_crc32c_shift_stripe(crc0) ^ crc2;
+		src += 3*SG_CRC32C_STRIPE;
+		if (dst != NULL)
+		{
+			dst += 3*SG_CRC32C_STRIPE;
+		}
+		n -= 3*SG_CRC32C_STRIPE;
+	}
+	for (; n >= 8; n -= 8, src += 8)
+	{
+		memcpy(&w0, src, 8);
+		crc0 = _mm_crc32_u64(crc0, w0);
+		if (dst != NULL)
+		{
+			memcpy(dst, &w0, 8);
+			dst += 8;
+		}
+	}
+	for (; n > 0; n--, src++)
+	{
+		crc0 = _mm_crc32_u8(crc0, *src);
+		if (dst != NULL)
+		{
+			*dst++ = *src;
+		}
+	}
+	return crc0;
+}
+#endif
+
+/*
+ * Build the tables and select the kernel for this CPU.
+ */
+static void sg_crc32c_init(void)
+{
+	uint32_t crc;
+	uint32_t xpow = 1u << 31;											// x^0
+	uint32_t x2n = 1u << 30;											// x^1, squared below
+	size_t n;
+	int ii, jj;
+	for (ii=0; ii<256; ii++)
+	{
+		crc = ii;
+		for (jj=0; jj<8; jj++)
+		{
+			crc = crc & 1 ? (crc >> 1) ^ SG_CRC32C_POLY : crc >> 1;
+		}
+		sg_crc32c.table[0][ii] = crc;
+	}
+	for (ii=0; ii<256; ii++)
+	{
+		for (jj=1; jj<8; jj++)
+		{
+			crc = sg_crc32c.table[jj-1][ii];
+			sg_crc32c.table[jj][ii] = (crc >> 8) ^ sg_crc32c.table[0][crc & 0xff];
+		}
+	}
+	/* x^(8*SG_CRC32C_STRIPE) by square-and-multiply */
+	for (n=8*(size_t)SG_CRC32C_STRIPE; n>0; n>>=1)
+	{
+		if (n & 1)
+		{
+			xpow = sg_crc32c_multmodp(x2n, xpow);
+		}
+		x2n = sg_crc32c_multmodp(x2n, x2n);
+	}
+	for (ii=0; ii<4; ii++)
+	{
+		for (jj=0; jj<256; jj++)
+		{
+			sg_crc32c.stripe_shift[ii][jj] = sg_crc32c_multmodp(xpow, (uint32_t)jj << (8*ii));
+		}
+	}
+	sg_crc32c.kernel = sg_crc32c_sw;
+	#if defined(__x86_64__)
+		if (__builtin_cpu_supports("sse4.2"))
+		{
+			sg_crc32c.kernel = sg_crc32c_hw;
+		}
+	#endif
+}
+
+/*
+ * Copy a buffer while computing its CRC32C.
+ * Arguments:
+ *   uint32_t crc -- CRC of the preceding data, 0 to start.
+ *   void *dst -- Destination, or NULL to only compute the CRC.
+ *   const void *src -- Data.
+ *   size_t n -- Bytes in src.
+ * Returns:
+ *   uint32_t -- CRC of the preceding data followed by src.
+ * Notes:
+ *   Each word is checksummed while it is in a register on its way to 
+ *     dst, so the CRC costs no extra pass over memory.
+ */
+uint32_t copy_sg_crc32c(uint32_t crc, void *dst, const void *src, size_t n)
+{
+	pthread_once(&(sg_crc32c.once), sg_crc32c_init);
+	return ~sg_crc32c.kernel(~crc, (unsigned char *)dst, (const unsigned char *)src, n);
+}
+
+/*
+ * Compute a CRC32C (Castagnoli) checksum.
+ * Arguments:
+ *   uint32_t crc -- CRC of the preceding data, 0 to start.
+ *   const void *buf -- Data.
+ *   size_t n -- Bytes in buf.
+ * Returns:
+ *   uint32_t -- CRC of the preceding data followed by buf.
+ */
+uint32_t compute_sg_crc32c(uint32_t crc, const void *buf, size_t n)
+{
+	return copy_sg_crc32c(crc, NULL, buf, n);
+}
+
+/*
+ * Enable per-block CRC32C checksums.
+ * Arguments:
+ *   SGPlan *sgpln -- SGPlan instance, read or write mode.
+ *   int enable -- Non-zero to enable, 0 to disable.
+ * Returns:
+ *   int -- 0 on success, -1 on error.
+ * Notes:
+ *   Write plans compute the CRC32C of the frames of each block while 
+ *     copying them into the file and store it in the extended block 
+ *     header, so enabling checksums selects SG_FILE_VERSION_EXT and 
+ *     must be done before the first write.
+ *   Read plans verify blocks that carry a checksum while copying them 
+ *     out of the file (or the read-ahead buffer). A mismatch is 
+ *     reported on stderr and counted (get_sg_plan_checksum_errors); the
+ *     frames are still returned. Blocks served from the block cache 
+ *     are not verified again.
+ *   The CRC uses the SSE4.2 crc32 instruction over three interleaved 
+ *     streams where available, and a table-driven fallback otherwise.
+ */
+int set_sg_plan_checksums(SGPlan *sgpln, int enable)
+{
+	if (sgpln->sgm == SCATGAT_MODE_WRITE && enable && sgpln->file_version != SG_FILE_VERSION_EXT)
+	{
+		if (set_sg_plan_file_version(sgpln, SG_FILE_VERSION_EXT) != 0)
+		{
+			fprintf(stderr,"Block checksums need the extended file format.\n");
 			return -1;
 		}
-		sgi->smi.eomem = sgi->smi.start + new_size;
+	}
+	sgpln->checksums = enable != 0;
+	return 0;
+}
+
+/*
+ * Get the number of blocks that failed checksum verification.
+ * Arguments:
+ *   SGPlan *sgpln -- SGPlan instance created in read-mode.
+ * Returns:
+ *   uint64_t -- Blocks read with a CRC32C mismatch.
+ */
+uint64_t get_sg_plan_checksum_errors(SGPlan *sgpln)
+{
+	return __atomic_load_n(&(sgpln->checksum_errors), __ATOMIC_RELAXED);
+}
+
+/*
+ * Write data to an SG file while computing its CRC32C.
+ * Arguments:
+ *   SGInfo *sgi -- SG file, as for write_to_sg.
+ *   const void *src -- Pointer to buffer containing source data.
+ *   size_t n -- Number of bytes to be written from the source data.
+ *   uint32_t *crc -- CRC of the preceding data on entry, updated with 
+ *     the written data on return.
+ * Return:
+ *   int -- 0 on success, -1 on failure
+ */
+int write_crc32c_to_sg(SGInfo *sgi, const void *src, size_t n, uint32_t *crc)
+{
+	if (sgi->smi.size+n > (off_t)(sgi->smi.eomem-sgi->smi.start))
+	{
+		if (resize_to_sg(sgi, (off_t)(sgi->smi.eomem-sgi->smi.start)+(off_t)GROWTH_SIZE_IN_BLOCKS*sgi->sg_wr_block) == -1)
+		{
+			return -1;
+		}
+	}
+	*crc = copy_sg_crc32c(*crc, sgi->smi.start+sgi->smi.size, src, n);
+	sgi->smi.size += n;
+	return 0;
+}
+
+/*
+ * Check the CRC32C of a block against its extended block header.
+ * Arguments:
+ *   SGPart *sgprt -- Part the block was read from.
+ *   const struct sg_wb_header_ext_tag *wbht -- Block header, with 
+ *     SG_WB_EXT_CRC32C set.
+ *   uint32_t crc -- CRC32C of the frames as read.
+ * Returns:
+ *   int -- 0 if the checksums match, -1 otherwise.
+ * Notes:
+ *   A mismatch is reported and counted in the plan. Called from the 
+ *     worker threads.
+ */
+int test_sg_part_block_crc32c(SGPart *sgprt, const struct sg_wb_header_ext_tag *wbht, uint32_t crc)
+{
+	if (crc == wbht->crc32c)
+	{
+		return 0;
+	}
+	fprintf(stderr,"CRC32C mismatch in block %ld of %s (0x%08x, expected 0x%08x).\n",
+		(long)sgprt->iblock,sgprt->sgi->name,crc,wbht->crc32c);
+	__atomic_fetch_add(&(sgprt->sgpln->checksum_errors), 1, __ATOMIC_RELAXED);
+	return -1;
+}
+
+//////////////////////////////////////////////////////////////////////// BLOCK CACHE
+/* Initial number of hash buckets, doubled as entries are added. */
+#define SG_BLOCK_CACHE_MIN_BUCKETS 256
+
+/* Cached copy of one SG block */
+typedef struct sg_cache_entry {
+	SGFileId file_id;
+	off_t iblock;
+	uint32_t *data_buf;
+	uint32_t n_frames;
+	int pkt_size;
+	uint64_t first_stamp;
+	uint64_t last_stamp;
+	SGAllocator data_sga;												// allocator data_buf came from
+	SGAllocator meta_sga;												// allocator the entry came from
+	int referenced;														// CLOCK reference bit
+	int pins;															// readers copying out of data_buf
+	int dead;															// unlinked, free when unpinned
+	struct sg_cache_entry *hash_next;
+	struct sg_cache_entry *ring_prev;									// CLOCK ring
+	struct sg_cache_entry *ring_next;
+} SGCacheEntry;
+
+/* Process-wide cache state, protected by lock */
+static struct {
+	pthread_mutex_t lock;
+	size_t budget;
+	size_t bytes;														// linked entries plus inserts in progress
+	int n_entries;
+	int n_buckets;
+	SGCacheEntry **buckets;
+	SGAllocator buckets_sga;											// allocator buckets came from
+	SGCacheEntry *hand;													// CLOCK hand, NULL when empty
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+} sg_block_cache = { PTHREAD_MUTEX_INITIALIZER, 0, 0, 0, 0, NULL, { NULL, NULL, NULL }, NULL, 0, 0, 0 };
+
+static size_t sg_cache_entry_bytes(const SGCacheEntry *ce)
+{
+	return (size_t)ce->n_frames*ce->pkt_size;
+}
+
+static int sg_cache_key_equal(const SGCacheEntry *ce, const SGFileId *fid, off_t iblock)
+{
+	return ce->iblock == iblock && ce->file_id.dev == fid->dev && 
+		ce->file_id.ino == fid->ino && ce->file_id.size == fid->size &&
+		ce->file_id.mtime.tv_sec == fid->mtime.tv_sec && 
+		ce->file_id.mtime.tv_nsec == fid->mtime.tv_nsec;
+}
+
+static unsigned int sg_cache_hash(const SGFileId *fid, off_t iblock)
+{
+	uint64_t h = (uint64_t)fid->ino*0x9e3779b97f4a7c15ULL;
+	h ^= (uint64_t)fid->dev + 0x632be59bd9b4e019ULL + (h << 6) + (h >> 2);
+	h ^= (uint64_t)iblock*0xbf58476d1ce4e5b9ULL;
+	return (unsigned int)(h ^ (h >> 31));
+}
+
+static void sg_cache_free_entry(SGCacheEntry *ce)
+{
+	SGAllocator meta_sga = ce->meta_sga;
+	free_sg_mem(&(ce->data_sga), ce->data_buf);
+	free_sg_mem(&meta_sga, ce);
+}
+
+/* Find the entry of a block, with the cache lock held */
+static SGCacheEntry *sg_cache_find(const SGFileId *fid, off_t iblock)
+{
+	SGCacheEntry *ce = NULL;
+	if (sg_block_cache.buckets != NULL)
+	{
+		ce = sg_block_cache.buckets[sg_cache_hash(fid,iblock) & (sg_block_cache.n_buckets-1)];
+		while (ce != NULL && !sg_cache_key_equal(ce, fid, iblock))
+		{
+			ce = ce->hash_next;
+		}
+	}
+	return ce;
+}
+
+/*
+ * Unlink an entry from hash table and CLOCK ring, with the cache lock
+ * held. The entry is freed now, or by the last reader that has it 
+ * pinned.
+ */
+static void sg_cache_remove(SGCacheEntry *ce)
+{
+	SGCacheEntry **pce;
+	pce = &(sg_block_cache.buckets[sg_cache_hash(&(ce->file_id),ce->iblock) & (sg_block_cache.n_buckets-1)]);
+	while (*pce != ce)
+	{
+		pce = &((*pce)->hash_next);
+	}
+	*pce = ce->hash_next;
+	if (ce->ring_next == ce)
+	{
+		sg_block_cache.hand = NULL;
+	}
+	else
+	{
+		ce->ring_prev->ring_next = ce->ring_next;
+		ce->ring_next->ring_prev = ce->ring_prev;
+		if (sg_block_cache.hand == ce)
+		{
+			sg_block_cache.hand = ce->ring_next;
+		}
+	}
+	sg_block_cache.bytes -= sg_cache_entry_bytes(ce);
+	sg_block_cache.n_entries--;
+	if (ce->pins > 0)
+	{
+		ce->dead = 1;
 	}
 	else
 	{
-		if (munmap(sgi->smi.start, (sgi->smi.eomem - sgi->smi.start)) == -1)
-		{
-			perror("Unable to unmap file for resize to zero.");
-			return -1;
-		}
-		sgi->smi.start = NULL;
-		sgi->smi.eomem = NULL;
+		sg_cache_free_entry(ce);
+	}
+}
+
+/*
+ * Evict entries until need more bytes fit within the budget, with the
+ * cache lock held.
+ * Returns:
+ *   int -- 0 if the bytes fit, -1 if not.
+ * Notes:
+ *   Pinned entries are unlinked like any other and only their memory 
+ *     release is deferred.
+ */
+static int sg_cache_make_room(size_t need)
+{
+	SGCacheEntry *ce;
+	int n_scanned = 0;
+	while (sg_block_cache.bytes + need > sg_block_cache.budget)
+	{
+		if (sg_block_cache.hand == NULL || n_scanned > 2*sg_block_cache.n_entries)
+		{
+			return -1;
+		}
+		ce = sg_block_cache.hand;
+		sg_block_cache.hand = ce->ring_next;
+		n_scanned++;
+		if (ce->referenced)
+		{
+			ce->referenced = 0;
+			continue;
+		}
+		sg_cache_remove(ce);
+		sg_block_cache.evictions++;
+	}
+	return 0;
+}
+
+/*
+ * Double the hash table when the load factor exceeds one, with the 
+ * cache lock held. Failure to grow is not an error.
+ */
+static void sg_cache_grow(void)
+{
+	SGCacheEntry **buckets;
+	SGCacheEntry *ce;
+	SGCacheEntry *next;
+	int n_buckets;
+	int ii;
+	if (sg_block_cache.buckets != NULL && sg_block_cache.n_entries < sg_block_cache.n_buckets)
+	{
+		return;
+	}
+	n_buckets = sg_block_cache.n_buckets > 0 ? 2*sg_block_cache.n_buckets : SG_BLOCK_CACHE_MIN_BUCKETS;
+	/* The table keeps the allocator it was first created with */
+	if (sg_block_cache.buckets == NULL)
+	{
+		sg_block_cache.buckets_sga = sg_default_meta_sga;
+	}
+	buckets = (SGCacheEntry **)alloc_sg_meta(&(sg_block_cache.buckets_sga), sizeof(SGCacheEntry *)*n_buckets);
+	if (buckets == NULL)
+	{
+		return;
+	}
+	memset(buckets, 0, sizeof(SGCacheEntry *)*n_buckets);
+	for (ii=0; ii<sg_block_cache.n_buckets; ii++)
+	{
+		for (ce = sg_block_cache.buckets[ii]; ce != NULL; ce = next)
+		{
+			next = ce->hash_next;
+			ce->hash_next = buckets[sg_cache_hash(&(ce->file_id),ce->iblock) & (n_buckets-1)];
+			buckets[sg_cache_hash(&(ce->file_id),ce->iblock) & (n_buckets-1)] = ce;
+		}
+	}
+	free_sg_mem(&(sg_block_cache.buckets_sga), sg_block_cache.buckets);
+	sg_block_cache.buckets = buckets;
+	sg_block_cache.n_buckets = n_buckets;
+}
+
+/*
+ * Enable the process-wide block cache, or change its budget.
+ * Arguments:
+ *   size_t budget -- Maximum bytes of frame data to keep cached, 0 to
+ *     disable the cache and drop all entries.
+ * Returns:
+ *   int -- 0 on success, -1 on error.
+ */
+int set_sg_block_cache_budget(size_t budget)
+{
+	#ifdef DEBUG_LEVEL
+		char _dbgmsg[_DBGMSGLEN];
+	#endif
+	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
+		DEBUGMSG_ENTERFUNC;
+	#endif
+	pthread_mutex_lock(&(sg_block_cache.lock));
+	sg_block_cache.budget = budget;
+	sg_cache_make_room(0);
+	pthread_mutex_unlock(&(sg_block_cache.lock));
+	if (budget == 0)
+	{
+		clear_sg_block_cache();
+	}
+	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
+		DEBUGMSG_LEAVEFUNC;
+	#endif
+	return 0;
+}
+
+/*
+ * Drop all entries from the block cache, keeping its budget.
+ * Return:
+ *   void
+ */
+void clear_sg_block_cache(void)
+{
+	#ifdef DEBUG_LEVEL
+		char _dbgmsg[_DBGMSGLEN];
+	#endif
+	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
+		DEBUGMSG_ENTERFUNC;
+	#endif
+	pthread_mutex_lock(&(sg_block_cache.lock));
+	while (sg_block_cache.hand != NULL)
+	{
+		sg_cache_remove(sg_block_cache.hand);
 	}
+	pthread_mutex_unlock(&(sg_block_cache.lock));
 	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
 		DEBUGMSG_LEAVEFUNC;
 	#endif
-	return 0;
 }
 
-
-//////////////////////////////////////////////////////////////////////// TIME ORDERING UTILITIES
 /*
- * Comparison method to sort an array of integers in reverse order, i.e.
- *   from largest to smallest.
+ * Get block cache counters.
  * Arguments:
- *   const void *a -- Integer by reference
- *   const void *b -- Integer by reference
+ *   SGBlockCacheStats *stats -- Filled with the current counters.
  * Return:
- *   int -- Returns -1 if a > b, 0 if a == b, and 1 if a < b.
+ *   void
  */
-int compare_int_descend(const void *a, const void *b)
+void get_sg_block_cache_stats(SGBlockCacheStats *stats)
 {
-	int *int_a = (int *)a;
-	int *int_b = (int *)b;
-	return *int_b < *int_a ? -1 : *int_b > *int_a;
+	pthread_mutex_lock(&(sg_block_cache.lock));
+	stats->hits = sg_block_cache.hits;
+	stats->misses = sg_block_cache.misses;
+	stats->evictions = sg_block_cache.evictions;
+	stats->bytes = sg_block_cache.bytes;
+	stats->budget = sg_block_cache.budget;
+	stats->n_entries = sg_block_cache.n_entries;
+	pthread_mutex_unlock(&(sg_block_cache.lock));
 }
 
 /*
- * Comparison method to sort an array of SGInfo elements.
+ * Fill an SGPart buffer from the block cache.
  * Arguments:
- *   const void *a -- SGInfo by reference.
- *   const void *b -- SGInfo by reference.
- * Return:
- *   int - Returns -1 if a < b, 0 if a == b, and 1 if a > b.
+ *   SGPart *sgprt -- Part whose block sgprt->iblock is to be read.
+ * Returns:
+ *   int -- 0 if the block was served from the cache, -1 if the cache is
+ *     disabled, the block is not cached, or allocation failed.
  * Notes:
- *   The comparison is done by comparing the timestamp on the first VDIF
- *     frame in the file associated with *a and *b.
+ *   On success data_buf, n_frames and the stamps are set as if the 
+ *     block had been read from file. The copy is made with the entry 
+ *     pinned but without holding the cache lock, so that parts of a 
+ *     plan read from the cache in parallel.
  */
-int compare_sg_info(const void *a, const void *b)
+int lookup_sg_block_cache(SGPart *sgprt)
 {
 	#ifdef DEBUG_LEVEL
 		char _dbgmsg[_DBGMSGLEN];
@@ -1151,13 +8822,43 @@ int compare_sg_info(const void *a, const void *b)
 	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
 		DEBUGMSG_ENTERFUNC;
 	#endif
-	SGInfo *sgi_a = (SGInfo *)a;
-	SGInfo *sgi_b = (SGInfo *)b;
-	int result = sgi_a->first_secs < sgi_b->first_secs ? -1 : sgi_a->first_secs > sgi_b->first_secs;
-	if (result == 0)
+	SGCacheEntry *ce;
+	uint32_t *data_buf;
+	int result = -1;
+	/* Unlocked peek; a stale read only skips or tries the cache once. */
+	if (sg_block_cache.budget == 0)
 	{
-		result = sgi_a->first_frame < sgi_b->first_frame ? -1 : sgi_a->first_frame > sgi_b->first_frame;
+		return -1;
+	}
+	pthread_mutex_lock(&(sg_block_cache.lock));
+	ce = sg_cache_find(&(sgprt->file_id), sgprt->iblock);
+	if (ce == NULL || ce->pkt_size != sgprt->sgi->pkt_size)
+	{
+		sg_block_cache.misses++;
+		pthread_mutex_unlock(&(sg_block_cache.lock));
+		return -1;
+	}
+	ce->referenced = 1;
+	ce->pins++;
+	sg_block_cache.hits++;
+	pthread_mutex_unlock(&(sg_block_cache.lock));
+	data_buf = (uint32_t *)alloc_sg_data(&(sgprt->sgpln->data_sga), sg_cache_entry_bytes(ce));
+	if (data_buf != NULL)
+	{
+		memcpy(data_buf, ce->data_buf, sg_cache_entry_bytes(ce));
+		sgprt->data_buf = data_buf;
+		sgprt->n_frames = ce->n_frames;
+		sgprt->n_block_frames = ce->n_frames;
+		sgprt->first_stamp = ce->first_stamp;
+		sgprt->last_stamp = ce->last_stamp;
+		result = 0;
 	}
+	pthread_mutex_lock(&(sg_block_cache.lock));
+	if (--(ce->pins) == 0 && ce->dead)
+	{
+		sg_cache_free_entry(ce);
+	}
+	pthread_mutex_unlock(&(sg_block_cache.lock));
 	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
 		DEBUGMSG_LEAVEFUNC;
 	#endif
@@ -1165,334 +8866,570 @@ int compare_sg_info(const void *a, const void *b)
 }
 
 /*
- * Comparison method to sort an array of SGPart elements.
- * Arguments
- *   const void *a -- SGPart by reference.
- *   const void *b -- SGPart by reference.
- * Return:
- *   int -- Returns -1 if a < b, 0 if a == b, and 1 if a > b.
+ * Test whether the block cache is enabled.
+ * Arguments:
+ *   void
+ * Returns:
+ *   int -- Nonzero if blocks read are offered to the cache.
  * Notes:
- *   The comparison is based on the timestamp on the first VDIF frame in
- *     the a->data_buf and b->data_buf.
+ *   Unlocked peek, as in lookup_sg_block_cache.
  */
-int compare_sg_part(const void *a, const void *b)
+int test_sg_block_cache_enabled(void)
 {
-	#ifdef DEBUG_LEVEL
-		char _dbgmsg[_DBGMSGLEN];
-	#endif
-	//~ #if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
-		//~ DEBUGMSG_ENTERFUNC;
-	//~ #endif
-	SGPart *sgprt_a = (SGPart *)a;
-	SGPart *sgprt_b = (SGPart *)b;
-	/* Seconds since reference epoch. */
-	uint32_t secs_inre_a = FIRST_VDIF_SECS_INRE(sgprt_a);
-	uint32_t secs_inre_b = FIRST_VDIF_SECS_INRE(sgprt_b);
-	/* Data frame number within second */
-	uint32_t df_num_insec_a = FIRST_VDIF_DF_NUM_INSEC(sgprt_a);
-	uint32_t df_num_insec_b = FIRST_VDIF_DF_NUM_INSEC(sgprt_b);
-	
-	int result = secs_inre_a < secs_inre_b ? -1 : secs_inre_a > secs_inre_b;
-	//~ #if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
-		//~ snprintf(_dbgmsg, _DBGMSGLEN, "%d = %d ? %d : %d",result,secs_inre_a < secs_inre_b,-1,secs_inre_a > secs_inre_b);
-		//~ DEBUGMSG(_dbgmsg);
-	//~ #endif
-	if (result == 0)
-	{
-		result = df_num_insec_a < df_num_insec_b ? -1 : df_num_insec_a > df_num_insec_b;
-		//~ #if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
-			//~ snprintf(_dbgmsg, _DBGMSGLEN, "%d = %d ? %d : %d",result,df_num_insec_a < df_num_insec_b,-1,df_num_insec_a > df_num_insec_b);
-			//~ DEBUGMSG(_dbgmsg);
-		//~ #endif
-	}
-	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
-		snprintf(_dbgmsg,_DBGMSGLEN,"Result = %d (%u.%u ? %u.%u)",result,secs_inre_a,df_num_insec_a,secs_inre_b,df_num_insec_b);
-		DEBUGMSG(_dbgmsg);
-		//~ DEBUGMSG_LEAVEFUNC;
-	#endif
-	return result;
+	return sg_block_cache.budget != 0;
 }
 
 /*
- * Find a contiguous mapping of SGParts in the given SGPlan.
+ * Offer a freshly read SGPart buffer to the block cache.
  * Arguments:
- *   SGPlan *sgpln -- SGPlan that contains the SGParts array to order.
- *   int *mapping -- Allocated integer array that will contain the 
- *     ordered mapping so that the first M entries will list the 
- *     contiguous blocks from start to end. This is followed by 
- *     sgpln->n_sgprt-M negative indecies that list blocks that are not
- *     contiguous with this block set.
- * Returns:
- *   int -- The number of contiguous blocks found.
+ *   SGPart *sgprt -- Part holding the block sgprt->iblock in data_buf.
+ * Return:
+ *   void
+ * Notes:
+ *   Room for the block is made first, and the block is only copied if
+ *     it is admitted; the part keeps ownership of its buffer. Blocks
+ *     already cached, blocks larger than the budget, empty blocks and 
+ *     blocks of parts without a file identity are not copied.
  */
-int map_sg_parts_contiguous(SGPlan *sgpln, int *mapping)
+void insert_sg_block_cache(SGPart *sgprt)
 {
-	//~ printf(" -->> map_sg_parts_contiguous\n");
 	#ifdef DEBUG_LEVEL
 		char _dbgmsg[_DBGMSGLEN];
 	#endif
 	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
 		DEBUGMSG_ENTERFUNC;
 	#endif
-	int ii, jj;
-	int idx_min_new = 0;
-	int tmp_map = 0;
-	int return_value = 0;
-	int dead_nodes = sgpln->n_sgprt;
-	/* Initialize mapping array. Just put indecies in increasing 
-	 * magnitude, and make entries for dead nodes negative.
-	 */
-	for (ii=0; ii<sgpln->n_sgprt; ii++)
+	SGCacheEntry *ce;
+	size_t n_bytes = (size_t)sgprt->n_frames*sgprt->sgi->pkt_size;
+	unsigned int ibucket;
+	if (sg_block_cache.budget == 0 || n_bytes == 0 || 
+		n_bytes > sg_block_cache.budget || sgprt->file_id.ino == 0)
+	{
+		return;
+	}
+	/* Admit the block and reserve its bytes before copying */
+	pthread_mutex_lock(&(sg_block_cache.lock));
+	sg_cache_grow();
+	if (sg_block_cache.buckets == NULL || sg_cache_find(&(sgprt->file_id), sgprt->iblock) != NULL ||
+		sg_cache_make_room(n_bytes) != 0)
+	{
+		pthread_mutex_unlock(&(sg_block_cache.lock));
+		return;
+	}
+	sg_block_cache.bytes += n_bytes;
+	pthread_mutex_unlock(&(sg_block_cache.lock));
+	/* Copy outside the lock, the entry is not visible yet. */
+	ce = (SGCacheEntry *)alloc_sg_meta(&sg_default_meta_sga, sizeof(SGCacheEntry));
+	if (ce != NULL)
 	{
-		if (sgpln->sgprt[ii].n_frames > 0)
+		memset(ce, 0, sizeof(SGCacheEntry));
+		ce->meta_sga = sg_default_meta_sga;
+		ce->data_sga = sg_default_data_sga;
+		ce->data_buf = (uint32_t *)alloc_sg_data(&(ce->data_sga), n_bytes);
+		if (ce->data_buf == NULL)
 		{
-			dead_nodes--;
-			mapping[ii] = ii+1;
+			sg_cache_free_entry(ce);
+			ce = NULL;
 		}
-		else
+	}
+	if (ce != NULL)
+	{
+		memcpy(ce->data_buf, sgprt->data_buf, n_bytes);
+		ce->file_id = sgprt->file_id;
+		ce->iblock = sgprt->iblock;
+		ce->n_frames = sgprt->n_frames;
+		ce->pkt_size = sgprt->sgi->pkt_size;
+		ce->first_stamp = sgprt->first_stamp;
+		ce->last_stamp = sgprt->last_stamp;
+	}
+	pthread_mutex_lock(&(sg_block_cache.lock));
+	/* Another plan may have inserted the same block meanwhile, or the
+	 * cache been disabled. */
+	if (ce == NULL || sg_block_cache.budget == 0 || sg_cache_find(&(ce->file_id), ce->iblock) != NULL)
+	{
+		sg_block_cache.bytes -= n_bytes;
+		pthread_mutex_unlock(&(sg_block_cache.lock));
+		if (ce != NULL)
 		{
-			mapping[ii] = -(ii+1);
+			sg_cache_free_entry(ce);
 		}
+		return;
+	}
+	ibucket = sg_cache_hash(&(ce->file_id),ce->iblock) & (sg_block_cache.n_buckets-1);
+	ce->hash_next = sg_block_cache.buckets[ibucket];
+	sg_block_cache.buckets[ibucket] = ce;
+	/* New entries go just behind the hand, i.e. are scanned last. */
+	if (sg_block_cache.hand == NULL)
+	{
+		ce->ring_prev = ce->ring_next = ce;
+		sg_block_cache.hand = ce;
+	}
+	else
+	{
+		ce->ring_next = sg_block_cache.hand;
+		ce->ring_prev = sg_block_cache.hand->ring_prev;
+		ce->ring_prev->ring_next = ce;
+		sg_block_cache.hand->ring_prev = ce;
 	}
+	sg_block_cache.n_entries++;
+	pthread_mutex_unlock(&(sg_block_cache.lock));
 	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
-		
-		printf("Mapping(init) = [");
-		for (ii=0; ii<sgpln->n_sgprt; ii++)
-		{
-			printf("%5d",mapping[ii]);
-		}
-		printf("]\n");
 		DEBUGMSG_LEAVEFUNC;
 	#endif
-	/* If all nodes dead, just return zero. */
-	if (dead_nodes == sgpln->n_sgprt)
+}
+
+//////////////////////////////////////////////////////////////////////// DEVICE SCHEDULER
+/* Queues of waiting transfers, each served only when the ones before 
+ * it are empty */
+enum sg_device_queue {
+	SG_DEVICE_QUEUE_URGENT,												// write plans and the realtime class
+	SG_DEVICE_QUEUE_NORMAL,
+	SG_DEVICE_QUEUE_IDLE,												// idle class
+	SG_DEVICE_QUEUES
+};
+
+/* Arbitration state of one device */
+typedef struct sg_device {
+	dev_t dev;
+	SGPlan *owner;														// plan the device is granted to, NULL if free
+	int owner_queue;													// queue the owner was served from
+	int active;															// owner's transfers in progress
+	size_t batch_used;													// bytes transferred in the owner's batch
+	struct timespec idle_since;											// when active last dropped to zero
+	uint64_t next_ticket[SG_DEVICE_QUEUES];								// FIFO of waiting transfers per queue
+	uint64_t now_serving[SG_DEVICE_QUEUES];
+	pthread_cond_t cond;												// signalled on release and expiry
+	struct sg_device *next;
+} SGDevice;
+
+/* Process-wide scheduler state, protected by lock. Devices are never 
+ * freed, waiting threads may hold pointers to them. */
+static struct {
+	pthread_mutex_t lock;
+	size_t batch_bytes;													// 0 when disabled
+	long hold_nsec;
+	SGDevice *devices;
+	uint64_t requests;
+	uint64_t waits;
+	uint64_t switches;
+	int n_devices;
+} sg_device_scheduler = { PTHREAD_MUTEX_INITIALIZER, 0, 0, NULL, 0, 0, 0, 0 };
+
+/* Find or add the entry for a device, with the scheduler lock held */
+static SGDevice *sg_device_lookup(dev_t dev)
+{
+	SGDevice *sgd;
+	pthread_condattr_t attr;
+	for (sgd = sg_device_scheduler.devices; sgd != NULL; sgd = sgd->next)
 	{
-		return 0;
+		if (sgd->dev == dev)
+		{
+			return sgd;
+		}
 	}
-	/* Put all dead nodes at the end */
-	qsort((void *)mapping, sgpln->n_sgprt, sizeof(int), compare_int_descend);
-	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
-		
-		printf("Mapping(qsort) = [");
-		for (ii=0; ii<sgpln->n_sgprt; ii++)
+	sgd = (SGDevice *)alloc_sg_meta(&sg_default_meta_sga, sizeof(SGDevice));
+	if (sgd == NULL)
+	{
+		return NULL;
+	}
+	memset(sgd, 0, sizeof(SGDevice));
+	sgd->dev = dev;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&(sgd->cond), &attr);
+	pthread_condattr_destroy(&attr);
+	sgd->next = sg_device_scheduler.devices;
+	sg_device_scheduler.devices = sgd;
+	sg_device_scheduler.n_devices++;
+	return sgd;
+}
+
+/* Queue for the transfers of a plan */
+static int sg_device_queue(const SGPlan *sgpln)
+{
+	if (sgpln->sgm == SCATGAT_MODE_WRITE || sgpln->qos.io_class == SG_IO_CLASS_REALTIME)
+	{
+		return SG_DEVICE_QUEUE_URGENT;
+	}
+	return sgpln->qos.io_class == SG_IO_CLASS_IDLE ? SG_DEVICE_QUEUE_IDLE : SG_DEVICE_QUEUE_NORMAL;
+}
+
+/* Test if transfers wait in any queue before the given one, with the 
+ * scheduler lock held */
+static int sg_device_waiting(const SGDevice *sgd, int queue)
+{
+	int iq;
+	for (iq=0; iq<queue; iq++)
+	{
+		if (sgd->next_ticket[iq] != sgd->now_serving[iq])
 		{
-			printf("%5d",mapping[ii]);
+			return 1;
 		}
-		printf("]\n");
-		DEBUGMSG_LEAVEFUNC;
-	#endif
-	/* Sort according to timestamps */
-	for (ii=0; ii<sgpln->n_sgprt-dead_nodes; ii++)
+	}
+	return 0;
+}
+
+/* Drop an owner that is idle past the hold time, out of batch, or 
+ * idle while more urgent transfers wait, with the scheduler lock held.
+ * Returns the time the hold expires in *expiry if the owner is kept 
+ * but idle. */
+static int sg_device_expire(SGDevice *sgd, struct timespec *expiry)
+{
+	struct timespec now;
+	if (sgd->owner == NULL || sgd->active > 0)
 	{
-		idx_min_new = ii;
-		for (jj=ii; jj<sgpln->n_sgprt-dead_nodes; jj++)
+		return 0;
+	}
+	if (sg_device_waiting(sgd, sgd->owner_queue))
+	{
+		sgd->owner = NULL;
+		return 0;
+	}
+	expiry->tv_sec = sgd->idle_since.tv_sec;
+	expiry->tv_nsec = sgd->idle_since.tv_nsec + sg_device_scheduler.hold_nsec;
+	expiry->tv_sec += expiry->tv_nsec/1000000000L;
+	expiry->tv_nsec %= 1000000000L;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (sgd->batch_used >= sg_device_scheduler.batch_bytes || now.tv_sec > expiry->tv_sec ||
+		(now.tv_sec == expiry->tv_sec && now.tv_nsec >= expiry->tv_nsec))
+	{
+		sgd->owner = NULL;
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Enable the process-wide per-device I/O scheduler, or change it.
+ * Arguments:
+ *   size_t batch_bytes -- Bytes a plan may transfer on a device before
+ *     it must give way to other plans, 0 to disable the scheduler.
+ *   int hold_usec -- Time a device stays reserved for its current plan
+ *     after a transfer, waiting for that plan's next request.
+ * Returns:
+ *   int -- 0 on success, -1 on error.
+ */
+int set_sg_device_scheduler(size_t batch_bytes, int hold_usec)
+{
+	SGDevice *sgd;
+	int iq;
+	if (hold_usec < 0)
+	{
+		fprintf(stderr,"Invalid device hold time %d us.\n",hold_usec);
+		return -1;
+	}
+	pthread_mutex_lock(&(sg_device_scheduler.lock));
+	sg_device_scheduler.batch_bytes = batch_bytes;
+	sg_device_scheduler.hold_nsec = (long)hold_usec*1000L;
+	for (sgd = sg_device_scheduler.devices; sgd != NULL; sgd = sgd->next)
+	{
+		/* Release all waiters when disabling */
+		if (batch_bytes == 0)
 		{
-			if (compare_sg_part((void *)&(sgpln->sgprt[mapping[jj]-1]),(void *)&(sgpln->sgprt[mapping[idx_min_new]-1])) < 0)
+			sgd->owner = NULL;
+			for (iq=0; iq<SG_DEVICE_QUEUES; iq++)
 			{
-				idx_min_new = jj;
+				sgd->now_serving[iq] = sgd->next_ticket[iq];
 			}
 		}
-		tmp_map = mapping[ii];
-		mapping[ii] = mapping[idx_min_new];
-		mapping[idx_min_new] = tmp_map;
+		pthread_cond_broadcast(&(sgd->cond));
 	}
-	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
-		
-		printf("Mapping(bsort) = [");
-		for (ii=0; ii<sgpln->n_sgprt; ii++)
+	pthread_mutex_unlock(&(sg_device_scheduler.lock));
+	return 0;
+}
+
+/*
+ * Get device scheduler counters.
+ * Arguments:
+ *   SGDeviceSchedulerStats *stats -- Filled with the current counters.
+ * Return:
+ *   void
+ */
+void get_sg_device_scheduler_stats(SGDeviceSchedulerStats *stats)
+{
+	pthread_mutex_lock(&(sg_device_scheduler.lock));
+	stats->requests = sg_device_scheduler.requests;
+	stats->waits = sg_device_scheduler.waits;
+	stats->switches = sg_device_scheduler.switches;
+	stats->n_devices = sg_device_scheduler.n_devices;
+	pthread_mutex_unlock(&(sg_device_scheduler.lock));
+}
+
+/*
+ * Wait until the device holding an SG file is granted to its plan.
+ * Arguments:
+ *   SGPart *sgprt -- Part about to transfer a block.
+ * Returns:
+ *   SGDevice * -- Device to pass to release_sg_device, or NULL if the
+ *     scheduler is disabled.
+ * Notes:
+ *   A plan that owns the device continues its batch without queueing,
+ *     unless more urgent transfers wait. Any other transfer takes a 
+ *     ticket in the queue of its plan (see sg_device_queue) and is 
+ *     granted the device in ticket order, after all more urgent 
+ *     queues, once the owner is out of batch, idle for longer than the
+ *     hold time, or idle while this transfer is more urgent.
+ *   The grant should cover the transfer itself, i.e. the copy from or
+ *     into the mapped file, or the pread, not just the request for it.
+ */
+SGDevice *acquire_sg_device(SGPart *sgprt)
+{
+	SGPlan *sgpln = sgprt->sgpln;
+	SGDevice *sgd;
+	struct timespec expiry;
+	uint64_t ticket;
+	int queue = sg_device_queue(sgpln);
+	int waited = 0;
+	pthread_mutex_lock(&(sg_device_scheduler.lock));
+	if (sg_device_scheduler.batch_bytes == 0 || (sgd = sg_device_lookup(sgprt->file_id.dev)) == NULL)
+	{
+		pthread_mutex_unlock(&(sg_device_scheduler.lock));
+		return NULL;
+	}
+	sg_device_scheduler.requests++;
+	/* Continue own batch unless more urgent transfers wait, or take a 
+	 * free device nobody as or more urgent waits for */
+	if ((sgd->owner == sgpln && sgd->batch_used < sg_device_scheduler.batch_bytes && 
+			!sg_device_waiting(sgd, sgd->owner_queue)) ||
+		(sgd->owner == NULL && !sg_device_waiting(sgd, queue+1)))
+	{
+		if (sgd->owner != sgpln)
 		{
-			printf("%5d",mapping[ii]);
+			sgd->owner = sgpln;
+			sgd->owner_queue = queue;
+			sgd->batch_used = 0;
+			sg_device_scheduler.switches++;
 		}
-		printf("]\n");
-		DEBUGMSG_LEAVEFUNC;
-	#endif
-	
-	/* Check data continuity, and set index negative if not. */
-	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
-		snprintf(_dbgmsg,_DBGMSGLEN,"%d / %d dead nodes",dead_nodes,sgpln->n_sgprt);
-		DEBUGMSG(_dbgmsg);
-	#endif
-	for (ii = 0;ii<sgpln->n_sgprt-dead_nodes-1; ii++)
+		sgd->active++;
+		pthread_mutex_unlock(&(sg_device_scheduler.lock));
+		return sgd;
+	}
+	ticket = sgd->next_ticket[queue]++;
+	while (sg_device_scheduler.batch_bytes > 0)
 	{
-		#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
-			snprintf(_dbgmsg,_DBGMSGLEN,"ii = %d",ii);
-			DEBUGMSG(_dbgmsg);
-		#endif
-		if (!test_sg_parts_contiguous(&(sgpln->sgprt[mapping[ii]-1]),&(sgpln->sgprt[mapping[ii+1]-1])))
+		if (sg_device_expire(sgd, &expiry))
+		{
+			waited = 1;
+			pthread_cond_timedwait(&(sgd->cond), &(sg_device_scheduler.lock), &expiry);
+			continue;
+		}
+		if (ticket == sgd->now_serving[queue] && !sg_device_waiting(sgd, queue) && 
+			(sgd->owner == NULL || sgd->owner == sgpln))
 		{
 			break;
 		}
+		waited = 1;
+		pthread_cond_wait(&(sgd->cond), &(sg_device_scheduler.lock));
 	}
-	return_value = ii+1;
-	for (jj=return_value; jj<sgpln->n_sgprt-dead_nodes; jj++)
+	/* Tickets were voided if the scheduler was disabled meanwhile */
+	if (ticket == sgd->now_serving[queue])
 	{
-		mapping[jj] = -mapping[jj];
+		sgd->now_serving[queue]++;
+	}
+	if (sgd->owner != sgpln)
+	{
+		sgd->owner = sgpln;
+		sgd->owner_queue = queue;
+		sgd->batch_used = 0;
+		sg_device_scheduler.switches++;
+	}
+	else if (queue < sgd->owner_queue)
+	{
+		sgd->owner_queue = queue;
+	}
+	sgd->active++;
+	sg_device_scheduler.waits += waited;
+	pthread_cond_broadcast(&(sgd->cond));
+	pthread_mutex_unlock(&(sg_device_scheduler.lock));
+	return sgd;
+}
+
+/*
+ * Finish a transfer granted by acquire_sg_device.
+ * Arguments:
+ *   SGDevice *sgd -- Device returned by acquire_sg_device, may be NULL.
+ *   size_t n_bytes -- Bytes transferred.
+ * Return:
+ *   void
+ */
+void release_sg_device(SGDevice *sgd, size_t n_bytes)
+{
+	if (sgd == NULL)
+	{
+		return;
 	}
-	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
-		
-		printf("Mapping(final) = [");
-		for (ii=0; ii<sgpln->n_sgprt; ii++)
+	pthread_mutex_lock(&(sg_device_scheduler.lock));
+	sgd->active--;
+	sgd->batch_used += n_bytes;
+	if (sgd->active == 0)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &(sgd->idle_since));
+		if (sgd->batch_used >= sg_device_scheduler.batch_bytes)
 		{
-			printf("%5d",mapping[ii]);
+			sgd->owner = NULL;
 		}
-		printf("]\n");
-		DEBUGMSG_LEAVEFUNC;
-	#endif
-	//~ printf(" <<-- map_sg_parts_contiguous\n");
-	return return_value;
+	}
+	pthread_cond_broadcast(&(sgd->cond));
+	pthread_mutex_unlock(&(sg_device_scheduler.lock));
 }
 
+//////////////////////////////////////////////////////////////////////// MEMORY MANAGEMENT
 /*
- * Test whether two SG parts are contiguous.
+ * Default allocators. Metadata uses malloc, frame buffers use 
+ * posix_memalign; both release with free, so buffers handed out with
+ * the defaults may still be freed by the caller with free().
+ */
+static void *sg_libc_alloc(size_t size, size_t alignment, void *ctx)
+{
+	(void)alignment;
+	(void)ctx;
+	return malloc(size);
+}
+
+static void *sg_libc_aligned_alloc(size_t size, size_t alignment, void *ctx)
+{
+	void *ptr = NULL;
+	(void)ctx;
+	if (posix_memalign(&ptr, alignment, size > 0 ? size : 1) != 0)
+	{
+		return NULL;
+	}
+	return ptr;
+}
+
+static void sg_libc_free(void *ptr, void *ctx)
+{
+	(void)ctx;
+	free(ptr);
+}
+
+/*
+ * Set the allocators used by plans created from now on.
  * Arguments:
- *   SGPart *a -- Pointer to SGPart assumed to contain first data.
- *   SGPart *b -- Pointer to SGPart assumed to contain last data.
- * Returns:
- *   int -- 1 if contiguous, 0 if not.
+ *   const SGAllocator *meta_sga -- Allocator for small metadata, or 
+ *     NULL for the malloc-based default.
+ *   const SGAllocator *data_sga -- Allocator for large frame buffers, 
+ *     or NULL for the posix_memalign-based default.
+ * Return:
+ *   void
  * Notes:
- *   Continuinity means that the last VDIF frame in the a->data_buf
- *     and the first VDIF frame in b->data_buf are adjacent or aligned
- *     in time, according to seconds-since-reference-epoch and 
- *     data-frame-within-second counters. The aligned case is needed if
- *     two or more parallel streams are processed simultaneously, in 
- *     which case packets may have duplicate timestamps.
- *   In order to make the code portable for different frame rates, the
- *     reliance on VDIF_FRAMES_PER_SECOND is removed. This means that 
- *     continuity across a 1-second boundary is ignored.
+ *   Setup only, the defaults are read without a lock by every object
+ *     created afterwards.
  */
-int test_sg_parts_contiguous(SGPart *a, SGPart *b)
+void set_sg_default_allocators(const SGAllocator *meta_sga, 
+					const SGAllocator *data_sga)
 {
-	#ifdef DEBUG_LEVEL
-		char _dbgmsg[_DBGMSGLEN];
-	#endif
-	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
-		DEBUGMSG_ENTERFUNC;
-	#endif
-	
-	// Test if either pointer is NULL
-	if (a == NULL || b == NULL) {
-		#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
-			DEBUGMSG_LEAVEFUNC;
-		#endif
-		return 0;
+	SGAllocator libc_meta_sga = { sg_libc_alloc, sg_libc_free, NULL };
+	SGAllocator libc_data_sga = { sg_libc_aligned_alloc, sg_libc_free, NULL };
+	sg_default_meta_sga = meta_sga != NULL ? *meta_sga : libc_meta_sga;
+	sg_default_data_sga = data_sga != NULL ? *data_sga : libc_data_sga;
+}
+
+/*
+ * Get the allocators used by plans created from now on.
+ * Arguments:
+ *   SGAllocator *meta_sga -- Receives the metadata allocator, may be 
+ *     NULL.
+ *   SGAllocator *data_sga -- Receives the frame buffer allocator, may 
+ *     be NULL.
+ * Return:
+ *   void
+ */
+void get_sg_default_allocators(SGAllocator *meta_sga, SGAllocator *data_sga)
+{
+	if (meta_sga != NULL)
+	{
+		*meta_sga = sg_default_meta_sga;
 	}
-	
-	/* Seconds since reference epoch. */
-	uint32_t secs_inre_a_last = LAST_VDIF_SECS_INRE(a);
-	uint32_t secs_inre_a_first = FIRST_VDIF_SECS_INRE(a);
-	uint32_t secs_inre_b_first = FIRST_VDIF_SECS_INRE(b);
-	uint32_t secs_inre_b_last = LAST_VDIF_SECS_INRE(b);
-	/* Data frame number within second */
-	uint32_t df_num_insec_a_last = LAST_VDIF_DF_NUM_INSEC(a);
-	uint32_t df_num_insec_a_first = FIRST_VDIF_DF_NUM_INSEC(a);
-	uint32_t df_num_insec_b_first = FIRST_VDIF_DF_NUM_INSEC(b);
-	uint32_t df_num_insec_b_last = LAST_VDIF_DF_NUM_INSEC(b);
-	
-	/* Set valid range for b start */
-	uint32_t min_secs_inre_b_first = secs_inre_a_first;
-	uint32_t max_secs_inre_b_first = secs_inre_a_last;
-	uint32_t min_df_num_insec_b_first;
-	uint32_t max_df_num_insec_b_first;
-	
-	
-	if (secs_inre_a_first == secs_inre_a_last) // If a is contained in single second
+	if (data_sga != NULL)
 	{
-		if (secs_inre_b_first == secs_inre_a_last) // If b starts in the same second as that containing a
-		{
-			if (df_num_insec_b_first >= df_num_insec_a_first && // b cannot start before a
-				df_num_insec_b_first <= df_num_insec_a_last+1) // and b should start at least directly after a ends
-			{
-				#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
-					snprintf(_dbgmsg,_DBGMSGLEN,"Contiguous (%u.%u -> %u.%u ? %u.%u -> %u.%u)",
-								secs_inre_a_first,df_num_insec_a_first,secs_inre_a_last,df_num_insec_a_last,
-								secs_inre_b_first,df_num_insec_b_first,secs_inre_b_last,df_num_insec_b_last);
-					DEBUGMSG(_dbgmsg);
-					DEBUGMSG_LEAVEFUNC;
-				#endif
-				return 1;
-			}
-		} // b cannot start outside the second in which a is contained
+		*data_sga = sg_default_data_sga;
 	}
-	else // a is split across multiple seconds
+}
+
+/*
+ * Set the allocator for large frame buffers of a single plan.
+ * Arguments:
+ *   SGPlan *sgpln -- Pointer to SGPlan.
+ *   const SGAllocator *data_sga -- Allocator for frame buffers, or NULL
+ *     for the posix_memalign-based default.
+ * Returns:
+ *   int -- 0 on success, -1 if the plan still holds frame buffers 
+ *     allocated by the previous allocator.
+ */
+int set_sg_plan_data_allocator(SGPlan *sgpln, const SGAllocator *data_sga)
+{
+	SGAllocator libc_data_sga = { sg_libc_aligned_alloc, sg_libc_free, NULL };
+	int ii;
+	for (ii=0; ii<sgpln->n_sgprt; ii++)
 	{
-		if (secs_inre_b_first == secs_inre_a_first) // if b starts in same second as a starts
-		{
-			if (df_num_insec_b_first >= df_num_insec_a_first) // since a ends in future second, only need to check that b did not start before a
-			{
-				#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
-					snprintf(_dbgmsg,_DBGMSGLEN,"Contiguous (%u.%u -> %u.%u ? %u.%u -> %u.%u)",
-								secs_inre_a_first,df_num_insec_a_first,secs_inre_a_last,df_num_insec_a_last,
-								secs_inre_b_first,df_num_insec_b_first,secs_inre_b_last,df_num_insec_b_last);
-					DEBUGMSG(_dbgmsg);
-					DEBUGMSG_LEAVEFUNC;
-				#endif
-				return 1;
-			}
-		}
-		else if (secs_inre_b_first == secs_inre_a_last) // if b starts in the same second as a ends
-		{
-			if (df_num_insec_b_first <= df_num_insec_a_last+1) // since a started in past second, only need to check that b starts directly after a ends or earlier
-			{
-				#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
-					snprintf(_dbgmsg,_DBGMSGLEN,"Contiguous (%u.%u -> %u.%u ? %u.%u -> %u.%u)",
-								secs_inre_a_first,df_num_insec_a_first,secs_inre_a_last,df_num_insec_a_last,
-								secs_inre_b_first,df_num_insec_b_first,secs_inre_b_last,df_num_insec_b_last);
-					DEBUGMSG(_dbgmsg);
-					DEBUGMSG_LEAVEFUNC;
-				#endif
-				return 1;
-			}
-		}
-		else if (secs_inre_b_first > secs_inre_a_first && // if b starts in some second between where a starts and ends, that's okay too
-					secs_inre_b_first < secs_inre_a_last)
+		if (sgpln->sgm == SCATGAT_MODE_READ && sgpln->sgprt[ii].data_buf != NULL)
 		{
-			#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
-				snprintf(_dbgmsg,_DBGMSGLEN,"Contiguous (%u.%u -> %u.%u ? %u.%u -> %u.%u)",
-							secs_inre_a_first,df_num_insec_a_first,secs_inre_a_last,df_num_insec_a_last,
-							secs_inre_b_first,df_num_insec_b_first,secs_inre_b_last,df_num_insec_b_last);
-				DEBUGMSG(_dbgmsg);
-				DEBUGMSG_LEAVEFUNC;
-			#endif
-			return 1;
+			fprintf(stderr,"Cannot change allocator while SGPlan holds frame buffers.\n");
+			return -1;
 		}
 	}
-	/* All other cases fail */
-	//~ if (secs_inre_b_first == secs_inre_a_last)
-	//~ {
-		//~ if ((df_num_insec_b_first == df_num_insec_a_last+1) || (df_num_insec_b_first == df_num_insec_a_first))
-		//~ {
-			//~ #if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
-				//~ snprintf(_dbgmsg,_DBGMSGLEN,"Contiguous (%u.%u -> %u.%u ? %u.%u -> %u.%u)",secs_inre_a_first,df_num_insec_a_first,secs_inre_a_last,df_num_insec_a_last,secs_inre_b_first,df_num_insec_b_first,secs_inre_b_last,df_num_insec_b_last);
-				//~ DEBUGMSG(_dbgmsg);
-				//~ DEBUGMSG_LEAVEFUNC;
-			//~ #endif
-			//~ #if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
-				//~ DEBUGMSG_LEAVEFUNC;
-			//~ #endif
-			//~ return 1;
-		//~ }
-	//~ }
-	//~ else if (secs_inre_b_first == secs_inre_a_last+1)
-	//~ {
-		//~ if (df_num_insec_a_last == VDIF_FRAMES_PER_SECOND-1 && df_num_insec_b_first == 0)
-		//~ {
-		//~ #if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
-			//~ DEBUGMSG_LEAVEFUNC;
-		//~ #endif
-			//~ return 1;
-		//~ }
-	//~ }
-	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
-		snprintf(_dbgmsg,_DBGMSGLEN,"Non-Contiguous (%u.%u -> %u.%u ? %u.%u -> %u.%u)",
-						secs_inre_a_first,df_num_insec_a_first,secs_inre_a_last,df_num_insec_a_last,
-						secs_inre_b_first,df_num_insec_b_first,secs_inre_b_last,df_num_insec_b_last);
-			DEBUGMSG(_dbgmsg);
-		DEBUGMSG_LEAVEFUNC;
-	#endif
+	sgpln->data_sga = data_sga != NULL ? *data_sga : libc_data_sga;
 	return 0;
 }
 
-//////////////////////////////////////////////////////////////////////// MEMORY MANAGEMENT
+/*
+ * Release a buffer returned by read_next_block_vdif_frames or 
+ * read_block_vdif_frames.
+ * Arguments:
+ *   SGPlan *sgpln -- Plan that allocated the buffer.
+ *   void *buf -- Buffer to release, may be NULL.
+ * Return:
+ *   void
+ */
+void free_sg_plan_buffer(SGPlan *sgpln, void *buf)
+{
+	free_sg_mem(&(sgpln->data_sga), buf);
+}
+
+/*
+ * Allocate small metadata through an allocator.
+ * Arguments:
+ *   const SGAllocator *sga -- Allocator to use.
+ *   size_t size -- Number of bytes.
+ * Return:
+ *   void * -- Pointer to memory, or NULL on failure.
+ */
+void *alloc_sg_meta(const SGAllocator *sga, size_t size)
+{
+	return sga->alloc(size, sizeof(void *) > sizeof(uint64_t) ? sizeof(void *) : sizeof(uint64_t), sga->ctx);
+}
+
+/*
+ * Allocate a large frame buffer through an allocator.
+ * Arguments:
+ *   const SGAllocator *sga -- Allocator to use.
+ *   size_t size -- Number of bytes.
+ * Return:
+ *   void * -- Pointer to memory aligned to SG_DATA_BUFFER_ALIGNMENT, or
+ *     NULL on failure.
+ */
+void *alloc_sg_data(const SGAllocator *sga, size_t size)
+{
+	return sga->alloc(size, SG_DATA_BUFFER_ALIGNMENT, sga->ctx);
+}
+
+/*
+ * Release memory obtained through an allocator.
+ * Arguments:
+ *   const SGAllocator *sga -- Allocator the memory came from.
+ *   void *ptr -- Memory to release, may be NULL.
+ * Return:
+ *   void
+ */
+void free_sg_mem(const SGAllocator *sga, void *ptr)
+{
+	if (ptr != NULL)
+	{
+		sga->free(ptr, sga->ctx);
+	}
+}
+
 /*
  * Clear the data buffer in SGPart.
  * Arguments:
@@ -1512,9 +9449,10 @@ void clear_sg_part_buffer(SGPart *sgprt)
 		DEBUGMSG_ENTERFUNC;
 	#endif
 	sgprt->n_frames = 0;
+	sgprt->n_block_frames = 0;
 	if (sgprt->data_buf != NULL)
 	{
-		free(sgprt->data_buf);
+		free_sg_mem(&(sgprt->sgpln->data_sga), sgprt->data_buf);
 		sgprt->data_buf = NULL;
 	}
 	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
@@ -1526,13 +9464,15 @@ void clear_sg_part_buffer(SGPart *sgprt)
  * Free the resources allocated for an SGInfo structure.
  * Arguments:
  *   SGInfo *sgi -- Pointer to allocated SGInfo structure.
+ *   const SGAllocator *meta_sga -- Allocator sgi came from.
  * Return:
  *   void
  * Notes:
  *   Free memory pointed to by name field (if not NULL), and free the 
- *     memory pointed to by sgi.
+ *     memory pointed to by sgi. The name is always released with free,
+ *     since sg_open allocates it with malloc.
  */
-void free_sg_info(SGInfo *sgi)
+void free_sg_info(SGInfo *sgi, const SGAllocator *meta_sga)
 {
 	#ifdef DEBUG_LEVEL
 		char _dbgmsg[_DBGMSGLEN];
@@ -1546,13 +9486,52 @@ void free_sg_info(SGInfo *sgi)
 		{
 			free(sgi->name);
 		}
-		free(sgi);
+		free_sg_mem(meta_sga, sgi);
 	}
 	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
 		DEBUGMSG_LEAVEFUNC;
 	#endif
 }
 
+/*
+ * Close the files of SGInfo instances that were not handed to a plan.
+ * Arguments:
+ *   SGInfo *sgi_buf -- Array of SGInfo, opened by sgthread_fill_*_sgi.
+ *   int n_sgi -- Number of entries.
+ *   int sgm -- scatgat_mode the files were opened in.
+ * Return:
+ *   void
+ * Notes:
+ *   Used on the error paths of plan creation. Files created for 
+ *     writing are still empty and are removed. File names are freed, 
+ *     the array itself is not.
+ */
+void discard_sg_infos(SGInfo *sgi_buf, int n_sgi, int sgm)
+{
+	int ii;
+	SGPart sgprt;
+	for (ii=0; ii<n_sgi; ii++)
+	{
+		if (sgm == SCATGAT_MODE_READ)
+		{
+			sgprt.sgi = &(sgi_buf[ii]);
+			close_sg_part_file(&sgprt);
+		}
+		else
+		{
+			/* Reset size to original value, to fool sg_close() */
+			sgi_buf[ii].smi.size = sgi_buf[ii].smi.eomem - sgi_buf[ii].smi.start;
+			sg_close(&(sgi_buf[ii]));
+			if (unlink(sgi_buf[ii].name) == -1)
+			{
+				perror("Unable to remove empty file.");
+			}
+		}
+		free(sgi_buf[ii].name);
+		sgi_buf[ii].name = NULL;
+	}
+}
+
 /*
  * Free the resources allocated for an SGPlan structure.
  * Arguments:
@@ -1574,16 +9553,24 @@ void free_sg_plan(SGPlan *sgpln)
 		DEBUGMSG_ENTERFUNC;
 	#endif
 	int ii;
+	SGAllocator meta_sga = sgpln->meta_sga;
+	stop_sg_async(sgpln);
+	free_sg_stats(sgpln);
+	clear_sg_plan_hooks(sgpln);
 	for (ii=0; ii<sgpln->n_sgprt; ii++)
 	{
 		if (sgpln->sgm == SCATGAT_MODE_READ)
 		{
 			clear_sg_part_buffer(&(sgpln->sgprt[ii]));
 		}
-		free_sg_info(sgpln->sgprt[ii].sgi);
+		free_sg_mem(&meta_sga, sgpln->sgprt[ii].blk_offset);
+		discard_sg_part_stage(&(sgpln->sgprt[ii]));
+		close_sg_checkpoint(&(sgpln->sgprt[ii]), &meta_sga, 0);
+		free_sg_info(sgpln->sgprt[ii].sgi, &meta_sga);
 	}
-	free(sgpln->sgprt);
-	free(sgpln);
+	free_sg_mem(&meta_sga, sgpln->sgprt);
+	pthread_mutex_destroy(&(sgpln->qos.lock));
+	free_sg_mem(&meta_sga, sgpln);
 	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
 		DEBUGMSG_LEAVEFUNC;
 	#endif
@@ -1595,13 +9582,16 @@ void free_sg_plan(SGPlan *sgpln)
  * Arguments:
  *   SGPart *sgprt -- Pointer to SGPart instance to initialize.
  *   SGInfo *sgi -- Pointer to SGInfo to use for initialization.
+ *   SGPlan *sgpln -- Plan the part belongs to, or NULL if the part is
+ *     built before the plan (the caller then sets sgprt->sgpln).
  * Return:
- *   void
+ *   int -- 0 on success, -1 if sgprt->sgi could not be allocated.
  * Notes:
  *   The sgprt->sgi member is allocated new memory and the contents of 
- *     the passed argument sgi are copied to that location.
+ *     the passed argument sgi are copied to that location, using the 
+ *     plan's metadata allocator (or the default if sgpln is NULL).
  */
-void init_sg_part(SGPart *sgprt, const SGInfo *sgi)
+int init_sg_part(SGPart *sgprt, const SGInfo *sgi, SGPlan *sgpln)
 {
 	#ifdef DEBUG_LEVEL
 		char _dbgmsg[_DBGMSGLEN];
@@ -1609,14 +9599,88 @@ void init_sg_part(SGPart *sgprt, const SGInfo *sgi)
 	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
 		DEBUGMSG_ENTERFUNC;
 	#endif
-	sgprt->sgi = (SGInfo *)malloc(sizeof(SGInfo));
+	struct stat st;
+	sgprt->sgi = (SGInfo *)alloc_sg_meta(sgpln != NULL ? &(sgpln->meta_sga) : &sg_default_meta_sga, sizeof(SGInfo));
+	if (sgprt->sgi == NULL)
+	{
+		perror("Unable to allocate SGInfo.");
+		#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
+			DEBUGMSG_LEAVEFUNC;
+		#endif
+		return -1;
+	}
 	memcpy(sgprt->sgi, sgi, sizeof(SGInfo));
+	sgprt->sgpln = sgpln;
 	sgprt->iblock = 0;
 	sgprt->data_buf = NULL;
 	sgprt->n_frames = 0;
+	sgprt->n_block_frames = 0;
+	sgprt->first_stamp = 0;
+	sgprt->last_stamp = 0;
+	sgprt->blk_offset = NULL;
+	sgprt->read_engine = SG_READ_ENGINE_MMAP;
+	sgprt->prefetch_blocks = 0;
+	memset(sgprt->stage_bufs, 0, sizeof(sgprt->stage_bufs));
+	sgprt->run_start = 0;
+	sgprt->run_end = 0;
+	sgprt->io_mbps = 0;
+	sgprt->ckpt = NULL;
+	if (sgpln != NULL && sgpln->sgm == SCATGAT_MODE_READ && sgi->sg_version == SG_FILE_VERSION_EXT)
+	{
+		index_sg_ext_part(sgprt, &(sgpln->meta_sga));
+	}
+	memset(&(sgprt->file_id), 0, sizeof(SGFileId));
+	if (fstat(sgi->smi.mmfd, &st) == 0)
+	{
+		sgprt->file_id.dev = st.st_dev;
+		sgprt->file_id.ino = st.st_ino;
+		sgprt->file_id.size = st.st_size;
+		sgprt->file_id.mtime = st.st_mtim;
+	}
 	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
 		DEBUGMSG_LEAVEFUNC;
 	#endif	
+	return 0;
+}
+
+/*
+ * Set default values for new SGPlan instance.
+ * Arguments:
+ *   SGPlan *sgpln -- Pointer to SGPlan instance to initialize.
+ *   int sgm -- scatgat_mode, read / write.
+ *   const SGAllocator *meta_sga -- Allocator sgpln itself came from.
+ * Return:
+ *   void
+ * Notes:
+ *   The SGPart array is left for the caller to allocate. Frame buffers
+ *     use the current default data allocator.
+ */
+void init_sg_plan(SGPlan *sgpln, int sgm, const SGAllocator *meta_sga)
+{
+	sgpln->sgm = sgm;
+	sgpln->n_sgprt = 0;
+	sgpln->sgprt = NULL;
+	sgpln->block_count = 0;
+	sgpln->asq = NULL;
+	sgpln->meta_sga = *meta_sga;
+	sgpln->data_sga = sg_default_data_sga;
+	sgpln->has_filter = 0;
+	init_sg_read_filter(&(sgpln->filter));
+	sgpln->file_version = FILE_VERSION;
+	sgpln->block_size = WBLOCK_SIZE;
+	sgpln->qos.io_class = sgm == SCATGAT_MODE_WRITE ? SG_IO_CLASS_REALTIME : SG_IO_CLASS_NONE;
+	sgpln->qos.io_level = 0;
+	sgpln->qos.max_bytes_per_sec = 0;
+	sgpln->qos.tokens = 0;
+	clock_gettime(CLOCK_MONOTONIC, &(sgpln->qos.refill));
+	pthread_mutex_init(&(sgpln->qos.lock), NULL);
+	sgpln->checksums = 0;
+	sgpln->write_probe = 0;
+	sgpln->checksum_errors = 0;
+	sgpln->last_stamp = 0;
+	sgpln->stats = NULL;
+	sgpln->qlk = NULL;
+	sgpln->hooks = NULL;
 }
 
 /*
@@ -1638,13 +9702,14 @@ void init_sg_info(SGInfo *sgi, const char *filename)
 	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
 		DEBUGMSG_ENTERFUNC;
 	#endif
-	sgi->name = (char *)malloc(strlen(filename)*sizeof(char));
+	sgi->name = (char *)malloc((strlen(filename)+1)*sizeof(char));
 	strcpy(sgi->name,filename);
 	sgi->verbose = 0;
 	sgi->total_pkts = 0;
 	sgi->sg_version = FILE_VERSION;
 	sgi->sg_fht_size = sizeof(struct file_header_tag);
 	sgi->sg_wbht_size = sizeof(struct wb_header_tag);
+	sgi->sg_wr_block = WBLOCK_SIZE;
 	#if defined(DEBUG_LEVEL) && DEBUG_LEVEL >= DEBUG_LEVEL_DEBUG
 		DEBUGMSG_LEAVEFUNC;
 	#endif	
@@ -1717,6 +9782,8 @@ void print_sg_part(SGPart *sgprt, const char *label)
 	printf("%s\t.iblock = %lu\n",label,(unsigned long int)(sgprt->iblock));
 	printf("%s\t.data_buf = 0x%lx\n",label,(unsigned long int)(sgprt->data_buf));
 	printf("%s\t.n_frames = %d\n",label,sgprt->n_frames);
+	printf("%s\t.read_engine = %d\n",label,sgprt->read_engine);
+	printf("%s\t.prefetch_blocks = %d\n",label,sgprt->prefetch_blocks);
 }
 
 void print_sg_plan(SGPlan *sgpln, const char *label)
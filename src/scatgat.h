@@ -15,24 +15,254 @@
 #ifndef SCATGAT_H
 #define SCATGAT_H
 
+#ifndef _GNU_SOURCE
 #define _GNU_SOURCE 
+#endif
 
+#include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <math.h>
 #include <pthread.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <stdio.h>
 #include <unistd.h>
 
 #include "sg_access.h"
 #include "dplane_proxy.h"
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* VDIF header fields decoded straight from the header words, h being
+ * a uint32_t pointer to the start of the frame. */
+#define VDIF_SECS_INRE(h) ((h)[0] & 0x3fffffffu)
+#define VDIF_LEGACY(h) (((h)[0] >> 30) & 0x1u)
+#define VDIF_INVALID(h) (((h)[0] >> 31) & 0x1u)
+#define VDIF_DF_NUM_INSEC(h) ((h)[1] & 0x00ffffffu)
+#define VDIF_REF_EPOCH(h) (((h)[1] >> 24) & 0x3fu)
+#define VDIF_DF_LEN_BYTES(h) (((h)[2] & 0x00ffffffu)*8)
+#define VDIF_LOG2_NCHAN(h) (((h)[2] >> 24) & 0x1fu)
+#define VDIF_STATION_ID(h) ((h)[3] & 0xffffu)
+#define VDIF_THREAD_ID(h) (((h)[3] >> 16) & 0x3ffu)
+#define VDIF_BITS_PER_SAMPLE(h) ((((h)[3] >> 26) & 0x1fu) + 1)
+#define VDIF_IS_COMPLEX(h) (((h)[3] >> 31) & 0x1u)
+
+/* Frame timestamp packed so that integer order is time order:
+ * seconds-since-reference-epoch above the 24-bit frame-within-second. */
+#define SG_VDIF_STAMP(h) (((uint64_t)VDIF_SECS_INRE(h) << 24) | VDIF_DF_NUM_INSEC(h))
+#define SG_STAMP_SECS(s) ((uint32_t)((s) >> 24))
+#define SG_STAMP_DF_NUM(s) ((uint32_t)((s) & 0xffffffu))
+#define SG_MAKE_STAMP(secs,df_num) (((uint64_t)(secs) << 24) | ((df_num) & 0xffffffu))
+
+/* Number of distinct VDIF thread IDs (10-bit field) */
+#define SG_MAX_VDIF_THREADS 1024
+
+/* Memory allocation hooks. alloc returns memory aligned to at least
+ * alignment bytes (a power of two), or NULL on failure; free releases 
+ * memory returned by alloc of the same allocator. */
+typedef struct sg_allocator {
+	void *(*alloc)(size_t size, size_t alignment, void *ctx);
+	void (*free)(void *ptr, void *ctx);
+	void *ctx;															// passed through to alloc / free
+} SGAllocator;
+
+/* Alignment requested for large data buffers */
+#define SG_DATA_BUFFER_ALIGNMENT 4096
+
+/* Limits on the write block size of a write plan (see 
+ * set_sg_plan_block_size). Block sizes are stored as int in the file
+ * and block headers. */
+#define SG_MIN_BLOCK_SIZE (64*1024)
+#define SG_MAX_BLOCK_SIZE (1024*1024*1024)
+
+/* Identity of an SG file as seen by the block cache. Size and 
+ * modification time are included so that a rewritten file does not hit
+ * stale entries. */
+typedef struct sg_file_id {
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+} SGFileId;
+
+/* Block cache counters, see get_sg_block_cache_stats */
+typedef struct sg_block_cache_stats {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+	size_t bytes;														// bytes of frame data currently cached
+	size_t budget;														// configured budget, 0 if disabled
+	int n_entries;
+} SGBlockCacheStats;
+
+/* Per-frame flags in SGHeaderScan.flags */
+#define SG_HEADER_INVALID 0x01
+#define SG_HEADER_LEGACY 0x02
+#define SG_HEADER_COMPLEX 0x04
+
+/* VDIF headers of a read plan in columnar form, one row per frame, see
+ * scan_sg_plan_headers. */
+typedef struct sg_header_scan {
+	int n_frames;														// number of rows
+	uint32_t *secs;														// seconds since reference epoch
+	uint32_t *df_num;													// data frame number within second
+	uint16_t *thread;													// thread ID
+	uint16_t *station;													// station ID
+	uint8_t *flags;														// SG_HEADER_* bits
+	uint16_t *part;														// index of SGPart (SG file) in the plan
+	uint32_t *block;													// block index within the SG file
+} SGHeaderScan;
+
+/* Frame selection applied while reading, see set_sg_read_filter.
+ * A frame is selected if its stamp is in [start_stamp, end_stamp), its
+ * thread is in thread_mask (if use_thread_mask is set) and its station 
+ * equals station_id (if not negative). */
+typedef struct sg_read_filter {
+	uint64_t start_stamp;												// SG_MAKE_STAMP, inclusive
+	uint64_t end_stamp;													// SG_MAKE_STAMP, exclusive
+	uint32_t thread_mask[SG_MAX_VDIF_THREADS/32];						// bit per thread ID
+	int use_thread_mask;												// 0 selects all threads
+	int station_id;														// -1 selects all stations
+} SGReadFilter;
+
+/* Output formats of read_next_block_vdif_samples */
+enum sg_sample_format {
+	SG_SAMPLES_INT8,													// int8_t, offset-binary codes as odd levels (-3,-1,1,3 for 2-bit)
+	SG_SAMPLES_FLOAT													// float, same levels
+};
+
+/* Layout of unpacked VDIF samples, see read_next_block_vdif_samples */
+typedef struct sg_sample_info {
+	int n_chan;															// channels per frame
+	int bits_per_sample;												// 1, 2, 4 or 8
+	int is_complex;														// each sample is an (I, Q) pair of values
+	int samples_per_frame;												// samples per channel per frame
+	int n_frames;														// frames unpacked by the last read
+	int n_samples;														// samples per channel unpacked by the last read
+	uint64_t first_stamp;												// SG_VDIF_STAMP of the first frame unpacked
+} SGSampleInfo;
+
+/* Summary of the sampler statistics of a read plan, see set_sg_plan_stats */
+typedef struct sg_stats_info {
+	int n_chan;															// channels per frame
+	int bits_per_sample;												// 1, 2, 4 or 8
+	int is_complex;														// I and Q are counted together per channel
+	int n_threads;														// VDIF threads seen
+	int n_bins;															// time bins, bin 0 starting at start_secs
+	uint32_t start_secs;												// VDIF seconds of the first bin
+	int bins_per_second;												// as set
+	uint64_t n_frames;													// frames counted
+	uint64_t n_skipped;													// frames invalid, of another format or out of range
+} SGStatsInfo;
+
+/* Extended SG file format revision. Files carrying this version in the
+ * file header use sg_wb_header_ext_tag for every block header, which
+ * describes the block contents so that readers can seek and filter 
+ * without touching the frames. Legacy files use wb_header_tag. */
+#define SG_FILE_VERSION_EXT (FILE_VERSION+1)
+
+/* Extended block header. The first two fields match wb_header_tag, and
+ * wb_size covers this header plus the frames that follow it. Block
+ * headers follow a 20-byte file header, so the 64-bit stamps are only 
+ * 4-byte aligned in the file. */
+struct __attribute__((packed, aligned(4))) sg_wb_header_ext_tag {
+	int blocknum;
+	int wb_size;
+	uint64_t first_stamp;												// SG_VDIF_STAMP of first frame
+	uint64_t last_stamp;												// SG_VDIF_STAMP of last frame
+	uint32_t n_frames;													// frames in the block
+	uint32_t flags;														// SG_WB_EXT_* bits
+	uint32_t crc32c;													// CRC32C of the frames if SG_WB_EXT_CRC32C
+	uint32_t reserved;													// zero
+	uint32_t thread_mask[SG_MAX_VDIF_THREADS/32];						// bit per VDIF thread ID present
+};
+
+/* How a read plan moves a block from an SG file into its buffer */
+enum sg_read_engine {
+	SG_READ_ENGINE_MMAP,												// copy from the memory map (default)
+	SG_READ_ENGINE_PREAD												// one pread per block
+};
+
+/* Burst allowed by a plan bandwidth cap, in seconds at the capped rate */
+#define SG_IO_QOS_BURST_SEC 0.25
+
+/* Limit on blocks read ahead per SG file */
+#define SG_MAX_PREFETCH_BLOCKS 16
+
+/* Coalesced reads (see set_sg_plan_read_engine) aim to take about 
+ * SG_COALESCE_TARGET_USEC each and are capped at SG_MAX_COALESCE_BYTES */
+#define SG_COALESCE_TARGET_USEC 50000
+#define SG_MAX_COALESCE_BYTES (64*1024*1024)
+
+/* Measured characteristics of the storage device holding SG files, see
+ * tune_sg_plan_storage. */
+typedef struct sg_storage_profile {
+	dev_t dev;															// st_dev of the SG files
+	double read_mbps;													// sequential read bandwidth, MB/s
+	double write_mbps;													// sequential write bandwidth, MB/s, 0 if not measured
+	double latency_us;													// mean uncached 4 KiB read
+} SGStorageProfile;
+
+/* I/O priority classes of plan worker threads, as for ioprio_set(2) */
+enum sg_io_class {
+	SG_IO_CLASS_NONE,													// leave threads at the process priority
+	SG_IO_CLASS_REALTIME,
+	SG_IO_CLASS_BEST_EFFORT,
+	SG_IO_CLASS_IDLE
+};
+
+/* Priority levels within the realtime and best-effort classes, 0 is 
+ * highest */
+#define SG_IO_LEVELS 8
+
+/* I/O quality of service of a plan, see set_sg_plan_io_qos */
+typedef struct sg_io_qos {
+	int io_class;														// enum sg_io_class
+	int io_level;														// 0 .. SG_IO_LEVELS-1
+	double max_bytes_per_sec;											// bandwidth cap, 0 for none
+	double tokens;														// bytes that may pass without waiting, may go negative
+	struct timespec refill;												// when tokens were last topped up
+	pthread_mutex_t lock;												// guards tokens and refill
+} SGIoQos;
+
+/* Device scheduler counters, see get_sg_device_scheduler_stats */
+typedef struct sg_device_scheduler_stats {
+	uint64_t requests;													// block transfers scheduled
+	uint64_t waits;														// transfers that queued behind another plan
+	uint64_t switches;													// device handed to a different plan
+	int n_devices;														// devices seen
+} SGDeviceSchedulerStats;
+
+/* Checkpoint sidecar of an SG file being written, see 
+ * set_sg_plan_checkpoint */
+#define SG_CHECKPOINT_SUFFIX ".sgck"
+
+/* Outcome of recovering one SG file, see recover_sg_file */
+typedef struct sg_recovery_info {
+	int n_blocks;														// valid blocks in the file
+	int n_scanned;														// of which found by scanning past the last checkpoint
+	off_t size;															// valid bytes, the file is truncated to this
+	off_t truncated;													// bytes removed from the end
+} SGRecoveryInfo;
+
+struct sg_checkpoint;
+
+/* Extended block header flags */
+#define SG_WB_EXT_CRC32C 0x1u											// crc32c is set
+
 /* Set SGPlan to read / write mode */
 enum scatgat_mode {
 	SCATGAT_MODE_READ,
@@ -45,17 +275,239 @@ typedef struct sg_part {
 	off_t iblock; 														// next block to read from / write to in SG file
 	uint32_t *data_buf; 												// points to start VDIF buffer from previous read / for pending write
 	uint32_t n_frames; 													// number of VDIF frames in buffer
+	uint32_t n_block_frames;											// frames in the block on file, before filtering
 	int inherited_block_count;
+	struct sg_plan *sgpln;												// plan this part belongs to
+	uint64_t first_stamp;												// SG_VDIF_STAMP of first frame in data_buf
+	uint64_t last_stamp;												// SG_VDIF_STAMP of last frame in data_buf
+	SGFileId file_id;													// key for the block cache
+	off_t *blk_offset;													// block offsets in extended-format files, else NULL
+	int read_engine;													// enum sg_read_engine
+	int prefetch_blocks;												// blocks read ahead of iblock, 0 leaves it to the kernel
+	uint32_t *stage_bufs[SG_MAX_PREFETCH_BLOCKS+1];						// frames of each block in the run read with pread, NULL once handed out
+	off_t run_start;													// first block of the current coalesced run
+	off_t run_end;														// block after the current run, equal to run_start if none
+	double io_mbps;														// measured throughput of coalesced reads, 0 if unknown
+	struct sg_checkpoint *ckpt;											// checkpoint state of write plans, NULL if disabled
 } SGPart;
 
+struct sg_plan;
+
+/* Completion callback for asynchronous operations. Called from a 
+ * thread of the asynchronous worker pool with the result the 
+ * synchronous call would have returned. */
+typedef void (*sg_async_callback)(struct sg_plan *sgpln, int result, void *user_data);
+
+/* Hooks run by the read workers on each block read, see 
+ * add_sg_plan_frame_hook. A frame hook returns nonzero to drop the 
+ * frame, a block hook returns the number of frames kept, compacted to
+ * the start of frames. */
+#define SG_MAX_HOOKS 16
+typedef int (*sg_frame_hook)(uint32_t *frame, int frame_size, void *user_data);
+typedef int (*sg_block_hook)(uint32_t *frames, int n_frames, int frame_size, void *user_data);
+
+/* Asynchronous operation types */
+enum sg_async_op_type {
+	SG_ASYNC_READ_NEXT_BLOCK,
+	SG_ASYNC_WRITE_FRAMES
+};
+
+/* Single queued asynchronous operation */
+typedef struct sg_async_op {
+	int op;																// sg_async_op_type
+	uint32_t *vdif_buf;													// buffer to read into / write from
+	int n_frames;														// buffer capacity (read) or frame count (write)
+	sg_async_callback cb;												// called on completion, NULL to queue a completion
+	void *user_data;													// passed through to cb
+	int result;															// set on completion
+	struct sg_async_op *next;
+} SGAsyncOp;
+
+/* Completed asynchronous operation, as returned by poll_sg_completions */
+typedef struct sg_completion {
+	int op;																// sg_async_op_type
+	uint32_t *vdif_buf;													// buffer passed on submission
+	int result;															// return value of the synchronous equivalent
+	void *user_data;													// passed on submission
+} SGCompletion;
+
+/* Worker threads shared by all plans, see set_sg_async_workers */
+#define SG_ASYNC_DEFAULT_WORKERS 4
+
+/* Per-plan FIFO of pending operations, executed in submission order by
+ * the asynchronous worker pool */
+typedef struct sg_async_queue {
+	struct sg_plan *sgpln;												// plan the operations are executed on
+	SGAllocator meta_sga;												// allocator of the queue and its operations
+	pthread_mutex_t lock;												// protects the fields below
+	SGAsyncOp *head;													// next operation to execute
+	SGAsyncOp *tail;													// last operation submitted
+	SGAsyncOp *done_head;												// completions not yet polled
+	SGAsyncOp *done_tail;
+	pthread_cond_t done_cond;											// signalled when a completion is queued
+	int pending;														// submitted but not yet completed
+	int efd;															// eventfd, readable while completions are queued
+	int stop;															// set when the plan is closed
+	int detached;														// plan closed from within a callback
+	int scheduled;														// in the pool's ready list or being executed
+	int serving;														// an operation is being executed by server
+	pthread_t server;
+	struct sg_async_queue *ready_next;									// next in the pool's ready list
+} SGAsyncQueue;
+
 /* Encapsulates group of SG files */
 typedef struct sg_plan {
 	int sgm;															// scatgat_mode: read / write
 	int n_sgprt; 														// number of SGPart elements
 	SGPart *sgprt; 														// array of SGPart elements (one per SG file)
 	int block_count;
+	SGAsyncQueue *asq;													// asynchronous operations, NULL until first submit
+	SGAllocator meta_sga;												// small metadata (plan, parts, queues)
+	SGAllocator data_sga;												// large frame buffers
+	SGReadFilter filter;												// applied to blocks read if has_filter
+	int has_filter;
+	int file_version;													// format written by a write plan
+	size_t block_size;													// bytes of frames per block written, WBLOCK_SIZE by default
+	SGIoQos qos;														// priority and bandwidth cap of worker threads
+	int checksums;														// write / verify block CRC32C, see set_sg_plan_checksums
+	int write_probe;													// tune_sg_plan_storage may write a probe file
+	uint64_t checksum_errors;											// blocks that failed verification
+	uint64_t last_stamp;												// stamp of the last frame read, 0 if none
+	struct sg_stats *stats;												// sampler statistics, NULL unless enabled
+	struct sg_quicklook *qlk;											// offered the frames read / written, NULL if none
+	struct sg_hooks *hooks;												// run on each block by the read workers, NULL if none
 } SGPlan;
 
+/* One read plan feeding an SGMerge */
+typedef struct sg_merge_source {
+	SGPlan *sgpln;														// read plan, not owned
+	int remap;															// thread_map is not the identity
+	uint16_t thread_map[SG_MAX_VDIF_THREADS];							// output thread ID per input thread ID
+	int *order;															// SGPart indices of the stitched blocks at hand, in time order
+	int n_order;														// number of stitched blocks at hand
+	int iorder;															// block being emitted
+	int next;															// next frame in the data_buf of that block
+	pthread_t *sg_threads;												// block reads, one per SGPart
+	int *sg_threads_mask;												// block reads started
+	int eof;															// sgpln has no more frames
+} SGMergeSource;
+
+/* Time-aligned merge of several read plans, see make_sg_merge */
+typedef struct sg_merge {
+	int n_src;															// number of sources
+	SGMergeSource *src;													// array of sources
+	int frame_size;														// bytes per frame, same for all sources
+	uint64_t start_stamp;												// earlier frames are dropped, see seek_sg_merge_time
+	SGAllocator meta_sga;												// allocator of this structure
+} SGMerge;
+
+/* Back-to-back scans read as one stream, see make_sg_scan_chain */
+typedef struct sg_scan_chain {
+	int n_scans;														// number of scans
+	char **patterns;													// filename pattern per scan
+	char *fmtstr;														// as for make_sg_read_plan
+	int *mod_list;
+	int n_mod;
+	int *disk_list;
+	int n_disk;
+	int iscan;															// scan being read
+	SGPlan *cur;														// plan of scan iscan, NULL past the end
+	SGPlan *next;														// plan of scan iscan+1, opened in the background
+	int next_result;													// make_sg_read_plan result for next
+	pthread_t opener;													// thread opening next
+	int opening;														// opener started and not yet joined
+	int have_last;														// last_stamp is set
+	uint64_t last_stamp;												// stamp of the last frame returned
+	uint32_t last_threads[SG_MAX_VDIF_THREADS/32];						// VDIF threads returned at last_stamp, one bit each
+	int n_boundaries;													// scan boundaries crossed
+	int n_gaps;															// boundaries with missing frames
+	long n_overlap;														// frames dropped as repeats at boundaries
+	SGAllocator meta_sga;												// allocator of this structure
+} SGScanChain;
+
+/* Longest quick-look FFT */
+#define SG_QL_MAX_FFT 65536
+/* Integrations open at once, frames of earlier intervals are late */
+#define SG_QL_OPEN 2
+
+/* Settings of a quick-look spectrometer, see make_sg_quicklook */
+typedef struct sg_quicklook_config {
+	int fft_size;														// points per FFT, a power of two up to SG_QL_MAX_FFT
+	double interval;													// integration time in seconds
+	int frames_per_second;												// VDIF frames per second of the thread analysed
+	int thread_id;														// VDIF thread analysed, -1 for the first one offered
+	int decimate;														// keep one frame in decimate of those offered
+	int n_workers;														// FFT threads, the core budget
+	int queue_frames;													// frames kept for the workers, more are dropped
+	int max_results;													// spectra kept for the caller, older ones are dropped
+} SGQuickLookConfig;
+
+/* Layout and time of an integrated spectrum, see read_sg_quicklook_spectrum */
+typedef struct sg_spectrum_info {
+	int n_chan;															// channels
+	int n_bins;															// bins per channel
+	int is_complex;														// bins run from -fs/2, else from 0
+	int64_t index;														// interval number, 0 starting at the first frame kept
+	double start_time;													// VDIF seconds (secs_inre) at the start of the interval
+	int n_frames;														// frames integrated
+	int n_fft;															// FFTs integrated per channel
+} SGSpectrumInfo;
+
+/* Frame counts of a quick-look spectrometer */
+typedef struct sg_quicklook_stats {
+	uint64_t n_offered;													// frames of the analysed thread offered
+	uint64_t n_queued;													// frames kept and queued for the workers
+	uint64_t n_dropped;													// frames kept but dropped, the queue was full
+	uint64_t n_late;													// frames of an interval already published
+	uint64_t n_skipped;													// frames invalid or of another format
+	uint64_t n_results_dropped;											// spectra dropped before they were read
+} SGQuickLookStats;
+
+/* Integration in progress or waiting to be read */
+typedef struct sg_quicklook_acc {
+	int64_t index;														// interval number, -1 if unused
+	int n_frames;														// frames integrated
+	int n_fft;															// FFTs integrated per channel
+	double *power;														// [n_chan][n_bins] sums of |X|^2
+} SGQuickLookAcc;
+
+/* Quick-look spectrometer, see make_sg_quicklook */
+typedef struct sg_quicklook {
+	SGQuickLookConfig cfg;												// as given
+	SGAllocator meta_sga;												// allocator of this structure
+	SGAllocator data_sga;												// frame slots and worker buffers
+	pthread_t *workers;													// cfg.n_workers FFT threads
+	pthread_mutex_t lock;												// protects the fields below
+	pthread_cond_t work_cond;											// signalled on queued frames and stop
+	pthread_cond_t idle_cond;											// signalled when a worker finishes a frame
+	int stop;															// set by free_sg_quicklook
+	int format_state;													// 0 until the first frame kept, 1 if usable, -1 if not
+	SGSampleInfo info;													// layout, from the first frame kept
+	uint32_t format_words[3];											// header words 0, 2, 3 masked to the format fields
+	int header_size;													// 32, or 16 for legacy headers
+	int frame_size;														// bytes per frame slot
+	int thread_id;														// VDIF thread analysed
+	int n_bins;															// bins per channel
+	uint32_t first_secs;												// VDIF seconds of interval 0
+	uint64_t n_skip;													// frames offered since the last one kept
+	uint32_t *slots;													// cfg.queue_frames frames
+	int *free_slots;													// stack of free slot indices
+	int n_free;
+	int *ready;															// ring of queued slot indices
+	int ready_head;
+	int n_ready;
+	int n_busy;															// frames being transformed
+	float *tw_re;														// twiddles of the stage of half h at [h, 2h)
+	float *tw_im;
+	int *bitrev;														// bit-reversed index per point
+	int64_t max_index;													// latest interval seen
+	SGQuickLookAcc open[SG_QL_OPEN];									// integrations in progress
+	SGQuickLookAcc *results;											// ring of cfg.max_results spectra
+	int results_head;
+	int n_results;
+	SGQuickLookStats stats;
+} SGQuickLook;
+
 /*
  * Create an SGPlan instance in read-mode.
  * Arguments:
@@ -72,6 +524,7 @@ typedef struct sg_plan {
  *   int n_disk -- Number of disks to use.
  * Returns:
  *   int -- Number of SGInfo instances (SG files found mathcing pattern)
+ *     or -1 if memory could not be allocated.
  * Notes:
  *   The SGInfo entries stored in sgplan are sorted in ascending order
  *     according to the timestamp on the first VDIF frame in each SG 
@@ -109,11 +562,241 @@ int make_sg_read_plan(SGPlan **sgpln, const char *pattern,
  *     that file.
  *   Memory is always allocated to *vdif_buf based on the estimated 
  *     number of frames expected to be read from file(s). It is left to
- *     the user to free *vdif_buf irrespective of whether data was 
- *     received or not.
+ *     the user to free *vdif_buf (see free_sg_plan_buffer) irrespective
+ *     of whether data was received or not.
  */
 int read_next_block_vdif_frames(SGPlan *sgpln, uint32_t **vdif_buf);
 
+/*
+ * Read the next block of VDIF frames into a caller-supplied buffer.
+ * Arguments:
+ *   SGPlan *sgpln -- The SGPlan created for a given filename pattern.
+ *   uint32_t *vdif_buf -- Buffer to receive the stitched VDIF frames.
+ *   int max_frames -- Capacity of vdif_buf in frames.
+ * Returns:
+ *   int -- The number of VDIF frames copied to the buffer, zero if no
+ *     frames could be read, and -1 on error.
+ * Notes:
+ *   Identical to read_next_block_vdif_frames, except that no memory is
+ *     allocated for the output. A buffer with room for 
+ *     get_sg_plan_max_block_frames frames always receives the complete
+ *     contiguous set. If the buffer is smaller, stitching stops at the
+ *     first block that does not fit and the remaining blocks stay 
+ *     parked in their SGPart to be returned by the next call.
+ */
+int read_next_block_vdif_frames_into(SGPlan *sgpln, uint32_t *vdif_buf,
+							int max_frames);
+
+/*
+ * Get the sample layout of the frames in a read plan.
+ * Arguments:
+ *   SGPlan *sgpln -- SGPlan instance created in read-mode.
+ *   SGSampleInfo *info -- Filled from the first frame of the first SG 
+ *     file; n_frames, n_samples and first_stamp are set to zero.
+ * Returns:
+ *   int -- 0 on success, -1 if there are no frames or their format 
+ *     cannot be unpacked.
+ */
+int get_sg_plan_sample_info(SGPlan *sgpln, SGSampleInfo *info);
+
+/*
+ * Read the next block of VDIF frames unpacked into per-channel samples.
+ * Arguments:
+ *   SGPlan *sgpln -- The SGPlan created for a given filename pattern.
+ *   void *out -- Buffer of n_chan channel arrays of int8_t or float, 
+ *     channel c starting at element c*max_values.
+ *   int format -- enum sg_sample_format.
+ *   int max_values -- Capacity of each channel array in values; 
+ *     complex samples take two (I then Q).
+ *   SGSampleInfo *info -- Receives the layout and the number of frames
+ *     and samples unpacked, may be NULL.
+ * Returns:
+ *   int -- The number of VDIF frames unpacked, zero if no frames could
+ *     be read, and -1 on error.
+ * Notes:
+ *   Frames are stitched as by read_next_block_vdif_frames_into, with 
+ *     room for max_values/(samples_per_frame*(1+is_complex)) frames, 
+ *     and unpacked straight from the block buffers instead of being 
+ *     copied, so the samples cost no extra pass over the frames. 
+ *   All frames must share the format of the first; frames of several 
+ *     VDIF threads are unpacked in stream order, so select one thread 
+ *     with a read filter where that matters. Headers are not kept.
+ *   Samples are expanded with AVX2 table lookups where the CPU allows,
+ *     and per-byte tables otherwise.
+ */
+int read_next_block_vdif_samples(SGPlan *sgpln, void *out, int format, 
+							int max_values, SGSampleInfo *info);
+
+/*
+ * Get the size of the frames produced by a channel read.
+ * Arguments:
+ *   SGPlan *sgpln -- SGPlan instance created in read-mode.
+ *   const int *chan_list -- Channels to keep, in ascending order.
+ *   int n_sel -- Number of channels in chan_list.
+ * Returns:
+ *   int -- Size in bytes of each frame returned by 
+ *     read_next_block_vdif_channels, or -1 if the selection cannot be
+ *     applied to the frames of the plan.
+ */
+int get_sg_plan_channel_frame_size(SGPlan *sgpln, const int *chan_list, int n_sel);
+
+/*
+ * Read the next block of VDIF frames, keeping only some channels.
+ * Arguments:
+ *   SGPlan *sgpln -- The SGPlan created for a given filename pattern.
+ *   uint32_t *vdif_buf -- Buffer to receive the narrowed VDIF frames,
+ *     packed at get_sg_plan_channel_frame_size bytes each.
+ *   int max_frames -- Capacity of vdif_buf in frames.
+ *   const int *chan_list -- Channels to keep, in ascending order.
+ *   int n_sel -- Number of channels in chan_list, a power of two.
+ * Returns:
+ *   int -- The number of VDIF frames written to the buffer, zero if no 
+ *     frames could be read, and -1 on error.
+ * Notes:
+ *   Frames are stitched as by read_next_block_vdif_frames_into and the
+ *     kept channels are extracted straight from the block buffers. 
+ *     Each output frame is a valid VDIF frame: the header is copied 
+ *     with the frame length and log2(channels) rewritten, and the 
+ *     payload holds the selected bit fields of every sample in stream
+ *     order, n_sel/n_chan of the input.
+ *   All frames must share the format of the first, and the narrowed 
+ *     payload must be a whole number of 8-byte words.
+ *   Bit fields are gathered with BMI2 bit extraction where the CPU 
+ *     allows, and copied run by run otherwise.
+ */
+int read_next_block_vdif_channels(SGPlan *sgpln, uint32_t *vdif_buf, int max_frames,
+							const int *chan_list, int n_sel);
+
+/*
+ * Collect sampler statistics of the blocks read by a plan.
+ * Arguments:
+ *   SGPlan *sgpln -- SGPlan instance created in read-mode.
+ *   int frames_per_second -- VDIF frames per second of each thread, or
+ *     0 to disable the statistics.
+ *   int bins_per_second -- Time bins per second for the power series.
+ * Returns:
+ *   int -- 0 on success, -1 on error.
+ * Notes:
+ *   The read workers count the sample states of every frame they copy,
+ *     per VDIF thread and channel, and sum the squared sample levels 
+ *     (as returned by read_next_block_vdif_samples) per time bin, while
+ *     the block is still in cache. Any read call collects them, also 
+ *     blocks read again after a seek. Calling again resets them.
+ *   The format is taken from the first frame of the plan and bin 0 
+ *     starts at the earliest second of its files. Invalid frames, 
+ *     frames of another format and frames outside the bins are 
+ *     skipped and counted. Payloads that do not hold a whole number of
+ *     sample times (or of 64-bit word periods) are rejected.
+ *   Set before reading, not while asynchronous reads are queued.
+ */
+int set_sg_plan_stats(SGPlan *sgpln, int frames_per_second, int bins_per_second);
+
+/*
+ * Get the summary of the sampler statistics of a plan.
+ * Arguments:
+ *   SGPlan *sgpln -- SGPlan instance with statistics enabled.
+ *   SGStatsInfo *info -- Receives the summary.
+ *   int *thread_ids -- Receives the IDs of the VDIF threads seen in 
+ *     ascending order, may be NULL.
+ *   int max_threads -- Capacity of thread_ids.
+ * Returns:
+ *   int -- 0 on success, -1 if statistics are not enabled.
+ */
+int get_sg_plan_stats_info(SGPlan *sgpln, SGStatsInfo *info, int *thread_ids, int max_threads);
+
+/*
+ * Get the sampler statistics of one VDIF thread.
+ * Arguments:
+ *   SGPlan *sgpln -- SGPlan instance with statistics enabled.
+ *   int thread_id -- VDIF thread ID.
+ *   uint64_t *counts -- Receives n_chan histograms of 
+ *     1 << bits_per_sample state counts, channel c starting at 
+ *     c << bits_per_sample, may be NULL.
+ *   double *power -- Receives the mean squared sample level per bin and
+ *     channel at power[bin*n_chan + c], 0 for empty bins, may be NULL.
+ *   int max_bins -- Capacity of power in bins.
+ * Returns:
+ *   int -- The number of bins written to power, or -1 if the thread 
+ *     was not seen.
+ */
+int get_sg_plan_thread_stats(SGPlan *sgpln, int thread_id, uint64_t *counts, double *power, int max_bins);
+
+/*
+ * Add a per-frame hook to the chain run by the read workers.
+ * Arguments:
+ *   SGPlan *sgpln -- SGPlan instance created in read-mode.
+ *   sg_frame_hook fn -- Called with each frame of each block read, 
+ *     which it may modify in place. Returns nonzero to drop the frame.
+ *   void *user_data -- Passed through to fn.
+ * Returns:
+ *   int -- 0 on success, -1 on error.
+ * Notes:
+ *   Hooks run in the order added, in the worker thread of each SG file
+ *     while the block is still in cache, so that header rewrites and 
+ *     flagging cost no extra pass over the output. Frame hooks added 
+ *     before any block hook run during the copy from file, a chunk of
+ *     frames at a time; the others in one pass over the block after it.
+ *   The workers of a plan run concurrently, so hooks must be thread 
+ *     safe. Any read call runs them, also on blocks read again after a
+ *     seek or served from the block cache, which keeps the frames as 
+ *     stored.
+ *   Stitching uses the time stamps of the frames as stored. Hooks may 
+ *     rewrite any header field, but frames whose time is moved are 
+ *     returned where the original time would have placed them.
+ *   Add before reading, not while asynchronous reads are queued.
+ */
+int add_sg_plan_frame_hook(SGPlan *sgpln, sg_frame_hook fn, void *user_data);
+
+/*
+ * Add a per-block hook to the chain run by the read workers.
+ * Arguments:
+ *   SGPlan *sgpln -- SGPlan instance created in read-mode.
+ *   sg_block_hook fn -- Called with the frames of each block read, 
+ *     after the hooks added before it. Returns the number of frames 
+ *     kept, moved to the start of the frames.
+ *   void *user_data -- Passed through to fn.
+ * Returns:
+ *   int -- 0 on success, -1 on error.
+ * Notes:
+ *   See add_sg_plan_frame_hook. A block hook is not called for blocks 
+ *     left without frames.
+ */
+int add_sg_plan_block_hook(SGPlan *sgpln, sg_block_hook fn, void *user_data);
+
+/*
+ * Remove all hooks of a plan.
+ * Arguments:
+ *   SGPlan *sgpln -- SGPlan instance.
+ * Returns:
+ *   void
+ * Notes:
+ *   Not while asynchronous reads are queued.
+ */
+void clear_sg_plan_hooks(SGPlan *sgpln);
+
+/*
+ * Reposition a read plan at a given block index.
+ * Arguments:
+ *   SGPlan *sgpln -- SGPlan instance created in read-mode.
+ *   off_t iblock -- Block index to continue reading from in every SG 
+ *     file, clipped to the number of blocks in each file.
+ * Returns:
+ *   int -- 0 on success, -1 on error.
+ * Notes:
+ *   Blocks parked from previous reads are discarded. Must not be 
+ *     called while asynchronous operations are pending.
+ */
+int seek_sg_read_plan(SGPlan *sgpln, off_t iblock);
+
+/*
+ * Get the maximum number of frames a single block read may return.
+ * Arguments:
+ *   SGPlan *sgpln -- SGPlan instance created in read-mode.
+ * Returns:
+ *   int -- Sum over all SG files of the packets per block.
+ */
+int get_sg_plan_max_block_frames(SGPlan *sgpln);
+
 /*
  * Read one block's worth of VDIF frames from a group of SG files.
  * Arguments:
@@ -140,11 +823,386 @@ int read_next_block_vdif_frames(SGPlan *sgpln, uint32_t **vdif_buf);
 int read_block_vdif_frames(SGPlan *sgpln, off_t iblock, 
 							uint32_t **vdif_buf);
 
+/*
+ * Initialize a read filter that matches every frame.
+ * Arguments:
+ *   SGReadFilter *flt -- Filter to initialize.
+ * Return:
+ *   void
+ */
+void init_sg_read_filter(SGReadFilter *flt);
+
+/*
+ * Add a VDIF thread to the set selected by a read filter.
+ * Arguments:
+ *   SGReadFilter *flt -- Filter to update.
+ *   int thread_id -- VDIF thread ID, 0 to 1023.
+ * Returns:
+ *   int -- 0 on success, -1 if thread_id is out of range.
+ * Notes:
+ *   A filter without any thread added selects all threads.
+ */
+int add_sg_read_filter_thread(SGReadFilter *flt, int thread_id);
+
+/*
+ * Set or clear the read filter of a read plan.
+ * Arguments:
+ *   SGPlan *sgpln -- SGPlan instance created in read-mode.
+ *   const SGReadFilter *flt -- Filter to copy into the plan, or NULL to
+ *     read all frames.
+ * Returns:
+ *   int -- 0 on success, -1 on error.
+ * Notes:
+ *   Blocks that end before the time range are skipped after reading 
+ *     only their first and last headers, and a file is finished at the
+ *     first block that starts after the range. Within the remaining 
+ *     blocks only matching frames are copied, so the I/O is roughly 
+ *     proportional to the data selected.
+ *   Reads return fewer frames than an unfiltered read, but never zero 
+ *     before the end of the selected data.
+ *   The filter applies to blocks read after the call. Blocks already 
+ *     parked in the plan keep the frames selected when they were read,
+ *     so set the filter before the first read or after a seek.
+ */
+int set_sg_read_filter(SGPlan *sgpln, const SGReadFilter *flt);
+
+/*
+ * Reposition a read plan at a given time.
+ * Arguments:
+ *   SGPlan *sgpln -- SGPlan instance created in read-mode.
+ *   uint64_t stamp -- Time as SG_MAKE_STAMP(secs, df_num).
+ * Returns:
+ *   int -- 0 on success, -1 on error.
+ * Notes:
+ *   Each SG file continues from the first block that ends at or after
+ *     stamp, found by binary search over the blocks. Extended-format 
+ *     files answer from block headers alone; legacy files read the 
+ *     first frame header of each block probed.
+ *   Frames before stamp in that first block are returned unless a read
+ *     filter excludes them. Blocks parked from previous reads are 
+ *     discarded.
+ */
+int seek_sg_read_plan_time(SGPlan *sgpln, uint64_t stamp);
+
+/*
+ * Get the size of the read cursor of a plan.
+ * Arguments:
+ *   SGPlan *sgpln -- SGPlan instance created in read-mode.
+ * Returns:
+ *   size_t -- Bytes needed by save_sg_read_cursor.
+ */
+size_t get_sg_read_cursor_size(SGPlan *sgpln);
+
+/*
+ * Save the read position of a plan.
+ * Arguments:
+ *   SGPlan *sgpln -- SGPlan instance created in read-mode.
+ *   void *buf -- Buffer to receive the cursor.
+ *   size_t size -- Capacity of buf, at least get_sg_read_cursor_size.
+ * Returns:
+ *   int -- Bytes written to buf, or -1 on error.
+ * Notes:
+ *   The cursor is a flat, checksummed record of the identity and next 
+ *     block of each SG file, plus the stamp of the last frame read, 
+ *     and can be written to disk as is. Blocks parked in the plan are 
+ *     recorded as not yet read, so that restoring reads them again and
+ *     the stream continues at the exact frame where it stopped.
+ *   Must not be called while asynchronous reads are pending.
+ */
+int save_sg_read_cursor(SGPlan *sgpln, void *buf, size_t size);
+
+/*
+ * Restore the read position of a plan saved with save_sg_read_cursor.
+ * Arguments:
+ *   SGPlan *sgpln -- SGPlan instance created in read-mode over the same
+ *     SG files.
+ *   const void *buf -- Saved cursor.
+ *   size_t size -- Bytes in buf.
+ * Returns:
+ *   int -- 0 on success, -1 if the cursor is damaged or the files 
+ *     differ (device, inode, size or modification time); the plan is 
+ *     then left unchanged.
+ * Notes:
+ *   Takes time proportional to the number of SG files; no data is read
+ *     until the next read.
+ */
+int restore_sg_read_cursor(SGPlan *sgpln, const void *buf, size_t size);
+
+/*
+ * Read only the VDIF headers of all frames in a read plan.
+ * Arguments:
+ *   SGPlan *sgpln -- SGPlan instance created in read-mode.
+ *   SGHeaderScan **scan -- Address of pointer to receive the columns.
+ * Returns:
+ *   int -- Number of frames scanned, or -1 on error.
+ * Notes:
+ *   Only the header words of each frame are touched, with the file 
+ *     mappings advised for random access so that payload pages are not
+ *     read ahead. Each SG file is scanned in its own thread.
+ *   Rows are grouped by SG file in plan order, and within each file 
+ *     are in block and frame order; sort on (secs, df_num) for time 
+ *     order across files.
+ *   The read position of the plan is not changed. Release the result 
+ *     with free_sg_header_scan.
+ */
+int scan_sg_plan_headers(SGPlan *sgpln, SGHeaderScan **scan);
+
+/*
+ * Release the result of scan_sg_plan_headers.
+ * Arguments:
+ *   SGPlan *sgpln -- Plan that produced the scan.
+ *   SGHeaderScan *scan -- Scan to release, may be NULL.
+ * Return:
+ *   void
+ */
+void free_sg_header_scan(SGPlan *sgpln, SGHeaderScan *scan);
+
 /*
  * Close scatter gather reader plan
  */
 void close_sg_read_plan(SGPlan *sgplan);
 
+/*
+ * Create a time-aligned merge of several read plans.
+ * Arguments:
+ *   SGMerge **sgmrg -- Address of SGMerge pointer to allocate memory.
+ *   SGPlan **plans -- Read plans to merge, e.g. one per band recorded 
+ *     on its own module group.
+ *   int n_plans -- Number of plans.
+ * Returns:
+ *   int -- Number of sources on success, -1 on error.
+ * Notes:
+ *   The plans must be in read mode, hold at least one SG file and 
+ *     share a frame size. They remain owned by the caller and must 
+ *     outlive the merge; they should not be read directly meanwhile.
+ *   Frames are merged straight from the block buffers of the SG files
+ *     of each plan; the blocks of all sources are read at the same 
+ *     time.
+ */
+int make_sg_merge(SGMerge **sgmrg, SGPlan **plans, int n_plans);
+
+/*
+ * Rename a VDIF thread of one merge source in the output.
+ * Arguments:
+ *   SGMerge *sgmrg -- Merge created with make_sg_merge.
+ *   int isrc -- Index of the source, in the order given.
+ *   int thread_in -- Thread ID as recorded.
+ *   int thread_out -- Thread ID to emit.
+ * Returns:
+ *   int -- 0 on success, -1 on error.
+ * Notes:
+ *   Used to keep thread IDs unique when bands were recorded with the 
+ *     same IDs. The header word is rewritten in the output buffer as 
+ *     frames are copied to it.
+ */
+int set_sg_merge_thread_map(SGMerge *sgmrg, int isrc, int thread_in, int thread_out);
+
+/*
+ * Position all sources of a merge at a time.
+ * Arguments:
+ *   SGMerge *sgmrg -- Merge created with make_sg_merge.
+ *   uint64_t stamp -- Time to start from, as from SG_MAKE_STAMP.
+ * Returns:
+ *   int -- 0 on success, -1 if no source has data from stamp.
+ * Notes:
+ *   Each plan is positioned with seek_sg_read_plan_time, and frames 
+ *     earlier than stamp are dropped, so that all sources start 
+ *     together.
+ */
+int seek_sg_merge_time(SGMerge *sgmrg, uint64_t stamp);
+
+/*
+ * Read the next frames of a merge in time order.
+ * Arguments:
+ *   SGMerge *sgmrg -- Merge created with make_sg_merge.
+ *   uint32_t *vdif_buf -- Buffer to receive the frames.
+ *   int max_frames -- Capacity of vdif_buf in frames.
+ * Returns:
+ *   int -- Number of frames copied, 0 at the end of all sources, and 
+ *     -1 on error.
+ * Notes:
+ *   Frames of all sources are interleaved by VDIF timestamp; frames 
+ *     with equal stamps follow source order, and the order within each 
+ *     source is kept. Sources that run out early simply drop out of 
+ *     the stream.
+ *   Runs of frames are copied once, from the blocks as read from the 
+ *     SG files into vdif_buf. Merging also reads the header of each 
+ *     frame to compare stamps, and rewrites it in vdif_buf for sources
+ *     with a thread map. When a source needs more data, the next blocks
+ *     of all such sources are read concurrently.
+ */
+int read_next_sg_merge_frames(SGMerge *sgmrg, uint32_t *vdif_buf, int max_frames);
+
+/*
+ * Free an SGMerge and its buffers. The plans are not closed.
+ * Arguments:
+ *   SGMerge *sgmrg -- Merge created with make_sg_merge, may be NULL.
+ * Return:
+ *   void
+ */
+void free_sg_merge(SGMerge *sgmrg);
+
+/*
+ * Create a reader for consecutive scans presented as one stream.
+ * Arguments:
+ *   SGScanChain **chain -- Address of SGScanChain pointer to allocate 
+ *     memory.
+ *   const char **patterns -- Filename pattern of each scan, in time 
+ *     order.
+ *   int n_scans -- Number of scans.
+ *   const char *fmtstr, int *mod_list, int n_mod, int *disk_list, 
+ *     int n_disk -- As for make_sg_read_plan, common to all scans.
+ * Returns:
+ *   int -- Number of scans on success, -1 on error.
+ * Notes:
+ *   The plan of the first scan is opened here; the plan of each 
+ *     following scan is opened by a background thread while the one 
+ *     before it is read, so crossing a boundary does not wait for file
+ *     discovery.
+ */
+int make_sg_scan_chain(SGScanChain **chain, const char **patterns, int n_scans, 
+					const char *fmtstr, int *mod_list, int n_mod, 
+					int *disk_list, int n_disk);
+
+/*
+ * Read the next frames of a scan chain.
+ * Arguments:
+ *   SGScanChain *chain -- Chain created with make_sg_scan_chain.
+ *   uint32_t *vdif_buf -- Buffer to receive the frames.
+ *   int max_frames -- Capacity of vdif_buf in frames, at least 
+ *     get_sg_plan_max_block_frames of each scan.
+ * Returns:
+ *   int -- Number of frames copied, 0 after the last scan, and -1 on 
+ *     error.
+ * Notes:
+ *   Reads as read_next_block_vdif_frames_into within a scan, and moves
+ *     on to the next scan when one is exhausted. Scans that cannot be 
+ *     opened are skipped with a warning.
+ *   At each boundary the first frame of the new scan is checked 
+ *     against the last frame returned. Frames before the stamp of that
+ *     frame, and frames at its stamp of VDIF threads already returned 
+ *     at it, are dropped as repeats (n_overlap); other threads at that
+ *     stamp are kept. A jump other than to the next frame number, or 
+ *     to frame 0 of the next second, is reported and counted in 
+ *     n_gaps; the frame rate is not assumed, so gaps ending exactly on
+ *     a second boundary pass.
+ */
+int read_next_sg_chain_frames(SGScanChain *chain, uint32_t *vdif_buf, int max_frames);
+
+/*
+ * Free a scan chain, closing its plans.
+ * Arguments:
+ *   SGScanChain *chain -- Chain created with make_sg_scan_chain, may be
+ *     NULL.
+ * Return:
+ *   void
+ */
+void free_sg_scan_chain(SGScanChain *chain);
+
+/*
+ * Create a quick-look spectrometer.
+ * Arguments:
+ *   SGQuickLook **qlk -- Address of SGQuickLook pointer to allocate 
+ *     memory.
+ *   const SGQuickLookConfig *cfg -- Settings.
+ * Returns:
+ *   int -- 0 on success, -1 on error.
+ * Notes:
+ *   Frames are offered with offer_sg_quicklook_frames, or by the read 
+ *     and write calls of plans it is attached to (attach_sg_quicklook).
+ *     Offering never waits: one frame in cfg.decimate of the analysed 
+ *     thread is copied to a free slot of the queue, and dropped if 
+ *     none is free, so the quick-look samples a full-rate stream 
+ *     instead of slowing it down.
+ *   cfg.n_workers threads unpack the queued frames, transform every 
+ *     channel in segments of cfg.fft_size samples, and integrate |X|^2 
+ *     over intervals of cfg.interval seconds of VDIF time. An interval
+ *     is published to the result queue once frames two intervals later
+ *     arrive, or by flush_sg_quicklook.
+ *   Real samples give fft_size/2 bins from 0, two segments sharing one
+ *     complex FFT; complex samples give fft_size bins from -fs/2.
+ *   The format is taken from the first frame kept; fft_size must not 
+ *     exceed the samples per channel of a frame.
+ */
+int make_sg_quicklook(SGQuickLook **qlk, const SGQuickLookConfig *cfg);
+
+/*
+ * Feed a quick-look spectrometer from a plan.
+ * Arguments:
+ *   SGPlan *sgpln -- SGPlan instance, read or write mode.
+ *   SGQuickLook *qlk -- Spectrometer, or NULL to detach.
+ * Returns:
+ *   int -- 0 on success.
+ * Notes:
+ *   Read plans offer the frames of every block returned, write plans 
+ *     the frames of every write_vdif_frames call, so a scan can be 
+ *     watched while it is recorded. Several plans may feed one 
+ *     spectrometer. Detach before freeing the spectrometer.
+ */
+int attach_sg_quicklook(SGPlan *sgpln, SGQuickLook *qlk);
+
+/*
+ * Offer frames to a quick-look spectrometer.
+ * Arguments:
+ *   SGQuickLook *qlk -- Spectrometer created with make_sg_quicklook.
+ *   const uint32_t *frames -- VDIF frames.
+ *   int n_frames -- Number of frames.
+ *   int frame_size -- Frame size in bytes.
+ * Returns:
+ *   int -- The number of frames queued for the workers.
+ */
+int offer_sg_quicklook_frames(SGQuickLook *qlk, const uint32_t *frames, int n_frames, int frame_size);
+
+/*
+ * Finish the frames queued and publish every open integration.
+ * Arguments:
+ *   SGQuickLook *qlk -- Spectrometer created with make_sg_quicklook.
+ * Returns:
+ *   void
+ * Notes:
+ *   Use at the end of a scan, later frames of the same intervals are 
+ *     counted as late.
+ */
+void flush_sg_quicklook(SGQuickLook *qlk);
+
+/*
+ * Take the oldest integrated spectrum.
+ * Arguments:
+ *   SGQuickLook *qlk -- Spectrometer created with make_sg_quicklook.
+ *   float *spec -- Receives the mean |X[k]|^2/fft_size per FFT, channel 
+ *     c at spec[c*n_bins].
+ *   int max_values -- Capacity of spec.
+ *   SGSpectrumInfo *info -- Receives the layout and time of the 
+ *     spectrum, may be NULL.
+ * Returns:
+ *   int -- 1 if a spectrum was taken, 0 if none is ready, and -1 if 
+ *     spec cannot hold n_chan*n_bins values; the spectrum then stays 
+ *     queued and info gives its layout.
+ */
+int read_sg_quicklook_spectrum(SGQuickLook *qlk, float *spec, int max_values, SGSpectrumInfo *info);
+
+/*
+ * Get the frame counts of a quick-look spectrometer.
+ * Arguments:
+ *   SGQuickLook *qlk -- Spectrometer created with make_sg_quicklook.
+ *   SGQuickLookStats *stats -- Receives the counts.
+ * Returns:
+ *   void
+ */
+void get_sg_quicklook_stats(SGQuickLook *qlk, SGQuickLookStats *stats);
+
+/*
+ * Stop a quick-look spectrometer and free it.
+ * Arguments:
+ *   SGQuickLook *qlk -- Spectrometer created with make_sg_quicklook, 
+ *     detached from all plans.
+ * Returns:
+ *   void
+ * Notes:
+ *   Frames still queued are discarded, flush first to keep them.
+ */
+void free_sg_quicklook(SGQuickLook *qlk);
+
 /*
  * Make scatter gather write plan. 
  */
@@ -162,6 +1220,467 @@ int write_vdif_frames(SGPlan *sgpln, uint32_t *vdif_buf, int n_frames);
  */
 void close_sg_write_plan(SGPlan *sgpln);
 
+/*
+ * Select the SG file format revision written by a write plan.
+ * Arguments:
+ *   SGPlan *sgpln -- SGPlan instance created in write-mode.
+ *   int version -- FILE_VERSION (default) or SG_FILE_VERSION_EXT.
+ * Returns:
+ *   int -- 0 on success, -1 on error.
+ * Notes:
+ *   Must be called before the first write. With SG_FILE_VERSION_EXT 
+ *     each block header also records the first / last frame stamps, the
+ *     frame count and the set of VDIF threads in the block. Read plans 
+ *     accept both revisions.
+ */
+int set_sg_plan_file_version(SGPlan *sgpln, int version);
+
+/*
+ * Set the block size used by a write plan.
+ * Arguments:
+ *   SGPlan *sgpln -- SGPlan instance created in write-mode.
+ *   size_t block_size -- Bytes of frames per block, between 
+ *     SG_MIN_BLOCK_SIZE and SG_MAX_BLOCK_SIZE.
+ * Returns:
+ *   int -- 0 on success, -1 on error.
+ * Notes:
+ *   Must be called before the first write. Each block holds as many 
+ *     whole frames as fit in block_size, which is recorded in the file
+ *     header, and files grow in multiples of it. Read plans take the 
+ *     block size from each file, so files written with different block
+ *     sizes can be read together.
+ *   Larger blocks favour streaming bandwidth, smaller blocks reduce the
+ *     latency until frames reach storage. The default is WBLOCK_SIZE.
+ */
+int set_sg_plan_block_size(SGPlan *sgpln, size_t block_size);
+
+/*
+ * Enable per-block CRC32C checksums.
+ * Arguments:
+ *   SGPlan *sgpln -- SGPlan instance, read or write mode.
+ *   int enable -- Non-zero to enable, 0 to disable.
+ * Returns:
+ *   int -- 0 on success, -1 on error.
+ * Notes:
+ *   Write plans compute the CRC32C of the frames of each block while 
+ *     copying them into the file and store it in the extended block 
+ *     header, so enabling checksums selects SG_FILE_VERSION_EXT and 
+ *     must be done before the first write.
+ *   Read plans verify blocks that carry a checksum while copying them 
+ *     out of the file (or the read-ahead buffer). A mismatch is 
+ *     reported on stderr and counted (get_sg_plan_checksum_errors); the
+ *     frames are still returned. Blocks served from the block cache 
+ *     are not verified again.
+ *   The CRC uses the SSE4.2 crc32 instruction over three interleaved 
+ *     streams where available, and a table-driven fallback otherwise.
+ */
+int set_sg_plan_checksums(SGPlan *sgpln, int enable);
+
+/*
+ * Get the number of blocks that failed checksum verification.
+ * Arguments:
+ *   SGPlan *sgpln -- SGPlan instance created in read-mode.
+ * Returns:
+ *   uint64_t -- Blocks read with a CRC32C mismatch.
+ */
+uint64_t get_sg_plan_checksum_errors(SGPlan *sgpln);
+
+/*
+ * Compute a CRC32C (Castagnoli) checksum.
+ * Arguments:
+ *   uint32_t crc -- CRC of the preceding data, 0 to start.
+ *   const void *buf -- Data.
+ *   size_t n -- Bytes in buf.
+ * Returns:
+ *   uint32_t -- CRC of the preceding data followed by buf.
+ */
+uint32_t compute_sg_crc32c(uint32_t crc, const void *buf, size_t n);
+
+/*
+ * Checkpoint a write plan every few blocks for crash recovery.
+ * Arguments:
+ *   SGPlan *sgpln -- SGPlan instance created in write-mode.
+ *   int n_blocks -- Blocks per SG file between checkpoints.
+ * Returns:
+ *   int -- 0 on success, -1 on error.
+ * Notes:
+ *   Must be called before the first write. Each SG file gets a sidecar
+ *     file, its name plus SG_CHECKPOINT_SUFFIX. Every n_blocks blocks 
+ *     the worker thread syncs the SG file, then appends the number of
+ *     those blocks, the last block number and the valid file size to 
+ *     the sidecar and syncs it, so a checkpoint costs two syncs and a 
+ *     fixed-size record.
+ *   close_sg_write_plan removes the sidecars, so a sidecar left behind
+ *     marks a file that was not closed cleanly; see recover_sg_file.
+ */
+int set_sg_plan_checkpoint(SGPlan *sgpln, int n_blocks);
+
+/*
+ * Restore an SG file left behind by a write plan that did not close.
+ * Arguments:
+ *   const char *filename -- SG file to recover.
+ *   SGRecoveryInfo *info -- Filled with the outcome, may be NULL.
+ * Returns:
+ *   int -- 0 on success, -1 on error.
+ * Notes:
+ *   Blocks up to the last complete checkpoint in the sidecar are taken
+ *     as valid without reading them. Past it, or from the start if 
+ *     there is no sidecar, block headers are walked while they are 
+ *     consistent with the file header and the first and last frame 
+ *     headers of each block match the frame size; blocknum must 
+ *     increase. The file is truncated after the last valid block, 
+ *     dropping the tail preallocated by the writer, and the sidecar is
+ *     removed.
+ *   Frames inside blocks past the checkpoint are not verified.
+ */
+int recover_sg_file(const char *filename, SGRecoveryInfo *info);
+
+/*
+ * Recover all SG files of a scan in parallel, see recover_sg_file.
+ * Arguments:
+ *   const char *pattern, *fmtstr, int *mod_list, int n_mod, 
+ *     int *disk_list, int n_disk -- As for make_sg_read_plan.
+ * Returns:
+ *   int -- Number of SG files recovered, or -1 if any file that exists
+ *     could not be recovered.
+ */
+int recover_sg_files(const char *pattern, const char *fmtstr, 
+					int *mod_list, int n_mod, int *disk_list, int n_disk);
+
+/*
+ * Submit an asynchronous read of the next block of VDIF frames.
+ * Arguments:
+ *   SGPlan *sgpln -- SGPlan instance created in read-mode.
+ *   uint32_t *vdif_buf -- Buffer to receive the frames, which must
+ *     remain valid until the callback has been called.
+ *   int max_frames -- Capacity of vdif_buf in frames.
+ *   sg_async_callback cb -- Completion callback, may be NULL.
+ *   void *user_data -- Passed through to cb.
+ * Returns:
+ *   int -- 0 if the operation was queued, -1 on error.
+ * Notes:
+ *   The operation is executed by a thread of the worker pool shared 
+ *     by all plans (see set_sg_async_workers), so many plans are served
+ *     by a few threads. Operations on a plan are executed one at a time
+ *     in submission order, and cb receives the return value of 
+ *     read_next_block_vdif_frames_into. A callback occupies its pool 
+ *     thread until it returns, so it should not block.
+ *   Synchronous reads must not be mixed with pending asynchronous
+ *     operations on the same plan.
+ *   If cb is NULL the completion is queued instead, to be collected 
+ *     with poll_sg_completions or wait_sg_completions.
+ */
+int submit_sg_read_next_block(SGPlan *sgpln, uint32_t *vdif_buf, 
+					int max_frames, sg_async_callback cb, void *user_data);
+
+/*
+ * Submit an asynchronous write of VDIF frames.
+ * Arguments:
+ *   SGPlan *sgpln -- SGPlan instance created in write-mode.
+ *   uint32_t *vdif_buf -- Buffer containing the frames to write, which
+ *     must remain valid until the callback has been called.
+ *   int n_frames -- Number of frames to write.
+ *   sg_async_callback cb -- Completion callback, may be NULL.
+ *   void *user_data -- Passed through to cb.
+ * Returns:
+ *   int -- 0 if the operation was queued, -1 on error.
+ * Notes:
+ *   See submit_sg_read_next_block. cb receives the return value of 
+ *     write_vdif_frames.
+ */
+int submit_sg_write_vdif_frames(SGPlan *sgpln, uint32_t *vdif_buf, 
+					int n_frames, sg_async_callback cb, void *user_data);
+
+/*
+ * Set the number of threads executing asynchronous operations.
+ * Arguments:
+ *   int n_workers -- Size of the worker pool shared by all plans, 
+ *     SG_ASYNC_DEFAULT_WORKERS by default.
+ * Returns:
+ *   int -- 0 on success, -1 if n_workers is less than one.
+ * Notes:
+ *   Threads are started as operations are queued, up to n_workers. 
+ *     When the size is reduced, idle threads beyond it exit.
+ *   Each thread executes one operation of one plan at a time, taking 
+ *     plans with queued operations in turn.
+ */
+int set_sg_async_workers(int n_workers);
+
+/*
+ * Get the completion eventfd of an SGPlan.
+ * Arguments:
+ *   SGPlan *sgpln -- Pointer to SGPlan.
+ * Returns:
+ *   int -- Non-blocking eventfd that is readable while completions are
+ *     queued, or -1 on error.
+ * Notes:
+ *   Suitable for registering with epoll (EPOLLIN). The descriptor is
+ *     owned by the plan and closed when the plan is closed. Creates the
+ *     plan's operation queue if necessary.
+ */
+int get_sg_plan_eventfd(SGPlan *sgpln);
+
+/*
+ * Collect queued completions without blocking.
+ * Arguments:
+ *   SGPlan *sgpln -- Pointer to SGPlan.
+ *   SGCompletion *completions -- Array to receive completions.
+ *   int max_completions -- Size of the array.
+ * Returns:
+ *   int -- Number of completions stored, in completion order.
+ * Notes:
+ *   Only operations submitted without a callback produce completions.
+ *   Resets the eventfd before collecting, so a wake-up is never lost.
+ *     Completions left queued because the array is full keep it 
+ *     readable.
+ */
+int poll_sg_completions(SGPlan *sgpln, SGCompletion *completions, 
+					int max_completions);
+
+/*
+ * Collect queued completions, blocking until at least one is available.
+ * Arguments:
+ *   SGPlan *sgpln -- Pointer to SGPlan.
+ *   SGCompletion *completions -- Array to receive completions.
+ *   int max_completions -- Size of the array.
+ * Returns:
+ *   int -- Number of completions stored, zero if no operations are
+ *     pending.
+ */
+int wait_sg_completions(SGPlan *sgpln, SGCompletion *completions, 
+					int max_completions);
+
+/*
+ * Set the allocators used by plans created from now on.
+ * Arguments:
+ *   const SGAllocator *meta_sga -- Allocator for small metadata 
+ *     (plans, parts, SGInfo copies, queue entries), or NULL for the 
+ *     default based on malloc / free.
+ *   const SGAllocator *data_sga -- Allocator for large frame buffers 
+ *     (per-file blocks and gathered output), or NULL for the default 
+ *     based on posix_memalign / free.
+ * Return:
+ *   void
+ * Notes:
+ *   Setup only: the defaults are not locked, so call this before any
+ *     plan, merge, scan chain or quick-look is created and before the 
+ *     block cache is enabled, and not while another thread uses the 
+ *     library. Objects keep the allocators they were created with, 
+ *     which must stay usable until those objects are freed.
+ *   File names allocated by sg_access are always released with free.
+ */
+void set_sg_default_allocators(const SGAllocator *meta_sga, 
+					const SGAllocator *data_sga);
+
+/*
+ * Get the allocators used by plans created from now on.
+ * Arguments:
+ *   SGAllocator *meta_sga -- Receives the metadata allocator, may be 
+ *     NULL.
+ *   SGAllocator *data_sga -- Receives the frame buffer allocator, may 
+ *     be NULL.
+ * Return:
+ *   void
+ */
+void get_sg_default_allocators(SGAllocator *meta_sga, SGAllocator *data_sga);
+
+/*
+ * Set the allocator for large frame buffers of a single plan.
+ * Arguments:
+ *   SGPlan *sgpln -- Pointer to SGPlan.
+ *   const SGAllocator *data_sga -- Allocator for frame buffers, or NULL
+ *     for the default based on posix_memalign / free.
+ * Returns:
+ *   int -- 0 on success, -1 if the plan still holds frame buffers 
+ *     allocated by the previous allocator.
+ */
+int set_sg_plan_data_allocator(SGPlan *sgpln, const SGAllocator *data_sga);
+
+/*
+ * Release a buffer returned by read_next_block_vdif_frames or 
+ * read_block_vdif_frames.
+ * Arguments:
+ *   SGPlan *sgpln -- Plan that allocated the buffer.
+ *   void *buf -- Buffer to release, may be NULL.
+ * Return:
+ *   void
+ * Notes:
+ *   With the default data allocator plain free() is equivalent.
+ */
+void free_sg_plan_buffer(SGPlan *sgpln, void *buf);
+
+/*
+ * Enable the process-wide block cache, or change its budget.
+ * Arguments:
+ *   size_t budget -- Maximum bytes of frame data to keep cached, 0 to
+ *     disable the cache and drop all entries.
+ * Returns:
+ *   int -- 0 on success, -1 on error.
+ * Notes:
+ *   The cache is shared by all read plans in the process and holds 
+ *     copies of whole SG blocks keyed by file identity and block index,
+ *     so that repeated reads of the same blocks (also through fresh 
+ *     plans) are served by a memcpy instead of from the file.
+ *   Entries are evicted with the CLOCK approximation of LRU when the 
+ *     budget is exceeded. Lowering the budget evicts immediately.
+ *   Cached blocks use the default data allocator at the time they are
+ *     inserted.
+ */
+int set_sg_block_cache_budget(size_t budget);
+
+/*
+ * Drop all entries from the block cache, keeping its budget.
+ * Return:
+ *   void
+ */
+void clear_sg_block_cache(void);
+
+/*
+ * Get block cache counters.
+ * Arguments:
+ *   SGBlockCacheStats *stats -- Filled with the current counters.
+ * Return:
+ *   void
+ */
+void get_sg_block_cache_stats(SGBlockCacheStats *stats);
+
+/*
+ * Enable the process-wide per-device I/O scheduler, or change it.
+ * Arguments:
+ *   size_t batch_bytes -- Bytes a plan may transfer on a device before
+ *     it must give way to other plans, 0 to disable the scheduler.
+ *   int hold_usec -- Time a device stays reserved for its current plan
+ *     after a transfer, waiting for that plan's next request.
+ * Returns:
+ *   int -- 0 on success, -1 on error.
+ * Notes:
+ *   SG files are mapped to devices by st_dev. With the scheduler on, 
+ *     the block transfers of all plans on a device go through it: the 
+ *     device is granted to one plan at a time for up to batch_bytes of
+ *     consecutive blocks, and other plans queue in arrival order. 
+ *     Write plans and plans in SG_IO_CLASS_REALTIME queue ahead of all
+ *     other plans, and those in SG_IO_CLASS_IDLE behind them; a plan 
+ *     owning the device gives it up after its transfers in progress 
+ *     when more urgent transfers wait. Writes are granted for the copy
+ *     into the SG file and its writeback, which is then waited for. This
+ *     turns interleaved requests from concurrent scans of the same 
+ *     disks into long sequential runs, at the cost of latency for the 
+ *     waiting plans, and suits rotational disks. A good batch is 
+ *     several blocks, e.g. 64 MB; hold_usec needs to cover the time 
+ *     between a plan's consecutive block reads, typically a few ms.
+ *   Disabled by default. Transfers already waiting when the scheduler
+ *     is disabled are released.
+ */
+int set_sg_device_scheduler(size_t batch_bytes, int hold_usec);
+
+/*
+ * Get device scheduler counters.
+ * Arguments:
+ *   SGDeviceSchedulerStats *stats -- Filled with the current counters.
+ * Return:
+ *   void
+ */
+void get_sg_device_scheduler_stats(SGDeviceSchedulerStats *stats);
+
+/*
+ * Set the I/O priority and bandwidth cap of a plan.
+ * Arguments:
+ *   SGPlan *sgpln -- SGPlan instance, read or write mode.
+ *   int io_class -- enum sg_io_class.
+ *   int io_level -- Level within the class, 0 (highest) to 
+ *     SG_IO_LEVELS-1; ignored for SG_IO_CLASS_NONE and _IDLE.
+ *   double max_mbps -- Cap on the plan's file I/O in MB/s, 0 for none.
+ * Returns:
+ *   int -- 0 on success, -1 on error.
+ * Notes:
+ *   Each worker thread applies the class with ioprio_set when it 
+ *     starts, so the setting takes effect from the next read or write.
+ *     Write plans default to SG_IO_CLASS_REALTIME level 0, read plans 
+ *     to SG_IO_CLASS_NONE. The realtime class needs CAP_SYS_ADMIN; 
+ *     without it threads fall back to best-effort level 0.
+ *   Write plans with a class other than SG_IO_CLASS_NONE start 
+ *     writeback of each block from the worker thread with 
+ *     sync_file_range, so that the disk writes carry the thread's 
+ *     priority instead of that of the kernel flusher threads. With 
+ *     the device scheduler on, all write plans do so and wait for the
+ *     writeback, see set_sg_device_scheduler.
+ *   The cap is a token bucket shared by the plan's threads with 
+ *     SG_IO_QOS_BURST_SEC of burst; a thread that overdraws it sleeps
+ *     before its next transfer.
+ */
+int set_sg_plan_io_qos(SGPlan *sgpln, int io_class, int io_level, double max_mbps);
+
+/*
+ * Set how a read plan reads its SG files.
+ * Arguments:
+ *   SGPlan *sgpln -- SGPlan instance created in read-mode.
+ *   int read_engine -- enum sg_read_engine.
+ *   int prefetch_blocks -- Blocks to read ahead, 0 to 
+ *     SG_MAX_PREFETCH_BLOCKS.
+ * Returns:
+ *   int -- 0 on success, -1 on error.
+ * Notes:
+ *   Applies to all files in the plan; tune_sg_plan_storage sets both 
+ *     per file from measurements instead.
+ *   With prefetch_blocks > 0, consecutive blocks of a file are fetched
+ *     as one request: a single preadv straight into the buffers that 
+ *     are returned for the blocks for SG_READ_ENGINE_PREAD, or one 
+ *     MADV_POPULATE_READ of the mapping (where unavailable, 
+ *     MADV_WILLNEED and a touch of each page) for SG_READ_ENGINE_MMAP,
+ *     after which the blocks are served from memory. The run length 
+ *     adapts to the throughput measured on earlier runs, so that a 
+ *     request takes about SG_COALESCE_TARGET_USEC, within 
+ *     prefetch_blocks+1 blocks and SG_MAX_COALESCE_BYTES.
+ */
+int set_sg_plan_read_engine(SGPlan *sgpln, int read_engine, int prefetch_blocks);
+
+/*
+ * Tune a plan to the storage holding its SG files.
+ * Arguments:
+ *   SGPlan *sgpln -- SGPlan instance, read or write mode.
+ *   const char *profile_path -- File to load and save device profiles,
+ *     or NULL to always probe and not save.
+ * Returns:
+ *   int -- Number of devices probed, or -1 on error.
+ * Notes:
+ *   Devices are identified by st_dev. Those without a saved profile 
+ *     are probed once each, in parallel, with a short sequential read 
+ *     and a few uncached random 4 KiB reads. Page cache is dropped for
+ *     the probed ranges with posix_fadvise.
+ *   Read plans only read: each device is probed through the largest SG
+ *     file of the plan on it, if that holds at least 16 MB. Write plans
+ *     only probe if enabled with set_sg_plan_write_probe, by writing, 
+ *     syncing and reading back a temporary file next to the SG file, 
+ *     which also measures write bandwidth.
+ *   Devices that cannot be probed (too little data, probing disabled,
+ *     read-only or full file system) keep the default settings and are
+ *     not saved; this is not an error.
+ *   Read plans get per-file read engine and prefetch depth (see 
+ *     set_sg_plan_read_engine): high latency (rotational) devices use 
+ *     pread, and enough blocks are read ahead to cover the 
+ *     bandwidth-latency product. 
+ *     Write plans that have not written yet get a block size large 
+ *     enough to keep per-block latency below 5% of transfer time on 
+ *     the slowest device.
+ *   Should be called before the first read or write.
+ */
+int tune_sg_plan_storage(SGPlan *sgpln, const char *profile_path);
+
+/*
+ * Allow tune_sg_plan_storage to write a probe file.
+ * Arguments:
+ *   SGPlan *sgpln -- SGPlan instance created in write-mode.
+ *   int enable -- Non-zero to enable, 0 to disable (default).
+ * Returns:
+ *   int -- 0 on success, -1 on error.
+ * Notes:
+ *   The probe writes and syncs SG_PROBE_BYTES (64 MB) to a temporary 
+ *     file in the directory of each SG file on a device without a 
+ *     saved profile, which competes with any recording on the same 
+ *     disks.
+ */
+int set_sg_plan_write_probe(SGPlan *sgpln, int enable);
+
 /*
  * Free the resources allocated for an SGPlan structure.
  * Arguments:
@@ -169,4 +1688,8 @@ void close_sg_write_plan(SGPlan *sgpln);
  */
 void free_sg_plan(SGPlan *sgpln);
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif // SCATGAT_H
@@ -0,0 +1,442 @@
+/*
+ * scatgat.hpp
+ * C++ interface to the scatter gather library.
+ *
+ * Changelog:
+ * 	Added RAII read / write plans, block views and frame iterators on
+ * 	top of the C interface in scatgat.h.
+ */
+
+#ifndef SCATGAT_HPP
+#define SCATGAT_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#if __cplusplus >= 202002L && __has_include(<span>)
+#include <span>
+#endif
+
+#include "scatgat.h"
+
+namespace scatgat {
+
+/* Contiguous view type: std::span when available, otherwise a minimal
+ * stand-in with the same spelling for the members used here. */
+#if defined(__cpp_lib_span)
+template <class T> using span = std::span<T>;
+#else
+template <class T>
+class span {
+public:
+	using element_type = T;
+	using iterator = T *;
+	constexpr span() noexcept : ptr_(nullptr), len_(0) {}
+	constexpr span(T *ptr, std::size_t len) noexcept : ptr_(ptr), len_(len) {}
+	template <class C>
+	constexpr span(C &c) noexcept : ptr_(c.data()), len_(c.size()) {}
+	constexpr T *data() const noexcept { return ptr_; }
+	constexpr std::size_t size() const noexcept { return len_; }
+	constexpr std::size_t size_bytes() const noexcept { return len_*sizeof(T); }
+	constexpr bool empty() const noexcept { return len_ == 0; }
+	constexpr T &operator[](std::size_t i) const noexcept { return ptr_[i]; }
+	constexpr T *begin() const noexcept { return ptr_; }
+	constexpr T *end() const noexcept { return ptr_ + len_; }
+	constexpr span subspan(std::size_t off, std::size_t n) const noexcept { return span(ptr_ + off, n); }
+private:
+	T *ptr_;
+	std::size_t len_;
+};
+#endif
+
+/* Raised when the C layer reports failure. */
+class Error : public std::runtime_error {
+public:
+	explicit Error(const std::string &what) : std::runtime_error(what) {}
+};
+
+/* Decoded view of a VDIF frame header. Fields are extracted directly
+ * from the header words, so no copy of the frame is made. */
+class FrameHeader {
+public:
+	explicit FrameHeader(const uint32_t *words) noexcept : w_(words) {}
+	uint32_t secs_inre() const noexcept { return w_[0] & 0x3fffffffu; }
+	bool legacy() const noexcept { return (w_[0] >> 30) & 0x1u; }
+	bool invalid() const noexcept { return (w_[0] >> 31) & 0x1u; }
+	uint32_t df_num_insec() const noexcept { return w_[1] & 0x00ffffffu; }
+	uint32_t ref_epoch() const noexcept { return (w_[1] >> 24) & 0x3fu; }
+	/* Frame length in bytes, including the header. */
+	std::size_t frame_length() const noexcept { return (std::size_t)(w_[2] & 0x00ffffffu)*8; }
+	uint32_t num_channels() const noexcept { return 1u << ((w_[2] >> 24) & 0x1fu); }
+	uint32_t version() const noexcept { return (w_[2] >> 29) & 0x7u; }
+	uint32_t station_id() const noexcept { return w_[3] & 0xffffu; }
+	uint32_t thread_id() const noexcept { return (w_[3] >> 16) & 0x3ffu; }
+	uint32_t bits_per_sample() const noexcept { return ((w_[3] >> 26) & 0x1fu) + 1; }
+	bool is_complex() const noexcept { return (w_[3] >> 31) & 0x1u; }
+	std::size_t header_length() const noexcept { return legacy() ? 16 : 32; }
+	const uint32_t *words() const noexcept { return w_; }
+private:
+	const uint32_t *w_;
+};
+
+/* A single VDIF frame inside a block. */
+class Frame {
+public:
+	Frame(const uint32_t *data, std::size_t frame_size) noexcept
+		: data_(data), size_(frame_size) {}
+	FrameHeader header() const noexcept { return FrameHeader(data_); }
+	span<const uint8_t> bytes() const noexcept
+	{
+		return span<const uint8_t>(reinterpret_cast<const uint8_t *>(data_), size_);
+	}
+	span<const uint8_t> payload() const noexcept
+	{
+		std::size_t hl = header().header_length();
+		return bytes().subspan(hl, size_ - hl);
+	}
+	const uint32_t *data() const noexcept { return data_; }
+	std::size_t size() const noexcept { return size_; }
+private:
+	const uint32_t *data_;
+	std::size_t size_;
+};
+
+/* Random access iterator over equally sized frames. */
+class FrameIterator {
+public:
+	using iterator_category = std::random_access_iterator_tag;
+	using value_type = Frame;
+	using difference_type = std::ptrdiff_t;
+	using pointer = void;
+	using reference = Frame;
+
+	FrameIterator() noexcept : p_(nullptr), words_(0) {}
+	FrameIterator(const uint32_t *p, std::size_t frame_size) noexcept
+		: p_(p), words_(frame_size/sizeof(uint32_t)) {}
+	Frame operator*() const noexcept { return Frame(p_, words_*sizeof(uint32_t)); }
+	Frame operator[](difference_type n) const noexcept { return *(*this + n); }
+	FrameIterator &operator++() noexcept { p_ += words_; return *this; }
+	FrameIterator operator++(int) noexcept { FrameIterator t(*this); p_ += words_; return t; }
+	FrameIterator &operator--() noexcept { p_ -= words_; return *this; }
+	FrameIterator operator--(int) noexcept { FrameIterator t(*this); p_ -= words_; return t; }
+	FrameIterator &operator+=(difference_type n) noexcept { p_ += n*(difference_type)words_; return *this; }
+	FrameIterator &operator-=(difference_type n) noexcept { p_ -= n*(difference_type)words_; return *this; }
+	friend FrameIterator operator+(FrameIterator it, difference_type n) noexcept { return it += n; }
+	friend FrameIterator operator+(difference_type n, FrameIterator it) noexcept { return it += n; }
+	friend FrameIterator operator-(FrameIterator it, difference_type n) noexcept { return it -= n; }
+	friend difference_type operator-(const FrameIterator &a, const FrameIterator &b) noexcept
+	{
+		return a.words_ ? (a.p_ - b.p_)/(difference_type)a.words_ : 0;
+	}
+	friend bool operator==(const FrameIterator &a, const FrameIterator &b) noexcept { return a.p_ == b.p_; }
+	friend bool operator!=(const FrameIterator &a, const FrameIterator &b) noexcept { return a.p_ != b.p_; }
+	friend bool operator<(const FrameIterator &a, const FrameIterator &b) noexcept { return a.p_ < b.p_; }
+	friend bool operator>(const FrameIterator &a, const FrameIterator &b) noexcept { return a.p_ > b.p_; }
+	friend bool operator<=(const FrameIterator &a, const FrameIterator &b) noexcept { return a.p_ <= b.p_; }
+	friend bool operator>=(const FrameIterator &a, const FrameIterator &b) noexcept { return a.p_ >= b.p_; }
+private:
+	const uint32_t *p_;
+	std::size_t words_;
+};
+
+/* Non-owning view of a run of gathered frames. */
+class BlockView {
+public:
+	BlockView() noexcept : data_(nullptr), n_frames_(0), frame_size_(0) {}
+	BlockView(const uint32_t *data, std::size_t n_frames, std::size_t frame_size) noexcept
+		: data_(data), n_frames_(n_frames), frame_size_(frame_size) {}
+	std::size_t size() const noexcept { return n_frames_; }
+	bool empty() const noexcept { return n_frames_ == 0; }
+	std::size_t frame_size() const noexcept { return frame_size_; }
+	FrameIterator begin() const noexcept { return FrameIterator(data_, frame_size_); }
+	FrameIterator end() const noexcept { return begin() + (std::ptrdiff_t)n_frames_; }
+	Frame operator[](std::size_t i) const noexcept { return begin()[(std::ptrdiff_t)i]; }
+	Frame front() const noexcept { return (*this)[0]; }
+	Frame back() const noexcept { return (*this)[n_frames_-1]; }
+	span<const uint32_t> words() const noexcept
+	{
+		return span<const uint32_t>(data_, n_frames_*frame_size_/sizeof(uint32_t));
+	}
+	span<const uint8_t> bytes() const noexcept
+	{
+		return span<const uint8_t>(reinterpret_cast<const uint8_t *>(data_), n_frames_*frame_size_);
+	}
+	const uint32_t *data() const noexcept { return data_; }
+private:
+	const uint32_t *data_;
+	std::size_t n_frames_;
+	std::size_t frame_size_;
+};
+
+/* Reusable frame buffer. Memory comes from an SGAllocator, by default
+ * the frame buffer allocator that new plans get (see 
+ * set_sg_default_allocators), so buffers can be exchanged with the C 
+ * layer as long as both sides use the same allocator. */
+class Buffer {
+public:
+	Buffer() noexcept : data_(nullptr), capacity_(0), n_frames_(0), frame_size_(0)
+	{
+		get_sg_default_allocators(nullptr, &sga_);
+	}
+	explicit Buffer(const SGAllocator &sga) noexcept
+		: data_(nullptr), capacity_(0), n_frames_(0), frame_size_(0), sga_(sga) {}
+	Buffer(std::size_t capacity_frames, std::size_t frame_size)
+		: Buffer()
+	{
+		reserve(capacity_frames, frame_size);
+	}
+	/* Take ownership of a buffer allocated by sga, e.g. from
+	 * read_next_block_vdif_frames with the plan's data_sga. */
+	static Buffer adopt(uint32_t *data, std::size_t capacity_frames,
+				std::size_t n_frames, std::size_t frame_size,
+				const SGAllocator &sga) noexcept
+	{
+		Buffer b(sga);
+		b.data_ = data;
+		b.capacity_ = capacity_frames;
+		b.n_frames_ = n_frames;
+		b.frame_size_ = frame_size;
+		return b;
+	}
+	Buffer(const Buffer &) = delete;
+	Buffer &operator=(const Buffer &) = delete;
+	Buffer(Buffer &&o) noexcept
+		: data_(std::exchange(o.data_, nullptr)), capacity_(std::exchange(o.capacity_, 0)),
+		  n_frames_(std::exchange(o.n_frames_, 0)), frame_size_(o.frame_size_), sga_(o.sga_) {}
+	Buffer &operator=(Buffer &&o) noexcept
+	{
+		if (this != &o)
+		{
+			deallocate();
+			data_ = std::exchange(o.data_, nullptr);
+			capacity_ = std::exchange(o.capacity_, 0);
+			n_frames_ = std::exchange(o.n_frames_, 0);
+			frame_size_ = o.frame_size_;
+			sga_ = o.sga_;
+		}
+		return *this;
+	}
+	~Buffer() { deallocate(); }
+
+	/* Grow (never shrink) the buffer; contents are not preserved. */
+	void reserve(std::size_t capacity_frames, std::size_t frame_size)
+	{
+		if (capacity_frames*frame_size > capacity_*frame_size_ || data_ == nullptr)
+		{
+			uint32_t *p = static_cast<uint32_t *>(sga_.alloc(capacity_frames*frame_size,
+											SG_DATA_BUFFER_ALIGNMENT, sga_.ctx));
+			if (p == nullptr)
+			{
+				throw std::bad_alloc();
+			}
+			deallocate();
+			data_ = p;
+			capacity_ = capacity_frames;
+		}
+		else
+		{
+			capacity_ = capacity_*frame_size_/frame_size;
+		}
+		frame_size_ = frame_size;
+		n_frames_ = 0;
+	}
+	/* Give up ownership; the caller must release the result with 
+	 * allocator(). */
+	uint32_t *release() noexcept
+	{
+		capacity_ = n_frames_ = 0;
+		return std::exchange(data_, nullptr);
+	}
+	void set_size(std::size_t n_frames) noexcept { n_frames_ = n_frames; }
+	std::size_t size() const noexcept { return n_frames_; }
+	std::size_t capacity() const noexcept { return capacity_; }
+	std::size_t frame_size() const noexcept { return frame_size_; }
+	uint32_t *data() noexcept { return data_; }
+	const uint32_t *data() const noexcept { return data_; }
+	const SGAllocator &allocator() const noexcept { return sga_; }
+	BlockView view() const noexcept { return BlockView(data_, n_frames_, frame_size_); }
+	FrameIterator begin() const noexcept { return view().begin(); }
+	FrameIterator end() const noexcept { return view().end(); }
+private:
+	void deallocate() noexcept
+	{
+		if (data_ != nullptr)
+		{
+			sga_.free(data_, sga_.ctx);
+		}
+	}
+	uint32_t *data_;
+	std::size_t capacity_;
+	std::size_t n_frames_;
+	std::size_t frame_size_;
+	SGAllocator sga_;
+};
+
+/* Common ownership of an SGPlan. Move-only. */
+class PlanBase {
+public:
+	PlanBase(const PlanBase &) = delete;
+	PlanBase &operator=(const PlanBase &) = delete;
+	SGPlan *native_handle() const noexcept { return plan_; }
+	explicit operator bool() const noexcept { return plan_ != nullptr; }
+	/* Number of SG files in the plan. */
+	int size() const noexcept { return plan_ ? plan_->n_sgprt : 0; }
+protected:
+	PlanBase() noexcept : plan_(nullptr) {}
+	explicit PlanBase(SGPlan *plan) noexcept : plan_(plan) {}
+	PlanBase(PlanBase &&o) noexcept : plan_(std::exchange(o.plan_, nullptr)) {}
+	~PlanBase() = default;
+	SGPlan *checked() const
+	{
+		if (plan_ == nullptr)
+		{
+			throw Error("Use of empty SGPlan.");
+		}
+		return plan_;
+	}
+	static span<int> mutable_list(span<const int> list) noexcept
+	{
+		/* The C interface takes non-const lists but never writes them. */
+		return span<int>(const_cast<int *>(list.data()), list.size());
+	}
+	SGPlan *plan_;
+};
+
+/* Read-mode plan. Closing and freeing happen in the destructor. */
+class ReadPlan : public PlanBase {
+public:
+	ReadPlan() noexcept = default;
+	ReadPlan(const std::string &pattern, const std::string &fmtstr,
+				span<const int> mod_list, span<const int> disk_list)
+	{
+		span<int> mods = mutable_list(mod_list);
+		span<int> disks = mutable_list(disk_list);
+		if (make_sg_read_plan(&plan_, pattern.c_str(), fmtstr.c_str(),
+				mods.data(), (int)mods.size(), disks.data(), (int)disks.size()) <= 0)
+		{
+			plan_ = nullptr;
+			throw Error("No SG files found matching '" + pattern + "'.");
+		}
+	}
+	ReadPlan(ReadPlan &&) noexcept = default;
+	ReadPlan &operator=(ReadPlan &&o) noexcept
+	{
+		if (this != &o)
+		{
+			reset();
+			plan_ = std::exchange(o.plan_, nullptr);
+		}
+		return *this;
+	}
+	~ReadPlan() { reset(); }
+
+	void reset() noexcept
+	{
+		if (plan_ != nullptr)
+		{
+			close_sg_read_plan(plan_);
+			free_sg_plan(plan_);
+			plan_ = nullptr;
+		}
+	}
+	std::size_t frame_size() const { return (std::size_t)checked()->sgprt[0].sgi->pkt_size; }
+	std::size_t max_block_frames() const { return (std::size_t)get_sg_plan_max_block_frames(checked()); }
+
+	/* Read the next contiguous block into a reusable buffer, growing it
+	 * on first use. An empty view signals the end of the data. */
+	BlockView read_next(Buffer &buf)
+	{
+		SGPlan *p = checked();
+		buf.reserve(max_block_frames(), frame_size());
+		int n = read_next_block_vdif_frames_into(p, buf.data(), (int)buf.capacity());
+		if (n < 0)
+		{
+			throw Error("Unable to read next block.");
+		}
+		buf.set_size((std::size_t)n);
+		return buf.view();
+	}
+	/* Read the next contiguous block into a newly owned buffer, from 
+	 * the plan's frame buffer allocator. */
+	Buffer read_next()
+	{
+		Buffer buf(checked()->data_sga);
+		read_next(buf);
+		return buf;
+	}
+};
+
+/* Write-mode plan. Closing (trimming files) and freeing happen in the
+ * destructor. */
+class WritePlan : public PlanBase {
+public:
+	WritePlan() noexcept = default;
+	WritePlan(const std::string &pattern, const std::string &fmtstr,
+				span<const int> mod_list, span<const int> disk_list)
+	{
+		span<int> mods = mutable_list(mod_list);
+		span<int> disks = mutable_list(disk_list);
+		if (make_sg_write_plan(&plan_, pattern.c_str(), fmtstr.c_str(),
+				mods.data(), (int)mods.size(), disks.data(), (int)disks.size()) <= 0)
+		{
+			if (plan_ != nullptr)
+			{
+				free_sg_plan(plan_);
+			}
+			plan_ = nullptr;
+			throw Error("Unable to create SG files for '" + pattern + "'.");
+		}
+	}
+	WritePlan(WritePlan &&) noexcept = default;
+	WritePlan &operator=(WritePlan &&o) noexcept
+	{
+		if (this != &o)
+		{
+			reset();
+			plan_ = std::exchange(o.plan_, nullptr);
+		}
+		return *this;
+	}
+	~WritePlan() { reset(); }
+
+	void reset() noexcept
+	{
+		if (plan_ != nullptr)
+		{
+			close_sg_write_plan(plan_);
+			free_sg_plan(plan_);
+			plan_ = nullptr;
+		}
+	}
+	/* Bytes of frames per block; only before the first write. */
+	void set_block_size(std::size_t block_size)
+	{
+		if (set_sg_plan_block_size(checked(), block_size) != 0)
+		{
+			throw Error("Unable to set block size.");
+		}
+	}
+	/* Write n_frames frames from a contiguous buffer. */
+	std::size_t write(const uint32_t *frames, std::size_t n_frames)
+	{
+		/* write_vdif_frames only reads from the buffer. */
+		int n = write_vdif_frames(checked(), const_cast<uint32_t *>(frames), (int)n_frames);
+		if (n < 0)
+		{
+			throw Error("Unable to write VDIF frames.");
+		}
+		return (std::size_t)n;
+	}
+	std::size_t write(const BlockView &block) { return write(block.data(), block.size()); }
+	std::size_t write(const Buffer &buf) { return write(buf.data(), buf.size()); }
+};
+
+} // namespace scatgat
+
+#endif // SCATGAT_HPP
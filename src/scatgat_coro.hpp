@@ -0,0 +1,234 @@
+/*
+ * scatgat_coro.hpp
+ * C++20 coroutine interface to the scatter gather library.
+ *
+ * Changelog:
+ * 	Added awaitable block reads and frame writes on top of the plan
+ * 	worker threads (submit_sg_read_next_block /
+ * 	submit_sg_write_vdif_frames).
+ * 	Coroutines can be resumed through a caller-supplied Executor, and
+ * 	QueueExecutor resumes them from an event loop.
+ */
+
+#ifndef SCATGAT_CORO_HPP
+#define SCATGAT_CORO_HPP
+
+#include <coroutine>
+#include <deque>
+#include <mutex>
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "scatgat.hpp"
+
+namespace scatgat {
+
+/* Resumes the coroutines of the awaitables below. post() is called 
+ * from a thread of the library's asynchronous worker pool once the 
+ * operation has completed, and must not block. Without an executor the
+ * coroutine is resumed inline on that thread, which serves no other 
+ * plan until the coroutine suspends again. */
+class Executor {
+public:
+	virtual ~Executor() = default;
+	virtual void post(std::coroutine_handle<> h) = 0;
+};
+
+/* Executor for event loops: coroutines are queued and resumed by run(),
+ * called on the loop thread whenever fd() becomes readable (EPOLLIN). */
+class QueueExecutor : public Executor {
+public:
+	QueueExecutor() : efd_(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))
+	{
+		if (efd_ == -1)
+		{
+			throw Error("Unable to create eventfd.");
+		}
+	}
+	QueueExecutor(const QueueExecutor &) = delete;
+	QueueExecutor &operator=(const QueueExecutor &) = delete;
+	~QueueExecutor() { ::close(efd_); }
+	int fd() const noexcept { return efd_; }
+	void post(std::coroutine_handle<> h) override
+	{
+		uint64_t one = 1;
+		{
+			std::lock_guard<std::mutex> guard(lock_);
+			ready_.push_back(h);
+		}
+		if (::write(efd_, &one, sizeof(one)) == -1)
+		{
+			/* Counter saturated, the fd is readable anyway. */
+		}
+	}
+	/* Resume the queued coroutines, returns how many were resumed. */
+	std::size_t run()
+	{
+		uint64_t count;
+		std::deque<std::coroutine_handle<>> ready;
+		if (::read(efd_, &count, sizeof(count)) == -1)
+		{
+			/* EAGAIN: nothing signalled, the queue decides. */
+		}
+		{
+			std::lock_guard<std::mutex> guard(lock_);
+			ready.swap(ready_);
+		}
+		for (auto h : ready)
+		{
+			h.resume();
+		}
+		return ready.size();
+	}
+private:
+	int efd_;
+	std::mutex lock_;
+	std::deque<std::coroutine_handle<>> ready_;
+};
+
+/* Awaitable returned by async_read_next. The coroutine is resumed 
+ * through the executor, or on the library worker thread, once the 
+ * block has been gathered, and co_await yields a view into the 
+ * supplied buffer (empty at the end of the data). */
+class ReadNextAwaitable {
+public:
+	ReadNextAwaitable(ReadPlan &plan, Buffer &buf, Executor *ex = nullptr)
+		: plan_(plan.native_handle()), buf_(buf), ex_(ex), result_(-1)
+	{
+		if (plan_ == nullptr)
+		{
+			throw Error("Use of empty SGPlan.");
+		}
+		buf_.reserve(plan.max_block_frames(), plan.frame_size());
+	}
+	bool await_ready() const noexcept { return false; }
+	bool await_suspend(std::coroutine_handle<> h) noexcept
+	{
+		handle_ = h;
+		/* Nothing may touch *this after a successful submit, since the
+		 * completion can resume (and destroy) the coroutine before
+		 * submit returns. */
+		if (submit_sg_read_next_block(plan_, buf_.data(), (int)buf_.capacity(),
+				&ReadNextAwaitable::complete, this) != 0)
+		{
+			result_ = -1;
+			return false;
+		}
+		return true;
+	}
+	BlockView await_resume()
+	{
+		if (result_ < 0)
+		{
+			throw Error("Unable to read next block.");
+		}
+		buf_.set_size((std::size_t)result_);
+		return buf_.view();
+	}
+private:
+	static void complete(SGPlan *, int result, void *user_data)
+	{
+		ReadNextAwaitable *self = static_cast<ReadNextAwaitable *>(user_data);
+		/* *self may be gone as soon as the coroutine is posted. */
+		Executor *ex = self->ex_;
+		std::coroutine_handle<> h = self->handle_;
+		self->result_ = result;
+		if (ex != nullptr)
+		{
+			ex->post(h);
+		}
+		else
+		{
+			h.resume();
+		}
+	}
+	SGPlan *plan_;
+	Buffer &buf_;
+	Executor *ex_;
+	int result_;
+	std::coroutine_handle<> handle_;
+};
+
+/* Awaitable returned by async_write. The frames must stay valid until
+ * the coroutine resumes; co_await yields the number of frames written. */
+class WriteAwaitable {
+public:
+	WriteAwaitable(WritePlan &plan, const uint32_t *frames, std::size_t n_frames, Executor *ex = nullptr)
+		: plan_(plan.native_handle()), frames_(frames), n_frames_(n_frames), ex_(ex), result_(-1)
+	{
+		if (plan_ == nullptr)
+		{
+			throw Error("Use of empty SGPlan.");
+		}
+	}
+	bool await_ready() const noexcept { return n_frames_ == 0; }
+	bool await_suspend(std::coroutine_handle<> h) noexcept
+	{
+		handle_ = h;
+		/* See ReadNextAwaitable::await_suspend. */
+		if (submit_sg_write_vdif_frames(plan_, const_cast<uint32_t *>(frames_), (int)n_frames_,
+				&WriteAwaitable::complete, this) != 0)
+		{
+			result_ = -1;
+			return false;
+		}
+		return true;
+	}
+	std::size_t await_resume()
+	{
+		if (n_frames_ == 0)
+		{
+			return 0;
+		}
+		if (result_ < 0)
+		{
+			throw Error("Unable to write VDIF frames.");
+		}
+		return (std::size_t)result_;
+	}
+private:
+	static void complete(SGPlan *, int result, void *user_data)
+	{
+		WriteAwaitable *self = static_cast<WriteAwaitable *>(user_data);
+		/* See ReadNextAwaitable::complete. */
+		Executor *ex = self->ex_;
+		std::coroutine_handle<> h = self->handle_;
+		self->result_ = result;
+		if (ex != nullptr)
+		{
+			ex->post(h);
+		}
+		else
+		{
+			h.resume();
+		}
+	}
+	SGPlan *plan_;
+	const uint32_t *frames_;
+	std::size_t n_frames_;
+	Executor *ex_;
+	int result_;
+	std::coroutine_handle<> handle_;
+};
+
+/* co_await async_read_next(plan, buf[, ex]) -> BlockView */
+inline ReadNextAwaitable async_read_next(ReadPlan &plan, Buffer &buf, Executor *ex = nullptr)
+{
+	return ReadNextAwaitable(plan, buf, ex);
+}
+
+/* co_await async_write(plan, frames[, ex]) -> frames written */
+inline WriteAwaitable async_write(WritePlan &plan, const BlockView &block, Executor *ex = nullptr)
+{
+	return WriteAwaitable(plan, block.data(), block.size(), ex);
+}
+
+inline WriteAwaitable async_write(WritePlan &plan, const Buffer &buf, Executor *ex = nullptr)
+{
+	return WriteAwaitable(plan, buf.data(), buf.size(), ex);
+}
+
+} // namespace scatgat
+
+#endif // SCATGAT_CORO_HPP
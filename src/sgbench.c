@@ -0,0 +1,365 @@
+/*
+ * sgbench.c
+ * Write / read throughput of scatter gather plans across block sizes.
+ *
+ * Usage:
+ *   sgbench <fmtstr> <mod> <disk,disk,...> [total_MB] [block_size ...]
+ *   sgbench -k [n_frames]
+ *
+ *   fmtstr, mod and the disk list are as for make_sg_write_plan, e.g.
+ *   "/mnt/disks/%d/%d/data/%s" 1 0,1,2,3. Each block size (bytes,
+ *   default: a range around WBLOCK_SIZE) writes total_MB (default 4096)
+ *   of synthetic VDIF frames to sgbench.vdif, reads them back and
+ *   removes the files. Read rates include any page cache hits, so use a
+ *   total larger than memory for storage figures.
+ *
+ *   With -k the per-frame loops of the read path (gather copy, header 
+ *   decode and continuity check) run in memory over n_frames (default 
+ *   4096) frames of each common frame size, once with the frame size as
+ *   a run-time stride and once compiled for that size, to check whether
+ *   frame-size specialised loops pay off. Build with optimisation for
+ *   these figures, e.g. make bench CFLAGS="-O2 -Wall".
+ *
+ * Changelog:
+ * 	Created for comparing set_sg_plan_block_size settings.
+ * 	Added -k for comparing frame-size specialised loops.
+ */
+
+#include <time.h>
+
+#include "scatgat.h"
+
+#define SGBENCH_PATTERN "sgbench.vdif"
+#define SGBENCH_FRAME_SIZE 8032
+#define SGBENCH_FRAMES_PER_WRITE 4096
+#define SGBENCH_MAX_DISKS 64
+/* Frame sizes (bytes, header included) compared with -k */
+#define SGBENCH_KERNEL_FRAME_SIZES(X) X(1032) X(8032) X(8224)
+#define SGBENCH_KERNEL_MAX_FRAME_SIZE 8224
+/* Bytes passed through each loop per frame size with -k */
+#define SGBENCH_KERNEL_BYTES (4L*1024*1024*1024)
+
+/* Per-frame loops of the read path, for one frame size */
+typedef struct sgbench_kernels
+{
+	int frame_size;
+	void (*gather)(uint32_t *dst, const uint32_t *src, int n_frames, int frame_size);
+	uint64_t (*headers)(const uint32_t *buf, int n_frames, int frame_size);
+	int (*continuity)(const uint32_t *buf, int n_frames, int frame_size);
+} SGBenchKernels;
+
+static double now_seconds(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+/* Fill buffer with frames of frame_size bytes numbered from first_frame */
+static void make_frames(uint32_t *buf, int n_frames, long first_frame, int frame_size)
+{
+	int ii;
+	VDIFHeader *vdif_header;
+	for (ii=0; ii<n_frames; ii++)
+	{
+		vdif_header = (VDIFHeader *)(buf + (size_t)ii*frame_size/sizeof(uint32_t));
+		memset(vdif_header, 0, sizeof(VDIFHeader));
+		vdif_header->w1.secs_inre = (first_frame + ii)/125000;
+		vdif_header->w2.df_num_insec = (first_frame + ii)%125000;
+		vdif_header->w3.df_len = frame_size/8;
+		vdif_header->w4.bps = 1;
+	}
+}
+
+/* Copy frames one at a time, as the gather of a block does */
+static inline void gather_frames(uint32_t *dst, const uint32_t *src, int n_frames, int frame_size)
+{
+	int ii;
+	for (ii=0; ii<n_frames; ii++)
+	{
+		memcpy(dst + (size_t)ii*(frame_size/sizeof(uint32_t)), src + (size_t)ii*(frame_size/sizeof(uint32_t)), frame_size);
+	}
+}
+
+/* Decode the header of every frame, returns the stamp sum of the valid ones */
+static inline uint64_t decode_headers(const uint32_t *buf, int n_frames, int frame_size)
+{
+	const uint32_t *h;
+	uint64_t sum = 0;
+	int ii;
+	for (ii=0, h=buf; ii<n_frames; ii++, h+=frame_size/sizeof(uint32_t))
+	{
+		if (!VDIF_INVALID(h) && VDIF_DF_LEN_BYTES(h) == (uint32_t)frame_size)
+		{
+			sum += SG_VDIF_STAMP(h);
+		}
+	}
+	return sum;
+}
+
+/* Count frames that do not follow their predecessor */
+static inline int check_continuity(const uint32_t *buf, int n_frames, int frame_size)
+{
+	const uint32_t *h;
+	uint64_t prev, stamp;
+	int n_breaks = 0;
+	int ii;
+	prev = SG_VDIF_STAMP(buf);
+	for (ii=1, h=buf+frame_size/sizeof(uint32_t); ii<n_frames; ii++, h+=frame_size/sizeof(uint32_t))
+	{
+		stamp = SG_VDIF_STAMP(h);
+		if (stamp != prev + 1 && (SG_STAMP_SECS(stamp) != SG_STAMP_SECS(prev) + 1 || SG_STAMP_DF_NUM(stamp) != 0))
+		{
+			n_breaks++;
+		}
+		prev = stamp;
+	}
+	return n_breaks;
+}
+
+/* Run-time stride versions, kept out of line so the size is not propagated */
+__attribute__((noinline)) static void gather_frames_generic(uint32_t *dst, const uint32_t *src, int n_frames, int frame_size)
+{
+	gather_frames(dst, src, n_frames, frame_size);
+}
+
+__attribute__((noinline)) static uint64_t decode_headers_generic(const uint32_t *buf, int n_frames, int frame_size)
+{
+	return decode_headers(buf, n_frames, frame_size);
+}
+
+__attribute__((noinline)) static int check_continuity_generic(const uint32_t *buf, int n_frames, int frame_size)
+{
+	return check_continuity(buf, n_frames, frame_size);
+}
+
+/* Versions compiled for one frame size, the frame_size argument is ignored */
+#define SGBENCH_DEFINE_KERNELS(SIZE) \
+__attribute__((noinline)) static void gather_frames_##SIZE(uint32_t *dst, const uint32_t *src, int n_frames, int frame_size) \
+{ \
+	gather_frames(dst, src, n_frames, SIZE); \
+} \
+__attribute__((noinline)) static uint64_t decode_headers_##SIZE(const uint32_t *buf, int n_frames, int frame_size) \
+{ \
+	return decode_headers(buf, n_frames, SIZE); \
+} \
+__attribute__((noinline)) static int check_continuity_##SIZE(const uint32_t *buf, int n_frames, int frame_size) \
+{ \
+	return check_continuity(buf, n_frames, SIZE); \
+}
+SGBENCH_KERNEL_FRAME_SIZES(SGBENCH_DEFINE_KERNELS)
+#undef SGBENCH_DEFINE_KERNELS
+
+#define SGBENCH_KERNELS_ENTRY(SIZE) { SIZE, gather_frames_##SIZE, decode_headers_##SIZE, check_continuity_##SIZE },
+static const SGBenchKernels specialized_kernels[] = {
+	SGBENCH_KERNEL_FRAME_SIZES(SGBENCH_KERNELS_ENTRY)
+};
+#undef SGBENCH_KERNELS_ENTRY
+
+static const SGBenchKernels generic_kernels = { 0, gather_frames_generic, decode_headers_generic, check_continuity_generic };
+
+/* Time the loops of sgk over n_frames frames, prints GB/s of each */
+static void time_kernels(const char *label, const SGBenchKernels *sgk, uint32_t *dst, const uint32_t *src, 
+	int n_frames, int frame_size, uint64_t *sum, int *n_breaks)
+{
+	long reps = SGBENCH_KERNEL_BYTES/((long)n_frames*frame_size) + 1;
+	double bytes = (double)reps*n_frames*frame_size;
+	double t0, t_gather, t_headers, t_continuity;
+	long ii;
+	t0 = now_seconds();
+	for (ii=0; ii<reps; ii++)
+	{
+		sgk->gather(dst, src, n_frames, frame_size);
+	}
+	t_gather = now_seconds() - t0;
+	t0 = now_seconds();
+	for (ii=0; ii<reps; ii++)
+	{
+		*sum = sgk->headers(dst, n_frames, frame_size);
+	}
+	t_headers = now_seconds() - t0;
+	t0 = now_seconds();
+	for (ii=0; ii<reps; ii++)
+	{
+		*n_breaks = sgk->continuity(dst, n_frames, frame_size);
+	}
+	t_continuity = now_seconds() - t0;
+	/* Header loops touch one cache line per frame, rate them per frame */
+	printf("%12d %12s %12.2f %12.1f %12.1f\n", frame_size, label, bytes/t_gather/1e9,
+		reps*(double)n_frames/t_headers/1e6, reps*(double)n_frames/t_continuity/1e6);
+}
+
+/* Compare run-time stride and specialised loops, returns 0 if they agree */
+static int run_kernels(int n_frames)
+{
+	uint32_t *src, *dst;
+	uint64_t sum_generic, sum_specialized;
+	int breaks_generic, breaks_specialized;
+	int ii;
+	int result = 0;
+	size_t buf_size = (size_t)n_frames*SGBENCH_KERNEL_MAX_FRAME_SIZE;
+	if (n_frames < 2)
+	{
+		fprintf(stderr,"Need at least 2 frames, got %d.\n",n_frames);
+		return -1;
+	}
+	src = (uint32_t *)malloc(buf_size);
+	dst = (uint32_t *)malloc(buf_size);
+	if (src == NULL || dst == NULL)
+	{
+		perror("Unable to allocate frame buffers.");
+		free(src);
+		free(dst);
+		return -1;
+	}
+	memset(src, 0, buf_size);
+	memset(dst, 0, buf_size);
+	printf("%12s %12s %12s %12s %12s\n", "frame_size", "loops", "gather_GB/s", "decode_Mf/s", "cont_Mf/s");
+	for (ii=0; ii<(int)(sizeof(specialized_kernels)/sizeof(SGBenchKernels)); ii++)
+	{
+		make_frames(src, n_frames, 0, specialized_kernels[ii].frame_size);
+		time_kernels("generic", &generic_kernels, dst, src, n_frames, specialized_kernels[ii].frame_size, &sum_generic, &breaks_generic);
+		time_kernels("specialized", &specialized_kernels[ii], dst, src, n_frames, specialized_kernels[ii].frame_size, &sum_specialized, &breaks_specialized);
+		if (sum_generic != sum_specialized || breaks_generic != breaks_specialized || breaks_generic != 0)
+		{
+			fprintf(stderr,"Loops disagree for %d byte frames.\n",specialized_kernels[ii].frame_size);
+			result = -1;
+		}
+	}
+	free(src);
+	free(dst);
+	return result;
+}
+
+/* Remove the files of a plan, they are found again through a read plan */
+static void remove_sg_files(const char *fmtstr, int *mod_list, int *disk_list, int n_disk)
+{
+	SGPlan *sgpln = NULL;
+	int ii;
+	int n = make_sg_read_plan(&sgpln, SGBENCH_PATTERN, fmtstr, mod_list, 1, disk_list, n_disk);
+	if (n <= 0)
+	{
+		return;
+	}
+	for (ii=0; ii<sgpln->n_sgprt; ii++)
+	{
+		unlink(sgpln->sgprt[ii].sgi->name);
+	}
+	close_sg_read_plan(sgpln);
+	free_sg_plan(sgpln);
+}
+
+/* Run one block size, returns 0 on success */
+static int run_block_size(const char *fmtstr, int *mod_list, int *disk_list, int n_disk,
+	size_t block_size, long total_frames, uint32_t *buf)
+{
+	SGPlan *sgpln = NULL;
+	double t0, t_write, t_read;
+	long frames_done = 0;
+	long frames_read = 0;
+	int n_frames;
+	uint32_t *vdif_buf = NULL;
+	if (make_sg_write_plan(&sgpln, SGBENCH_PATTERN, fmtstr, mod_list, 1, disk_list, n_disk) <= 0)
+	{
+		fprintf(stderr,"Unable to create write plan.\n");
+		return -1;
+	}
+	if (set_sg_plan_block_size(sgpln, block_size) != 0)
+	{
+		close_sg_write_plan(sgpln);
+		free_sg_plan(sgpln);
+		return -1;
+	}
+	t0 = now_seconds();
+	while (frames_done < total_frames)
+	{
+		n_frames = total_frames - frames_done < SGBENCH_FRAMES_PER_WRITE ? total_frames - frames_done : SGBENCH_FRAMES_PER_WRITE;
+		make_frames(buf, n_frames, frames_done, SGBENCH_FRAME_SIZE);
+		if (write_vdif_frames(sgpln, buf, n_frames) != n_frames)
+		{
+			fprintf(stderr,"Write failed.\n");
+			break;
+		}
+		frames_done += n_frames;
+	}
+	close_sg_write_plan(sgpln);
+	free_sg_plan(sgpln);
+	t_write = now_seconds() - t0;
+	sgpln = NULL;
+	t0 = now_seconds();
+	if (make_sg_read_plan(&sgpln, SGBENCH_PATTERN, fmtstr, mod_list, 1, disk_list, n_disk) > 0)
+	{
+		while ((n_frames = read_next_block_vdif_frames(sgpln, &vdif_buf)) > 0)
+		{
+			frames_read += n_frames;
+			free_sg_plan_buffer(sgpln, vdif_buf);
+		}
+		free_sg_plan_buffer(sgpln, vdif_buf);
+		close_sg_read_plan(sgpln);
+		free_sg_plan(sgpln);
+	}
+	t_read = now_seconds() - t0;
+	printf("%12lu %12.1f %12.1f %12ld\n", (unsigned long)block_size,
+		frames_done*(double)SGBENCH_FRAME_SIZE/t_write/1e6,
+		frames_read*(double)SGBENCH_FRAME_SIZE/t_read/1e6, frames_read);
+	remove_sg_files(fmtstr, mod_list, disk_list, n_disk);
+	return frames_read == frames_done ? 0 : -1;
+}
+
+int main(int argc, char **argv)
+{
+	int mod_list[1];
+	int disk_list[SGBENCH_MAX_DISKS];
+	int n_disk = 0;
+	char *tok;
+	long total_mb = 4096;
+	long total_frames;
+	size_t default_sizes[] = { WBLOCK_SIZE/8, WBLOCK_SIZE/2, WBLOCK_SIZE, 4*(size_t)WBLOCK_SIZE, 16*(size_t)WBLOCK_SIZE };
+	int ii;
+	int result = 0;
+	uint32_t *buf;
+	if (argc > 1 && strcmp(argv[1], "-k") == 0)
+	{
+		return run_kernels(argc > 2 ? atoi(argv[2]) : 4096) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+	if (argc < 4)
+	{
+		fprintf(stderr,"Usage: %s <fmtstr> <mod> <disk,disk,...> [total_MB] [block_size ...]\n",argv[0]);
+		fprintf(stderr,"       %s -k [n_frames]\n",argv[0]);
+		return EXIT_FAILURE;
+	}
+	mod_list[0] = atoi(argv[2]);
+	for (tok = strtok(argv[3], ","); tok != NULL && n_disk < SGBENCH_MAX_DISKS; tok = strtok(NULL, ","))
+	{
+		disk_list[n_disk++] = atoi(tok);
+	}
+	if (argc > 4)
+	{
+		total_mb = atol(argv[4]);
+	}
+	total_frames = total_mb*1000000/SGBENCH_FRAME_SIZE;
+	buf = (uint32_t *)malloc((size_t)SGBENCH_FRAMES_PER_WRITE*SGBENCH_FRAME_SIZE);
+	if (buf == NULL)
+	{
+		perror("Unable to allocate frame buffer.");
+		return EXIT_FAILURE;
+	}
+	memset(buf, 0, (size_t)SGBENCH_FRAMES_PER_WRITE*SGBENCH_FRAME_SIZE);
+	printf("%12s %12s %12s %12s\n", "block_size", "write_MB/s", "read_MB/s", "frames");
+	if (argc > 5)
+	{
+		for (ii=5; ii<argc; ii++)
+		{
+			result |= run_block_size(argv[1], mod_list, disk_list, n_disk, (size_t)atol(argv[ii]), total_frames, buf);
+		}
+	}
+	else
+	{
+		for (ii=0; ii<(int)(sizeof(default_sizes)/sizeof(size_t)); ii++)
+		{
+			result |= run_block_size(argv[1], mod_list, disk_list, n_disk, default_sizes[ii], total_frames, buf);
+		}
+	}
+	free(buf);
+	return result == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}